@@ -1,17 +1,102 @@
 #include "ASTNode.h"
 #include "bytecode.h"
 
+/* ASTNode */
+template <class _Node>
+static void destroy_as(ASTNode* node, bool free)
+{
+    _Node* self = static_cast<_Node*>(node);
+    if (free)
+        delete self;
+    else
+        self->~_Node();
+}
+
+void ASTNode::destroy(ASTNode* node, bool free)
+{
+    switch (node->type()) {
+    case NODE_NODELIST:         destroy_as<ASTNodeList>(node, free); break;
+    case NODE_OBJECT:           destroy_as<ASTObject>(node, free); break;
+    case NODE_UNARY:            destroy_as<ASTUnary>(node, free); break;
+    case NODE_BINARY:           destroy_as<ASTBinary>(node, free); break;
+    case NODE_COMPARE:          destroy_as<ASTCompare>(node, free); break;
+    case NODE_SLICE:            destroy_as<ASTSlice>(node, free); break;
+    case NODE_STORE:            destroy_as<ASTStore>(node, free); break;
+    case NODE_RETURN:           destroy_as<ASTReturn>(node, free); break;
+    case NODE_NAME:             destroy_as<ASTName>(node, free); break;
+    case NODE_DELETE:           destroy_as<ASTDelete>(node, free); break;
+    case NODE_FUNCTION:         destroy_as<ASTFunction>(node, free); break;
+    case NODE_CLASS:            destroy_as<ASTClass>(node, free); break;
+    case NODE_CALL:             destroy_as<ASTCall>(node, free); break;
+    case NODE_IMPORT:           destroy_as<ASTImport>(node, free); break;
+    case NODE_TUPLE:            destroy_as<ASTTuple>(node, free); break;
+    case NODE_LIST:             destroy_as<ASTList>(node, free); break;
+    case NODE_SET:              destroy_as<ASTSet>(node, free); break;
+    case NODE_MAP:              destroy_as<ASTMap>(node, free); break;
+    case NODE_SUBSCR:           destroy_as<ASTSubscr>(node, free); break;
+    case NODE_PRINT:            destroy_as<ASTPrint>(node, free); break;
+    case NODE_CONVERT:          destroy_as<ASTConvert>(node, free); break;
+    case NODE_KEYWORD:          destroy_as<ASTKeyword>(node, free); break;
+    case NODE_RAISE:            destroy_as<ASTRaise>(node, free); break;
+    case NODE_EXEC:             destroy_as<ASTExec>(node, free); break;
+    case NODE_COMPREHENSION:    destroy_as<ASTComprehension>(node, free); break;
+    case NODE_LOADBUILDCLASS:   destroy_as<ASTLoadBuildClass>(node, free); break;
+    case NODE_AWAITABLE:        destroy_as<ASTAwaitable>(node, free); break;
+    case NODE_FORMATTEDVALUE:   destroy_as<ASTFormattedValue>(node, free); break;
+    case NODE_JOINEDSTR:        destroy_as<ASTJoinedStr>(node, free); break;
+    case NODE_CONST_MAP:        destroy_as<ASTConstMap>(node, free); break;
+    case NODE_ANNOTATED_VAR:    destroy_as<ASTAnnotatedVar>(node, free); break;
+    case NODE_CHAINSTORE:       destroy_as<ASTChainStore>(node, free); break;
+    case NODE_TERNARY:          destroy_as<ASTTernary>(node, free); break;
+    case NODE_KW_NAMES_MAP:     destroy_as<ASTKwNamesMap>(node, free); break;
+    case NODE_BLOCK:
+        switch (static_cast<ASTBlock*>(node)->blkclass()) {
+        case ASTBlock::CLASS_BLOCK:     destroy_as<ASTBlock>(node, free); break;
+        case ASTBlock::CLASS_COND:      destroy_as<ASTCondBlock>(node, free); break;
+        case ASTBlock::CLASS_ITER:      destroy_as<ASTIterBlock>(node, free); break;
+        case ASTBlock::CLASS_CONTAINER: destroy_as<ASTContainerBlock>(node, free); break;
+        case ASTBlock::CLASS_WITH:      destroy_as<ASTWithBlock>(node, free); break;
+        }
+        break;
+    default:
+        // Just the type, as NODE_LOCALS is
+        if (free)
+            delete node;
+        else
+            node->~ASTNode();
+        break;
+    }
+}
+
+
+/* ASTArena */
+ASTArena::~ASTArena()
+{
+    // Destroying a node still releases its references to other nodes, so
+    // the memory may only be freed (by m_alloc) once all of them are gone
+    for (ASTNode* node : m_nodes)
+        ASTNode::destroy(node, false);
+    release();
+}
+
+void ASTArena::release()
+{
+    m_held.clear();
+    if (m_account)
+        m_account->remove(m_heldBytes);
+    m_heldBytes = 0;
+}
+
+
 /* ASTNodeList */
 void ASTNodeList::removeLast()
 {
-    list_t::iterator it = m_nodes.end();
-    --it;
-    m_nodes.erase(it);
+    m_nodes.pop_back();
 }
 
 void ASTNodeList::removeFirst()
 {
-    m_nodes.erase(m_nodes.begin());
+    m_nodes.pop_front();
 }
 
 
@@ -35,6 +120,8 @@ const char* ASTBinary::op_str() const
         " >>= ", " &= ", " ^= ", " |= ", " //= ", " @= ", " <INVALID> "
 
     };
+    if (type() == NODE_COMPARE)
+        return static_cast<const ASTCompare*>(this)->op_str();
     return s_op_strings[op()];
 }
 
@@ -187,14 +274,12 @@ const char* ASTKeyword::word_str() const
 /* ASTBlock */
 void ASTBlock::removeLast()
 {
-    list_t::iterator it = m_nodes.end();
-    --it;
-    m_nodes.erase(it);
+    m_nodes.pop_back();
 }
 
 void ASTBlock::removeFirst()
 {
-    m_nodes.erase(m_nodes.begin());
+    m_nodes.pop_front();
 }
 
 const char* ASTBlock::type_str() const
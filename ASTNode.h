@@ -2,8 +2,12 @@
 #define _PYC_ASTNODE_H
 
 #include "pyc_module.h"
+#include "arena.h"
 #include <list>
 #include <deque>
+#include <new>
+#include <utility>
+#include <vector>
 
 /* Similar interface to PycObject, so PycRef can work on it... *
  * However, this does *NOT* mean the two are interchangeable!  */
@@ -24,37 +28,62 @@ public:
         NODE_LOCALS,
     };
 
-    ASTNode(int type = NODE_INVALID) : m_refs(), m_type(type), m_processed() { }
-    virtual ~ASTNode() { }
+    ASTNode(int type = NODE_INVALID) : m_refs(), m_type(type), m_processed(), m_origin() { }
 
     int type() const { return internalGetType(this); }
 
     bool processed() const { return m_processed; }
     void setProcessed() { m_processed = true; }
 
+    /* Where the statement this was made for came from, or 0 if it isn't
+     * known (see ASTArena::setOrigin): its source line, or when building for
+     * a source map, one past the offset of its first instruction */
+    int origin() const { return m_origin; }
+
+    /* Runs the destructor of the node's own class, which is found from its
+     * type, and frees the node too if it was allocated on its own */
+    static void destroy(ASTNode* node, bool free);
+
+protected:
+    /* Nodes have no vtable, so this may only be called by destroy() */
+    ~ASTNode() { }
+
 private:
+    /* Only 8 bytes, as there can be tens of millions of nodes */
     int m_refs;
-    int m_type;
-    bool m_processed;
+    unsigned m_type : 7;
+    unsigned m_processed : 1;
+    unsigned m_origin : 24;
+
+    static const int MAX_ORIGIN = (1 << 24) - 1;
+
+    /* Origins which don't fit are left unknown */
+    void setOrigin(int origin)
+    {
+        m_origin = (origin > 0 && origin <= MAX_ORIGIN) ? origin : 0;
+    }
 
     // Hack to make clang happy :(
     static int internalGetType(const ASTNode *node)
     {
-        return node ? node->m_type : NODE_INVALID;
+        return node ? (int)node->m_type : (int)NODE_INVALID;
     }
 
+    // Nodes owned by an ASTArena have a negative count and are not counted
     static void internalAddRef(ASTNode *node)
     {
-        if (node)
+        if (node && node->m_refs >= 0)
             ++node->m_refs;
     }
 
     static void internalDelRef(ASTNode *node)
     {
-        if (node && --node->m_refs == 0)
-            delete node;
+        if (node && node->m_refs > 0 && --node->m_refs == 0)
+            destroy(node, true);
     }
 
+    friend class ASTArena;
+
 public:
     void addRef() { internalAddRef(this); }
     void delRef() { internalDelRef(this); }
@@ -63,7 +92,15 @@ public:
 
 class ASTNodeList : public ASTNode {
 public:
-    typedef std::list<PycRef<ASTNode>> list_t;
+    static bool classof(const ASTNode* node)
+    {
+        return node->type() == NODE_NODELIST
+                || node->type() == NODE_CHAINSTORE;
+    }
+
+    /* Chunked contiguous storage, which still allows cheap removal of the
+     * first and last statements */
+    typedef std::deque<PycRef<ASTNode>> list_t;
 
     ASTNodeList(list_t nodes)
         : ASTNode(NODE_NODELIST), m_nodes(std::move(nodes)) { }
@@ -84,10 +121,12 @@ private:
 
 class ASTChainStore : public ASTNodeList {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_CHAINSTORE; }
+
     ASTChainStore(list_t nodes, PycRef<ASTNode> src)
-        : ASTNodeList(nodes, NODE_CHAINSTORE), m_src(std::move(src)) { }
+        : ASTNodeList(std::move(nodes), NODE_CHAINSTORE), m_src(std::move(src)) { }
     
-    PycRef<ASTNode> src() const { return m_src; }
+    const PycRef<ASTNode>& src() const { return m_src; }
 
 private:
     PycRef<ASTNode> m_src;
@@ -96,10 +135,12 @@ private:
 
 class ASTObject : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_OBJECT; }
+
     ASTObject(PycRef<PycObject> obj)
         : ASTNode(NODE_OBJECT), m_obj(std::move(obj)) { }
 
-    PycRef<PycObject> object() const { return m_obj; }
+    const PycRef<PycObject>& object() const { return m_obj; }
 
 private:
     PycRef<PycObject> m_obj;
@@ -108,6 +149,8 @@ private:
 
 class ASTUnary : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_UNARY; }
+
     enum UnOp {
         UN_POSITIVE, UN_NEGATIVE, UN_INVERT, UN_NOT
     };
@@ -115,9 +158,9 @@ public:
     ASTUnary(PycRef<ASTNode> operand, int op)
         : ASTNode(NODE_UNARY), m_op(op), m_operand(std::move(operand)) { }
 
-    PycRef<ASTNode> operand() const { return m_operand; }
+    const PycRef<ASTNode>& operand() const { return m_operand; }
     int op() const { return m_op; }
-    virtual const char* op_str() const;
+    const char* op_str() const;
 
 protected:
     int m_op;
@@ -129,6 +172,13 @@ private:
 
 class ASTBinary : public ASTNode {
 public:
+    static bool classof(const ASTNode* node)
+    {
+        return node->type() == NODE_BINARY
+                || node->type() == NODE_COMPARE
+                || node->type() == NODE_SLICE;
+    }
+
     enum BinOp {
         BIN_ATTR, BIN_POWER, BIN_MULTIPLY, BIN_DIVIDE, BIN_FLOOR_DIVIDE,
         BIN_MODULO, BIN_ADD, BIN_SUBTRACT, BIN_LSHIFT, BIN_RSHIFT, BIN_AND,
@@ -145,11 +195,11 @@ public:
               int type = NODE_BINARY)
         : ASTNode(type), m_op(op), m_left(std::move(left)), m_right(std::move(right)) { }
 
-    PycRef<ASTNode> left() const { return m_left; }
-    PycRef<ASTNode> right() const { return m_right; }
+    const PycRef<ASTNode>& left() const { return m_left; }
+    const PycRef<ASTNode>& right() const { return m_right; }
     int op() const { return m_op; }
     bool is_inplace() const { return m_op >= BIN_IP_ADD; }
-    virtual const char* op_str() const;
+    const char* op_str() const;
 
     static BinOp from_opcode(int opcode);
     static BinOp from_binary_op(int operand);
@@ -165,6 +215,8 @@ private:
 
 class ASTCompare : public ASTBinary {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_COMPARE; }
+
     enum CompareOp {
         CMP_LESS, CMP_LESS_EQUAL, CMP_EQUAL, CMP_NOT_EQUAL, CMP_GREATER,
         CMP_GREATER_EQUAL, CMP_IN, CMP_NOT_IN, CMP_IS, CMP_IS_NOT,
@@ -174,12 +226,14 @@ public:
     ASTCompare(PycRef<ASTNode> left, PycRef<ASTNode> right, int op)
         : ASTBinary(std::move(left), std::move(right), op, NODE_COMPARE) { }
 
-    const char* op_str() const override;
+    const char* op_str() const;
 };
 
 
 class ASTSlice : public ASTBinary {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_SLICE; }
+
     enum SliceOp {
         SLICE0, SLICE1, SLICE2, SLICE3
     };
@@ -191,11 +245,13 @@ public:
 
 class ASTStore : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_STORE; }
+
     ASTStore(PycRef<ASTNode> src, PycRef<ASTNode> dest)
         : ASTNode(NODE_STORE), m_src(std::move(src)), m_dest(std::move(dest)) { }
 
-    PycRef<ASTNode> src() const { return m_src; }
-    PycRef<ASTNode> dest() const { return m_dest; }
+    const PycRef<ASTNode>& src() const { return m_src; }
+    const PycRef<ASTNode>& dest() const { return m_dest; }
 
 private:
     PycRef<ASTNode> m_src;
@@ -205,6 +261,8 @@ private:
 
 class ASTReturn : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_RETURN; }
+
     enum RetType {
         RETURN, YIELD, YIELD_FROM
     };
@@ -212,7 +270,7 @@ public:
     ASTReturn(PycRef<ASTNode> value, RetType rettype = RETURN)
         : ASTNode(NODE_RETURN), m_value(std::move(value)), m_rettype(rettype) { }
 
-    PycRef<ASTNode> value() const { return m_value; }
+    const PycRef<ASTNode>& value() const { return m_value; }
     RetType rettype() const { return m_rettype; }
 
 private:
@@ -223,10 +281,12 @@ private:
 
 class ASTName : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_NAME; }
+
     ASTName(PycRef<PycString> name)
         : ASTNode(NODE_NAME), m_name(std::move(name)) { }
 
-    PycRef<PycString> name() const { return m_name; }
+    const PycRef<PycString>& name() const { return m_name; }
 
 private:
     PycRef<PycString> m_name;
@@ -235,10 +295,12 @@ private:
 
 class ASTDelete : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_DELETE; }
+
     ASTDelete(PycRef<ASTNode> value)
         : ASTNode(NODE_DELETE), m_value(std::move(value)) { }
 
-    PycRef<ASTNode> value() const { return m_value; }
+    const PycRef<ASTNode>& value() const { return m_value; }
 
 private:
     PycRef<ASTNode> m_value;
@@ -247,13 +309,15 @@ private:
 
 class ASTFunction : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_FUNCTION; }
+
     typedef std::list<PycRef<ASTNode>> defarg_t;
 
     ASTFunction(PycRef<ASTNode> code, defarg_t defArgs, defarg_t kwDefArgs)
         : ASTNode(NODE_FUNCTION), m_code(std::move(code)),
           m_defargs(std::move(defArgs)), m_kwdefargs(std::move(kwDefArgs)) { }
 
-    PycRef<ASTNode> code() const { return m_code; }
+    const PycRef<ASTNode>& code() const { return m_code; }
     const defarg_t& defargs() const { return m_defargs; }
     const defarg_t& kwdefargs() const { return m_kwdefargs; }
 
@@ -266,13 +330,15 @@ private:
 
 class ASTClass : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_CLASS; }
+
     ASTClass(PycRef<ASTNode> code, PycRef<ASTNode> bases, PycRef<ASTNode> name)
         : ASTNode(NODE_CLASS), m_code(std::move(code)), m_bases(std::move(bases)),
           m_name(std::move(name)) { }
 
-    PycRef<ASTNode> code() const { return m_code; }
-    PycRef<ASTNode> bases() const { return m_bases; }
-    PycRef<ASTNode> name() const { return m_name; }
+    const PycRef<ASTNode>& code() const { return m_code; }
+    const PycRef<ASTNode>& bases() const { return m_bases; }
+    const PycRef<ASTNode>& name() const { return m_name; }
 
 private:
     PycRef<ASTNode> m_code;
@@ -283,6 +349,8 @@ private:
 
 class ASTCall : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_CALL; }
+
     typedef std::list<PycRef<ASTNode>> pparam_t;
     typedef std::list<std::pair<PycRef<ASTNode>, PycRef<ASTNode>>> kwparam_t;
 
@@ -290,11 +358,11 @@ public:
         : ASTNode(NODE_CALL), m_func(std::move(func)), m_pparams(std::move(pparams)),
           m_kwparams(std::move(kwparams)) { }
 
-    PycRef<ASTNode> func() const { return m_func; }
+    const PycRef<ASTNode>& func() const { return m_func; }
     const pparam_t& pparams() const { return m_pparams; }
     const kwparam_t& kwparams() const { return m_kwparams; }
-    PycRef<ASTNode> var() const { return m_var; }
-    PycRef<ASTNode> kw() const { return m_kw; }
+    const PycRef<ASTNode>& var() const { return m_var; }
+    const PycRef<ASTNode>& kw() const { return m_kw; }
 
     bool hasVar() const { return m_var != nullptr; }
     bool hasKW() const { return m_kw != nullptr; }
@@ -313,16 +381,18 @@ private:
 
 class ASTImport : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_IMPORT; }
+
     typedef std::list<PycRef<ASTStore>> list_t;
 
     ASTImport(PycRef<ASTNode> name, PycRef<ASTNode> fromlist)
         : ASTNode(NODE_IMPORT), m_name(std::move(name)), m_fromlist(std::move(fromlist)) { }
 
-    PycRef<ASTNode> name() const { return m_name; }
+    const PycRef<ASTNode>& name() const { return m_name; }
     list_t stores() const { return m_stores; }
     void add_store(PycRef<ASTStore> store) { m_stores.emplace_back(std::move(store)); }
 
-    PycRef<ASTNode> fromlist() const { return m_fromlist; }
+    const PycRef<ASTNode>& fromlist() const { return m_fromlist; }
 
 private:
     PycRef<ASTNode> m_name;
@@ -334,6 +404,8 @@ private:
 
 class ASTTuple : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_TUPLE; }
+
     typedef std::vector<PycRef<ASTNode>> value_t;
 
     ASTTuple(value_t values)
@@ -354,6 +426,8 @@ private:
 
 class ASTList : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_LIST; }
+
     typedef std::list<PycRef<ASTNode>> value_t;
 
     ASTList(value_t values)
@@ -367,6 +441,8 @@ private:
 
 class ASTSet : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_SET; }
+
     typedef std::deque<PycRef<ASTNode>> value_t;
 
     ASTSet(value_t values)
@@ -380,6 +456,8 @@ private:
 
 class ASTMap : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_MAP; }
+
     typedef std::list<std::pair<PycRef<ASTNode>, PycRef<ASTNode>>> map_t;
 
     ASTMap() : ASTNode(NODE_MAP) { }
@@ -397,6 +475,8 @@ private:
 
 class ASTKwNamesMap : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_KW_NAMES_MAP; }
+
     typedef std::list<std::pair<PycRef<ASTNode>, PycRef<ASTNode>>> map_t;
 
     ASTKwNamesMap() : ASTNode(NODE_KW_NAMES_MAP) { }
@@ -414,6 +494,8 @@ private:
 
 class ASTConstMap : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_CONST_MAP; }
+
     typedef std::vector<PycRef<ASTNode>> values_t;
 
     ASTConstMap(PycRef<ASTNode> keys, const values_t& values)
@@ -430,11 +512,13 @@ private:
 
 class ASTSubscr : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_SUBSCR; }
+
     ASTSubscr(PycRef<ASTNode> name, PycRef<ASTNode> key)
         : ASTNode(NODE_SUBSCR), m_name(std::move(name)), m_key(std::move(key)) { }
 
-    PycRef<ASTNode> name() const { return m_name; }
-    PycRef<ASTNode> key() const { return m_key; }
+    const PycRef<ASTNode>& name() const { return m_name; }
+    const PycRef<ASTNode>& key() const { return m_key; }
 
 private:
     PycRef<ASTNode> m_name;
@@ -444,6 +528,8 @@ private:
 
 class ASTPrint : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_PRINT; }
+
     typedef std::list<PycRef<ASTNode>> values_t;
 
     ASTPrint(PycRef<ASTNode> value, PycRef<ASTNode> stream = {})
@@ -456,7 +542,7 @@ public:
     }
 
     values_t values() const { return m_values; }
-    PycRef<ASTNode> stream() const { return m_stream; }
+    const PycRef<ASTNode>& stream() const { return m_stream; }
     bool eol() const { return m_eol; }
 
     void add(PycRef<ASTNode> value) { m_values.emplace_back(std::move(value)); }
@@ -471,10 +557,12 @@ private:
 
 class ASTConvert : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_CONVERT; }
+
     ASTConvert(PycRef<ASTNode> name)
         : ASTNode(NODE_CONVERT), m_name(std::move(name)) { }
 
-    PycRef<ASTNode> name() const { return m_name; }
+    const PycRef<ASTNode>& name() const { return m_name; }
 
 private:
     PycRef<ASTNode> m_name;
@@ -483,6 +571,8 @@ private:
 
 class ASTKeyword : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_KEYWORD; }
+
     enum Word {
         KW_PASS, KW_BREAK, KW_CONTINUE
     };
@@ -499,6 +589,8 @@ private:
 
 class ASTRaise : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_RAISE; }
+
     typedef std::list<PycRef<ASTNode>> param_t;
 
     ASTRaise(param_t params) : ASTNode(NODE_RAISE), m_params(std::move(params)) { }
@@ -512,13 +604,15 @@ private:
 
 class ASTExec : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_EXEC; }
+
     ASTExec(PycRef<ASTNode> stmt, PycRef<ASTNode> glob, PycRef<ASTNode> loc)
         : ASTNode(NODE_EXEC), m_stmt(std::move(stmt)), m_glob(std::move(glob)),
           m_loc(std::move(loc)) { }
 
-    PycRef<ASTNode> statement() const { return m_stmt; }
-    PycRef<ASTNode> globals() const { return m_glob; }
-    PycRef<ASTNode> locals() const { return m_loc; }
+    const PycRef<ASTNode>& statement() const { return m_stmt; }
+    const PycRef<ASTNode>& globals() const { return m_glob; }
+    const PycRef<ASTNode>& locals() const { return m_loc; }
 
 private:
     PycRef<ASTNode> m_stmt;
@@ -529,7 +623,9 @@ private:
 
 class ASTBlock : public ASTNode {
 public:
-    typedef std::list<PycRef<ASTNode>> list_t;
+    static bool classof(const ASTNode* node) { return node->type() == NODE_BLOCK; }
+
+    typedef ASTNodeList::list_t list_t;
 
     enum BlkType {
         BLK_MAIN, BLK_IF, BLK_ELSE, BLK_ELIF, BLK_TRY,
@@ -537,10 +633,17 @@ public:
         BLK_WHILE, BLK_FOR, BLK_WITH, BLK_ASYNCFOR
     };
 
+    /* Which class the block is, since the block type doesn't tell */
+    enum BlkClass {
+        CLASS_BLOCK, CLASS_COND, CLASS_ITER, CLASS_CONTAINER, CLASS_WITH
+    };
+
     ASTBlock(BlkType blktype, int end = 0, int inited = 0)
-        : ASTNode(NODE_BLOCK), m_blktype(blktype), m_end(end), m_inited(inited) { }
+        : ASTNode(NODE_BLOCK), m_blktype(blktype), m_blkclass(CLASS_BLOCK), m_end(end),
+          m_inited(inited) { }
 
     BlkType blktype() const { return m_blktype; }
+    BlkClass blkclass() const { return m_blkclass; }
     int end() const { return m_end; }
     const list_t& nodes() const { return m_nodes; }
     list_t::size_type size() const { return m_nodes.size(); }
@@ -549,14 +652,20 @@ public:
     void append(PycRef<ASTNode> node) { m_nodes.emplace_back(std::move(node)); }
     const char* type_str() const;
 
-    virtual int inited() const { return m_inited; }
-    virtual void init() { m_inited = 1; }
-    virtual void init(int init) { m_inited = init; }
+    int inited() const { return m_inited; }
+    void init() { m_inited = 1; }
+    void init(int init) { m_inited = init; }
 
     void setEnd(int end) { m_end = end; }
 
+protected:
+    ASTBlock(BlkClass blkclass, BlkType blktype, int end)
+        : ASTNode(NODE_BLOCK), m_blktype(blktype), m_blkclass(blkclass), m_end(end),
+          m_inited() { }
+
 private:
     BlkType m_blktype;
+    BlkClass m_blkclass;
     int m_end;
     list_t m_nodes;
 
@@ -567,15 +676,21 @@ protected:
 
 class ASTCondBlock : public ASTBlock {
 public:
+    static bool classof(const ASTNode* node)
+    {
+        return ASTBlock::classof(node)
+                && static_cast<const ASTBlock*>(node)->blkclass() == CLASS_COND;
+    }
+
     enum InitCond {
         UNINITED, POPPED, PRE_POPPED
     };
 
     ASTCondBlock(ASTBlock::BlkType blktype, int end, PycRef<ASTNode> cond,
                  bool negative = false)
-        : ASTBlock(blktype, end), m_cond(std::move(cond)), m_negative(negative) { }
+        : ASTBlock(CLASS_COND, blktype, end), m_cond(std::move(cond)), m_negative(negative) { }
 
-    PycRef<ASTNode> cond() const { return m_cond; }
+    const PycRef<ASTNode>& cond() const { return m_cond; }
     bool negative() const { return m_negative; }
 
 private:
@@ -586,12 +701,18 @@ private:
 
 class ASTIterBlock : public ASTBlock {
 public:
+    static bool classof(const ASTNode* node)
+    {
+        return ASTBlock::classof(node)
+                && static_cast<const ASTBlock*>(node)->blkclass() == CLASS_ITER;
+    }
+
     ASTIterBlock(ASTBlock::BlkType blktype, int start, int end, PycRef<ASTNode> iter)
-        : ASTBlock(blktype, end), m_iter(std::move(iter)), m_idx(), m_comp(), m_start(start) { }
+        : ASTBlock(CLASS_ITER, blktype, end), m_iter(std::move(iter)), m_idx(), m_comp(), m_start(start) { }
 
-    PycRef<ASTNode> iter() const { return m_iter; }
-    PycRef<ASTNode> index() const { return m_idx; }
-    PycRef<ASTNode> condition() const { return m_cond; }
+    const PycRef<ASTNode>& iter() const { return m_iter; }
+    const PycRef<ASTNode>& index() const { return m_idx; }
+    const PycRef<ASTNode>& condition() const { return m_cond; }
     bool isComprehension() const { return m_comp; }
     int start() const { return m_start; }
 
@@ -609,8 +730,14 @@ private:
 
 class ASTContainerBlock : public ASTBlock {
 public:
+    static bool classof(const ASTNode* node)
+    {
+        return ASTBlock::classof(node)
+                && static_cast<const ASTBlock*>(node)->blkclass() == CLASS_CONTAINER;
+    }
+
     ASTContainerBlock(int finally, int except = 0)
-        : ASTBlock(ASTBlock::BLK_CONTAINER, 0), m_finally(finally), m_except(except) { }
+        : ASTBlock(CLASS_CONTAINER, ASTBlock::BLK_CONTAINER, 0), m_finally(finally), m_except(except) { }
 
     bool hasFinally() const { return m_finally != 0; }
     bool hasExcept() const { return m_except != 0; }
@@ -626,11 +753,17 @@ private:
 
 class ASTWithBlock : public ASTBlock {
 public:
+    static bool classof(const ASTNode* node)
+    {
+        return ASTBlock::classof(node)
+                && static_cast<const ASTBlock*>(node)->blkclass() == CLASS_WITH;
+    }
+
     ASTWithBlock(int end)
-        : ASTBlock(ASTBlock::BLK_WITH, end) { }
+        : ASTBlock(CLASS_WITH, ASTBlock::BLK_WITH, end) { }
 
-    PycRef<ASTNode> expr() const { return m_expr; }
-    PycRef<ASTNode> var() const { return m_var; }
+    const PycRef<ASTNode>& expr() const { return m_expr; }
+    const PycRef<ASTNode>& var() const { return m_var; }
 
     void setExpr(PycRef<ASTNode> expr) { m_expr = std::move(expr); init(); }
     void setVar(PycRef<ASTNode> var) { m_var = std::move(var); }
@@ -642,12 +775,14 @@ private:
 
 class ASTComprehension : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_COMPREHENSION; }
+
     typedef std::list<PycRef<ASTIterBlock>> generator_t;
 
     ASTComprehension(PycRef<ASTNode> result)
         : ASTNode(NODE_COMPREHENSION), m_result(std::move(result)) { }
 
-    PycRef<ASTNode> result() const { return m_result; }
+    const PycRef<ASTNode>& result() const { return m_result; }
     generator_t generators() const { return m_generators; }
 
     void addGenerator(PycRef<ASTIterBlock> gen) {
@@ -662,10 +797,12 @@ private:
 
 class ASTLoadBuildClass : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_LOADBUILDCLASS; }
+
     ASTLoadBuildClass(PycRef<PycObject> obj)
         : ASTNode(NODE_LOADBUILDCLASS), m_obj(std::move(obj)) { }
 
-    PycRef<PycObject> object() const { return m_obj; }
+    const PycRef<PycObject>& object() const { return m_obj; }
 
 private:
     PycRef<PycObject> m_obj;
@@ -673,10 +810,12 @@ private:
 
 class ASTAwaitable : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_AWAITABLE; }
+
     ASTAwaitable(PycRef<ASTNode> expr)
         : ASTNode(NODE_AWAITABLE), m_expr(std::move(expr)) { }
 
-    PycRef<ASTNode> expression() const { return m_expr; }
+    const PycRef<ASTNode>& expression() const { return m_expr; }
 
 private:
     PycRef<ASTNode> m_expr;
@@ -684,6 +823,8 @@ private:
 
 class ASTFormattedValue : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_FORMATTEDVALUE; }
+
     enum ConversionFlag {
         NONE = 0,
         STR = 1,
@@ -702,9 +843,9 @@ public:
           m_format_spec(std::move(format_spec))
     { }
 
-    PycRef<ASTNode> val() const { return m_val; }
+    const PycRef<ASTNode>& val() const { return m_val; }
     ConversionFlag conversion() const { return m_conversion; }
-    PycRef<ASTNode> format_spec() const { return m_format_spec; }
+    const PycRef<ASTNode>& format_spec() const { return m_format_spec; }
 
 private:
     PycRef<ASTNode> m_val;
@@ -715,6 +856,8 @@ private:
 // Same as ASTList
 class ASTJoinedStr : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_JOINEDSTR; }
+
     typedef std::list<PycRef<ASTNode>> value_t;
 
     ASTJoinedStr(value_t values)
@@ -728,11 +871,13 @@ private:
 
 class ASTAnnotatedVar : public ASTNode {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_ANNOTATED_VAR; }
+
     ASTAnnotatedVar(PycRef<ASTNode> name, PycRef<ASTNode> type)
         : ASTNode(NODE_ANNOTATED_VAR), m_name(std::move(name)), m_type(std::move(type)) { }
 
-    PycRef<ASTNode> name() const noexcept { return m_name; }
-    PycRef<ASTNode> annotation() const noexcept { return m_type; }
+    const PycRef<ASTNode>& name() const noexcept { return m_name; }
+    const PycRef<ASTNode>& annotation() const noexcept { return m_type; }
 
 private:
     PycRef<ASTNode> m_name;
@@ -742,14 +887,16 @@ private:
 class ASTTernary : public ASTNode
 {
 public:
+    static bool classof(const ASTNode* node) { return node->type() == NODE_TERNARY; }
+
     ASTTernary(PycRef<ASTNode> if_block, PycRef<ASTNode> if_expr,
                PycRef<ASTNode> else_expr)
         : ASTNode(NODE_TERNARY), m_if_block(std::move(if_block)),
           m_if_expr(std::move(if_expr)), m_else_expr(std::move(else_expr)) { }
 
-    PycRef<ASTNode> if_block() const noexcept { return m_if_block; }
-    PycRef<ASTNode> if_expr() const noexcept { return m_if_expr; }
-    PycRef<ASTNode> else_expr() const noexcept { return m_else_expr; }
+    const PycRef<ASTNode>& if_block() const noexcept { return m_if_block; }
+    const PycRef<ASTNode>& if_expr() const noexcept { return m_if_expr; }
+    const PycRef<ASTNode>& else_expr() const noexcept { return m_else_expr; }
 
 private:
     PycRef<ASTNode> m_if_block; // contains "condition" and "negative"
@@ -757,4 +904,67 @@ private:
     PycRef<ASTNode> m_else_expr;
 };
 
+
+/* Owns all of the nodes built for one code object.  Nodes are bump-allocated
+ * from large blocks, skip reference counting, and are all freed together
+ * when the arena is destroyed.
+ *
+ * A counted arena instead makes ordinary reference counted nodes and keeps
+ * a reference to each of them only until release(), so nodes can be freed
+ * while the rest of the code object is still being built.
+ *
+ * The memory is charged to account, if given; for a counted arena, that's
+ * the size of the nodes held until release(). */
+class ASTArena {
+public:
+    explicit ASTArena(bool counted = false, MemoryAccount* account = nullptr)
+        : m_counted(counted), m_made(), m_origin(), m_alloc(account), m_account(account),
+          m_heldBytes() { }
+    ~ASTArena();
+
+    ASTArena(const ASTArena&) = delete;
+    ASTArena& operator=(const ASTArena&) = delete;
+
+    /* Number of nodes allocated so far */
+    size_t size() const { return m_made; }
+
+    /* The origin which nodes made from now on are attributed to */
+    void setOrigin(int origin) { m_origin = origin; }
+
+    template <class _Node, class... _Args>
+    _Node* make(_Args&&... args)
+    {
+        ++m_made;
+        if (m_counted) {
+            _Node* node = new _Node(std::forward<_Args>(args)...);
+            static_cast<ASTNode*>(node)->setOrigin(m_origin);
+            m_held.emplace_back(node);
+            if (m_account) {
+                m_account->add(sizeof(_Node));
+                m_heldBytes += sizeof(_Node);
+            }
+            return node;
+        }
+        _Node* node = new (m_alloc.allocate(sizeof(_Node))) _Node(std::forward<_Args>(args)...);
+        m_nodes.push_back(node);
+        static_cast<ASTNode*>(node)->m_refs = -1;
+        static_cast<ASTNode*>(node)->setOrigin(m_origin);
+        return node;
+    }
+
+    /* Drops the references a counted arena holds.  Only call this while
+     * every node which is still needed is referenced from somewhere else. */
+    void release();
+
+private:
+    bool m_counted;
+    size_t m_made;
+    int m_origin;
+    BumpAllocator m_alloc;
+    MemoryAccount* m_account;
+    size_t m_heldBytes;
+    std::vector<ASTNode*> m_nodes;
+    std::vector<PycRef<ASTNode>> m_held;
+};
+
 #endif
@@ -1,8 +1,18 @@
+#include <algorithm>
 #include <cstring>
 #include <cstdint>
+#include <exception>
+#include <map>
+#include <sstream>
 #include <stdexcept>
+#include <unordered_map>
 #include "ASTree.h"
+#include "DecompileCache.h"
+#include "Disassembler.h"
 #include "FastStack.h"
+#include "OpcodeProfile.h"
+#include "SourceMap.h"
+#include "ThreadPool.h"
 #include "pyc_numeric.h"
 #include "bytecode.h"
 
@@ -14,29 +24,59 @@
 // NOTE: Nested f-strings not supported.
 #define F_STRING_QUOTE "'''"
 
-static void append_to_chain_store(const PycRef<ASTNode>& chainStore,
-        PycRef<ASTNode> item, FastStack& stack, const PycRef<ASTBlock>& curblock);
-
-/* Use this to determine if an error occurred (and therefore, if we should
- * avoid cleaning the output tree) */
-static bool cleanBuild;
+/* Literals can't be split over lines anywhere in an f-string, even in the
+ * expressions it formats */
+class KeepLiteralsWhole {
+public:
+    explicit KeepLiteralsWhole(PycModule* mod) : m_mod(mod), m_width(mod->literalWidth())
+    {
+        mod->setLiteralWidth(0);
+    }
+    ~KeepLiteralsWhole() { m_mod->setLiteralWidth(m_width); }
 
-/* Use this to prevent printing return keywords and newlines in lambdas. */
-static bool inLambda = false;
+private:
+    PycModule* m_mod;
+    size_t m_width;
+};
 
-/* Use this to keep track of whether we need to print out any docstring and
- * the list of global variables that we are using (such as inside a function). */
-static bool printDocstringAndGlobals = false;
+static void append_to_chain_store(const PycRef<ASTNode>& chainStore,
+        PycRef<ASTNode> item, FastStack& stack, const PycRef<ASTBlock>& curblock);
 
-/* Use this to keep track of whether we need to print a class or module docstring */
-static bool printClassDocstring = true;
+/* Prints the statements of a module's outermost block while the rest of it
+ * is still being built, just like print_src() prints them as part of the
+ * finished block */
+class StatementStream {
+public:
+    StatementStream(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+                    DecompileContext& ctx)
+        : m_code(std::move(code)), m_mod(mod), m_output(pyc_output), m_ctx(ctx),
+          m_printed(), m_nanos() { }
+
+    /* Prints and removes all but the last keep statements of block */
+    void flush(const PycRef<ASTBlock>& block, size_t keep);
+
+    size_t printed() const { return m_printed; }
+
+    /* Time spent in flush(), if stats are enabled */
+    uint64_t nanos() const { return m_nanos; }
+
+private:
+    PycRef<PycCode> m_code;
+    PycModule* m_mod;
+    PycOutput& m_output;
+    DecompileContext& m_ctx;
+    size_t m_printed;
+    uint64_t m_nanos;
+};
+
+/* Statements which are kept back from the stream: code which follows may
+ * still merge them with or replace them by the ones built after them */
+static const size_t STREAM_KEEP = 2;
 
 // shortcut for all top/pop calls
 static PycRef<ASTNode> StackPopTop(FastStack& stack)
 {
-    const auto node(stack.top());
-    stack.pop();
-    return node;
+    return stack.take();
 }
 
 /* compiler generates very, VERY similar byte code for if/else statement block and if-expression
@@ -49,7 +89,7 @@ static PycRef<ASTNode> StackPopTop(FastStack& stack)
  *  here, try to guess if just finished else statement is part of if-expression (ternary operator)
  *  if it is, remove statements from the block and put a ternary node on top of stack
  */
-static void CheckIfExpr(FastStack& stack, PycRef<ASTBlock> curblock)
+static void CheckIfExpr(FastStack& stack, PycRef<ASTBlock> curblock, ASTArena& arena)
 {
     if (stack.empty())
         return;
@@ -69,18 +109,84 @@ static void CheckIfExpr(FastStack& stack, PycRef<ASTBlock> curblock)
     auto if_block = curblock->nodes().back();
     auto if_expr = StackPopTop(stack);
     curblock->removeLast();
-    stack.push(new ASTTernary(std::move(if_block), std::move(if_expr), std::move(else_expr)));
+    stack.push(arena.make<ASTTernary>(std::move(if_block), std::move(if_expr), std::move(else_expr)));
 }
 
-PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
+/* The Python versions one instantiation of build_from_code() handles,
+ * as major * 100 + minor.  Version checks falling outside the range are
+ * settled at compile time, so every era gets a loop without most of them. */
+template <int Lo, int Hi>
+struct VersionRange {
+    static const int lo = Lo;
+    static const int hi = Hi;
+};
+
+typedef VersionRange<100, 207> Python1To2;
+typedef VersionRange<300, 305> Python30To35;
+typedef VersionRange<306, 310> Python36To310;
+typedef VersionRange<311, 9999> Python311Up;
+
+template <int Maj, int Min, class Ver>
+static inline bool at_least(const PycModule* mod)
 {
-    PycBuffer source(code->code()->value(), code->code()->length());
+    return (Maj * 100 + Min <= Ver::lo)
+        || (Maj * 100 + Min <= Ver::hi && mod->verCompare(Maj, Min) >= 0);
+}
 
-    FastStack stack((mod->majorVer() == 1) ? 20 : code->stackSize());
+/* Counts the steps building one code object takes, against its budget,
+ * and checks the input's memory account, if it has a limit.  Once either
+ * has run out, it stays out. */
+class BuildMeter {
+public:
+    BuildMeter(const BuildBudget& budget, const MemoryAccount* memory)
+        : m_budget(budget), m_memory((memory && memory->limit()) ? memory : nullptr),
+          m_steps(), m_start(budget.millis ? PycStats::now() : 0), m_exhausted(),
+          m_overMemory() { }
+
+    /* Returns false if the budget has run out */
+    bool step()
+    {
+        if (m_exhausted)
+            return false;
+        ++m_steps;
+        if (m_budget.steps && m_steps > m_budget.steps) {
+            m_exhausted = true;
+        } else if (m_budget.millis && (m_steps & 255) == 0
+                && PycStats::now() - m_start > (uint64_t)m_budget.millis * 1000000) {
+            // The clock is only read now and then, as it is much slower
+            m_exhausted = true;
+        } else if (m_memory && m_memory->over()) {
+            m_exhausted = m_overMemory = true;
+        }
+        return !m_exhausted;
+    }
+
+    bool exhausted() const { return m_exhausted; }
+    bool overMemory() const { return m_overMemory; }
+
+private:
+    const BuildBudget& m_budget;
+    const MemoryAccount* m_memory;
+    unsigned long m_steps;
+    uint64_t m_start;
+    bool m_exhausted;
+    bool m_overMemory;
+};
+
+template <class Ver>
+static PycRef<ASTNode> build_from_code(PycRef<PycCode> code, PycModule* mod,
+                                       DecompileContext& ctx, StatementStream* stream,
+                                       size_t& peak_depth)
+{
+    ASTArena& arena = *ctx.arena;
+    const PycCode::instructions_t& instructions = code->instructions(mod);
+    size_t next_insn = 0;
+
+    FastStack stack(!at_least<2, 0, Ver>(mod) ? 20 : code->stackSize());
     stackhist_t stack_hist;
 
     std::stack<PycRef<ASTBlock> > blocks;
-    PycRef<ASTBlock> defblock = new ASTBlock(ASTBlock::BLK_MAIN);
+    PycRef<ASTBlock> defblock = arena.make<ASTBlock>(ASTBlock::BLK_MAIN);
     defblock->init();
     PycRef<ASTBlock> curblock = defblock;
     blocks.push(defblock);
@@ -92,8 +198,42 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
     bool else_pop = false;
     bool need_try = false;
     bool variable_annotations = false;
+    BuildMeter meter(ctx.budget, mod->memoryAccount());
+
+    // With line markers, nodes are attributed to the earliest line of the
+    // instructions since the last statement started, which is the line of
+    // the statement they are made for.  For a source map, they are
+    // attributed to the first of those instructions instead.
+    static const PycCode::lines_t no_lines;
+    bool origins = ctx.lineMarkers || ctx.sourceOffsets;
+    PycLineCursor lines(origins ? code->lineTable(mod) : no_lines);
+    PycRef<ASTBlock> stmt_block;
+    size_t stmt_count = 0;
+    int stmt_line = 0;
+    int stmt_offset = -1;
+    int insn_line = 0;
+
+    // Moves on to the next instruction.  Past the end of the code, this
+    // yields what bc_next() would have read there.
+    auto advance = [&]() {
+        if (next_insn < instructions.size()) {
+            const PycInstruction& insn = instructions[next_insn++];
+            opcode = insn.opcode;
+            operand = insn.operand;
+            pos = insn.offset + insn.length;
+        } else {
+            opcode = Pyc::PYC_INVALID_OPCODE;
+            if (at_least<3, 6, Ver>(mod)) {
+                operand = EOF;
+                pos += 2;
+            } else {
+                operand = 0;
+                pos += 1;
+            }
+        }
+    };
 
-    while (!source.atEof()) {
+    while (next_insn < instructions.size()) {
 #if defined(BLOCK_DEBUG) || defined(STACK_DEBUG)
         fprintf(stderr, "%-7d", pos);
     #ifdef STACK_DEBUG
@@ -107,15 +247,48 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         fprintf(stderr, "\n");
 #endif
 
+        if (!meter.step()) {
+            PycStringView name = code->name()->view();
+            pyc_diagnostic("Gave up on %.*s: over the %s budget\n", (int)name.size(),
+                           name.data(), meter.overMemory() ? "memory" : "build");
+            ctx.overBudget = true;
+            ctx.cleanBuild = false;
+            return arena.make<ASTNodeList>(defblock->nodes());
+        }
+
+        if (stack_hist.size() > peak_depth)
+            peak_depth = stack_hist.size();
+
+        if (origins) {
+            if (curblock != stmt_block || curblock->size() != stmt_count) {
+                stmt_block = curblock;
+                stmt_count = curblock->size();
+                stmt_line = 0;
+                stmt_offset = -1;
+            }
+            // A new line with nothing on the stack starts a new statement,
+            // even where the previous one didn't add anything (e.g. a loop
+            // condition)
+            int offset = instructions[next_insn].offset;
+            int line = lines.lineAt(offset);
+            bool new_line = (line != insn_line && stack.empty());
+            if (line > 0 && (stmt_line == 0 || line < stmt_line || new_line))
+                stmt_line = line;
+            if (stmt_offset < 0 || new_line)
+                stmt_offset = offset;
+            insn_line = line;
+            arena.setOrigin(ctx.sourceOffsets ? stmt_offset + 1 : stmt_line);
+        }
+
         curpos = pos;
-        bc_next(source, mod, opcode, operand, pos);
+        advance();
 
         if (need_try && opcode != Pyc::SETUP_EXCEPT_A) {
             need_try = false;
 
             /* Store the current stack for the except/finally statement(s) */
             stack_hist.push(stack);
-            PycRef<ASTBlock> tryblock = new ASTBlock(ASTBlock::BLK_TRY, curblock->end(), true);
+            PycRef<ASTBlock> tryblock = arena.make<ASTBlock>(ASTBlock::BLK_TRY, curblock->end(), true);
             blocks.push(tryblock);
             curblock = blocks.top();
         } else if (else_pop
@@ -133,7 +306,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
 
             PycRef<ASTBlock> prev = curblock;
             while (prev->end() < pos
-                    && prev->blktype() != ASTBlock::BLK_MAIN) {
+                    && prev->blktype() != ASTBlock::BLK_MAIN && meter.step()) {
                 if (prev->blktype() != ASTBlock::BLK_CONTAINER) {
                     if (prev->end() == 0) {
                         break;
@@ -155,21 +328,23 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
 
                 prev = curblock;
 
-                CheckIfExpr(stack, curblock);
+                CheckIfExpr(stack, curblock, arena);
             }
         }
 
+#ifdef OPCODE_PROFILE
+        OpcodeProfile::Scope opcode_scope(OpcodeProfile::opcode(mod->majorVer(),
+                                                                mod->minorVer(), opcode));
+#endif
         switch (opcode) {
         case Pyc::BINARY_OP_A:
             {
                 ASTBinary::BinOp op = ASTBinary::from_binary_op(operand);
                 if (op == ASTBinary::BIN_INVALID)
-                    fprintf(stderr, "Unsupported `BINARY_OP` operand value: %d\n", operand);
-                PycRef<ASTNode> right = stack.top();
-                stack.pop();
-                PycRef<ASTNode> left = stack.top();
-                stack.pop();
-                stack.push(new ASTBinary(left, right, op));
+                    pyc_diagnostic("Unsupported `BINARY_OP` operand value: %d\n", operand);
+                PycRef<ASTNode> right = StackPopTop(stack);
+                PycRef<ASTNode> left = StackPopTop(stack);
+                stack.push(arena.make<ASTBinary>(left, right, op));
             }
             break;
         case Pyc::BINARY_ADD:
@@ -204,41 +379,33 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 ASTBinary::BinOp op = ASTBinary::from_opcode(opcode);
                 if (op == ASTBinary::BIN_INVALID)
                     throw std::runtime_error("Unhandled opcode from ASTBinary::from_opcode");
-                PycRef<ASTNode> right = stack.top();
-                stack.pop();
-                PycRef<ASTNode> left = stack.top();
-                stack.pop();
-                stack.push(new ASTBinary(left, right, op));
+                PycRef<ASTNode> right = StackPopTop(stack);
+                PycRef<ASTNode> left = StackPopTop(stack);
+                stack.push(arena.make<ASTBinary>(left, right, op));
             }
             break;
         case Pyc::BINARY_SUBSCR:
             {
-                PycRef<ASTNode> subscr = stack.top();
-                stack.pop();
-                PycRef<ASTNode> src = stack.top();
-                stack.pop();
-                stack.push(new ASTSubscr(src, subscr));
+                PycRef<ASTNode> subscr = StackPopTop(stack);
+                PycRef<ASTNode> src = StackPopTop(stack);
+                stack.push(arena.make<ASTSubscr>(src, subscr));
             }
             break;
         case Pyc::BREAK_LOOP:
-            curblock->append(new ASTKeyword(ASTKeyword::KW_BREAK));
+            curblock->append(arena.make<ASTKeyword>(ASTKeyword::KW_BREAK));
             break;
         case Pyc::BUILD_CLASS:
             {
-                PycRef<ASTNode> class_code = stack.top();
-                stack.pop();
-                PycRef<ASTNode> bases = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
-                stack.push(new ASTClass(class_code, bases, name));
+                PycRef<ASTNode> class_code = StackPopTop(stack);
+                PycRef<ASTNode> bases = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
+                stack.push(arena.make<ASTClass>(class_code, bases, name));
             }
             break;
         case Pyc::BUILD_FUNCTION:
             {
-                PycRef<ASTNode> fun_code = stack.top();
-                stack.pop();
-                stack.push(new ASTFunction(fun_code, {}, {}));
+                PycRef<ASTNode> fun_code = StackPopTop(stack);
+                stack.push(arena.make<ASTFunction>(fun_code, ASTFunction::defarg_t(), ASTFunction::defarg_t()));
             }
             break;
         case Pyc::BUILD_LIST_A:
@@ -248,7 +415,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     values.push_front(stack.top());
                     stack.pop();
                 }
-                stack.push(new ASTList(values));
+                stack.push(arena.make<ASTList>(values));
             }
             break;
         case Pyc::BUILD_SET_A:
@@ -258,17 +425,15 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     values.push_front(stack.top());
                     stack.pop();
                 }
-                stack.push(new ASTSet(values));
+                stack.push(arena.make<ASTSet>(values));
             }
             break;
         case Pyc::BUILD_MAP_A:
-            if (mod->verCompare(3, 5) >= 0) {
-                auto map = new ASTMap;
+            if (at_least<3, 5, Ver>(mod)) {
+                auto map = arena.make<ASTMap>();
                 for (int i=0; i<operand; ++i) {
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> key = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> value = StackPopTop(stack);
+                    PycRef<ASTNode> key = StackPopTop(stack);
                     map->add(key, value);
                 }
                 stack.push(map);
@@ -276,33 +441,29 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
                     stack.pop();
                 }
-                stack.push(new ASTMap());
+                stack.push(arena.make<ASTMap>());
             }
             break;
         case Pyc::BUILD_CONST_KEY_MAP_A:
             // Top of stack will be a tuple of keys.
             // Values will start at TOS - 1.
             {
-                PycRef<ASTNode> keys = stack.top();
-                stack.pop();
+                PycRef<ASTNode> keys = StackPopTop(stack);
 
                 ASTConstMap::values_t values;
                 values.reserve(operand);
                 for (int i = 0; i < operand; ++i) {
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> value = StackPopTop(stack);
                     values.push_back(value);
                 }
 
-                stack.push(new ASTConstMap(keys, values));
+                stack.push(arena.make<ASTConstMap>(keys, values));
             }
             break;
         case Pyc::STORE_MAP:
             {
-                PycRef<ASTNode> key = stack.top();
-                stack.pop();
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> key = StackPopTop(stack);
+                PycRef<ASTNode> value = StackPopTop(stack);
                 PycRef<ASTMap> map = stack.top().cast<ASTMap>();
                 map->add(key, value);
             }
@@ -310,10 +471,8 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::BUILD_SLICE_A:
             {
                 if (operand == 2) {
-                    PycRef<ASTNode> end = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> start = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> end = StackPopTop(stack);
+                    PycRef<ASTNode> start = StackPopTop(stack);
 
                     if (start.type() == ASTNode::NODE_OBJECT
                             && start.cast<ASTObject>()->object() == Pyc_None) {
@@ -326,21 +485,18 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     }
 
                     if (start == NULL && end == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE0));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE0));
                     } else if (start == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE2, start, end));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE2, start, end));
                     } else if (end == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE1, start, end));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE1, start, end));
                     } else {
-                        stack.push(new ASTSlice(ASTSlice::SLICE3, start, end));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE3, start, end));
                     }
                 } else if (operand == 3) {
-                    PycRef<ASTNode> step = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> end = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> start = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> step = StackPopTop(stack);
+                    PycRef<ASTNode> end = StackPopTop(stack);
+                    PycRef<ASTNode> start = StackPopTop(stack);
 
                     if (start.type() == ASTNode::NODE_OBJECT
                             && start.cast<ASTObject>()->object() == Pyc_None) {
@@ -361,22 +517,21 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     /* [[a:b]:c] */
 
                     if (start == NULL && end == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE0));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE0));
                     } else if (start == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE2, start, end));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE2, start, end));
                     } else if (end == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE1, start, end));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE1, start, end));
                     } else {
-                        stack.push(new ASTSlice(ASTSlice::SLICE3, start, end));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE3, start, end));
                     }
 
-                    PycRef<ASTNode> lhs = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> lhs = StackPopTop(stack);
 
                     if (step == NULL) {
-                        stack.push(new ASTSlice(ASTSlice::SLICE1, lhs, step));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE1, lhs, step));
                     } else {
-                        stack.push(new ASTSlice(ASTSlice::SLICE3, lhs, step));
+                        stack.push(arena.make<ASTSlice>(ASTSlice::SLICE3, lhs, step));
                     }
                 }
             }
@@ -389,7 +544,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     values.push_front(stack.top());
                     stack.pop();
                 }
-                stack.push(new ASTJoinedStr(values));
+                stack.push(arena.make<ASTJoinedStr>(values));
             }
             break;
         case Pyc::BUILD_TUPLE_A:
@@ -406,7 +561,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     values[operand-i-1] = stack.top();
                     stack.pop();
                 }
-                stack.push(new ASTTuple(values));
+                stack.push(arena.make<ASTTuple>(values));
             }
             break;
         case Pyc::KW_NAMES_A:
@@ -416,10 +571,10 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 ASTKwNamesMap kwparamList;
                 std::vector<PycRef<PycObject>> keys = code->getConst(operand).cast<PycSimpleSequence>()->values();
                 for (int i = 0; i < kwparams; i++) {
-                    kwparamList.add(new ASTObject(keys[kwparams - i - 1]), stack.top());
+                    kwparamList.add(arena.make<ASTObject>(keys[kwparams - i - 1]), stack.top());
                     stack.pop();
                 }
-                stack.push(new ASTKwNamesMap(kwparamList));
+                stack.push(arena.make<ASTKwNamesMap>(kwparamList));
             }
             break;
         case Pyc::CALL_A:
@@ -448,16 +603,13 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     TOS_type = TOS.type();
                 }
                 // qualified name is PycString at TOS
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
-                PycRef<ASTNode> function = stack.top();
-                stack.pop();
-                PycRef<ASTNode> loadbuild = stack.top();
-                stack.pop();
+                PycRef<ASTNode> name = StackPopTop(stack);
+                PycRef<ASTNode> function = StackPopTop(stack);
+                PycRef<ASTNode> loadbuild = StackPopTop(stack);
                 int loadbuild_type = loadbuild.type();
                 if (loadbuild_type == ASTNode::NODE_LOADBUILDCLASS) {
-                    PycRef<ASTNode> call = new ASTCall(function, pparamList, kwparamList);
-                    stack.push(new ASTClass(call, new ASTTuple(bases), name));
+                    PycRef<ASTNode> call = arena.make<ASTCall>(function, pparamList, kwparamList);
+                    stack.push(arena.make<ASTClass>(call, arena.make<ASTTuple>(bases), name));
                     stack_hist.pop();
                     break;
                 }
@@ -473,7 +625,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     co_consts[consti] must be a tuple of strings.
                     New in version 3.11.
                 */
-                if (mod->verCompare(3, 11) >= 0) {
+                if (at_least<3, 11, Ver>(mod)) {
                     PycRef<ASTNode> object_or_map = stack.top();
                     if (object_or_map.type() == ASTNode::NODE_KW_NAMES_MAP) {
                         stack.pop();
@@ -486,26 +638,23 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 }
                 else {
                     for (int i = 0; i < kwparams; i++) {
-                        PycRef<ASTNode> val = stack.top();
-                        stack.pop();
-                        PycRef<ASTNode> key = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> val = StackPopTop(stack);
+                        PycRef<ASTNode> key = StackPopTop(stack);
                         kwparamList.push_front(std::make_pair(key, val));
                     }
                 }
                 for (int i=0; i<pparams; i++) {
-                    PycRef<ASTNode> param = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> param = StackPopTop(stack);
                     if (param.type() == ASTNode::NODE_FUNCTION) {
                         PycRef<ASTNode> fun_code = param.cast<ASTFunction>()->code();
                         PycRef<PycCode> code_src = fun_code.cast<ASTObject>()->object().cast<PycCode>();
                         PycRef<PycString> function_name = code_src->name();
-                        if (function_name->isEqual("<lambda>")) {
+                        if (mod->isName(function_name, PycInterner::NAME_LAMBDA)) {
                             pparamList.push_front(param);
                         } else {
                             // Decorator used
-                            PycRef<ASTNode> decor_name = new ASTName(function_name);
-                            curblock->append(new ASTStore(param, decor_name));
+                            PycRef<ASTNode> decor_name = arena.make<ASTName>(function_name);
+                            curblock->append(arena.make<ASTStore>(param, decor_name));
 
                             pparamList.push_front(decor_name);
                         }
@@ -513,95 +662,81 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         pparamList.push_front(param);
                     }
                 }
-                PycRef<ASTNode> func = stack.top();
-                stack.pop();
+                PycRef<ASTNode> func = StackPopTop(stack);
                 if ((opcode == Pyc::CALL_A || opcode == Pyc::INSTRUMENTED_CALL_A) &&
                         stack.top() == nullptr) {
                     stack.pop();
                 }
 
-                stack.push(new ASTCall(func, pparamList, kwparamList));
+                stack.push(arena.make<ASTCall>(func, pparamList, kwparamList));
             }
             break;
         case Pyc::CALL_FUNCTION_VAR_A:
             {
-                PycRef<ASTNode> var = stack.top();
-                stack.pop();
+                PycRef<ASTNode> var = StackPopTop(stack);
                 int kwparams = (operand & 0xFF00) >> 8;
                 int pparams = (operand & 0xFF);
                 ASTCall::kwparam_t kwparamList;
                 ASTCall::pparam_t pparamList;
                 for (int i=0; i<kwparams; i++) {
-                    PycRef<ASTNode> val = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> key = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> val = StackPopTop(stack);
+                    PycRef<ASTNode> key = StackPopTop(stack);
                     kwparamList.push_front(std::make_pair(key, val));
                 }
                 for (int i=0; i<pparams; i++) {
                     pparamList.push_front(stack.top());
                     stack.pop();
                 }
-                PycRef<ASTNode> func = stack.top();
-                stack.pop();
+                PycRef<ASTNode> func = StackPopTop(stack);
 
-                PycRef<ASTNode> call = new ASTCall(func, pparamList, kwparamList);
+                PycRef<ASTNode> call = arena.make<ASTCall>(func, pparamList, kwparamList);
                 call.cast<ASTCall>()->setVar(var);
                 stack.push(call);
             }
             break;
         case Pyc::CALL_FUNCTION_KW_A:
             {
-                PycRef<ASTNode> kw = stack.top();
-                stack.pop();
+                PycRef<ASTNode> kw = StackPopTop(stack);
                 int kwparams = (operand & 0xFF00) >> 8;
                 int pparams = (operand & 0xFF);
                 ASTCall::kwparam_t kwparamList;
                 ASTCall::pparam_t pparamList;
                 for (int i=0; i<kwparams; i++) {
-                    PycRef<ASTNode> val = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> key = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> val = StackPopTop(stack);
+                    PycRef<ASTNode> key = StackPopTop(stack);
                     kwparamList.push_front(std::make_pair(key, val));
                 }
                 for (int i=0; i<pparams; i++) {
                     pparamList.push_front(stack.top());
                     stack.pop();
                 }
-                PycRef<ASTNode> func = stack.top();
-                stack.pop();
+                PycRef<ASTNode> func = StackPopTop(stack);
 
-                PycRef<ASTNode> call = new ASTCall(func, pparamList, kwparamList);
+                PycRef<ASTNode> call = arena.make<ASTCall>(func, pparamList, kwparamList);
                 call.cast<ASTCall>()->setKW(kw);
                 stack.push(call);
             }
             break;
         case Pyc::CALL_FUNCTION_VAR_KW_A:
             {
-                PycRef<ASTNode> kw = stack.top();
-                stack.pop();
-                PycRef<ASTNode> var = stack.top();
-                stack.pop();
+                PycRef<ASTNode> kw = StackPopTop(stack);
+                PycRef<ASTNode> var = StackPopTop(stack);
                 int kwparams = (operand & 0xFF00) >> 8;
                 int pparams = (operand & 0xFF);
                 ASTCall::kwparam_t kwparamList;
                 ASTCall::pparam_t pparamList;
                 for (int i=0; i<kwparams; i++) {
-                    PycRef<ASTNode> val = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> key = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> val = StackPopTop(stack);
+                    PycRef<ASTNode> key = StackPopTop(stack);
                     kwparamList.push_front(std::make_pair(key, val));
                 }
                 for (int i=0; i<pparams; i++) {
                     pparamList.push_front(stack.top());
                     stack.pop();
                 }
-                PycRef<ASTNode> func = stack.top();
-                stack.pop();
+                PycRef<ASTNode> func = StackPopTop(stack);
 
-                PycRef<ASTNode> call = new ASTCall(func, pparamList, kwparamList);
+                PycRef<ASTNode> call = arena.make<ASTCall>(func, pparamList, kwparamList);
                 call.cast<ASTCall>()->setKW(kw);
                 call.cast<ASTCall>()->setVar(var);
                 stack.push(call);
@@ -611,18 +746,17 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             {
                 ASTCall::pparam_t pparamList;
                 for (int i = 0; i < operand; i++) {
-                    PycRef<ASTNode> param = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> param = StackPopTop(stack);
                     if (param.type() == ASTNode::NODE_FUNCTION) {
                         PycRef<ASTNode> fun_code = param.cast<ASTFunction>()->code();
                         PycRef<PycCode> code_src = fun_code.cast<ASTObject>()->object().cast<PycCode>();
                         PycRef<PycString> function_name = code_src->name();
-                        if (function_name->isEqual("<lambda>")) {
+                        if (mod->isName(function_name, PycInterner::NAME_LAMBDA)) {
                             pparamList.push_front(param);
                         } else {
                             // Decorator used
-                            PycRef<ASTNode> decor_name = new ASTName(function_name);
-                            curblock->append(new ASTStore(param, decor_name));
+                            PycRef<ASTNode> decor_name = arena.make<ASTName>(function_name);
+                            curblock->append(arena.make<ASTStore>(param, decor_name));
 
                             pparamList.push_front(decor_name);
                         }
@@ -630,43 +764,37 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         pparamList.push_front(param);
                     }
                 }
-                PycRef<ASTNode> func = stack.top();
-                stack.pop();
-                stack.push(new ASTCall(func, pparamList, ASTCall::kwparam_t()));
+                PycRef<ASTNode> func = StackPopTop(stack);
+                stack.push(arena.make<ASTCall>(func, pparamList, ASTCall::kwparam_t()));
             }
             break;
         case Pyc::CONTINUE_LOOP_A:
-            curblock->append(new ASTKeyword(ASTKeyword::KW_CONTINUE));
+            curblock->append(arena.make<ASTKeyword>(ASTKeyword::KW_CONTINUE));
             break;
         case Pyc::COMPARE_OP_A:
             {
-                PycRef<ASTNode> right = stack.top();
-                stack.pop();
-                PycRef<ASTNode> left = stack.top();
-                stack.pop();
+                PycRef<ASTNode> right = StackPopTop(stack);
+                PycRef<ASTNode> left = StackPopTop(stack);
                 auto arg = operand;
-                if (mod->verCompare(3, 12) == 0)
+                if ((at_least<3, 12, Ver>(mod) && !at_least<3, 13, Ver>(mod)))
                     arg >>= 4; // changed under GH-100923
-                else if (mod->verCompare(3, 13) >= 0)
+                else if (at_least<3, 13, Ver>(mod))
                     arg >>= 5;
-                stack.push(new ASTCompare(left, right, arg));
+                stack.push(arena.make<ASTCompare>(left, right, arg));
             }
             break;
         case Pyc::CONTAINS_OP_A:
             {
-                PycRef<ASTNode> right = stack.top();
-                stack.pop();
-                PycRef<ASTNode> left = stack.top();
-                stack.pop();
+                PycRef<ASTNode> right = StackPopTop(stack);
+                PycRef<ASTNode> left = StackPopTop(stack);
                 // The operand will be 0 for 'in' and 1 for 'not in'.
-                stack.push(new ASTCompare(left, right, operand ? ASTCompare::CMP_NOT_IN : ASTCompare::CMP_IN));
+                stack.push(arena.make<ASTCompare>(left, right, operand ? ASTCompare::CMP_NOT_IN : ASTCompare::CMP_IN));
             }
             break;
         case Pyc::DELETE_ATTR_A:
             {
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
-                curblock->append(new ASTDelete(new ASTBinary(name, new ASTName(code->getName(operand)), ASTBinary::BIN_ATTR)));
+                PycRef<ASTNode> name = StackPopTop(stack);
+                curblock->append(arena.make<ASTDelete>(arena.make<ASTBinary>(name, arena.make<ASTName>(code->getName(operand)), ASTBinary::BIN_ATTR)));
             }
             break;
         case Pyc::DELETE_GLOBAL_A:
@@ -676,82 +804,70 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             {
                 PycRef<PycString> varname = code->getName(operand);
 
-                if (varname->length() >= 2 && varname->value()[0] == '_'
-                        && varname->value()[1] == '[') {
+                if (varname->startsWith("_[")) {
                     /* Don't show deletes that are a result of list comps. */
                     break;
                 }
 
-                PycRef<ASTNode> name = new ASTName(varname);
-                curblock->append(new ASTDelete(name));
+                PycRef<ASTNode> name = arena.make<ASTName>(varname);
+                curblock->append(arena.make<ASTDelete>(name));
             }
             break;
         case Pyc::DELETE_FAST_A:
             {
                 PycRef<ASTNode> name;
 
-                if (mod->verCompare(1, 3) < 0)
-                    name = new ASTName(code->getName(operand));
+                if (!at_least<1, 3, Ver>(mod))
+                    name = arena.make<ASTName>(code->getName(operand));
                 else
-                    name = new ASTName(code->getLocal(operand));
+                    name = arena.make<ASTName>(code->getLocal(operand));
 
-                if (name.cast<ASTName>()->name()->value()[0] == '_'
-                        && name.cast<ASTName>()->name()->value()[1] == '[') {
+                if (name.cast<ASTName>()->name()->startsWith("_[")) {
                     /* Don't show deletes that are a result of list comps. */
                     break;
                 }
 
-                curblock->append(new ASTDelete(name));
+                curblock->append(arena.make<ASTDelete>(name));
             }
             break;
         case Pyc::DELETE_SLICE_0:
             {
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                curblock->append(new ASTDelete(new ASTSubscr(name, new ASTSlice(ASTSlice::SLICE0))));
+                curblock->append(arena.make<ASTDelete>(arena.make<ASTSubscr>(name, arena.make<ASTSlice>(ASTSlice::SLICE0))));
             }
             break;
         case Pyc::DELETE_SLICE_1:
             {
-                PycRef<ASTNode> upper = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> upper = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                curblock->append(new ASTDelete(new ASTSubscr(name, new ASTSlice(ASTSlice::SLICE1, upper))));
+                curblock->append(arena.make<ASTDelete>(arena.make<ASTSubscr>(name, arena.make<ASTSlice>(ASTSlice::SLICE1, upper))));
             }
             break;
         case Pyc::DELETE_SLICE_2:
             {
-                PycRef<ASTNode> lower = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> lower = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                curblock->append(new ASTDelete(new ASTSubscr(name, new ASTSlice(ASTSlice::SLICE2, NULL, lower))));
+                curblock->append(arena.make<ASTDelete>(arena.make<ASTSubscr>(name, arena.make<ASTSlice>(ASTSlice::SLICE2, nullptr, lower))));
             }
             break;
         case Pyc::DELETE_SLICE_3:
             {
-                PycRef<ASTNode> lower = stack.top();
-                stack.pop();
-                PycRef<ASTNode> upper = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> lower = StackPopTop(stack);
+                PycRef<ASTNode> upper = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                curblock->append(new ASTDelete(new ASTSubscr(name, new ASTSlice(ASTSlice::SLICE3, upper, lower))));
+                curblock->append(arena.make<ASTDelete>(arena.make<ASTSubscr>(name, arena.make<ASTSlice>(ASTSlice::SLICE3, upper, lower))));
             }
             break;
         case Pyc::DELETE_SUBSCR:
             {
-                PycRef<ASTNode> key = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> key = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                curblock->append(new ASTDelete(new ASTSubscr(name, key)));
+                curblock->append(arena.make<ASTDelete>(arena.make<ASTSubscr>(name, key)));
             }
             break;
         case Pyc::DUP_TOP:
@@ -759,21 +875,19 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (stack.top().type() == PycObject::TYPE_NULL) {
                     stack.push(stack.top());
                 } else if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
-                    auto chainstore = stack.top();
-                    stack.pop();
+                    auto chainstore = StackPopTop(stack);
                     stack.push(stack.top());
                     stack.push(chainstore);
                 } else {
                     stack.push(stack.top());
                     ASTNodeList::list_t targets;
-                    stack.push(new ASTChainStore(targets, stack.top()));
+                    stack.push(arena.make<ASTChainStore>(targets, stack.top()));
                 }
             }
             break;
         case Pyc::DUP_TOP_TWO:
             {
-                PycRef<ASTNode> first = stack.top();
-                stack.pop();
+                PycRef<ASTNode> first = StackPopTop(stack);
                 PycRef<ASTNode> second = stack.top();
 
                 stack.push(first);
@@ -787,8 +901,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 std::stack<PycRef<ASTNode> > second;
 
                 for (int i = 0; i < operand; i++) {
-                    PycRef<ASTNode> node = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> node = StackPopTop(stack);
                     first.push(node);
                     second.push(node);
                 }
@@ -839,7 +952,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                             stack = stack_hist.top();
                             stack_hist.pop();
                             if (!curblock->inited())
-                                fprintf(stderr, "Error when decompiling 'async for'.\n");
+                                pyc_diagnostic("Error when decompiling 'async for'.\n");
                         } else {
                             blocks.push(container);
                         }
@@ -854,7 +967,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
 
                         /* Turn it into an else statement. */
                         if (curblock->end() != pos || curblock.cast<ASTContainerBlock>()->hasFinally()) {
-                            PycRef<ASTBlock> elseblk = new ASTBlock(ASTBlock::BLK_ELSE, prev->end());
+                            PycRef<ASTBlock> elseblk = arena.make<ASTBlock>(ASTBlock::BLK_ELSE, prev->end());
                             elseblk->init();
                             blocks.push(elseblk);
                             curblock = blocks.top();
@@ -883,14 +996,11 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
                     stack.pop();
                 }
-                PycRef<ASTNode> loc = stack.top();
-                stack.pop();
-                PycRef<ASTNode> glob = stack.top();
-                stack.pop();
-                PycRef<ASTNode> stmt = stack.top();
-                stack.pop();
+                PycRef<ASTNode> loc = StackPopTop(stack);
+                PycRef<ASTNode> glob = StackPopTop(stack);
+                PycRef<ASTNode> stmt = StackPopTop(stack);
 
-                curblock->append(new ASTExec(stmt, glob, loc));
+                curblock->append(arena.make<ASTExec>(stmt, glob, loc));
             }
             break;
         case Pyc::FOR_ITER_A:
@@ -906,12 +1016,12 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 // before 3.8, there is a SETUP_LOOP instruction with block start and end position,
                 //    the operand is usually a jump to a POP_BLOCK instruction
                 // after 3.8, block extent has to be inferred implicitly; the operand is a jump to a position after the for block
-                if (mod->majorVer() == 3 && mod->minorVer() >= 8) {
+                if (at_least<3, 8, Ver>(mod)) {
                     end = operand;
-                    if (mod->verCompare(3, 10) >= 0)
+                    if (at_least<3, 10, Ver>(mod))
                         end *= sizeof(uint16_t); // // BPO-27129
                     end += pos;
-                    comprehension = strcmp(code->name()->value(), "<listcomp>") == 0;
+                    comprehension = mod->isName(code->name(), PycInterner::NAME_LISTCOMP);
                 } else {
                     PycRef<ASTBlock> top = blocks.top();
                     end = top->end(); // block end position from SETUP_LOOP
@@ -922,7 +1032,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     }
                 }
 
-                PycRef<ASTIterBlock> forblk = new ASTIterBlock(ASTBlock::BLK_FOR, curpos, end, iter);
+                PycRef<ASTIterBlock> forblk = arena.make<ASTIterBlock>(ASTBlock::BLK_FOR, curpos, end, iter);
                 forblk->setComprehension(comprehension);
                 blocks.push(forblk.cast<ASTBlock>());
                 curblock = blocks.top();
@@ -944,7 +1054,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 } else {
                     comprehension = true;
                 }
-                PycRef<ASTIterBlock> forblk = new ASTIterBlock(ASTBlock::BLK_FOR, curpos, top->end(), iter);
+                PycRef<ASTIterBlock> forblk = arena.make<ASTIterBlock>(ASTBlock::BLK_FOR, curpos, top->end(), iter);
                 forblk->setComprehension(comprehension);
                 blocks.push(forblk.cast<ASTBlock>());
                 curblock = blocks.top();
@@ -966,12 +1076,12 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 PycRef<ASTBlock> top = blocks.top();
                 if (top->blktype() == ASTBlock::BLK_WHILE) {
                     blocks.pop();
-                    PycRef<ASTIterBlock> forblk = new ASTIterBlock(ASTBlock::BLK_ASYNCFOR, curpos, top->end(), iter);
+                    PycRef<ASTIterBlock> forblk = arena.make<ASTIterBlock>(ASTBlock::BLK_ASYNCFOR, curpos, top->end(), iter);
                     blocks.push(forblk.cast<ASTBlock>());
                     curblock = blocks.top();
                     stack.push(nullptr);
                 } else {
-                     fprintf(stderr, "Unsupported use of GET_AITER outside of SETUP_LOOP\n");
+                     pyc_diagnostic("Unsupported use of GET_AITER outside of SETUP_LOOP\n");
                 }
             }
             break;
@@ -982,19 +1092,16 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 auto conversion_flag = static_cast<ASTFormattedValue::ConversionFlag>(operand);
                 PycRef<ASTNode> format_spec = nullptr;
                 if (conversion_flag & ASTFormattedValue::HAVE_FMT_SPEC) {
-                    format_spec = stack.top();
-                    stack.pop();
+                    format_spec = StackPopTop(stack);
                 }
-                auto val = stack.top();
-                stack.pop();
-                stack.push(new ASTFormattedValue(val, conversion_flag, format_spec));
+                auto val = StackPopTop(stack);
+                stack.push(arena.make<ASTFormattedValue>(val, conversion_flag, format_spec));
             }
             break;
         case Pyc::GET_AWAITABLE:
             {
-                PycRef<ASTNode> object = stack.top();
-                stack.pop();
-                stack.push(new ASTAwaitable(object));
+                PycRef<ASTNode> object = StackPopTop(stack);
+                stack.push(arena.make<ASTAwaitable>(object));
             }
             break;
         case Pyc::GET_ITER:
@@ -1002,34 +1109,30 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             /* We just entirely ignore this */
             break;
         case Pyc::IMPORT_NAME_A:
-            if (mod->majorVer() == 1) {
-                stack.push(new ASTImport(new ASTName(code->getName(operand)), NULL));
+            if (!at_least<2, 0, Ver>(mod)) {
+                stack.push(arena.make<ASTImport>(arena.make<ASTName>(code->getName(operand)), nullptr));
             } else {
-                PycRef<ASTNode> fromlist = stack.top();
-                stack.pop();
-                if (mod->verCompare(2, 5) >= 0)
+                PycRef<ASTNode> fromlist = StackPopTop(stack);
+                if (at_least<2, 5, Ver>(mod))
                     stack.pop();    // Level -- we don't care
-                stack.push(new ASTImport(new ASTName(code->getName(operand)), fromlist));
+                stack.push(arena.make<ASTImport>(arena.make<ASTName>(code->getName(operand)), fromlist));
             }
             break;
         case Pyc::IMPORT_FROM_A:
-            stack.push(new ASTName(code->getName(operand)));
+            stack.push(arena.make<ASTName>(code->getName(operand)));
             break;
         case Pyc::IMPORT_STAR:
             {
-                PycRef<ASTNode> import = stack.top();
-                stack.pop();
-                curblock->append(new ASTStore(import, NULL));
+                PycRef<ASTNode> import = StackPopTop(stack);
+                curblock->append(arena.make<ASTStore>(import, nullptr));
             }
             break;
         case Pyc::IS_OP_A:
             {
-                PycRef<ASTNode> right = stack.top();
-                stack.pop();
-                PycRef<ASTNode> left = stack.top();
-                stack.pop();
+                PycRef<ASTNode> right = StackPopTop(stack);
+                PycRef<ASTNode> left = StackPopTop(stack);
                 // The operand will be 0 for 'is' and 1 for 'is not'.
-                stack.push(new ASTCompare(left, right, operand ? ASTCompare::CMP_IS_NOT : ASTCompare::CMP_IS));
+                stack.push(arena.make<ASTCompare>(left, right, operand ? ASTCompare::CMP_IS_NOT : ASTCompare::CMP_IS));
             }
             break;
         case Pyc::JUMP_IF_FALSE_A:
@@ -1076,9 +1179,9 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         || opcode == Pyc::INSTRUMENTED_POP_JUMP_IF_TRUE_A;
 
                 int offs = operand;
-                if (mod->verCompare(3, 10) >= 0)
+                if (at_least<3, 10, Ver>(mod))
                     offs *= sizeof(uint16_t); // // BPO-27129
-                if (mod->verCompare(3, 12) >= 0
+                if (at_least<3, 12, Ver>(mod)
                         || opcode == Pyc::JUMP_IF_FALSE_A
                         || opcode == Pyc::JUMP_IF_TRUE_A
                         || opcode == Pyc::POP_JUMP_FORWARD_IF_TRUE_A
@@ -1097,20 +1200,20 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         stack_hist.pop();
                     }
 
-                    ifblk = new ASTCondBlock(ASTBlock::BLK_EXCEPT, offs, cond.cast<ASTCompare>()->right(), false);
+                    ifblk = arena.make<ASTCondBlock>(ASTBlock::BLK_EXCEPT, offs, cond.cast<ASTCompare>()->right(), false);
                 } else if (curblock->blktype() == ASTBlock::BLK_ELSE
                            && curblock->size() == 0) {
                     /* Collapse into elif statement */
                     blocks.pop();
                     stack = stack_hist.top();
                     stack_hist.pop();
-                    ifblk = new ASTCondBlock(ASTBlock::BLK_ELIF, offs, cond, neg);
+                    ifblk = arena.make<ASTCondBlock>(ASTBlock::BLK_ELIF, offs, cond, neg);
                 } else if (curblock->size() == 0 && !curblock->inited()
                            && curblock->blktype() == ASTBlock::BLK_WHILE) {
                     /* The condition for a while loop */
                     PycRef<ASTBlock> top = blocks.top();
                     blocks.pop();
-                    ifblk = new ASTCondBlock(top->blktype(), offs, cond, neg);
+                    ifblk = arena.make<ASTCondBlock>(top->blktype(), offs, cond, neg);
 
                     /* We don't store the stack for loops! Pop it! */
                     stack_hist.pop();
@@ -1135,15 +1238,15 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (curblock->end() == offs
                             || (curblock->end() == curpos && !top->negative())) {
                         /* if blah and blah */
-                        newcond = new ASTBinary(cond1, cond, ASTBinary::BIN_LOG_AND);
+                        newcond = arena.make<ASTBinary>(cond1, cond, ASTBinary::BIN_LOG_AND);
                     } else {
                         /* if blah or blah */
-                        newcond = new ASTBinary(cond1, cond, ASTBinary::BIN_LOG_OR);
+                        newcond = arena.make<ASTBinary>(cond1, cond, ASTBinary::BIN_LOG_OR);
                     }
-                    ifblk = new ASTCondBlock(top->blktype(), offs, newcond, neg);
+                    ifblk = arena.make<ASTCondBlock>(top->blktype(), offs, newcond, neg);
                 } else if (curblock->blktype() == ASTBlock::BLK_FOR
                             && curblock.cast<ASTIterBlock>()->isComprehension()
-                            && mod->verCompare(2, 7) >= 0) {
+                            && at_least<2, 7, Ver>(mod)) {
                     /* Comprehension condition */
                     curblock.cast<ASTIterBlock>()->setCondition(cond);
                     stack_hist.pop();
@@ -1152,7 +1255,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     break;
                 } else {
                     /* Plain old if statement */
-                    ifblk = new ASTCondBlock(ASTBlock::BLK_IF, offs, cond, neg);
+                    ifblk = arena.make<ASTCondBlock>(ASTBlock::BLK_IF, offs, cond, neg);
                 }
 
                 if (popped)
@@ -1165,7 +1268,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::JUMP_ABSOLUTE_A:
             {
                 int offs = operand;
-                if (mod->verCompare(3, 10) >= 0)
+                if (at_least<3, 10, Ver>(mod))
                     offs *= sizeof(uint16_t); // // BPO-27129
 
                 if (offs < pos) {
@@ -1173,7 +1276,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         bool is_jump_to_start = offs == curblock.cast<ASTIterBlock>()->start();
                         bool should_pop_for_block = curblock.cast<ASTIterBlock>()->isComprehension();
                         // in v3.8, SETUP_LOOP is deprecated and for blocks aren't terminated by POP_BLOCK, so we add them here
-                        bool should_add_for_block = mod->majorVer() == 3 && mod->minorVer() >= 8 && is_jump_to_start && !curblock.cast<ASTIterBlock>()->isComprehension();
+                        bool should_add_for_block = at_least<3, 8, Ver>(mod) && is_jump_to_start && !curblock.cast<ASTIterBlock>()->isComprehension();
 
                         if (should_pop_for_block || should_add_for_block) {
                             PycRef<ASTNode> top = stack.top();
@@ -1206,7 +1309,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                             curblock = blocks.top();
                         }
                     } else {
-                        curblock->append(new ASTKeyword(ASTKeyword::KW_CONTINUE));
+                        curblock->append(arena.make<ASTKeyword>(ASTKeyword::KW_CONTINUE));
                     }
 
                     /* We're in a loop, this jumps back to the start */
@@ -1217,7 +1320,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (curblock->blktype() == ASTBlock::BLK_CONTAINER) {
                     PycRef<ASTContainerBlock> cont = curblock.cast<ASTContainerBlock>();
                     if (cont->hasExcept() && pos < cont->except()) {
-                        PycRef<ASTBlock> except = new ASTCondBlock(ASTBlock::BLK_EXCEPT, 0, NULL, false);
+                        PycRef<ASTBlock> except = arena.make<ASTCondBlock>(ASTBlock::BLK_EXCEPT, 0, nullptr, false);
                         except->init();
                         blocks.push(except);
                         curblock = blocks.top();
@@ -1242,7 +1345,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         if (push) {
                             stack_hist.push(stack);
                         }
-                        PycRef<ASTBlock> next = new ASTBlock(ASTBlock::BLK_ELSE, blocks.top()->end());
+                        PycRef<ASTBlock> next = arena.make<ASTBlock>(ASTBlock::BLK_ELSE, blocks.top()->end());
                         if (prev->inited() == ASTCondBlock::PRE_POPPED) {
                             next->init(ASTCondBlock::PRE_POPPED);
                         }
@@ -1253,7 +1356,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         if (push) {
                             stack_hist.push(stack);
                         }
-                        PycRef<ASTBlock> next = new ASTCondBlock(ASTBlock::BLK_EXCEPT, blocks.top()->end(), NULL, false);
+                        PycRef<ASTBlock> next = arena.make<ASTCondBlock>(ASTBlock::BLK_EXCEPT, blocks.top()->end(), nullptr, false);
                         next->init();
 
                         blocks.push(next.cast<ASTBlock>());
@@ -1270,7 +1373,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         prev = nil;
                     }
 
-                } while (prev != nil);
+                } while (prev != nil && meter.step());
 
                 curblock = blocks.top();
             }
@@ -1279,7 +1382,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::INSTRUMENTED_JUMP_FORWARD_A:
             {
                 int offs = operand;
-                if (mod->verCompare(3, 10) >= 0)
+                if (at_least<3, 10, Ver>(mod))
                     offs *= sizeof(uint16_t); // // BPO-27129
 
                 if (curblock->blktype() == ASTBlock::BLK_CONTAINER) {
@@ -1288,7 +1391,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         stack_hist.push(stack);
 
                         curblock->setEnd(pos+offs);
-                        PycRef<ASTBlock> except = new ASTCondBlock(ASTBlock::BLK_EXCEPT, pos+offs, NULL, false);
+                        PycRef<ASTBlock> except = arena.make<ASTCondBlock>(ASTBlock::BLK_EXCEPT, pos+offs, nullptr, false);
                         except->init();
                         blocks.push(except);
                         curblock = blocks.top();
@@ -1322,7 +1425,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         if (push) {
                             stack_hist.push(stack);
                         }
-                        PycRef<ASTBlock> next = new ASTBlock(ASTBlock::BLK_ELSE, pos+offs);
+                        PycRef<ASTBlock> next = arena.make<ASTBlock>(ASTBlock::BLK_ELSE, pos+offs);
                         if (prev->inited() == ASTCondBlock::PRE_POPPED) {
                             next->init(ASTCondBlock::PRE_POPPED);
                         }
@@ -1338,7 +1441,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         if (push) {
                             stack_hist.push(stack);
                         }
-                        PycRef<ASTBlock> next = new ASTCondBlock(ASTBlock::BLK_EXCEPT, pos+offs, NULL, false);
+                        PycRef<ASTBlock> next = arena.make<ASTCondBlock>(ASTBlock::BLK_EXCEPT, pos+offs, nullptr, false);
                         next->init();
 
                         blocks.push(next.cast<ASTBlock>());
@@ -1369,19 +1472,19 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                                     stack_hist.push(stack);
                                 }
 
-                                PycRef<ASTBlock> except = new ASTCondBlock(ASTBlock::BLK_EXCEPT, pos+offs, NULL, false);
+                                PycRef<ASTBlock> except = arena.make<ASTCondBlock>(ASTBlock::BLK_EXCEPT, pos+offs, nullptr, false);
                                 except->init();
                                 blocks.push(except);
                             }
                         } else {
-                            fprintf(stderr, "Something TERRIBLE happened!!\n");
+                            pyc_diagnostic("Something TERRIBLE happened!!\n");
                         }
                         prev = nil;
                     } else {
                         prev = nil;
                     }
 
-                } while (prev != nil);
+                } while (prev != nil && meter.step());
 
                 curblock = blocks.top();
 
@@ -1393,8 +1496,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::LIST_APPEND:
         case Pyc::LIST_APPEND_A:
             {
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> value = StackPopTop(stack);
 
                 PycRef<ASTNode> list = stack.top();
 
@@ -1402,64 +1504,62 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (curblock->blktype() == ASTBlock::BLK_FOR
                         && curblock.cast<ASTIterBlock>()->isComprehension()) {
                     stack.pop();
-                    stack.push(new ASTComprehension(value));
+                    stack.push(arena.make<ASTComprehension>(value));
                 } else {
-                    stack.push(new ASTSubscr(list, value)); /* Total hack */
+                    stack.push(arena.make<ASTSubscr>(list, value)); /* Total hack */
                 }
             }
             break;
         case Pyc::SET_UPDATE_A:
             {
-                PycRef<ASTNode> rhs = stack.top();
-                stack.pop();
+                PycRef<ASTNode> rhs = StackPopTop(stack);
                 PycRef<ASTSet> lhs = stack.top().cast<ASTSet>();
                 stack.pop();
 
                 if (rhs.type() != ASTNode::NODE_OBJECT) {
-                    fprintf(stderr, "Unsupported argument found for SET_UPDATE\n");
+                    pyc_diagnostic("Unsupported argument found for SET_UPDATE\n");
                     break;
                 }
 
                 // I've only ever seen this be a TYPE_FROZENSET, but let's be careful...
                 PycRef<PycObject> obj = rhs.cast<ASTObject>()->object();
                 if (obj->type() != PycObject::TYPE_FROZENSET) {
-                    fprintf(stderr, "Unsupported argument type found for SET_UPDATE\n");
+                    pyc_diagnostic("Unsupported argument type found for SET_UPDATE\n");
                     break;
                 }
 
                 ASTSet::value_t result = lhs->values();
                 for (const auto& it : obj.cast<PycSet>()->values()) {
-                    result.push_back(new ASTObject(it));
+                    result.push_back(arena.make<ASTObject>(it));
                 }
 
-                stack.push(new ASTSet(result));
+                stack.push(arena.make<ASTSet>(result));
             }
             break;
         case Pyc::LIST_EXTEND_A:
             {
-                PycRef<ASTNode> rhs = stack.top();
-                stack.pop();
+                PycRef<ASTNode> rhs = StackPopTop(stack);
                 PycRef<ASTList> lhs = stack.top().cast<ASTList>();
                 stack.pop();
 
                 if (rhs.type() != ASTNode::NODE_OBJECT) {
-                    fprintf(stderr, "Unsupported argument found for LIST_EXTEND\n");
+                    pyc_diagnostic("Unsupported argument found for LIST_EXTEND\n");
                     break;
                 }
 
                 // I've only ever seen this be a SMALL_TUPLE, but let's be careful...
                 PycRef<PycObject> obj = rhs.cast<ASTObject>()->object();
                 if (obj->type() != PycObject::TYPE_TUPLE && obj->type() != PycObject::TYPE_SMALL_TUPLE) {
-                    fprintf(stderr, "Unsupported argument type found for LIST_EXTEND\n");
+                    pyc_diagnostic("Unsupported argument type found for LIST_EXTEND\n");
                     break;
                 }
 
                 ASTList::value_t result = lhs->values();
                 for (const auto& it : obj.cast<PycTuple>()->values()) {
-                    result.push_back(new ASTObject(it));
+                    result.push_back(arena.make<ASTObject>(it));
                 }
 
-                stack.push(new ASTList(result));
+                stack.push(arena.make<ASTList>(result));
             }
             break;
         case Pyc::LOAD_ATTR_A:
@@ -1468,7 +1568,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (name.type() != ASTNode::NODE_IMPORT) {
                     stack.pop();
 
-                    if (mod->verCompare(3, 12) >= 0) {
+                    if (at_least<3, 12, Ver>(mod)) {
                         if (operand & 1) {
                             /* Changed in version 3.12:
                             If the low bit of name is set, then a NULL or self is pushed to the stack
@@ -1478,25 +1578,25 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         operand >>= 1;
                     }
 
-                    stack.push(new ASTBinary(name, new ASTName(code->getName(operand)), ASTBinary::BIN_ATTR));
+                    stack.push(arena.make<ASTBinary>(name, arena.make<ASTName>(code->getName(operand)), ASTBinary::BIN_ATTR));
                 }
             }
             break;
         case Pyc::LOAD_BUILD_CLASS:
-            stack.push(new ASTLoadBuildClass(new PycObject()));
+            stack.push(arena.make<ASTLoadBuildClass>(new PycObject()));
             break;
         case Pyc::LOAD_CLOSURE_A:
             /* Ignore this */
             break;
         case Pyc::LOAD_CONST_A:
             {
-                PycRef<ASTObject> t_ob = new ASTObject(code->getConst(operand));
+                PycRef<ASTObject> t_ob = arena.make<ASTObject>(code->getConst(operand));
 
                 if ((t_ob->object().type() == PycObject::TYPE_TUPLE ||
                         t_ob->object().type() == PycObject::TYPE_SMALL_TUPLE) &&
                         !t_ob->object().cast<PycTuple>()->values().size()) {
                     ASTTuple::value_t values;
-                    stack.push(new ASTTuple(values));
+                    stack.push(arena.make<ASTTuple>(values));
                 } else if (t_ob->object().type() == PycObject::TYPE_NONE) {
                     stack.push(NULL);
                 } else {
@@ -1506,20 +1606,20 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::LOAD_DEREF_A:
         case Pyc::LOAD_CLASSDEREF_A:
-            stack.push(new ASTName(code->getCellVar(mod, operand)));
+            stack.push(arena.make<ASTName>(code->getCellVar(mod, operand)));
             break;
         case Pyc::LOAD_FAST_A:
-            if (mod->verCompare(1, 3) < 0)
-                stack.push(new ASTName(code->getName(operand)));
+            if (!at_least<1, 3, Ver>(mod))
+                stack.push(arena.make<ASTName>(code->getName(operand)));
             else
-                stack.push(new ASTName(code->getLocal(operand)));
+                stack.push(arena.make<ASTName>(code->getLocal(operand)));
             break;
         case Pyc::LOAD_FAST_LOAD_FAST_A:
-            stack.push(new ASTName(code->getLocal(operand >> 4)));
-            stack.push(new ASTName(code->getLocal(operand & 0xF)));
+            stack.push(arena.make<ASTName>(code->getLocal(operand >> 4)));
+            stack.push(arena.make<ASTName>(code->getLocal(operand & 0xF)));
             break;
         case Pyc::LOAD_GLOBAL_A:
-            if (mod->verCompare(3, 11) >= 0) {
+            if (at_least<3, 11, Ver>(mod)) {
                 // Loads the global named co_names[namei>>1] onto the stack.
                 if (operand & 1) {
                     /* Changed in version 3.11: 
@@ -1529,10 +1629,10 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 }
                 operand >>= 1;
             }
-            stack.push(new ASTName(code->getName(operand)));
+            stack.push(arena.make<ASTName>(code->getName(operand)));
             break;
         case Pyc::LOAD_LOCALS:
-            stack.push(new ASTNode(ASTNode::NODE_LOCALS));
+            stack.push(arena.make<ASTNode>(ASTNode::NODE_LOCALS));
             break;
         case Pyc::STORE_LOCALS:
             stack.pop();
@@ -1540,26 +1640,23 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::LOAD_METHOD_A:
             {
                 // Behave like LOAD_ATTR
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
-                stack.push(new ASTBinary(name, new ASTName(code->getName(operand)), ASTBinary::BIN_ATTR));
+                PycRef<ASTNode> name = StackPopTop(stack);
+                stack.push(arena.make<ASTBinary>(name, arena.make<ASTName>(code->getName(operand)), ASTBinary::BIN_ATTR));
             }
             break;
         case Pyc::LOAD_NAME_A:
-            stack.push(new ASTName(code->getName(operand)));
+            stack.push(arena.make<ASTName>(code->getName(operand)));
             break;
         case Pyc::MAKE_CLOSURE_A:
         case Pyc::MAKE_FUNCTION_A:
             {
-                PycRef<ASTNode> fun_code = stack.top();
-                stack.pop();
+                PycRef<ASTNode> fun_code = StackPopTop(stack);
 
                 /* Test for the qualified name of the function (at TOS) */
                 int tos_type = fun_code.cast<ASTObject>()->object().type();
                 if (tos_type != PycObject::TYPE_CODE &&
                     tos_type != PycObject::TYPE_CODE2) {
-                    fun_code = stack.top();
-                    stack.pop();
+                    fun_code = StackPopTop(stack);
                 }
 
                 ASTFunction::defarg_t defArgs, kwDefArgs;
@@ -1573,7 +1670,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     kwDefArgs.push_front(stack.top());
                     stack.pop();
                 }
-                stack.push(new ASTFunction(fun_code, defArgs, kwDefArgs));
+                stack.push(arena.make<ASTFunction>(fun_code, defArgs, kwDefArgs));
             }
             break;
         case Pyc::NOP:
@@ -1606,7 +1703,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         stack = stack_hist.top();
                         stack_hist.pop();
                     } else {
-                        fprintf(stderr, "Warning: Stack history is empty, something wrong might have happened\n");
+                        pyc_diagnostic("Warning: Stack history is empty, something wrong might have happened\n");
                     }
                 }
                 PycRef<ASTBlock> tmp = curblock;
@@ -1623,7 +1720,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (tmp->blktype() == ASTBlock::BLK_FOR && tmp->end() >= pos) {
                     stack_hist.push(stack);
 
-                    PycRef<ASTBlock> blkelse = new ASTBlock(ASTBlock::BLK_ELSE, tmp->end());
+                    PycRef<ASTBlock> blkelse = arena.make<ASTBlock>(ASTBlock::BLK_ELSE, tmp->end());
                     blocks.push(blkelse);
                     curblock = blocks.top();
                 }
@@ -1661,7 +1758,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         /* Add the finally block */
                         stack_hist.push(stack);
 
-                        PycRef<ASTBlock> final = new ASTBlock(ASTBlock::BLK_FINALLY, 0, true);
+                        PycRef<ASTBlock> final = arena.make<ASTBlock>(ASTBlock::BLK_FINALLY, 0, true);
                         blocks.push(final);
                         curblock = blocks.top();
                     }
@@ -1680,8 +1777,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::POP_TOP:
             {
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> value = StackPopTop(stack);
                 if (!curblock->inited()) {
                     if (curblock->blktype() == ASTBlock::BLK_WITH) {
                         curblock.cast<ASTWithBlock>()->setExpr(value);
@@ -1705,7 +1801,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         auto& pparams = value.cast<ASTCall>()->pparams();
                         if (!pparams.empty()) {
                             PycRef<ASTNode> res = pparams.front();
-                            stack.push(new ASTComprehension(res));
+                            stack.push(arena.make<ASTComprehension>(res));
                         }
                     }
                 }
@@ -1719,14 +1815,13 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (printNode && printNode->stream() == nullptr && !printNode->eol())
                     printNode->add(stack.top());
                 else
-                    curblock->append(new ASTPrint(stack.top()));
+                    curblock->append(arena.make<ASTPrint>(stack.top()));
                 stack.pop();
             }
             break;
         case Pyc::PRINT_ITEM_TO:
             {
-                PycRef<ASTNode> stream = stack.top();
-                stack.pop();
+                PycRef<ASTNode> stream = StackPopTop(stack);
 
                 PycRef<ASTPrint> printNode;
                 if (curblock->size() > 0 && curblock->nodes().back().type() == ASTNode::NODE_PRINT)
@@ -1734,7 +1829,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (printNode && printNode->stream() == stream && !printNode->eol())
                     printNode->add(stack.top());
                 else
-                    curblock->append(new ASTPrint(stack.top(), stream));
+                    curblock->append(arena.make<ASTPrint>(stack.top(), stream));
                 stack.pop();
                 stream->setProcessed();
             }
@@ -1747,14 +1842,13 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (printNode && printNode->stream() == nullptr && !printNode->eol())
                     printNode->setEol(true);
                 else
-                    curblock->append(new ASTPrint(nullptr));
+                    curblock->append(arena.make<ASTPrint>(nullptr));
                 stack.pop();
             }
             break;
         case Pyc::PRINT_NEWLINE_TO:
             {
-                PycRef<ASTNode> stream = stack.top();
-                stack.pop();
+                PycRef<ASTNode> stream = StackPopTop(stack);
 
                 PycRef<ASTPrint> printNode;
                 if (curblock->size() > 0 && curblock->nodes().back().type() == ASTNode::NODE_PRINT)
@@ -1762,7 +1856,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (printNode && printNode->stream() == stream && !printNode->eol())
                     printNode->setEol(true);
                 else
-                    curblock->append(new ASTPrint(nullptr, stream));
+                    curblock->append(arena.make<ASTPrint>(nullptr, stream));
                 stack.pop();
                 stream->setProcessed();
             }
@@ -1774,12 +1868,12 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     paramList.push_front(stack.top());
                     stack.pop();
                 }
-                curblock->append(new ASTRaise(paramList));
+                curblock->append(arena.make<ASTRaise>(paramList));
 
                 if ((curblock->blktype() == ASTBlock::BLK_IF
                         || curblock->blktype() == ASTBlock::BLK_ELSE)
                         && stack_hist.size()
-                        && (mod->verCompare(2, 6) >= 0)) {
+                        && (at_least<2, 6, Ver>(mod))) {
                     stack = stack_hist.top();
                     stack_hist.pop();
 
@@ -1788,21 +1882,20 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     curblock = blocks.top();
                     curblock->append(prev.cast<ASTNode>());
 
-                    bc_next(source, mod, opcode, operand, pos);
+                    advance();
                 }
             }
             break;
         case Pyc::RETURN_VALUE:
         case Pyc::INSTRUMENTED_RETURN_VALUE_A:
             {
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
-                curblock->append(new ASTReturn(value));
+                PycRef<ASTNode> value = StackPopTop(stack);
+                curblock->append(arena.make<ASTReturn>(value));
 
                 if ((curblock->blktype() == ASTBlock::BLK_IF
                         || curblock->blktype() == ASTBlock::BLK_ELSE)
                         && stack_hist.size()
-                        && (mod->verCompare(2, 6) >= 0)) {
+                        && (at_least<2, 6, Ver>(mod))) {
                     stack = stack_hist.top();
                     stack_hist.pop();
 
@@ -1811,26 +1904,24 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     curblock = blocks.top();
                     curblock->append(prev.cast<ASTNode>());
 
-                    bc_next(source, mod, opcode, operand, pos);
+                    advance();
                 }
             }
             break;
         case Pyc::RETURN_CONST_A:
         case Pyc::INSTRUMENTED_RETURN_CONST_A:
             {
-                PycRef<ASTObject> value = new ASTObject(code->getConst(operand));
-                curblock->append(new ASTReturn(value.cast<ASTNode>()));
+                PycRef<ASTObject> value = arena.make<ASTObject>(code->getConst(operand));
+                curblock->append(arena.make<ASTReturn>(value.cast<ASTNode>()));
             }
             break;
         case Pyc::ROT_TWO:
             {
-                PycRef<ASTNode> one = stack.top();
-                stack.pop();
+                PycRef<ASTNode> one = StackPopTop(stack);
                 if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
                     stack.pop();
                 }
-                PycRef<ASTNode> two = stack.top();
-                stack.pop();
+                PycRef<ASTNode> two = StackPopTop(stack);
 
                 stack.push(one);
                 stack.push(two);
@@ -1838,15 +1929,12 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::ROT_THREE:
             {
-                PycRef<ASTNode> one = stack.top();
-                stack.pop();
-                PycRef<ASTNode> two = stack.top();
-                stack.pop();
+                PycRef<ASTNode> one = StackPopTop(stack);
+                PycRef<ASTNode> two = StackPopTop(stack);
                 if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
                     stack.pop();
                 }
-                PycRef<ASTNode> three = stack.top();
-                stack.pop();
+                PycRef<ASTNode> three = StackPopTop(stack);
                 stack.push(one);
                 stack.push(three);
                 stack.push(two);
@@ -1854,17 +1942,13 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::ROT_FOUR:
             {
-                PycRef<ASTNode> one = stack.top();
-                stack.pop();
-                PycRef<ASTNode> two = stack.top();
-                stack.pop();
-                PycRef<ASTNode> three = stack.top();
-                stack.pop();
+                PycRef<ASTNode> one = StackPopTop(stack);
+                PycRef<ASTNode> two = StackPopTop(stack);
+                PycRef<ASTNode> three = StackPopTop(stack);
                 if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
                     stack.pop();
                 }
-                PycRef<ASTNode> four = stack.top();
-                stack.pop();
+                PycRef<ASTNode> four = StackPopTop(stack);
                 stack.push(one);
                 stack.push(four);
                 stack.push(three);
@@ -1877,7 +1961,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::SETUP_WITH_A:
         case Pyc::WITH_EXCEPT_START:
             {
-                PycRef<ASTBlock> withblock = new ASTWithBlock(pos+operand);
+                PycRef<ASTBlock> withblock = arena.make<ASTWithBlock>(pos+operand);
                 blocks.push(withblock);
                 curblock = blocks.top();
             }
@@ -1886,11 +1970,10 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::WITH_CLEANUP_START:
             {
                 // Stack top should be a None. Ignore it.
-                PycRef<ASTNode> none = stack.top();
-                stack.pop();
+                PycRef<ASTNode> none = StackPopTop(stack);
 
                 if (none != NULL) {
-                    fprintf(stderr, "Something TERRIBLE happened!\n");
+                    pyc_diagnostic("Something TERRIBLE happened!\n");
                     break;
                 }
 
@@ -1902,7 +1985,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     curblock->append(with.cast<ASTNode>());
                 }
                 else {
-                    fprintf(stderr, "Something TERRIBLE happened! No matching with block found for WITH_CLEANUP at %d\n", curpos);
+                    pyc_diagnostic("Something TERRIBLE happened! No matching with block found for WITH_CLEANUP at %d\n", curpos);
                 }
             }
             break;
@@ -1914,13 +1997,13 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (curblock->blktype() == ASTBlock::BLK_CONTAINER) {
                     curblock.cast<ASTContainerBlock>()->setExcept(pos+operand);
                 } else {
-                    PycRef<ASTBlock> next = new ASTContainerBlock(0, pos+operand);
+                    PycRef<ASTBlock> next = arena.make<ASTContainerBlock>(0, pos+operand);
                     blocks.push(next.cast<ASTBlock>());
                 }
 
                 /* Store the current stack for the except/finally statement(s) */
                 stack_hist.push(stack);
-                PycRef<ASTBlock> tryblock = new ASTBlock(ASTBlock::BLK_TRY, pos+operand, true);
+                PycRef<ASTBlock> tryblock = arena.make<ASTBlock>(ASTBlock::BLK_TRY, pos+operand, true);
                 blocks.push(tryblock.cast<ASTBlock>());
                 curblock = blocks.top();
 
@@ -1929,7 +2012,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::SETUP_FINALLY_A:
             {
-                PycRef<ASTBlock> next = new ASTContainerBlock(pos+operand);
+                PycRef<ASTBlock> next = arena.make<ASTContainerBlock>(pos+operand);
                 blocks.push(next.cast<ASTBlock>());
                 curblock = blocks.top();
 
@@ -1938,88 +2021,76 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::SETUP_LOOP_A:
             {
-                PycRef<ASTBlock> next = new ASTCondBlock(ASTBlock::BLK_WHILE, pos+operand, NULL, false);
+                PycRef<ASTBlock> next = arena.make<ASTCondBlock>(ASTBlock::BLK_WHILE, pos+operand, nullptr, false);
                 blocks.push(next.cast<ASTBlock>());
                 curblock = blocks.top();
             }
             break;
         case Pyc::SLICE_0:
             {
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                PycRef<ASTNode> slice = new ASTSlice(ASTSlice::SLICE0);
-                stack.push(new ASTSubscr(name, slice));
+                PycRef<ASTNode> slice = arena.make<ASTSlice>(ASTSlice::SLICE0);
+                stack.push(arena.make<ASTSubscr>(name, slice));
             }
             break;
         case Pyc::SLICE_1:
             {
-                PycRef<ASTNode> lower = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> lower = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                PycRef<ASTNode> slice = new ASTSlice(ASTSlice::SLICE1, lower);
-                stack.push(new ASTSubscr(name, slice));
+                PycRef<ASTNode> slice = arena.make<ASTSlice>(ASTSlice::SLICE1, lower);
+                stack.push(arena.make<ASTSubscr>(name, slice));
             }
             break;
         case Pyc::SLICE_2:
             {
-                PycRef<ASTNode> upper = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> upper = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                PycRef<ASTNode> slice = new ASTSlice(ASTSlice::SLICE2, NULL, upper);
-                stack.push(new ASTSubscr(name, slice));
+                PycRef<ASTNode> slice = arena.make<ASTSlice>(ASTSlice::SLICE2, nullptr, upper);
+                stack.push(arena.make<ASTSubscr>(name, slice));
             }
             break;
         case Pyc::SLICE_3:
             {
-                PycRef<ASTNode> upper = stack.top();
-                stack.pop();
-                PycRef<ASTNode> lower = stack.top();
-                stack.pop();
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
+                PycRef<ASTNode> upper = StackPopTop(stack);
+                PycRef<ASTNode> lower = StackPopTop(stack);
+                PycRef<ASTNode> name = StackPopTop(stack);
 
-                PycRef<ASTNode> slice = new ASTSlice(ASTSlice::SLICE3, lower, upper);
-                stack.push(new ASTSubscr(name, slice));
+                PycRef<ASTNode> slice = arena.make<ASTSlice>(ASTSlice::SLICE3, lower, upper);
+                stack.push(arena.make<ASTSubscr>(name, slice));
             }
             break;
         case Pyc::STORE_ATTR_A:
             {
                 if (unpack) {
-                    PycRef<ASTNode> name = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> attr = new ASTBinary(name, new ASTName(code->getName(operand)), ASTBinary::BIN_ATTR);
+                    PycRef<ASTNode> name = StackPopTop(stack);
+                    PycRef<ASTNode> attr = arena.make<ASTBinary>(name, arena.make<ASTName>(code->getName(operand)), ASTBinary::BIN_ATTR);
 
                     PycRef<ASTNode> tup = stack.top();
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(attr);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        pyc_diagnostic("Something TERRIBLE happened!\n");
 
                     if (--unpack <= 0) {
                         stack.pop();
-                        PycRef<ASTNode> seq = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> seq = StackPopTop(stack);
                         if (seq.type() == ASTNode::NODE_CHAINSTORE) {
                             append_to_chain_store(seq, tup, stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(seq, tup));
+                            curblock->append(arena.make<ASTStore>(seq, tup));
                         }
                     }
                 } else {
-                    PycRef<ASTNode> name = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> attr = new ASTBinary(name, new ASTName(code->getName(operand)), ASTBinary::BIN_ATTR);
+                    PycRef<ASTNode> name = StackPopTop(stack);
+                    PycRef<ASTNode> value = StackPopTop(stack);
+                    PycRef<ASTNode> attr = arena.make<ASTBinary>(name, arena.make<ASTName>(code->getName(operand)), ASTBinary::BIN_ATTR);
                     if (value.type() == ASTNode::NODE_CHAINSTORE) {
                         append_to_chain_store(value, attr, stack, curblock);
                     } else {
-                        curblock->append(new ASTStore(value, attr));
+                        curblock->append(arena.make<ASTStore>(value, attr));
                     }
                 }
             }
@@ -2027,34 +2098,32 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::STORE_DEREF_A:
             {
                 if (unpack) {
-                    PycRef<ASTNode> name = new ASTName(code->getCellVar(mod, operand));
+                    PycRef<ASTNode> name = arena.make<ASTName>(code->getCellVar(mod, operand));
 
                     PycRef<ASTNode> tup = stack.top();
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        pyc_diagnostic("Something TERRIBLE happened!\n");
 
                     if (--unpack <= 0) {
                         stack.pop();
-                        PycRef<ASTNode> seq = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> seq = StackPopTop(stack);
 
                         if (seq.type() == ASTNode::NODE_CHAINSTORE) {
                             append_to_chain_store(seq, tup, stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(seq, tup));
+                            curblock->append(arena.make<ASTStore>(seq, tup));
                         }
                     }
                 } else {
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> name = new ASTName(code->getCellVar(mod, operand));
+                    PycRef<ASTNode> value = StackPopTop(stack);
+                    PycRef<ASTNode> name = arena.make<ASTName>(code->getCellVar(mod, operand));
 
                     if (value.type() == ASTNode::NODE_CHAINSTORE) {
                         append_to_chain_store(value, name, stack, curblock);
                     } else {
-                        curblock->append(new ASTStore(value, name));
+                        curblock->append(arena.make<ASTStore>(value, name));
                     }
                 }
             }
@@ -2064,21 +2133,20 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 if (unpack) {
                     PycRef<ASTNode> name;
 
-                    if (mod->verCompare(1, 3) < 0)
-                        name = new ASTName(code->getName(operand));
+                    if (!at_least<1, 3, Ver>(mod))
+                        name = arena.make<ASTName>(code->getName(operand));
                     else
-                        name = new ASTName(code->getLocal(operand));
+                        name = arena.make<ASTName>(code->getLocal(operand));
 
                     PycRef<ASTNode> tup = stack.top();
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        pyc_diagnostic("Something TERRIBLE happened!\n");
 
                     if (--unpack <= 0) {
                         stack.pop();
-                        PycRef<ASTNode> seq = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> seq = StackPopTop(stack);
 
                         if (curblock->blktype() == ASTBlock::BLK_FOR
                                 && !curblock->inited()) {
@@ -2089,21 +2157,19 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         } else if (seq.type() == ASTNode::NODE_CHAINSTORE) {
                             append_to_chain_store(seq, tup, stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(seq, tup));
+                            curblock->append(arena.make<ASTStore>(seq, tup));
                         }
                     }
                 } else {
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> value = StackPopTop(stack);
                     PycRef<ASTNode> name;
 
-                    if (mod->verCompare(1, 3) < 0)
-                        name = new ASTName(code->getName(operand));
+                    if (!at_least<1, 3, Ver>(mod))
+                        name = arena.make<ASTName>(code->getName(operand));
                     else
-                        name = new ASTName(code->getLocal(operand));
+                        name = arena.make<ASTName>(code->getLocal(operand));
 
-                    if (name.cast<ASTName>()->name()->value()[0] == '_'
-                            && name.cast<ASTName>()->name()->value()[1] == '[') {
+                    if (name.cast<ASTName>()->name()->startsWith("_[")) {
                         /* Don't show stores of list comp append objects. */
                         break;
                     }
@@ -2118,26 +2184,25 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     } else if (value.type() == ASTNode::NODE_CHAINSTORE) {
                         append_to_chain_store(value, name, stack, curblock);
                     } else {
-                        curblock->append(new ASTStore(value, name));
+                        curblock->append(arena.make<ASTStore>(value, name));
                     }
                 }
             }
             break;
         case Pyc::STORE_GLOBAL_A:
             {
-                PycRef<ASTNode> name = new ASTName(code->getName(operand));
+                PycRef<ASTNode> name = arena.make<ASTName>(code->getName(operand));
 
                 if (unpack) {
                     PycRef<ASTNode> tup = stack.top();
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        pyc_diagnostic("Something TERRIBLE happened!\n");
 
                     if (--unpack <= 0) {
                         stack.pop();
-                        PycRef<ASTNode> seq = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> seq = StackPopTop(stack);
 
                         if (curblock->blktype() == ASTBlock::BLK_FOR
                                 && !curblock->inited()) {
@@ -2148,16 +2213,15 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         } else if (seq.type() == ASTNode::NODE_CHAINSTORE) {
                             append_to_chain_store(seq, tup, stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(seq, tup));
+                            curblock->append(arena.make<ASTStore>(seq, tup));
                         }
                     }
                 } else {
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> value = StackPopTop(stack);
                     if (value.type() == ASTNode::NODE_CHAINSTORE) {
                         append_to_chain_store(value, name, stack, curblock);
                     } else {
-                        curblock->append(new ASTStore(value, name));
+                        curblock->append(arena.make<ASTStore>(value, name));
                     }
                 }
 
@@ -2168,18 +2232,17 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         case Pyc::STORE_NAME_A:
             {
                 if (unpack) {
-                    PycRef<ASTNode> name = new ASTName(code->getName(operand));
+                    PycRef<ASTNode> name = arena.make<ASTName>(code->getName(operand));
 
                     PycRef<ASTNode> tup = stack.top();
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        pyc_diagnostic("Something TERRIBLE happened!\n");
 
                     if (--unpack <= 0) {
                         stack.pop();
-                        PycRef<ASTNode> seq = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> seq = StackPopTop(stack);
 
                         if (curblock->blktype() == ASTBlock::BLK_FOR
                                 && !curblock->inited()) {
@@ -2190,26 +2253,29 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         } else if (seq.type() == ASTNode::NODE_CHAINSTORE) {
                             append_to_chain_store(seq, tup, stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(seq, tup));
+                            curblock->append(arena.make<ASTStore>(seq, tup));
                         }
                     }
                 } else {
-                    PycRef<ASTNode> value = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> value = StackPopTop(stack);
 
                     PycRef<PycString> varname = code->getName(operand);
-                    if (varname->length() >= 2 && varname->value()[0] == '_'
-                            && varname->value()[1] == '[') {
+                    if (varname->startsWith("_[")) {
                         /* Don't show stores of list comp append objects. */
                         break;
                     }
 
                     // Return private names back to their original name
-                    const std::string class_prefix = std::string("_") + code->name()->strValue();
-                    if (varname->startsWith(class_prefix + std::string("__")))
-                        varname->setValue(varname->strValue().substr(class_prefix.size()));
+                    const std::string class_prefix = "_" + code->name()->view().str();
+                    if (varname->startsWith(class_prefix + "__")) {
+                        PycRef<PycCode> scope = mod->verCompare(3, 4) >= 0 ? nullptr : code;
+                        ctx.privateNames.insert(std::make_pair(
+                                std::make_pair((const PycCode*)scope, (const PycString*)varname),
+                                DecompileContext::PrivateName { scope, varname,
+                                                                class_prefix.size() }));
+                    }
 
-                    PycRef<ASTNode> name = new ASTName(varname);
+                    PycRef<ASTNode> name = arena.make<ASTName>(varname);
 
                     if (curblock->blktype() == ASTBlock::BLK_FOR
                             && !curblock->inited()) {
@@ -2217,7 +2283,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     } else if (stack.top().type() == ASTNode::NODE_IMPORT) {
                         PycRef<ASTImport> import = stack.top().cast<ASTImport>();
 
-                        import->add_store(new ASTStore(value, name));
+                        import->add_store(arena.make<ASTStore>(value, name));
                     } else if (curblock->blktype() == ASTBlock::BLK_WITH
                                && !curblock->inited()) {
                         curblock.cast<ASTWithBlock>()->setExpr(value);
@@ -2225,7 +2291,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     } else if (value.type() == ASTNode::NODE_CHAINSTORE) {
                         append_to_chain_store(value, name, stack, curblock);
                     } else {
-                        curblock->append(new ASTStore(value, name));
+                        curblock->append(arena.make<ASTStore>(value, name));
 
                         if (value.type() == ASTNode::NODE_INVALID)
                             break;
@@ -2235,91 +2301,73 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::STORE_SLICE_0:
             {
-                PycRef<ASTNode> dest = stack.top();
-                stack.pop();
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> dest = StackPopTop(stack);
+                PycRef<ASTNode> value = StackPopTop(stack);
 
-                curblock->append(new ASTStore(value, new ASTSubscr(dest, new ASTSlice(ASTSlice::SLICE0))));
+                curblock->append(arena.make<ASTStore>(value, arena.make<ASTSubscr>(dest, arena.make<ASTSlice>(ASTSlice::SLICE0))));
             }
             break;
         case Pyc::STORE_SLICE_1:
             {
-                PycRef<ASTNode> upper = stack.top();
-                stack.pop();
-                PycRef<ASTNode> dest = stack.top();
-                stack.pop();
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> upper = StackPopTop(stack);
+                PycRef<ASTNode> dest = StackPopTop(stack);
+                PycRef<ASTNode> value = StackPopTop(stack);
 
-                curblock->append(new ASTStore(value, new ASTSubscr(dest, new ASTSlice(ASTSlice::SLICE1, upper))));
+                curblock->append(arena.make<ASTStore>(value, arena.make<ASTSubscr>(dest, arena.make<ASTSlice>(ASTSlice::SLICE1, upper))));
             }
             break;
         case Pyc::STORE_SLICE_2:
             {
-                PycRef<ASTNode> lower = stack.top();
-                stack.pop();
-                PycRef<ASTNode> dest = stack.top();
-                stack.pop();
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> lower = StackPopTop(stack);
+                PycRef<ASTNode> dest = StackPopTop(stack);
+                PycRef<ASTNode> value = StackPopTop(stack);
 
-                curblock->append(new ASTStore(value, new ASTSubscr(dest, new ASTSlice(ASTSlice::SLICE2, NULL, lower))));
+                curblock->append(arena.make<ASTStore>(value, arena.make<ASTSubscr>(dest, arena.make<ASTSlice>(ASTSlice::SLICE2, nullptr, lower))));
             }
             break;
         case Pyc::STORE_SLICE_3:
             {
-                PycRef<ASTNode> lower = stack.top();
-                stack.pop();
-                PycRef<ASTNode> upper = stack.top();
-                stack.pop();
-                PycRef<ASTNode> dest = stack.top();
-                stack.pop();
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
+                PycRef<ASTNode> lower = StackPopTop(stack);
+                PycRef<ASTNode> upper = StackPopTop(stack);
+                PycRef<ASTNode> dest = StackPopTop(stack);
+                PycRef<ASTNode> value = StackPopTop(stack);
 
-                curblock->append(new ASTStore(value, new ASTSubscr(dest, new ASTSlice(ASTSlice::SLICE3, upper, lower))));
+                curblock->append(arena.make<ASTStore>(value, arena.make<ASTSubscr>(dest, arena.make<ASTSlice>(ASTSlice::SLICE3, upper, lower))));
             }
             break;
         case Pyc::STORE_SUBSCR:
             {
                 if (unpack) {
-                    PycRef<ASTNode> subscr = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> dest = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> subscr = StackPopTop(stack);
+                    PycRef<ASTNode> dest = StackPopTop(stack);
 
-                    PycRef<ASTNode> save = new ASTSubscr(dest, subscr);
+                    PycRef<ASTNode> save = arena.make<ASTSubscr>(dest, subscr);
 
                     PycRef<ASTNode> tup = stack.top();
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(save);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        pyc_diagnostic("Something TERRIBLE happened!\n");
 
                     if (--unpack <= 0) {
                         stack.pop();
-                        PycRef<ASTNode> seq = stack.top();
-                        stack.pop();
+                        PycRef<ASTNode> seq = StackPopTop(stack);
                         if (seq.type() == ASTNode::NODE_CHAINSTORE) {
                             append_to_chain_store(seq, tup, stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(seq, tup));
+                            curblock->append(arena.make<ASTStore>(seq, tup));
                         }
                     }
                 } else {
-                    PycRef<ASTNode> subscr = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> dest = stack.top();
-                    stack.pop();
-                    PycRef<ASTNode> src = stack.top();
-                    stack.pop();
+                    PycRef<ASTNode> subscr = StackPopTop(stack);
+                    PycRef<ASTNode> dest = StackPopTop(stack);
+                    PycRef<ASTNode> src = StackPopTop(stack);
 
                     // If variable annotations are enabled, we'll need to check for them here.
                     // Python handles a varaible annotation by setting:
                     // __annotations__['var-name'] = type
                     const bool found_annotated_var = (variable_annotations && dest->type() == ASTNode::Type::NODE_NAME
-                                                      && dest.cast<ASTName>()->name()->isEqual("__annotations__"));
+                                                      && mod->isName(dest.cast<ASTName>()->name(), PycInterner::NAME_ANNOTATIONS));
 
                     if (found_annotated_var) {
                         // Annotations can be done alone or as part of an assignment.
@@ -2328,18 +2376,18 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                             // Replace the existing NODE_STORE with a new one that includes the annotation.
                             PycRef<ASTStore> store = curblock->nodes().back().cast<ASTStore>();
                             curblock->removeLast();
-                            curblock->append(new ASTStore(store->src(),
-                                                          new ASTAnnotatedVar(subscr, src)));
+                            curblock->append(arena.make<ASTStore>(store->src(),
+                                                          arena.make<ASTAnnotatedVar>(subscr, src)));
                         } else {
-                            curblock->append(new ASTAnnotatedVar(subscr, src));
+                            curblock->append(arena.make<ASTAnnotatedVar>(subscr, src));
                         }
                     } else {
                         if (dest.type() == ASTNode::NODE_MAP) {
                             dest.cast<ASTMap>()->add(subscr, src);
                         } else if (src.type() == ASTNode::NODE_CHAINSTORE) {
-                            append_to_chain_store(src, new ASTSubscr(dest, subscr), stack, curblock);
+                            append_to_chain_store(src, arena.make<ASTSubscr>(dest, subscr), stack, curblock);
                         } else {
-                            curblock->append(new ASTStore(src, new ASTSubscr(dest, subscr)));
+                            curblock->append(arena.make<ASTStore>(src, arena.make<ASTSubscr>(dest, subscr)));
                         }
                     }
                 }
@@ -2347,44 +2395,38 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::UNARY_CALL:
             {
-                PycRef<ASTNode> func = stack.top();
-                stack.pop();
-                stack.push(new ASTCall(func, ASTCall::pparam_t(), ASTCall::kwparam_t()));
+                PycRef<ASTNode> func = StackPopTop(stack);
+                stack.push(arena.make<ASTCall>(func, ASTCall::pparam_t(), ASTCall::kwparam_t()));
             }
             break;
         case Pyc::UNARY_CONVERT:
             {
-                PycRef<ASTNode> name = stack.top();
-                stack.pop();
-                stack.push(new ASTConvert(name));
+                PycRef<ASTNode> name = StackPopTop(stack);
+                stack.push(arena.make<ASTConvert>(name));
             }
             break;
         case Pyc::UNARY_INVERT:
             {
-                PycRef<ASTNode> arg = stack.top();
-                stack.pop();
-                stack.push(new ASTUnary(arg, ASTUnary::UN_INVERT));
+                PycRef<ASTNode> arg = StackPopTop(stack);
+                stack.push(arena.make<ASTUnary>(arg, ASTUnary::UN_INVERT));
             }
             break;
         case Pyc::UNARY_NEGATIVE:
             {
-                PycRef<ASTNode> arg = stack.top();
-                stack.pop();
-                stack.push(new ASTUnary(arg, ASTUnary::UN_NEGATIVE));
+                PycRef<ASTNode> arg = StackPopTop(stack);
+                stack.push(arena.make<ASTUnary>(arg, ASTUnary::UN_NEGATIVE));
             }
             break;
         case Pyc::UNARY_NOT:
             {
-                PycRef<ASTNode> arg = stack.top();
-                stack.pop();
-                stack.push(new ASTUnary(arg, ASTUnary::UN_NOT));
+                PycRef<ASTNode> arg = StackPopTop(stack);
+                stack.push(arena.make<ASTUnary>(arg, ASTUnary::UN_NOT));
             }
             break;
         case Pyc::UNARY_POSITIVE:
             {
-                PycRef<ASTNode> arg = stack.top();
-                stack.pop();
-                stack.push(new ASTUnary(arg, ASTUnary::UN_POSITIVE));
+                PycRef<ASTNode> arg = StackPopTop(stack);
+                stack.push(arena.make<ASTUnary>(arg, ASTUnary::UN_POSITIVE));
             }
             break;
         case Pyc::UNPACK_LIST_A:
@@ -2394,22 +2436,21 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 unpack = operand;
                 if (unpack > 0) {
                     ASTTuple::value_t vals;
-                    stack.push(new ASTTuple(vals));
+                    stack.push(arena.make<ASTTuple>(vals));
                 } else {
                     // Unpack zero values and assign it to top of stack or for loop variable.
                     // E.g. [] = TOS / for [] in X
                     ASTTuple::value_t vals;
-                    auto tup = new ASTTuple(vals);
+                    auto tup = arena.make<ASTTuple>(vals);
                     if (curblock->blktype() == ASTBlock::BLK_FOR
                         && !curblock->inited()) {
                         tup->setRequireParens(true);
                         curblock.cast<ASTIterBlock>()->setIndex(tup);
                     } else if (stack.top().type() == ASTNode::NODE_CHAINSTORE) {
-                        auto chainStore = stack.top();
-                        stack.pop();
+                        auto chainStore = StackPopTop(stack);
                         append_to_chain_store(chainStore, tup, stack, curblock);
                     } else {
-                        curblock->append(new ASTStore(stack.top(), tup));
+                        curblock->append(arena.make<ASTStore>(stack.top(), tup));
                         stack.pop();
                     }
                 }
@@ -2417,22 +2458,20 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             break;
         case Pyc::YIELD_FROM:
             {
-                PycRef<ASTNode> dest = stack.top();
-                stack.pop();
+                PycRef<ASTNode> dest = StackPopTop(stack);
                 // TODO: Support yielding into a non-null destination
                 PycRef<ASTNode> value = stack.top();
                 if (value) {
                     value->setProcessed();
-                    curblock->append(new ASTReturn(value, ASTReturn::YIELD_FROM));
+                    curblock->append(arena.make<ASTReturn>(value, ASTReturn::YIELD_FROM));
                 }
             }
             break;
         case Pyc::YIELD_VALUE:
         case Pyc::INSTRUMENTED_YIELD_VALUE_A:
             {
-                PycRef<ASTNode> value = stack.top();
-                stack.pop();
-                curblock->append(new ASTReturn(value, ASTReturn::YIELD));
+                PycRef<ASTNode> value = StackPopTop(stack);
+                curblock->append(arena.make<ASTReturn>(value, ASTReturn::YIELD));
             }
             break;
         case Pyc::SETUP_ANNOTATIONS:
@@ -2465,28 +2504,39 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     values[operand - i - 1] = stack.top();
                     stack.pop();
                 }
-                auto tup = new ASTTuple(values);
+                auto tup = arena.make<ASTTuple>(values);
                 tup->setRequireParens(false);
-                auto next_tup = new ASTTuple(next_tuple);
+                auto next_tup = arena.make<ASTTuple>(next_tuple);
                 next_tup->setRequireParens(false);
                 stack.push(tup);
                 stack.push(next_tup);
             }
             break;
         default:
-            fprintf(stderr, "Unsupported opcode: %s (%d)\n", Pyc::OpcodeName(opcode), opcode);
-            cleanBuild = false;
-            return new ASTNodeList(defblock->nodes());
+            pyc_diagnostic("Unsupported opcode: %s (%d)\n", Pyc::OpcodeName(opcode), opcode);
+            ctx.cleanBuild = false;
+            return arena.make<ASTNodeList>(defblock->nodes());
         }
+#ifdef OPCODE_PROFILE
+        opcode_scope.stop();
+#endif
 
         else_pop =  ( (curblock->blktype() == ASTBlock::BLK_ELSE)
                       || (curblock->blktype() == ASTBlock::BLK_IF)
                       || (curblock->blktype() == ASTBlock::BLK_ELIF) )
                  && (curblock->end() == pos);
+
+        // Only the outer block's statements are complete while nothing is
+        // left on the stack; everything still needed is reachable from it
+        if (stream && blocks.size() == 1 && stack.empty() && stack_hist.empty()
+                && defblock->size() > STREAM_KEEP) {
+            stream->flush(defblock, STREAM_KEEP);
+            arena.release();
+        }
     }
 
     if (stack_hist.size()) {
-        fputs("Warning: Stack history is not empty!\n", stderr);
+        pyc_diagnostic("Warning: Stack history is not empty!\n");
 
         while (stack_hist.size()) {
             stack_hist.pop();
@@ -2494,7 +2544,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
     }
 
     if (blocks.size() > 1) {
-        fputs("Warning: block stack is not empty!\n", stderr);
+        pyc_diagnostic("Warning: block stack is not empty!\n");
 
         while (blocks.size() > 1) {
             PycRef<ASTBlock> tmp = blocks.top();
@@ -2504,8 +2554,41 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         }
     }
 
-    cleanBuild = true;
-    return new ASTNodeList(defblock->nodes());
+    ctx.cleanBuild = true;
+    return arena.make<ASTNodeList>(defblock->nodes());
+}
+
+static PycRef<ASTNode> build_for_version(PycRef<PycCode> code, PycModule* mod,
+                                         DecompileContext& ctx, StatementStream* stream,
+                                         size_t& peak_depth)
+{
+    if (mod->majorVer() < 3)
+        return build_from_code<Python1To2>(code, mod, ctx, stream, peak_depth);
+    if (mod->verCompare(3, 6) < 0)
+        return build_from_code<Python30To35>(code, mod, ctx, stream, peak_depth);
+    if (mod->verCompare(3, 11) < 0)
+        return build_from_code<Python36To310>(code, mod, ctx, stream, peak_depth);
+    return build_from_code<Python311Up>(code, mod, ctx, stream, peak_depth);
+}
+
+PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod, DecompileContext& ctx,
+                              StatementStream* stream)
+{
+    size_t peak_depth = 0;
+    PycStats* stats = mod->stats();
+    if (!stats)
+        return build_for_version(code, mod, ctx, stream, peak_depth);
+
+    uint64_t start = PycStats::now();
+    size_t nodes = ctx.arena->size();
+    PycRef<ASTNode> source = build_for_version(code, mod, ctx, stream, peak_depth);
+    // Printing streamed statements is accounted for elsewhere
+    uint64_t elapsed = PycStats::now() - start - (stream ? stream->nanos() : 0);
+    stats->buildNanos += elapsed;
+    stats->astNodes += ctx.arena->size() - nodes;
+    stats->notePeakStackDepth(peak_depth);
+    ctx.buildNanos += elapsed;
+    return source;
 }
 
 static void append_to_chain_store(const PycRef<ASTNode> &chainStore,
@@ -2520,7 +2603,7 @@ static void append_to_chain_store(const PycRef<ASTNode> &chainStore,
     }
 }
 
-static int cmp_prec(PycRef<ASTNode> parent, PycRef<ASTNode> child)
+static int cmp_prec(const PycRef<ASTNode>& parent, const PycRef<ASTNode>& child)
 {
     /* Determine whether the parent has higher precedence than therefore
        child, so we don't flood the source code with extraneous parens.
@@ -2581,74 +2664,200 @@ static int cmp_prec(PycRef<ASTNode> parent, PycRef<ASTNode> child)
     return -1;
 }
 
-static void print_ordered(PycRef<ASTNode> parent, PycRef<ASTNode> child,
-                          PycModule* mod, std::ostream& pyc_output)
+static void print_ordered(const PycRef<ASTNode>& parent, const PycRef<ASTNode>& child,
+                          PycModule* mod, PycOutput& pyc_output, DecompileContext& ctx)
 {
     if (child.type() == ASTNode::NODE_BINARY ||
         child.type() == ASTNode::NODE_COMPARE) {
         if (cmp_prec(parent, child) > 0) {
             pyc_output << "(";
-            print_src(child, mod, pyc_output);
+            print_src(child, mod, pyc_output, ctx);
             pyc_output << ")";
         } else {
-            print_src(child, mod, pyc_output);
+            print_src(child, mod, pyc_output, ctx);
         }
     } else if (child.type() == ASTNode::NODE_UNARY) {
         if (cmp_prec(parent, child) > 0) {
             pyc_output << "(";
-            print_src(child, mod, pyc_output);
+            print_src(child, mod, pyc_output, ctx);
             pyc_output << ")";
         } else {
-            print_src(child, mod, pyc_output);
+            print_src(child, mod, pyc_output, ctx);
         }
     } else {
-        print_src(child, mod, pyc_output);
+        print_src(child, mod, pyc_output, ctx);
     }
 }
 
-static void start_line(int indent, std::ostream& pyc_output)
+/* The source printed for code objects which the module has more than one
+ * of (see PycModule::isDuplicate), so each of them is only decompiled
+ * once.  The indentation which start_line() wrote is taken out of the text
+ * while it's recorded, and written again for the indentation of each place
+ * the text is used.  Text from the DecompileCache doesn't mark where its
+ * lines are indented, so the two aren't used together. */
+class PrintedCode {
+public:
+    struct Indent {
+        size_t offset;
+        int level;
+    };
+
+    struct Text {
+        std::string text;
+        std::vector<Indent> indents;
+        int base;               // The indentation it was printed at
+        bool result, clean;
+    };
+
+    PrintedCode() : m_recording() { }
+
+    const Text* find(const PycCode* code, const std::string& state) const
+    {
+        auto iter = m_texts.find(std::make_pair(code, state));
+        return (iter != m_texts.end()) ? &iter->second : nullptr;
+    }
+
+    /* Between these, start_line() passes the indentation it writes to
+     * noteIndent() */
+    size_t beginRecording()
+    {
+        ++m_recording;
+        return m_indents.size();
+    }
+
+    void endRecording(const PycCode* code, const std::string& state, Text text,
+                      const std::string& printed, size_t start, size_t first_indent)
+    {
+        size_t from = 0;
+        for (size_t i = first_indent; i < m_indents.size(); ++i) {
+            size_t offset = m_indents[i].offset - start;
+            text.text.append(printed, from, offset - from);
+            text.indents.push_back({ text.text.size(), m_indents[i].level });
+            from = offset + 4 * (size_t)std::max(m_indents[i].level, 0);
+        }
+        text.text.append(printed, from, std::string::npos);
+        m_texts[std::make_pair(code, state)] = std::move(text);
+        cancelRecording();
+    }
+
+    void cancelRecording()
+    {
+        // The ones recorded for nested code objects also belong to the
+        // code which contains them
+        if (--m_recording == 0)
+            m_indents.clear();
+    }
+
+    bool recording() const { return m_recording != 0; }
+    void noteIndent(size_t offset, int level) { m_indents.push_back({ offset, level }); }
+
+private:
+    std::map<std::pair<const PycCode*, std::string>, Text> m_texts;
+    std::vector<Indent> m_indents;
+    int m_recording;
+};
+
+/* A name as it's printed, unmangled if it's private (see
+ * DecompileContext::privateNames) */
+static PycStringView name_view(const PycString* name, const DecompileContext& ctx)
 {
-    if (inLambda)
+    if (!ctx.privateNames.empty()) {
+        auto iter = ctx.privateNames.find(std::make_pair((const PycCode*)nullptr, name));
+        if (iter == ctx.privateNames.end())
+            iter = ctx.privateNames.find(std::make_pair((const PycCode*)ctx.mappedCode, name));
+        if (iter != ctx.privateNames.end())
+            return name->view().substr(iter->second.prefix);
+    }
+    return name->view();
+}
+
+static void start_line(int indent, PycOutput& pyc_output, DecompileContext& ctx)
+{
+    if (ctx.inLambda)
         return;
+    if (ctx.printed && ctx.printed->recording())
+        ctx.printed->noteIndent(pyc_output.bytesWritten(), indent);
     for (int i=0; i<indent; i++)
         pyc_output << "    ";
 }
 
-static void end_line(std::ostream& pyc_output)
+static void end_line(PycOutput& pyc_output, DecompileContext& ctx)
 {
-    if (inLambda)
+    if (ctx.inLambda)
         return;
     pyc_output << "\n";
 }
 
-int cur_indent = -1;
-static void print_block(PycRef<ASTBlock> blk, PycModule* mod,
-                        std::ostream& pyc_output)
+/* With line markers, the line a statement starts on, as a comment ahead
+ * of it, or with a source map, the offset it starts at, noted in the map.
+ * Blocks which don't start with an expression of their own have no line
+ * worth showing.  def and class statements start with a blank line, and
+ * get theirs after it, with afterBlank set. */
+static void print_line_marker(const PycRef<ASTNode>& node, PycOutput& pyc_output,
+                              DecompileContext& ctx, bool afterBlank = false)
 {
-    ASTBlock::list_t lines = blk->nodes();
+    if (!(ctx.lineMarkers || ctx.sourceMap) || ctx.inLambda || node == NULL
+            || node->origin() <= 0)
+        return;
+    if (node.type() == ASTNode::NODE_NODELIST)
+        return;
+    bool definition = false;
+    if (node.type() == ASTNode::NODE_STORE) {
+        int src_type = node.cast<ASTStore>()->src().type();
+        definition = (src_type == ASTNode::NODE_FUNCTION || src_type == ASTNode::NODE_CLASS);
+    }
+    if (definition != afterBlank)
+        return;
+    if (node.type() == ASTNode::NODE_BLOCK) {
+        switch (node.cast<ASTBlock>()->blktype()) {
+        case ASTBlock::BLK_IF:
+        case ASTBlock::BLK_ELIF:
+        case ASTBlock::BLK_WHILE:
+        case ASTBlock::BLK_FOR:
+        case ASTBlock::BLK_ASYNCFOR:
+        case ASTBlock::BLK_WITH:
+            break;
+        default:
+            return;
+        }
+    }
+    if (ctx.sourceMap) {
+        ctx.sourceMap->note(ctx.mappedCode, node->origin() - 1, pyc_output.lineNumber());
+        return;
+    }
+    start_line(ctx.cur_indent, pyc_output, ctx);
+    formatted_print(pyc_output, "# line %d", node->origin());
+    end_line(pyc_output, ctx);
+}
+
+static void print_block(const PycRef<ASTBlock>& blk, PycModule* mod,
+                        PycOutput& pyc_output, DecompileContext& ctx)
+{
+    const ASTBlock::list_t& lines = blk->nodes();
 
     if (lines.size() == 0) {
-        PycRef<ASTNode> pass = new ASTKeyword(ASTKeyword::KW_PASS);
-        start_line(cur_indent, pyc_output);
-        print_src(pass, mod, pyc_output);
+        PycRef<ASTNode> pass = ctx.arena->make<ASTKeyword>(ASTKeyword::KW_PASS);
+        start_line(ctx.cur_indent, pyc_output, ctx);
+        print_src(pass, mod, pyc_output, ctx);
     }
 
     for (auto ln = lines.cbegin(); ln != lines.cend();) {
+        print_line_marker(*ln, pyc_output, ctx);
         if ((*ln).cast<ASTNode>().type() != ASTNode::NODE_NODELIST) {
-            start_line(cur_indent, pyc_output);
+            start_line(ctx.cur_indent, pyc_output, ctx);
         }
-        print_src(*ln, mod, pyc_output);
+        print_src(*ln, mod, pyc_output, ctx);
         if (++ln != lines.end()) {
-            end_line(pyc_output);
+            end_line(pyc_output, ctx);
         }
     }
 }
 
 void print_formatted_value(PycRef<ASTFormattedValue> formatted_value, PycModule* mod,
-                           std::ostream& pyc_output)
+                           PycOutput& pyc_output, DecompileContext& ctx)
 {
     pyc_output << "{";
-    print_src(formatted_value->val(), mod, pyc_output);
+    print_src(formatted_value->val(), mod, pyc_output, ctx);
 
     switch (formatted_value->conversion() & ASTFormattedValue::CONVERSION_MASK) {
     case ASTFormattedValue::NONE:
@@ -2664,72 +2873,76 @@ void print_formatted_value(PycRef<ASTFormattedValue> formatted_value, PycModule*
         break;
     }
     if (formatted_value->conversion() & ASTFormattedValue::HAVE_FMT_SPEC) {
-        pyc_output << ":" << formatted_value->format_spec().cast<ASTObject>()->object().cast<PycString>()->value();
+        pyc_output << ":" << formatted_value->format_spec().cast<ASTObject>()->object().cast<PycString>()->view();
     }
     pyc_output << "}";
 }
 
-void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
+void print_src(const PycRef<ASTNode>& node, PycModule* mod, PycOutput& pyc_output,
+               DecompileContext& ctx)
 {
     if (node == NULL) {
         pyc_output << "None";
-        cleanBuild = true;
+        ctx.cleanBuild = true;
         return;
     }
 
+#ifdef OPCODE_PROFILE
+    OpcodeProfile::Scope node_scope(OpcodeProfile::node(node->type()));
+#endif
     switch (node->type()) {
     case ASTNode::NODE_BINARY:
     case ASTNode::NODE_COMPARE:
         {
             PycRef<ASTBinary> bin = node.cast<ASTBinary>();
-            print_ordered(node, bin->left(), mod, pyc_output);
+            print_ordered(node, bin->left(), mod, pyc_output, ctx);
             pyc_output << bin->op_str();
-            print_ordered(node, bin->right(), mod, pyc_output);
+            print_ordered(node, bin->right(), mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_UNARY:
         {
             PycRef<ASTUnary> un = node.cast<ASTUnary>();
             pyc_output << un->op_str();
-            print_ordered(node, un->operand(), mod, pyc_output);
+            print_ordered(node, un->operand(), mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_CALL:
         {
             PycRef<ASTCall> call = node.cast<ASTCall>();
-            print_src(call->func(), mod, pyc_output);
+            print_src(call->func(), mod, pyc_output, ctx);
             pyc_output << "(";
             bool first = true;
             for (const auto& param : call->pparams()) {
                 if (!first)
                     pyc_output << ", ";
-                print_src(param, mod, pyc_output);
+                print_src(param, mod, pyc_output, ctx);
                 first = false;
             }
             for (const auto& param : call->kwparams()) {
                 if (!first)
                     pyc_output << ", ";
                 if (param.first.type() == ASTNode::NODE_NAME) {
-                    pyc_output << param.first.cast<ASTName>()->name()->value() << " = ";
+                    pyc_output << name_view(param.first.cast<ASTName>()->name(), ctx) << " = ";
                 } else {
                     PycRef<PycString> str_name = param.first.cast<ASTObject>()->object().cast<PycString>();
-                    pyc_output << str_name->value() << " = ";
+                    pyc_output << name_view(str_name, ctx) << " = ";
                 }
-                print_src(param.second, mod, pyc_output);
+                print_src(param.second, mod, pyc_output, ctx);
                 first = false;
             }
             if (call->hasVar()) {
                 if (!first)
                     pyc_output << ", ";
                 pyc_output << "*";
-                print_src(call->var(), mod, pyc_output);
+                print_src(call->var(), mod, pyc_output, ctx);
                 first = false;
             }
             if (call->hasKW()) {
                 if (!first)
                     pyc_output << ", ";
                 pyc_output << "**";
-                print_src(call->kw(), mod, pyc_output);
+                print_src(call->kw(), mod, pyc_output, ctx);
                 first = false;
             }
             pyc_output << ")";
@@ -2738,49 +2951,55 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
     case ASTNode::NODE_DELETE:
         {
             pyc_output << "del ";
-            print_src(node.cast<ASTDelete>()->value(), mod, pyc_output);
+            print_src(node.cast<ASTDelete>()->value(), mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_EXEC:
         {
             PycRef<ASTExec> exec = node.cast<ASTExec>();
             pyc_output << "exec ";
-            print_src(exec->statement(), mod, pyc_output);
+            print_src(exec->statement(), mod, pyc_output, ctx);
 
             if (exec->globals() != NULL) {
                 pyc_output << " in ";
-                print_src(exec->globals(), mod, pyc_output);
+                print_src(exec->globals(), mod, pyc_output, ctx);
 
                 if (exec->locals() != NULL
                         && exec->globals() != exec->locals()) {
                     pyc_output << ", ";
-                    print_src(exec->locals(), mod, pyc_output);
+                    print_src(exec->locals(), mod, pyc_output, ctx);
                 }
             }
         }
         break;
     case ASTNode::NODE_FORMATTEDVALUE:
-        pyc_output << "f" F_STRING_QUOTE;
-        print_formatted_value(node.cast<ASTFormattedValue>(), mod, pyc_output);
-        pyc_output << F_STRING_QUOTE;
+        {
+            KeepLiteralsWhole whole(mod);
+            pyc_output << "f" F_STRING_QUOTE;
+            print_formatted_value(node.cast<ASTFormattedValue>(), mod, pyc_output, ctx);
+            pyc_output << F_STRING_QUOTE;
+        }
         break;
     case ASTNode::NODE_JOINEDSTR:
-        pyc_output << "f" F_STRING_QUOTE;
-        for (const auto& val : node.cast<ASTJoinedStr>()->values()) {
-            switch (val.type()) {
-            case ASTNode::NODE_FORMATTEDVALUE:
-                print_formatted_value(val.cast<ASTFormattedValue>(), mod, pyc_output);
-                break;
-            case ASTNode::NODE_OBJECT:
-                // When printing a piece of the f-string, keep the quote style consistent.
-                // This avoids problems when ''' or """ is part of the string.
-                print_const(pyc_output, val.cast<ASTObject>()->object(), mod, F_STRING_QUOTE);
-                break;
-            default:
-                fprintf(stderr, "Unsupported node type %d in NODE_JOINEDSTR\n", val.type());
+        {
+            KeepLiteralsWhole whole(mod);
+            pyc_output << "f" F_STRING_QUOTE;
+            for (const auto& val : node.cast<ASTJoinedStr>()->values()) {
+                switch (val.type()) {
+                case ASTNode::NODE_FORMATTEDVALUE:
+                    print_formatted_value(val.cast<ASTFormattedValue>(), mod, pyc_output, ctx);
+                    break;
+                case ASTNode::NODE_OBJECT:
+                    // When printing a piece of the f-string, keep the quote style consistent.
+                    // This avoids problems when ''' or """ is part of the string.
+                    print_const(pyc_output, val.cast<ASTObject>()->object(), mod, F_STRING_QUOTE);
+                    break;
+                default:
+                    pyc_diagnostic("Unsupported node type %d in NODE_JOINEDSTR\n", val.type());
+                }
             }
+            pyc_output << F_STRING_QUOTE;
         }
-        pyc_output << F_STRING_QUOTE;
         break;
     case ASTNode::NODE_KEYWORD:
         pyc_output << node.cast<ASTKeyword>()->word_str();
@@ -2789,17 +3008,17 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             pyc_output << "[";
             bool first = true;
-            cur_indent++;
+            ctx.cur_indent++;
             for (const auto& val : node.cast<ASTList>()->values()) {
                 if (first)
                     pyc_output << "\n";
                 else
                     pyc_output << ",\n";
-                start_line(cur_indent, pyc_output);
-                print_src(val, mod, pyc_output);
+                start_line(ctx.cur_indent, pyc_output, ctx);
+                print_src(val, mod, pyc_output, ctx);
                 first = false;
             }
-            cur_indent--;
+            ctx.cur_indent--;
             pyc_output << "]";
         }
         break;
@@ -2807,17 +3026,17 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             pyc_output << "{";
             bool first = true;
-            cur_indent++;
+            ctx.cur_indent++;
             for (const auto& val : node.cast<ASTSet>()->values()) {
                 if (first)
                     pyc_output << "\n";
                 else
                     pyc_output << ",\n";
-                start_line(cur_indent, pyc_output);
-                print_src(val, mod, pyc_output);
+                start_line(ctx.cur_indent, pyc_output, ctx);
+                print_src(val, mod, pyc_output, ctx);
                 first = false;
             }
-            cur_indent--;
+            ctx.cur_indent--;
             pyc_output << "}";
         }
         break;
@@ -2826,16 +3045,16 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             PycRef<ASTComprehension> comp = node.cast<ASTComprehension>();
 
             pyc_output << "[ ";
-            print_src(comp->result(), mod, pyc_output);
+            print_src(comp->result(), mod, pyc_output, ctx);
 
             for (const auto& gen : comp->generators()) {
                 pyc_output << " for ";
-                print_src(gen->index(), mod, pyc_output);
+                print_src(gen->index(), mod, pyc_output, ctx);
                 pyc_output << " in ";
-                print_src(gen->iter(), mod, pyc_output);
+                print_src(gen->iter(), mod, pyc_output, ctx);
                 if (gen->condition()) {
                     pyc_output << " if ";
-                    print_src(gen->condition(), mod, pyc_output);
+                    print_src(gen->condition(), mod, pyc_output, ctx);
                 }
             }
             pyc_output << " ]";
@@ -2845,54 +3064,55 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             pyc_output << "{";
             bool first = true;
-            cur_indent++;
+            ctx.cur_indent++;
             for (const auto& val : node.cast<ASTMap>()->values()) {
                 if (first)
                     pyc_output << "\n";
                 else
                     pyc_output << ",\n";
-                start_line(cur_indent, pyc_output);
-                print_src(val.first, mod, pyc_output);
+                start_line(ctx.cur_indent, pyc_output, ctx);
+                print_src(val.first, mod, pyc_output, ctx);
                 pyc_output << ": ";
-                print_src(val.second, mod, pyc_output);
+                print_src(val.second, mod, pyc_output, ctx);
                 first = false;
             }
-            cur_indent--;
+            ctx.cur_indent--;
             pyc_output << " }";
         }
         break;
     case ASTNode::NODE_CONST_MAP:
         {
             PycRef<ASTConstMap> const_map = node.cast<ASTConstMap>();
-            PycTuple::value_t keys = const_map->keys().cast<ASTObject>()->object().cast<PycTuple>()->values();
+            const PycTuple::value_t& keys = const_map->keys().cast<ASTObject>()->object().cast<PycTuple>()->values();
             ASTConstMap::values_t values = const_map->values();
 
-            auto map = new ASTMap;
+            auto map = ctx.arena->make<ASTMap>();
             for (const auto& key : keys) {
                 // Values are pushed onto the stack in reverse order.
                 PycRef<ASTNode> value = values.back();
                 values.pop_back();
 
-                map->add(new ASTObject(key), value);
+                map->add(ctx.arena->make<ASTObject>(key), value);
             }
 
-            print_src(map, mod, pyc_output);
+            print_src(map, mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_NAME:
-        pyc_output << node.cast<ASTName>()->name()->value();
+        pyc_output << name_view(node.cast<ASTName>()->name(), ctx);
         break;
     case ASTNode::NODE_NODELIST:
         {
-            cur_indent++;
+            ctx.cur_indent++;
             for (const auto& ln : node.cast<ASTNodeList>()->nodes()) {
+                print_line_marker(ln, pyc_output, ctx);
                 if (ln.cast<ASTNode>().type() != ASTNode::NODE_NODELIST) {
-                    start_line(cur_indent, pyc_output);
+                    start_line(ctx.cur_indent, pyc_output, ctx);
                 }
-                print_src(ln, mod, pyc_output);
-                end_line(pyc_output);
+                print_src(ln, mod, pyc_output, ctx);
+                end_line(pyc_output, ctx);
             }
-            cur_indent--;
+            ctx.cur_indent--;
         }
         break;
     case ASTNode::NODE_BLOCK:
@@ -2902,9 +3122,9 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                 break;
 
             if (blk->blktype() == ASTBlock::BLK_CONTAINER) {
-                end_line(pyc_output);
-                print_block(blk, mod, pyc_output);
-                end_line(pyc_output);
+                end_line(pyc_output, ctx);
+                print_block(blk, mod, pyc_output, ctx);
+                end_line(pyc_output, ctx);
                 break;
             }
 
@@ -2917,30 +3137,30 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                 else
                     pyc_output << " ";
 
-                print_src(blk.cast<ASTCondBlock>()->cond(), mod, pyc_output);
+                print_src(blk.cast<ASTCondBlock>()->cond(), mod, pyc_output, ctx);
             } else if (blk->blktype() == ASTBlock::BLK_FOR || blk->blktype() == ASTBlock::BLK_ASYNCFOR) {
                 pyc_output << " ";
-                print_src(blk.cast<ASTIterBlock>()->index(), mod, pyc_output);
+                print_src(blk.cast<ASTIterBlock>()->index(), mod, pyc_output, ctx);
                 pyc_output << " in ";
-                print_src(blk.cast<ASTIterBlock>()->iter(), mod, pyc_output);
+                print_src(blk.cast<ASTIterBlock>()->iter(), mod, pyc_output, ctx);
             } else if (blk->blktype() == ASTBlock::BLK_EXCEPT &&
                     blk.cast<ASTCondBlock>()->cond() != NULL) {
                 pyc_output << " ";
-                print_src(blk.cast<ASTCondBlock>()->cond(), mod, pyc_output);
+                print_src(blk.cast<ASTCondBlock>()->cond(), mod, pyc_output, ctx);
             } else if (blk->blktype() == ASTBlock::BLK_WITH) {
                 pyc_output << " ";
-                print_src(blk.cast<ASTWithBlock>()->expr(), mod, pyc_output);
+                print_src(blk.cast<ASTWithBlock>()->expr(), mod, pyc_output, ctx);
                 PycRef<ASTNode> var = blk.try_cast<ASTWithBlock>()->var();
                 if (var != NULL) {
                     pyc_output << " as ";
-                    print_src(var, mod, pyc_output);
+                    print_src(var, mod, pyc_output, ctx);
                 }
             }
             pyc_output << ":\n";
 
-            cur_indent++;
-            print_block(blk, mod, pyc_output);
-            cur_indent--;
+            ctx.cur_indent++;
+            print_block(blk, mod, pyc_output, ctx);
+            ctx.cur_indent--;
         }
         break;
     case ASTNode::NODE_OBJECT:
@@ -2948,7 +3168,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             PycRef<PycObject> obj = node.cast<ASTObject>()->object();
             if (obj.type() == PycObject::TYPE_CODE) {
                 PycRef<PycCode> code = obj.cast<PycCode>();
-                decompyle(code, mod, pyc_output);
+                decompyle(code, mod, pyc_output, ctx);
             } else {
                 print_const(pyc_output, obj, mod);
             }
@@ -2960,14 +3180,14 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             bool first = true;
             if (node.cast<ASTPrint>()->stream() != nullptr) {
                 pyc_output << ">>";
-                print_src(node.cast<ASTPrint>()->stream(), mod, pyc_output);
+                print_src(node.cast<ASTPrint>()->stream(), mod, pyc_output, ctx);
                 first = false;
             }
 
             for (const auto& val : node.cast<ASTPrint>()->values()) {
                 if (!first)
                     pyc_output << ", ";
-                print_src(val, mod, pyc_output);
+                print_src(val, mod, pyc_output, ctx);
                 first = false;
             }
             if (!node.cast<ASTPrint>()->eol())
@@ -2982,7 +3202,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             for (const auto& param : raise->params()) {
                 if (!first)
                     pyc_output << ", ";
-                print_src(param, mod, pyc_output);
+                print_src(param, mod, pyc_output, ctx);
                 first = false;
             }
         }
@@ -2991,7 +3211,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             PycRef<ASTReturn> ret = node.cast<ASTReturn>();
             PycRef<ASTNode> value = ret->value();
-            if (!inLambda) {
+            if (!ctx.inLambda) {
                 switch (ret->rettype()) {
                 case ASTReturn::RETURN:
                     pyc_output << "return ";
@@ -3009,7 +3229,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     break;
                 }
             }
-            print_src(value, mod, pyc_output);
+            print_src(value, mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_SLICE:
@@ -3017,11 +3237,11 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             PycRef<ASTSlice> slice = node.cast<ASTSlice>();
 
             if (slice->op() & ASTSlice::SLICE1) {
-                print_src(slice->left(), mod, pyc_output);
+                print_src(slice->left(), mod, pyc_output, ctx);
             }
             pyc_output << ":";
             if (slice->op() & ASTSlice::SLICE2) {
-                print_src(slice->right(), mod, pyc_output);
+                print_src(slice->right(), mod, pyc_output, ctx);
             }
         }
         break;
@@ -3029,41 +3249,43 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             PycRef<ASTImport> import = node.cast<ASTImport>();
             if (import->stores().size()) {
-                ASTImport::list_t stores = import->stores();
+                const ASTImport::list_t& stores = import->stores();
 
                 pyc_output << "from ";
                 if (import->name().type() == ASTNode::NODE_IMPORT)
-                    print_src(import->name().cast<ASTImport>()->name(), mod, pyc_output);
+                    print_src(import->name().cast<ASTImport>()->name(), mod, pyc_output, ctx);
                 else
-                    print_src(import->name(), mod, pyc_output);
+                    print_src(import->name(), mod, pyc_output, ctx);
                 pyc_output << " import ";
 
                 if (stores.size() == 1) {
                     auto src = stores.front()->src();
                     auto dest = stores.front()->dest();
-                    print_src(src, mod, pyc_output);
+                    print_src(src, mod, pyc_output, ctx);
 
-                    if (src.cast<ASTName>()->name()->value() != dest.cast<ASTName>()->name()->value()) {
+                    if (name_view(src.cast<ASTName>()->name(), ctx)
+                            != name_view(dest.cast<ASTName>()->name(), ctx)) {
                         pyc_output << " as ";
-                        print_src(dest, mod, pyc_output);
+                        print_src(dest, mod, pyc_output, ctx);
                     }
                 } else {
                     bool first = true;
                     for (const auto& st : stores) {
                         if (!first)
                             pyc_output << ", ";
-                        print_src(st->src(), mod, pyc_output);
+                        print_src(st->src(), mod, pyc_output, ctx);
                         first = false;
 
-                        if (st->src().cast<ASTName>()->name()->value() != st->dest().cast<ASTName>()->name()->value()) {
+                        if (name_view(st->src().cast<ASTName>()->name(), ctx)
+                                != name_view(st->dest().cast<ASTName>()->name(), ctx)) {
                             pyc_output << " as ";
-                            print_src(st->dest(), mod, pyc_output);
+                            print_src(st->dest(), mod, pyc_output, ctx);
                         }
                     }
                 }
             } else {
                 pyc_output << "import ";
-                print_src(import->name(), mod, pyc_output);
+                print_src(import->name(), mod, pyc_output, ctx);
             }
         }
         break;
@@ -3080,10 +3302,10 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             for (int i=0; i<code_src->argCount(); i++) {
                 if (narg)
                     pyc_output << ", ";
-                pyc_output << code_src->getLocal(narg++)->value();
+                pyc_output << name_view(code_src->getLocal(narg++), ctx);
                 if ((code_src->argCount() - i) <= (int)defargs.size()) {
                     pyc_output << " = ";
-                    print_src(*da++, mod, pyc_output);
+                    print_src(*da++, mod, pyc_output, ctx);
                 }
             }
             da = kwdefargs.cbegin();
@@ -3091,18 +3313,18 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                 pyc_output << (narg == 0 ? "*" : ", *");
                 for (int i = 0; i < code_src->argCount(); i++) {
                     pyc_output << ", ";
-                    pyc_output << code_src->getLocal(narg++)->value();
+                    pyc_output << name_view(code_src->getLocal(narg++), ctx);
                     if ((code_src->kwOnlyArgCount() - i) <= (int)kwdefargs.size()) {
                         pyc_output << " = ";
-                        print_src(*da++, mod, pyc_output);
+                        print_src(*da++, mod, pyc_output, ctx);
                     }
                 }
             }
             pyc_output << ": ";
 
-            inLambda = true;
-            print_src(code, mod, pyc_output);
-            inLambda = false;
+            ctx.inLambda = true;
+            print_src(code, mod, pyc_output, ctx);
+            ctx.inLambda = false;
 
             pyc_output << ")";
         }
@@ -3116,19 +3338,21 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                 PycRef<PycCode> code_src = code.cast<ASTObject>()->object().cast<PycCode>();
                 bool isLambda = false;
 
-                if (strcmp(code_src->name()->value(), "<lambda>") == 0) {
+                if (mod->isName(code_src->name(), PycInterner::NAME_LAMBDA)) {
                     pyc_output << "\n";
-                    start_line(cur_indent, pyc_output);
-                    print_src(dest, mod, pyc_output);
+                    print_line_marker(node, pyc_output, ctx, true);
+                    start_line(ctx.cur_indent, pyc_output, ctx);
+                    print_src(dest, mod, pyc_output, ctx);
                     pyc_output << " = lambda ";
                     isLambda = true;
                 } else {
                     pyc_output << "\n";
-                    start_line(cur_indent, pyc_output);
+                    print_line_marker(node, pyc_output, ctx, true);
+                    start_line(ctx.cur_indent, pyc_output, ctx);
                     if (code_src->flags() & PycCode::CO_COROUTINE)
                         pyc_output << "async ";
                     pyc_output << "def ";
-                    print_src(dest, mod, pyc_output);
+                    print_src(dest, mod, pyc_output, ctx);
                     pyc_output << "(";
                 }
 
@@ -3139,10 +3363,10 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                 for (int i = 0; i < code_src->argCount(); ++i) {
                     if (narg)
                         pyc_output << ", ";
-                    pyc_output << code_src->getLocal(narg++)->value();
+                    pyc_output << name_view(code_src->getLocal(narg++), ctx);
                     if ((code_src->argCount() - i) <= (int)defargs.size()) {
                         pyc_output << " = ";
-                        print_src(*da++, mod, pyc_output);
+                        print_src(*da++, mod, pyc_output, ctx);
                     }
                 }
                 da = kwdefargs.cbegin();
@@ -3150,42 +3374,43 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     pyc_output << (narg == 0 ? "*" : ", *");
                     for (int i = 0; i < code_src->kwOnlyArgCount(); ++i) {
                         pyc_output << ", ";
-                        pyc_output << code_src->getLocal(narg++)->value();
+                        pyc_output << name_view(code_src->getLocal(narg++), ctx);
                         if ((code_src->kwOnlyArgCount() - i) <= (int)kwdefargs.size()) {
                             pyc_output << " = ";
-                            print_src(*da++, mod, pyc_output);
+                            print_src(*da++, mod, pyc_output, ctx);
                         }
                     }
                 }
                 if (code_src->flags() & PycCode::CO_VARARGS) {
                     if (narg)
                         pyc_output << ", ";
-                    pyc_output << "*" << code_src->getLocal(narg++)->value();
+                    pyc_output << "*" << name_view(code_src->getLocal(narg++), ctx);
                 }
                 if (code_src->flags() & PycCode::CO_VARKEYWORDS) {
                     if (narg)
                         pyc_output << ", ";
-                    pyc_output << "**" << code_src->getLocal(narg++)->value();
+                    pyc_output << "**" << name_view(code_src->getLocal(narg++), ctx);
                 }
 
                 if (isLambda) {
                     pyc_output << ": ";
                 } else {
                     pyc_output << "):\n";
-                    printDocstringAndGlobals = true;
+                    ctx.printDocstringAndGlobals = true;
                 }
 
-                bool preLambda = inLambda;
-                inLambda |= isLambda;
+                bool preLambda = ctx.inLambda;
+                ctx.inLambda |= isLambda;
 
-                print_src(code, mod, pyc_output);
+                print_src(code, mod, pyc_output, ctx);
 
-                inLambda = preLambda;
+                ctx.inLambda = preLambda;
             } else if (src.type() == ASTNode::NODE_CLASS) {
                 pyc_output << "\n";
-                start_line(cur_indent, pyc_output);
+                print_line_marker(node, pyc_output, ctx, true);
+                start_line(ctx.cur_indent, pyc_output, ctx);
                 pyc_output << "class ";
-                print_src(dest, mod, pyc_output);
+                print_src(dest, mod, pyc_output, ctx);
                 PycRef<ASTTuple> bases = src.cast<ASTClass>()->bases().cast<ASTTuple>();
                 if (bases->values().size() > 0) {
                     pyc_output << "(";
@@ -3193,7 +3418,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     for (const auto& val : bases->values()) {
                         if (!first)
                             pyc_output << ", ";
-                        print_src(val, mod, pyc_output);
+                        print_src(val, mod, pyc_output, ctx);
                         first = false;
                     }
                     pyc_output << "):\n";
@@ -3201,10 +3426,10 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     // Don't put parens if there are no base classes
                     pyc_output << ":\n";
                 }
-                printClassDocstring = true;
+                ctx.printClassDocstring = true;
                 PycRef<ASTNode> code = src.cast<ASTClass>()->code().cast<ASTCall>()
                                        ->func().cast<ASTFunction>()->code();
-                print_src(code, mod, pyc_output);
+                print_src(code, mod, pyc_output, ctx);
             } else if (src.type() == ASTNode::NODE_IMPORT) {
                 PycRef<ASTImport> import = src.cast<ASTImport>();
                 if (import->fromlist() != NULL) {
@@ -3212,9 +3437,9 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     if (fromlist != Pyc_None) {
                         pyc_output << "from ";
                         if (import->name().type() == ASTNode::NODE_IMPORT)
-                            print_src(import->name().cast<ASTImport>()->name(), mod, pyc_output);
+                            print_src(import->name().cast<ASTImport>()->name(), mod, pyc_output, ctx);
                         else
-                            print_src(import->name(), mod, pyc_output);
+                            print_src(import->name(), mod, pyc_output, ctx);
                         pyc_output << " import ";
                         if (fromlist.type() == PycObject::TYPE_TUPLE ||
                                 fromlist.type() == PycObject::TYPE_SMALL_TUPLE) {
@@ -3222,70 +3447,70 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                             for (const auto& val : fromlist.cast<PycTuple>()->values()) {
                                 if (!first)
                                     pyc_output << ", ";
-                                pyc_output << val.cast<PycString>()->value();
+                                pyc_output << name_view(val.cast<PycString>(), ctx);
                                 first = false;
                             }
                         } else {
-                            pyc_output << fromlist.cast<PycString>()->value();
+                            pyc_output << name_view(fromlist.cast<PycString>(), ctx);
                         }
                     } else {
                         pyc_output << "import ";
-                        print_src(import->name(), mod, pyc_output);
+                        print_src(import->name(), mod, pyc_output, ctx);
                     }
                 } else {
                     pyc_output << "import ";
                     PycRef<ASTNode> import_name = import->name();
-                    print_src(import_name, mod, pyc_output);
+                    print_src(import_name, mod, pyc_output, ctx);
                     if (!dest.cast<ASTName>()->name()->isEqual(import_name.cast<ASTName>()->name().cast<PycObject>())) {
                         pyc_output << " as ";
-                        print_src(dest, mod, pyc_output);
+                        print_src(dest, mod, pyc_output, ctx);
                     }
                 }
             } else if (src.type() == ASTNode::NODE_BINARY
                     && src.cast<ASTBinary>()->is_inplace()) {
-                print_src(src, mod, pyc_output);
+                print_src(src, mod, pyc_output, ctx);
             } else {
-                print_src(dest, mod, pyc_output);
+                print_src(dest, mod, pyc_output, ctx);
                 pyc_output << " = ";
-                print_src(src, mod, pyc_output);
+                print_src(src, mod, pyc_output, ctx);
             }
         }
         break;
     case ASTNode::NODE_CHAINSTORE:
         {
             for (auto& dest : node.cast<ASTChainStore>()->nodes()) {
-                print_src(dest, mod, pyc_output);
+                print_src(dest, mod, pyc_output, ctx);
                 pyc_output << " = ";
             }
-            print_src(node.cast<ASTChainStore>()->src(), mod, pyc_output);
+            print_src(node.cast<ASTChainStore>()->src(), mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_SUBSCR:
         {
-            print_src(node.cast<ASTSubscr>()->name(), mod, pyc_output);
+            print_src(node.cast<ASTSubscr>()->name(), mod, pyc_output, ctx);
             pyc_output << "[";
-            print_src(node.cast<ASTSubscr>()->key(), mod, pyc_output);
+            print_src(node.cast<ASTSubscr>()->key(), mod, pyc_output, ctx);
             pyc_output << "]";
         }
         break;
     case ASTNode::NODE_CONVERT:
         {
             pyc_output << "`";
-            print_src(node.cast<ASTConvert>()->name(), mod, pyc_output);
+            print_src(node.cast<ASTConvert>()->name(), mod, pyc_output, ctx);
             pyc_output << "`";
         }
         break;
     case ASTNode::NODE_TUPLE:
         {
             PycRef<ASTTuple> tuple = node.cast<ASTTuple>();
-            ASTTuple::value_t values = tuple->values();
+            const ASTTuple::value_t& values = tuple->values();
             if (tuple->requireParens())
                 pyc_output << "(";
             bool first = true;
             for (const auto& val : values) {
                 if (!first)
                     pyc_output << ", ";
-                print_src(val, mod, pyc_output);
+                print_src(val, mod, pyc_output, ctx);
                 first = false;
             }
             if (values.size() == 1)
@@ -3300,9 +3525,9 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             PycRef<ASTObject> name = annotated_var->name().cast<ASTObject>();
             PycRef<ASTNode> annotation = annotated_var->annotation();
 
-            pyc_output << name->object().cast<PycString>()->value();
+            pyc_output << name_view(name->object().cast<PycString>(), ctx);
             pyc_output << ": ";
-            print_src(annotation, mod, pyc_output);
+            print_src(annotation, mod, pyc_output, ctx);
         }
         break;
     case ASTNode::NODE_TERNARY:
@@ -3317,34 +3542,34 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
              */
             PycRef<ASTTernary> ternary = node.cast<ASTTernary>();
             //pyc_output << "(";
-            print_src(ternary->if_expr(), mod, pyc_output);
+            print_src(ternary->if_expr(), mod, pyc_output, ctx);
             const auto if_block = ternary->if_block().cast<ASTCondBlock>();
             pyc_output << " if ";
             if (if_block->negative())
                 pyc_output << "not ";
-            print_src(if_block->cond(), mod, pyc_output);
+            print_src(if_block->cond(), mod, pyc_output, ctx);
             pyc_output << " else ";
-            print_src(ternary->else_expr(), mod, pyc_output);
+            print_src(ternary->else_expr(), mod, pyc_output, ctx);
             //pyc_output << ")";
         }
         break;
     default:
         pyc_output << "<NODE:" << node->type() << ">";
-        fprintf(stderr, "Unsupported Node type: %d\n", node->type());
-        cleanBuild = false;
+        pyc_diagnostic("Unsupported Node type: %d\n", node->type());
+        ctx.cleanBuild = false;
         return;
     }
 
-    cleanBuild = true;
+    ctx.cleanBuild = true;
 }
 
 bool print_docstring(PycRef<PycObject> obj, int indent, PycModule* mod,
-                     std::ostream& pyc_output)
+                     PycOutput& pyc_output, DecompileContext& ctx)
 {
     // docstrings are translated from the bytecode __doc__ = 'string' to simply '''string'''
     auto doc = obj.try_cast<PycString>();
     if (doc != nullptr) {
-        start_line(indent, pyc_output);
+        start_line(indent, pyc_output, ctx);
         doc->print(pyc_output, mod, true);
         pyc_output << "\n";
         return true;
@@ -3352,38 +3577,301 @@ bool print_docstring(PycRef<PycObject> obj, int indent, PycModule* mod,
     return false;
 }
 
-void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output)
+/* Prints a "__doc__ = '...'" statement as the docstring it stands for.
+ * Returns false if node isn't one. */
+static bool print_docstring_store(const PycRef<ASTNode>& node, int indent, PycModule* mod,
+                                  PycOutput& pyc_output, DecompileContext& ctx)
+{
+    if (node.type() != ASTNode::NODE_STORE)
+        return false;
+    PycRef<ASTStore> store = node.cast<ASTStore>();
+    if (store->dest().type() != ASTNode::NODE_NAME ||
+            !mod->isName(store->dest().cast<ASTName>()->name(), PycInterner::NAME_DOC) ||
+            store->src().type() != ASTNode::NODE_OBJECT)
+        return false;
+    return print_docstring(store->src().cast<ASTObject>()->object(), indent, mod,
+                           pyc_output, ctx);
+}
+
+/* Lets go of the code objects nested in code which were printed (or will
+ * be printed from the nodes which still refer to them) */
+static void unload_nested(const PycRef<PycCode>& code, DecompileContext& ctx)
+{
+    code->unloadConsts();
+    // They may be freed, and their addresses reused
+    if (ctx.cache)
+        ctx.cache->forgetHashes();
+}
+
+void StatementStream::flush(const PycRef<ASTBlock>& block, size_t keep)
+{
+    DecompileContext& ctx = m_ctx;
+    PycStats* stats = m_mod->stats();
+    uint64_t start = stats ? PycStats::now() : 0;
+    while (block->size() > keep) {
+        PycRef<ASTNode> node = block->nodes().front();
+        block->removeFirst();
+
+        // The module docstring, as decompyle_code() would have printed it
+        if (m_printed++ == 0 && ctx.printClassDocstring) {
+            ctx.printClassDocstring = false;
+            if (print_docstring_store(node, ctx.cur_indent, m_mod, m_output, ctx))
+                continue;
+        }
+
+        ctx.cur_indent++;
+        print_line_marker(node, m_output, ctx);
+        if (node.type() != ASTNode::NODE_NODELIST)
+            start_line(ctx.cur_indent, m_output, ctx);
+        print_src(node, m_mod, m_output, ctx);
+        end_line(m_output, ctx);
+        ctx.cur_indent--;
+    }
+    m_output.flush();
+    if (ctx.lowMemory)
+        unload_nested(m_code, ctx);
+    if (stats)
+        m_nanos += PycStats::now() - start;
+}
+
+/* Restores the enclosing code object's arena, and the code object the
+ * source map attributes statements to, when a nested one is done */
+class ArenaScope {
+public:
+    explicit ArenaScope(DecompileContext& ctx)
+        : m_ctx(ctx), m_saved(ctx.arena), m_savedCode(ctx.mappedCode) { }
+    ~ArenaScope()
+    {
+        m_ctx.arena = m_saved;
+        m_ctx.mappedCode = m_savedCode;
+    }
+
+private:
+    DecompileContext& m_ctx;
+    ASTArena* m_saved;
+    PycRef<PycCode> m_savedCode;
+};
+
+/* Sets up a context for building as the settings ask */
+static void apply_build_settings(DecompileContext& ctx, const DecompileSettings& settings)
+{
+    ctx.lineMarkers = settings.lineMarkers && !settings.sourceMap;
+    ctx.sourceOffsets = (settings.sourceMap != nullptr);
+    ctx.budget = settings.budget;
+}
+
+NestedBuilds::NestedBuilds(PycRef<PycCode> code, PycModule* mod,
+                           const DecompileSettings& settings, bool buildRoot)
+    : m_shared(std::make_shared<Shared>())
+{
+    m_shared->settings = settings;
+    ThreadPool* pool = settings.pool;
+    // Queue them in source order, which is also the order they are printed in
+    std::vector<PycCode*> pending(1, code);
+    m_index[code] = (size_t)-1;
+    while (!pending.empty()) {
+        PycCode* parent = pending.back();
+        pending.pop_back();
+        const auto& consts = parent->consts();
+        for (int i = consts->size(); i > 0; --i) {
+            PycCode* child = consts->get(i - 1).try_cast<PycCode>();
+            if (child && m_index.find(child) == m_index.end()) {
+                m_index[child] = (size_t)-1;
+                pending.push_back(child);
+            }
+        }
+        m_index[parent] = m_shared->jobs.size();
+        m_shared->jobs.emplace_back(parent);
+    }
+    if (!buildRoot)
+        m_shared->jobs[m_index[code]].state = Job::TAKEN;
+
+    auto shared = m_shared;
+    for (size_t i = 0; i < shared->jobs.size(); ++i) {
+        if (pool)
+            pool->submit([shared, i, mod]() { run(shared, i, mod); });
+        else
+            run(shared, i, mod);
+    }
+}
+
+NestedBuilds::~NestedBuilds()
+{
+    // Queued jobs are cancelled, and running ones may still be using the
+    // module, so wait for them.  The leftover ASTs reference the module's
+    // objects and must be released here as well.
+    std::unique_lock<std::mutex> guard(m_shared->lock);
+    for (auto& job : m_shared->jobs) {
+        if (job.state == Job::PENDING)
+            job.state = Job::TAKEN;
+    }
+    m_shared->done.wait(guard, [this] { return m_shared->running == 0; });
+    for (auto& job : m_shared->jobs) {
+        job.source = nullptr;
+        job.arena.reset();
+    }
+}
+
+void NestedBuilds::run(const std::shared_ptr<Shared>& shared, size_t index, PycModule* mod)
+{
+    PycCode* code;
+    {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        Job& job = shared->jobs[index];
+        if (job.state != Job::PENDING)
+            return;
+        job.state = Job::RUNNING;
+        ++shared->running;
+        code = job.code;
+    }
+
+    DecompileContext ctx;
+    apply_build_settings(ctx, shared->settings);
+    std::unique_ptr<ASTArena> arena(new ASTArena(false, mod->memoryAccount()));
+    ctx.arena = arena.get();
+    PycRef<ASTNode> source;
+    std::exception_ptr error;
+    try {
+        source = BuildFromCode(code, mod, ctx);
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        Job& job = shared->jobs[index];
+        job.arena = std::move(arena);
+        job.source = std::move(source);
+        job.cleanBuild = ctx.cleanBuild;
+        job.overBudget = ctx.overBudget;
+        job.privateNames = std::move(ctx.privateNames);
+        job.error = error;
+        job.state = Job::DONE;
+        --shared->running;
+    }
+    shared->done.notify_all();
+}
+
+bool NestedBuilds::take(PycCode* code, PycRef<ASTNode>& source,
+                        std::unique_ptr<ASTArena>& arena, DecompileContext& ctx)
+{
+    auto iter = m_index.find(code);
+    if (iter == m_index.end() || iter->second == (size_t)-1)
+        return false;
+
+    std::unique_lock<std::mutex> guard(m_shared->lock);
+    Job& job = m_shared->jobs[iter->second];
+    if (job.state == Job::TAKEN)
+        return false;
+    if (job.state == Job::PENDING) {
+        // Not started yet, so it's quicker to do it right here
+        job.state = Job::TAKEN;
+        return false;
+    }
+    m_shared->done.wait(guard, [&job] { return job.state == Job::DONE; });
+
+    job.state = Job::TAKEN;
+    arena = std::move(job.arena);
+    source = std::move(job.source);
+    job.source = nullptr;
+    ctx.cleanBuild = job.cleanBuild;
+    ctx.overBudget = job.overBudget;
+    // As if the AST was only built now, ahead of printing it
+    ctx.privateNames.insert(job.privateNames.begin(), job.privateNames.end());
+    job.privateNames.clear();
+    if (job.error)
+        std::rethrow_exception(job.error);
+    return true;
+}
+
+/* What's printed in place of the body of code which went over the build
+ * budget: its disassembly, as comments */
+static void print_disassembly(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+                              DecompileContext& ctx)
 {
-    PycRef<ASTNode> source = BuildFromCode(code, mod);
+    if (ctx.inLambda)
+        return;
+    std::ostringstream listing;
+    {
+        PycOutput out(listing);
+        output_object(code.cast<PycObject>(), mod, 0, 0, out);
+    }
+    start_line(ctx.cur_indent + 1, pyc_output, ctx);
+    pyc_output << "# WARNING: Decompyle gave up, over the build budget.  Disassembly:\n";
+    const std::string text = listing.str();
+    for (size_t from = 0; from < text.size(); ) {
+        size_t end = text.find('\n', from);
+        if (end == std::string::npos)
+            end = text.size();
+        start_line(ctx.cur_indent + 1, pyc_output, ctx);
+        pyc_output << "# ";
+        pyc_output.write(text.data() + from, end - from);
+        pyc_output << "\n";
+        from = end + 1;
+    }
+}
 
+static bool decompyle_code(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+                           DecompileContext& ctx)
+{
+    // Code nested in this one is printed as usual
+    bool streaming = ctx.streamStatements;
+    ctx.streamStatements = false;
+    StatementStream stream(code, mod, pyc_output, ctx);
+
+    // The arena has to outlive every reference to its nodes
+    std::unique_ptr<ASTArena> arena;
+    PycRef<ASTNode> source;
+    ArenaScope scope(ctx);
+    ctx.mappedCode = code;
+    bool over_budget = ctx.overBudget;
+    ctx.overBudget = false;
+    if (!streaming && ctx.nestedBuilds && ctx.nestedBuilds->take(code, source, arena, ctx)) {
+        ctx.arena = arena.get();
+    } else {
+        // Streamed statements are freed as soon as they are printed
+        arena.reset(new ASTArena(streaming, mod->memoryAccount()));
+        ctx.arena = arena.get();
+        source = BuildFromCode(code, mod, ctx, streaming ? &stream : nullptr);
+        if (ctx.lowMemory)
+            code->releaseInstructions();
+    }
+    // Whatever was built is left out along with the rest
+    bool gave_up = ctx.overBudget;
+    ctx.overBudget = over_budget || gave_up;
+    if (gave_up)
+        source = ctx.arena->make<ASTNodeList>(ASTNodeList::list_t());
+
+    // The first statements may have been streamed already
+    bool at_start = (stream.printed() == 0);
     PycRef<ASTNodeList> clean = source.cast<ASTNodeList>();
-    if (cleanBuild) {
+    if (ctx.cleanBuild) {
         // The Python compiler adds some stuff that we don't really care
         // about, and would add extra code for re-compilation anyway.
         // We strip these lines out here, and then add a "pass" statement
         // if the cleaned up code is empty
-        if (clean->nodes().front().type() == ASTNode::NODE_STORE) {
+        if (at_start && clean->nodes().front().type() == ASTNode::NODE_STORE) {
             PycRef<ASTStore> store = clean->nodes().front().cast<ASTStore>();
             if (store->src().type() == ASTNode::NODE_NAME
                     && store->dest().type() == ASTNode::NODE_NAME) {
                 PycRef<ASTName> src = store->src().cast<ASTName>();
                 PycRef<ASTName> dest = store->dest().cast<ASTName>();
-                if (src->name()->isEqual("__name__")
-                        && dest->name()->isEqual("__module__")) {
+                if (mod->isName(src->name(), PycInterner::NAME_NAME)
+                        && mod->isName(dest->name(), PycInterner::NAME_MODULE)) {
                     // __module__ = __name__
                     // Automatically added by Python 2.2.1 and later
                     clean->removeFirst();
                 }
             }
         }
-        if (clean->nodes().front().type() == ASTNode::NODE_STORE) {
+        if (at_start && clean->nodes().front().type() == ASTNode::NODE_STORE) {
             PycRef<ASTStore> store = clean->nodes().front().cast<ASTStore>();
             if (store->src().type() == ASTNode::NODE_OBJECT
                     && store->dest().type() == ASTNode::NODE_NAME) {
                 PycRef<ASTObject> src = store->src().cast<ASTObject>();
                 PycRef<PycString> srcString = src->object().try_cast<PycString>();
                 PycRef<ASTName> dest = store->dest().cast<ASTName>();
-                if (dest->name()->isEqual("__qualname__")) {
+                if (mod->isName(dest->name(), PycInterner::NAME_QUALNAME)) {
                     // __qualname__ = '<Class Name>'
                     // Automatically added by Python 3.3 and later
                     clean->removeFirst();
@@ -3392,16 +3880,10 @@ void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output)
         }
 
         // Class and module docstrings may only appear at the beginning of their source
-        if (printClassDocstring && clean->nodes().front().type() == ASTNode::NODE_STORE) {
-            PycRef<ASTStore> store = clean->nodes().front().cast<ASTStore>();
-            if (store->dest().type() == ASTNode::NODE_NAME &&
-                    store->dest().cast<ASTName>()->name()->isEqual("__doc__") &&
-                    store->src().type() == ASTNode::NODE_OBJECT) {
-                if (print_docstring(store->src().cast<ASTObject>()->object(),
-                        cur_indent + (code->name()->isEqual("<module>") ? 0 : 1), mod, pyc_output))
-                    clean->removeFirst();
-            }
-        }
+        if (at_start && ctx.printClassDocstring && print_docstring_store(clean->nodes().front(),
+                ctx.cur_indent + (mod->isName(code->name(), PycInterner::NAME_MODULE_CODE) ? 0 : 1),
+                mod, pyc_output, ctx))
+            clean->removeFirst();
         if (clean->nodes().back().type() == ASTNode::NODE_RETURN) {
             PycRef<ASTReturn> ret = clean->nodes().back().cast<ASTReturn>();
 
@@ -3412,39 +3894,285 @@ void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output)
             }
         }
     }
-    if (printClassDocstring)
-        printClassDocstring = false;
+    if (ctx.printClassDocstring)
+        ctx.printClassDocstring = false;
     // This is outside the clean check so a source block will always
     // be compilable, even if decompylation failed.
     if (clean->nodes().size() == 0 && !code.isIdent(mod->code()))
-        clean->append(new ASTKeyword(ASTKeyword::KW_PASS));
+        clean->append(ctx.arena->make<ASTKeyword>(ASTKeyword::KW_PASS));
 
-    bool part1clean = cleanBuild;
+    bool part1clean = ctx.cleanBuild;
 
-    if (printDocstringAndGlobals) {
+    if (ctx.printDocstringAndGlobals) {
         if (code->consts()->size())
-            print_docstring(code->getConst(0), cur_indent + 1, mod, pyc_output);
+            print_docstring(code->getConst(0), ctx.cur_indent + 1, mod, pyc_output, ctx);
 
         PycCode::globals_t globs = code->getGlobals();
         if (globs.size()) {
-            start_line(cur_indent + 1, pyc_output);
+            start_line(ctx.cur_indent + 1, pyc_output, ctx);
             pyc_output << "global ";
             bool first = true;
             for (const auto& glob : globs) {
                 if (!first)
                     pyc_output << ", ";
-                pyc_output << glob->value();
+                pyc_output << name_view(glob, ctx);
                 first = false;
             }
             pyc_output << "\n";
         }
-        printDocstringAndGlobals = false;
+        ctx.printDocstringAndGlobals = false;
     }
 
-    print_src(source, mod, pyc_output);
+    if (gave_up)
+        print_disassembly(code, mod, pyc_output, ctx);
+    print_src(source, mod, pyc_output, ctx);
 
-    if (!cleanBuild || !part1clean) {
-        start_line(cur_indent, pyc_output);
+    bool result = true;
+    if (!ctx.cleanBuild || !part1clean) {
+        start_line(ctx.cur_indent, pyc_output, ctx);
         pyc_output << "# WARNING: Decompyle incomplete\n";
+        result = false;
+    }
+    if (ctx.lowMemory)
+        unload_nested(code, ctx);
+    return result;
+}
+
+/* The printing state besides the indentation which the output depends on,
+ * as well as on the code object */
+static std::string print_state(const DecompileContext& ctx)
+{
+    std::string state;
+    state += ctx.inLambda ? 'L' : '-';
+    state += ctx.printDocstringAndGlobals ? 'G' : '-';
+    state += ctx.printClassDocstring ? 'D' : '-';
+    state += ctx.streamStatements ? 'S' : '-';
+    state += ctx.lineMarkers ? 'N' : '-';
+
+    // The private names noted so far print unmangled wherever they are used
+    if (!ctx.privateNames.empty()) {
+        std::vector<std::string> names;
+        for (const auto& entry : ctx.privateNames) {
+            if (!entry.first.first) {
+                names.push_back(entry.second.name->view().str() + ':'
+                                + std::to_string(entry.second.prefix));
+            }
+        }
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names)
+            state += ' ' + name;
     }
+    return state;
+}
+
+/* Whether building code, or the code nested in it, may note private names
+ * (see DecompileContext::privateNames), which the code printed after it
+ * depends on.  Such code is built each time, and never reused from a cache
+ * or left out as unchanged. */
+static bool may_note_private_names(PycCode* code)
+{
+    std::vector<PycCode*> pending(1, code);
+    while (!pending.empty()) {
+        PycCode* current = pending.back();
+        pending.pop_back();
+        const std::string prefix = "_" + current->name()->view().str() + "__";
+        const auto& names = current->names();
+        for (int i = 0; names && i < names->size(); ++i) {
+            PycString* name = names->get(i).try_cast<PycString>();
+            if (name && name->startsWith(prefix))
+                return true;
+        }
+        auto consts = current->consts();
+        for (int i = 0; i < consts->size(); ++i) {
+            PycCode* child = consts->get(i).try_cast<PycCode>();
+            if (child)
+                pending.push_back(child);
+        }
+    }
+    return false;
+}
+
+/* As decompyle_code() would have left the state */
+static void finish_reused(DecompileContext& ctx, bool clean)
+{
+    ctx.cleanBuild = clean;
+    ctx.printDocstringAndGlobals = false;
+    ctx.printClassDocstring = false;
+    ctx.streamStatements = false;
+}
+
+static bool decompyle_shared(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+                             DecompileContext& ctx)
+{
+    PrintedCode& printed = *ctx.printed;
+    std::string state = print_state(ctx);
+    if (const PrintedCode::Text* text = printed.find(code, state)) {
+        size_t from = 0;
+        for (const auto& indent : text->indents) {
+            pyc_output.write(text->text.data() + from, indent.offset - from);
+            start_line(indent.level - text->base + ctx.cur_indent, pyc_output, ctx);
+            from = indent.offset;
+        }
+        pyc_output.write(text->text.data() + from, text->text.size() - from);
+        finish_reused(ctx, text->clean);
+        return text->result;
+    }
+
+    PrintedCode::Text text;
+    text.base = ctx.cur_indent;
+    size_t first_indent = printed.beginRecording();
+    size_t start = pyc_output.beginCapture();
+    try {
+        text.result = decompyle_code(code, mod, pyc_output, ctx);
+    } catch (...) {
+        pyc_output.endCapture(start);
+        printed.cancelRecording();
+        throw;
+    }
+    text.clean = ctx.cleanBuild;
+    bool result = text.result;
+    printed.endRecording(code, state, std::move(text), pyc_output.endCapture(start), start,
+                         first_indent);
+    return result;
+}
+
+bool decompyle(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+               DecompileContext& ctx)
+{
+    if (ctx.unchanged && ctx.unchanged->count(code) && !code->name()->startsWith("<")) {
+        // Only the names it notes are kept
+        if (may_note_private_names(code)) {
+            size_t start = pyc_output.beginCapture();
+            try {
+                decompyle_code(code, mod, pyc_output, ctx);
+            } catch (...) {
+                pyc_output.endCapture(start);
+                throw;
+            }
+            pyc_output.endCapture(start);
+        }
+        start_line(ctx.cur_indent + 1, pyc_output, ctx);
+        pyc_output << "...  # Unchanged\n";
+        finish_reused(ctx, true);
+        return true;
+    }
+
+    if (!ctx.cache || may_note_private_names(code)) {
+        if (ctx.printed && mod->isDuplicate(code))
+            return decompyle_shared(code, mod, pyc_output, ctx);
+        return decompyle_code(code, mod, pyc_output, ctx);
+    }
+
+    std::string state = std::to_string(ctx.cur_indent) + print_state(ctx);
+    if (mod->literalWidth())
+        state += 'W' + std::to_string(mod->literalWidth());
+    DecompileCache::Key key = ctx.cache->key(code, mod, state);
+
+    std::string text;
+    bool result, clean;
+    if (ctx.cache->lookup(key, text, result, clean)) {
+        pyc_output << text;
+        finish_reused(ctx, clean);
+        return result;
+    }
+
+    // What goes over the time budget depends on the run, so it isn't kept
+    bool over_budget = ctx.overBudget;
+    ctx.overBudget = false;
+    size_t start = pyc_output.beginCapture();
+    try {
+        result = decompyle_code(code, mod, pyc_output, ctx);
+    } catch (...) {
+        pyc_output.endCapture(start);
+        throw;
+    }
+    std::string printed = pyc_output.endCapture(start);
+    if (!ctx.overBudget)
+        ctx.cache->store(key, printed, result, ctx.cleanBuild);
+    ctx.overBudget = ctx.overBudget || over_budget;
+    return result;
+}
+
+bool decompyle(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+               const DecompileSettings& settings)
+{
+    PycStats* stats = mod->stats();
+    uint64_t start = stats ? PycStats::now() : 0;
+    bool result;
+    DecompileContext ctx;
+    PrintedCode printed;
+    SourceMap* sourceMap = settings.sourceMap;
+    // Reused source would leave its statements out of the source map
+    ctx.cache = sourceMap ? nullptr : settings.cache;
+    ctx.printed = (ctx.cache || sourceMap) ? nullptr : &printed;
+    ctx.streamStatements = settings.stream || settings.lowMemory;
+    ctx.lowMemory = settings.lowMemory;
+    ctx.sourceMap = sourceMap;
+    apply_build_settings(ctx, settings);
+    if (ctx.cache)
+        ctx.cache->setLineNumbers(ctx.lineMarkers);
+    if (sourceMap)
+        pyc_output.countLines();
+    if (settings.pool) {
+        mod->shareObjects();
+        NestedBuilds nested(code, mod, settings, !settings.stream);
+        ctx.nestedBuilds = &nested;
+        result = decompyle(code, mod, pyc_output, ctx);
+    } else {
+        result = decompyle(code, mod, pyc_output, ctx);
+    }
+    if (stats)
+        stats->printNanos += PycStats::now() - start - ctx.buildNanos;
+    return result;
+}
+
+bool decompyle_changes(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+                       const std::unordered_set<const PycCode*>& unchanged)
+{
+    PycStats* stats = mod->stats();
+    uint64_t start = stats ? PycStats::now() : 0;
+    DecompileContext ctx;
+    PrintedCode printed;
+    ctx.printed = &printed;
+    ctx.unchanged = &unchanged;
+    bool result = decompyle(code, mod, pyc_output, ctx);
+    if (stats)
+        stats->printNanos += PycStats::now() - start - ctx.buildNanos;
+    return result;
+}
+
+bool decompyle_only(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output)
+{
+    PycStats* stats = mod->stats();
+    uint64_t start = stats ? PycStats::now() : 0;
+    DecompileContext ctx;
+    ASTArena arena(false, mod->memoryAccount());
+    ctx.arena = &arena;
+
+    /* Print it through the same statement which would define it in its
+     * enclosing code, without anything that statement would take from the
+     * enclosing code's stack */
+    PycRef<ASTNode> object = arena.make<ASTObject>(code.cast<PycObject>());
+    PycRef<ASTNode> name = arena.make<ASTName>(code->name());
+    PycRef<ASTNode> source;
+    if (code->name()->startsWith("<")) {
+        // Lambdas, comprehensions and the like have no statement of their own
+        source = object;
+    } else if (mod->verCompare(1, 3) >= 0 && !(code->flags() & PycCode::CO_OPTIMIZED)) {
+        PycRef<ASTNode> body = arena.make<ASTCall>(
+                arena.make<ASTFunction>(object, ASTFunction::defarg_t(), ASTFunction::defarg_t()),
+                ASTCall::pparam_t(), ASTCall::kwparam_t());
+        PycRef<ASTNode> cls = arena.make<ASTClass>(body, arena.make<ASTTuple>(ASTTuple::value_t()),
+                                                   name);
+        source = arena.make<ASTNodeList>(ASTNodeList::list_t(1, arena.make<ASTStore>(cls, name)));
+    } else {
+        PycRef<ASTNode> func = arena.make<ASTFunction>(object, ASTFunction::defarg_t(),
+                                                       ASTFunction::defarg_t());
+        source = arena.make<ASTNodeList>(ASTNodeList::list_t(1, arena.make<ASTStore>(func, name)));
+    }
+
+    print_src(source, mod, pyc_output, ctx);
+    if (stats)
+        stats->printNanos += PycStats::now() - start - ctx.buildNanos;
+    return ctx.cleanBuild;
 }
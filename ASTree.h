@@ -2,10 +2,234 @@
 #define _PYC_ASTREE_H
 
 #include "ASTNode.h"
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod);
-void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output);
+class ThreadPool;
+class NestedBuilds;
+class DecompileCache;
+class PrintedCode;
+class SourceMap;
+class StatementStream;
 
-void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output);
+/* Limits on the work BuildFromCode does for any one code object, so a
+ * malformed file can't stall the caller for long.  Zero means no limit.
+ * A code object which goes over is printed as its disassembly instead, as
+ * is one which is being built when the module's MemoryAccount goes over
+ * its limit. */
+struct BuildBudget {
+    BuildBudget() : steps(), millis() { }
+
+    /* Instructions handled plus iterations of the loops unwinding blocks */
+    unsigned long steps;
+    unsigned long millis;
+};
+
+/* State which is carried through the nested BuildFromCode / print_src /
+ * decompyle calls for one module.  Keeping it here instead of in globals
+ * allows independent modules to be decompiled concurrently. */
+struct DecompileContext {
+    DecompileContext()
+        : cleanBuild(), inLambda(), printDocstringAndGlobals(),
+          printClassDocstring(true), cur_indent(-1), arena(), nestedBuilds(),
+          buildNanos(), cache(), printed(), streamStatements(), lowMemory(),
+          lineMarkers(), sourceOffsets(), sourceMap(), unchanged(), overBudget() { }
+
+    /* Use this to determine if an error occurred (and therefore, if we should
+     * avoid cleaning the output tree) */
+    bool cleanBuild;
+
+    /* Use this to prevent printing return keywords and newlines in lambdas. */
+    bool inLambda;
+
+    /* Use this to keep track of whether we need to print out any docstring and
+     * the list of global variables that we are using (such as inside a function). */
+    bool printDocstringAndGlobals;
+
+    /* Use this to keep track of whether we need to print a class or module docstring */
+    bool printClassDocstring;
+
+    int cur_indent;
+
+    /* Owns the nodes of the code object currently being decompiled */
+    ASTArena* arena;
+
+    /* ASTs of nested code objects which were built ahead of printing, if any */
+    NestedBuilds* nestedBuilds;
+
+    /* Time spent in BuildFromCode for this context, if stats are enabled */
+    uint64_t buildNanos;
+
+    /* Where to look up and store the source printed for code objects */
+    DecompileCache* cache;
+
+    /* The source printed for code objects which the module has several of,
+     * to print again for the others */
+    PrintedCode* printed;
+
+    /* Print the top-level statements of the next code object decompiled as
+     * soon as each of them is built.  Cleared once that has started. */
+    bool streamStatements;
+
+    /* Free each code object's decoded bytecode once it's built, and let go
+     * of nested code objects once they are printed */
+    bool lowMemory;
+
+    /* Record the line each statement starts on, and print it as a
+     * "# line N" comment ahead of the statement */
+    bool lineMarkers;
+
+    /* Attribute nodes to the offset their statement starts at, instead of
+     * its line, for a source map.  Takes the place of lineMarkers. */
+    bool sourceOffsets;
+
+    /* Where to note the code object and offset of each statement printed,
+     * which needs sourceOffsets to have been set while building */
+    SourceMap* sourceMap;
+
+    /* The code object whose statements are being printed */
+    PycRef<PycCode> mappedCode;
+
+    /* Code objects whose bodies are printed as "..." instead, being the same
+     * as in the module they are compared with (see ModuleDiff) */
+    const std::unordered_set<const PycCode*>* unchanged;
+
+    BuildBudget budget;
+
+    /* Set once a code object went over the budget */
+    bool overBudget;
+
+    /* The private names which were stored in the class bodies built so far.
+     * Python adds "_<class>" to them, which is left out wherever the same
+     * string is printed afterwards.  Before 3.4, a string is only shared
+     * within one code object, so it's only left out in the class body; the
+     * key's code object is null for one which applies everywhere. */
+    struct PrivateName {
+        PycRef<PycCode> code;       // Keep the key from being reused
+        PycRef<PycString> name;
+        size_t prefix;              // The length of what Python added
+    };
+    typedef std::map<std::pair<const PycCode*, const PycString*>, PrivateName> private_names_t;
+    private_names_t privateNames;
+};
+
+/* With a stream, the finished statements of the outermost block are handed
+ * to it while building, and are left out of the returned list */
+PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod, DecompileContext& ctx,
+                              StatementStream* stream = nullptr);
+void print_src(const PycRef<ASTNode>& node, PycModule* mod, PycOutput& pyc_output,
+               DecompileContext& ctx);
+
+/* Returns false if the output is known to be incomplete */
+bool decompyle(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+               DecompileContext& ctx);
+
+/* How decompyle() goes about a whole module.  The defaults are a plain
+ * serial run. */
+struct DecompileSettings {
+    /* The ASTs of all nested code objects are built on the pool ahead of
+     * being printed.  This makes the module's objects shared (see
+     * PycModule::shareObjects). */
+    ThreadPool* pool = nullptr;
+
+    /* Code objects found in the cache aren't decompiled again */
+    DecompileCache* cache = nullptr;
+
+    /* Print and flush each top-level statement as soon as it's complete,
+     * and free its nodes right away */
+    bool stream = false;
+
+    /* Implies stream, and frees whatever else it can as soon as it's done
+     * with it.  For code objects to be freed that way, the module must be
+     * loaded lazily, without an arena (see PycModule::setLazyLoading). */
+    bool lowMemory = false;
+
+    /* Print the source line of each statement as a comment ahead of it */
+    bool lineMarkers = false;
+
+    /* Applies to each code object separately */
+    BuildBudget budget;
+
+    /* Where to note which code object and offset each statement came from.
+     * The cache is left out then, and it can't be combined with
+     * lineMarkers. */
+    SourceMap* sourceMap = nullptr;
+};
+
+/* Decompile a module's code with a fresh context */
+bool decompyle(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+               const DecompileSettings& settings = DecompileSettings());
+
+/* Decompile a module's code with a fresh context, with the bodies of the
+ * functions and classes in unchanged left out, e.g. as found by
+ * diff_modules() */
+bool decompyle_changes(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output,
+                       const std::unordered_set<const PycCode*>& unchanged);
+
+/* Decompile just one code object nested in a module, as the def or class
+ * statement which creates it.  Default arguments, decorators and base
+ * classes are set up by the enclosing code, which isn't decompiled, so
+ * they are left out. */
+bool decompyle_only(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output);
+
+/* Builds the ASTs of a code object and all code nested in it ahead of
+ * printing, either on a thread pool or, without one, right away on the
+ * calling thread.  Each AST is handed out once, to the decompyle() call which
+ * would otherwise have built it, so the printed output is the same as for a
+ * plain serial run.  Set DecompileContext::nestedBuilds to use them. */
+class NestedBuilds {
+public:
+    /* The builds are done on the settings' pool, if any, with the module's
+     * objects shared (see PycModule::shareObjects).  Of the rest, only what
+     * affects building is used.  Without buildRoot, only the code nested
+     * in code is built. */
+    NestedBuilds(PycRef<PycCode> code, PycModule* mod, const DecompileSettings& settings,
+                 bool buildRoot = true);
+    ~NestedBuilds();
+
+    NestedBuilds(const NestedBuilds&) = delete;
+    NestedBuilds& operator=(const NestedBuilds&) = delete;
+
+    /* Returns false if the caller has to build the AST itself */
+    bool take(PycCode* code, PycRef<ASTNode>& source, std::unique_ptr<ASTArena>& arena,
+              DecompileContext& ctx);
+
+private:
+    struct Job {
+        enum State { PENDING, RUNNING, DONE, TAKEN };
+
+        explicit Job(PycCode* code_)
+            : code(code_), state(PENDING), cleanBuild(), overBudget() { }
+
+        PycCode* code;
+        State state;
+        std::unique_ptr<ASTArena> arena;
+        PycRef<ASTNode> source;
+        bool cleanBuild;
+        bool overBudget;
+        DecompileContext::private_names_t privateNames;
+        std::exception_ptr error;
+    };
+
+    /* Outlives this object if tasks are still queued on the pool */
+    struct Shared {
+        std::mutex lock;
+        std::condition_variable done;
+        std::vector<Job> jobs;
+        size_t running = 0;
+        DecompileSettings settings;
+    };
+
+    static void run(const std::shared_ptr<Shared>& shared, size_t index, PycModule* mod);
+
+    std::shared_ptr<Shared> m_shared;
+    std::unordered_map<PycCode*, size_t> m_index;
+};
 
 #endif
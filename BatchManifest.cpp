@@ -0,0 +1,137 @@
+#include "BatchManifest.h"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+static uint64_t fnv1a(uint64_t hash, const char* data, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+const char BatchManifest::FAILED_STATUS[] = "FAILED";
+
+unsigned shard_of(const std::string& path, unsigned count)
+{
+    return (unsigned)(fnv1a(14695981039346656037ULL, path.data(), path.size()) % count);
+}
+
+/* Reads back the "file" string at the start of a line written by record(),
+ * as append_json_string() escapes it, and the "status" which follows it */
+static bool parse_line(const std::string& line, std::string& path, std::string& status)
+{
+    static const char prefix[] = "{\"file\": \"";
+    if (line.compare(0, sizeof(prefix) - 1, prefix) != 0 || line.back() != '}')
+        return false;
+    path.clear();
+    for (size_t pos = sizeof(prefix) - 1; pos < line.size(); ++pos) {
+        char ch = line[pos];
+        if (ch == '"') {
+            static const char status_prefix[] = ", \"status\": \"";
+            if (line.compare(pos + 1, sizeof(status_prefix) - 1, status_prefix) != 0)
+                return false;
+            size_t start = pos + sizeof(status_prefix);
+            size_t end = line.find('"', start);
+            if (end == std::string::npos)
+                return false;
+            status = line.substr(start, end - start);
+            return true;
+        }
+        if (ch != '\\') {
+            path += ch;
+            continue;
+        }
+        if (++pos >= line.size())
+            return false;
+        if (line[pos] == 'u') {
+            if (pos + 4 >= line.size())
+                return false;
+            path += (char)strtol(line.substr(pos + 1, 4).c_str(), nullptr, 16);
+            pos += 4;
+        } else {
+            path += line[pos];
+        }
+    }
+    return false;
+}
+
+BatchManifest::~BatchManifest()
+{
+    if (m_file)
+        fclose(m_file);
+}
+
+bool BatchManifest::open(const char* filename)
+{
+    bool complete = true;
+    std::ifstream in(filename, std::ios_base::in | std::ios_base::binary);
+    std::string line, path, status;
+    while (std::getline(in, line)) {
+        complete = !in.eof();
+        if (!complete || !parse_line(line, path, status))
+            continue;
+        // The last record of an input is the one which counts
+        if (status == FAILED_STATUS)
+            m_done.erase(path);
+        else
+            m_done.insert(path);
+    }
+    in.close();
+
+    m_file = fopen(filename, "ab");
+    if (!m_file) {
+        fprintf(stderr, "Error opening file '%s' for writing\n", filename);
+        return false;
+    }
+    // Don't let the next record run on from a line which was cut short
+    if (!complete)
+        fputc('\n', m_file);
+    return true;
+}
+
+void BatchManifest::record(const std::string& path, const char* status, uint64_t wallNanos,
+                           const std::string& outputHash, const PycStats& stats)
+{
+    std::string line = "{\"file\": ";
+    append_json_string(line, path.data(), path.size());
+    line += ", \"status\": \"";
+    line += status;
+    char fields[128];
+    snprintf(fields, sizeof(fields), "\", \"wall_ms\": %.3f, \"output_hash\": \"%s\"",
+             wallNanos / 1e6, outputHash.c_str());
+    line += fields;
+    line += stats.jsonFields();
+    line += "}\n";
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    fwrite(line.data(), 1, line.size(), m_file);
+    fflush(m_file);
+}
+
+std::string HashingStreamBuf::hex() const
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)m_hash);
+    return buf;
+}
+
+void HashingStreamBuf::add(const char* data, size_t count)
+{
+    m_hash = fnv1a(m_hash, data, count);
+}
+
+HashingStreamBuf::int_type HashingStreamBuf::overflow(int_type ch)
+{
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+        return traits_type::not_eof(ch);
+    char byte = traits_type::to_char_type(ch);
+    add(&byte, 1);
+    return m_target->sputc(byte);
+}
+
+std::streamsize HashingStreamBuf::xsputn(const char* data, std::streamsize count)
+{
+    add(data, (size_t)count);
+    return m_target->sputn(data, count);
+}
@@ -0,0 +1,70 @@
+#ifndef _PYC_BATCH_MANIFEST_H
+#define _PYC_BATCH_MANIFEST_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <unordered_set>
+#include "pyc_stats.h"
+
+/* Which of count shards an input belongs to, by a hash of its path, so
+ * that every machine given the same inputs splits them the same way */
+unsigned shard_of(const std::string& path, unsigned count);
+
+/* An append-only record of the inputs a batch run has finished, one line
+ * of JSON each: the input and its status, the time it took, a hash of the
+ * output, and the --stats counters.  Opening it again reads back what's
+ * done already, so a restarted run can skip it.  Inputs whose last record
+ * is FAILED_STATUS don't count as done, so a restarted run tries them
+ * again.  A last line which was cut short, e.g. by the process being
+ * killed, doesn't count. */
+class BatchManifest {
+public:
+    static const char FAILED_STATUS[];
+
+    BatchManifest() : m_file() { }
+    ~BatchManifest();
+
+    BatchManifest(const BatchManifest&) = delete;
+    BatchManifest& operator=(const BatchManifest&) = delete;
+
+    /* Returns false, with an error message printed, if it can't be opened
+     * for appending */
+    bool open(const char* filename);
+
+    bool isDone(const std::string& path) const { return m_done.count(path) != 0; }
+
+    /* Appends a line and flushes it.  May be called from several threads. */
+    void record(const std::string& path, const char* status, uint64_t wallNanos,
+                const std::string& outputHash, const PycStats& stats);
+
+private:
+    FILE* m_file;
+    std::unordered_set<std::string> m_done;
+    std::mutex m_lock;
+};
+
+/* Passes what's written to it through to another stream buffer, and
+ * hashes it on the way (64-bit FNV-1a) */
+class HashingStreamBuf : public std::streambuf {
+public:
+    explicit HashingStreamBuf(std::streambuf* target)
+        : m_target(target), m_hash(14695981039346656037ULL) { }
+
+    std::string hex() const;
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* data, std::streamsize count) override;
+    int sync() override { return m_target->pubsync(); }
+
+private:
+    void add(const char* data, size_t count);
+
+    std::streambuf* m_target;
+    uint64_t m_hash;
+};
+
+#endif
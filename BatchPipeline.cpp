@@ -0,0 +1,119 @@
+#include "BatchPipeline.h"
+#include <cstdio>
+
+bool read_file(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+    bool ok = fseek(in, 0, SEEK_END) == 0;
+    long size = ok ? ftell(in) : -1;
+    if (size >= 0 && fseek(in, 0, SEEK_SET) == 0) {
+        data.resize((size_t)size);
+        ok = fread(data.data(), 1, data.size(), in) == data.size();
+    } else {
+        ok = false;
+    }
+    fclose(in);
+    return ok;
+}
+
+ReadAhead::ReadAhead(std::vector<std::string> paths, size_t window, unsigned threads)
+    : m_paths(std::move(paths)), m_files(m_paths.size()), m_window(window ? window : 1),
+      m_next(0), m_taken(0), m_stop(false)
+{
+    if (threads == 0)
+        threads = 1;
+    for (unsigned i = 0; i < threads; ++i)
+        m_threads.emplace_back(&ReadAhead::run, this);
+}
+
+ReadAhead::~ReadAhead()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_readable.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+bool ReadAhead::take(size_t index, std::vector<unsigned char>& data)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    ++m_taken;
+    m_readable.notify_all();
+    File& file = m_files[index];
+    m_ready.wait(guard, [&] { return file.ready; });
+    data.swap(file.data);
+    std::vector<unsigned char>().swap(file.data);
+    return file.ok;
+}
+
+void ReadAhead::run()
+{
+    for ( ;; ) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            m_readable.wait(guard, [this] {
+                return m_stop || m_next >= m_files.size() || m_next < m_taken + m_window;
+            });
+            if (m_stop || m_next >= m_files.size())
+                return;
+            index = m_next++;
+        }
+
+        std::vector<unsigned char> data;
+        bool ok = !m_paths[index].empty() && read_file(m_paths[index], data);
+
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_files[index].data.swap(data);
+            m_files[index].ok = ok;
+            m_files[index].ready = true;
+        }
+        m_ready.notify_all();
+    }
+}
+
+AsyncWriter::AsyncWriter(size_t limit)
+    : m_limit(limit ? limit : 1), m_stop(false), m_thread(&AsyncWriter::run, this) { }
+
+AsyncWriter::~AsyncWriter()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+void AsyncWriter::submit(task_t task)
+{
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_space.wait(guard, [this] { return m_tasks.size() < m_limit; });
+        m_tasks.push_back(std::move(task));
+    }
+    m_wake.notify_one();
+}
+
+void AsyncWriter::run()
+{
+    for ( ;; ) {
+        task_t task;
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            m_wake.wait(guard, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        m_space.notify_all();
+        task();
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef _PYC_BATCH_PIPELINE_H
+#define _PYC_BATCH_PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* The stages around decompiling in a pipelined batch run, which keep the
+ * workers from waiting on slow storage: ReadAhead reads the inputs before
+ * they are needed, and AsyncWriter writes the outputs after.  Both are
+ * bounded, so neither gets more than a few inputs ahead of the workers. */
+
+/* Reads a whole file into data, instead of mapping it, so it can't change
+ * under the caller.  Returns false if it couldn't be read. */
+bool read_file(const std::string& path, std::vector<unsigned char>& data);
+
+/* Reads whole files into memory on threads of its own, in the order given,
+ * at most window files ahead of the ones taken so far */
+class ReadAhead {
+public:
+    /* Empty paths are left for whoever takes them to load some other way */
+    ReadAhead(std::vector<std::string> paths, size_t window, unsigned threads);
+    ~ReadAhead();
+
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    /* Waits for the file at index to be read, and hands it over.  Each index
+     * may be taken once.  Returns false if it couldn't be read; opening it
+     * again reports why. */
+    bool take(size_t index, std::vector<unsigned char>& data);
+
+private:
+    struct File {
+        File() : ready(), ok() { }
+
+        bool ready, ok;
+        std::vector<unsigned char> data;
+    };
+
+    void run();
+
+    std::vector<std::string> m_paths;
+    std::vector<File> m_files;
+    size_t m_window;
+    size_t m_next;          // The next file to read
+    size_t m_taken;         // How many files were taken
+
+    std::mutex m_lock;
+    std::condition_variable m_readable, m_ready;
+    bool m_stop;
+    std::vector<std::thread> m_threads;
+};
+
+/* Runs tasks on a thread of its own, one at a time in the order they were
+ * submitted */
+class AsyncWriter {
+public:
+    typedef std::function<void()> task_t;
+
+    /* submit() waits while limit tasks are queued */
+    explicit AsyncWriter(size_t limit);
+
+    /* Runs all tasks which are still queued before returning */
+    ~AsyncWriter();
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    /* Tasks must not throw */
+    void submit(task_t task);
+
+private:
+    void run();
+
+    std::deque<task_t> m_tasks;
+    size_t m_limit;
+
+    std::mutex m_lock;
+    std::condition_variable m_wake, m_space;
+    bool m_stop;
+    std::thread m_thread;
+};
+
+#endif
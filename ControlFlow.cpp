@@ -0,0 +1,293 @@
+#include "ControlFlow.h"
+#include "bytecode.h"
+#include <algorithm>
+
+PycControlFlow::PycControlFlow(PycRef<PycCode> code, PycModule* mod)
+{
+    const PycCode::instructions_t& insns = code->instructions(mod);
+    int size = code->code()->length();
+    if (!insns.empty())
+        size = std::max(size, insns.back().offset + insns.back().length);
+
+    findBlocks(insns, code, mod, size);
+    link(insns, code, mod);
+    findDominators();
+    findLoops();
+}
+
+/* The last instruction which isn't an inline cache entry */
+static size_t last_real(const PycCode::instructions_t& insns, size_t first, size_t last)
+{
+    while (last - 1 > first && insns[last - 1].opcode == Pyc::CACHE)
+        --last;
+    return last - 1;
+}
+
+void PycControlFlow::findBlocks(const PycCode::instructions_t& insns, PycRef<PycCode> code,
+                                PycModule* mod, int size)
+{
+    const size_t count = insns.size();
+    std::vector<int> insn_at(size + 1, -1);
+    for (size_t i = 0; i < count; ++i)
+        insn_at[insns[i].offset] = (int)i;
+    if (count == 0)
+        return;
+
+    std::vector<bool> leader(count + 1, false);
+    auto mark = [&](int offset) {
+        if (offset >= 0 && offset <= size && insn_at[offset] >= 0)
+            leader[insn_at[offset]] = true;
+    };
+    leader[0] = true;
+
+    // Relative jumps count from past the inline caches, where the next
+    // block starts as well
+    m_targets.assign(count, -1);
+    int next_real = size;
+    for (size_t i = count; i-- > 0; ) {
+        const PycInstruction& insn = insns[i];
+        if (insn.opcode == Pyc::CACHE)
+            continue;
+        int target = bc_jump_target(mod, insn.opcode, insn.operand, next_real);
+        if (target >= 0 && target < size && insn_at[target] >= 0)
+            m_targets[i] = target;
+        if (Pyc::FlowKindOf(insn.opcode) != Pyc::FLOW_NEXT) {
+            mark(next_real);
+            mark(m_targets[i]);
+        }
+        next_real = insn.offset;
+    }
+    for (const auto& entry : code->exceptionEntries()) {
+        mark(entry.start);
+        mark(entry.end);
+        mark(entry.target);
+    }
+
+    Block block = Block();
+    for (size_t i = 0; i < count; ++i) {
+        if (i != 0 && leader[i]) {
+            block.last = i;
+            block.end = insns[i].offset;
+            m_blocks.push_back(block);
+        }
+        if (i == 0 || leader[i]) {
+            block = Block();
+            block.first = i;
+            block.start = insns[i].offset;
+            block.idom = block.loop = -1;
+        }
+    }
+    block.last = count;
+    block.end = size;
+    m_blocks.push_back(block);
+
+    m_blockAt.assign(size, -1);
+    for (size_t b = 0; b < m_blocks.size(); ++b) {
+        for (int offset = m_blocks[b].start; offset < m_blocks[b].end; ++offset)
+            m_blockAt[offset] = (int)b;
+    }
+}
+
+void PycControlFlow::link(const PycCode::instructions_t& insns, PycRef<PycCode> code,
+                          PycModule* mod)
+{
+    // Before 3.11, the SETUP_* blocks nest in the order of the bytecode, so
+    // the innermost one at the start of a block is where its exceptions go
+    struct Setup {
+        bool loop;
+        int target;
+    };
+    std::vector<Setup> setups;
+    const bool table = mod->has(PycModule::CAP_EXCEPTION_TABLE);
+
+    for (size_t b = 0; b < m_blocks.size(); ++b) {
+        Block& block = m_blocks[b];
+        auto add = [](std::vector<int>& edges, int target) {
+            if (target >= 0 && std::find(edges.begin(), edges.end(), target) == edges.end())
+                edges.push_back(target);
+        };
+
+        if (table) {
+            if (const PycExceptionEntry* entry = code->handlerAt(block.start))
+                add(block.handlers, blockAt(entry->target));
+        } else {
+            for (size_t s = setups.size(); s-- > 0; ) {
+                if (!setups[s].loop) {
+                    add(block.handlers, blockAt(setups[s].target));
+                    break;
+                }
+            }
+        }
+
+        int fall_through = (b + 1 < m_blocks.size()) ? (int)b + 1 : -1;
+        for (size_t i = block.first; i < block.last; ++i) {
+            const int opcode = insns[i].opcode;
+            if (opcode == Pyc::SETUP_LOOP_A) {
+                setups.push_back({ true, m_targets[i] });
+            } else if (Pyc::FlowKindOf(opcode) == Pyc::FLOW_SETUP) {
+                setups.push_back({ false, m_targets[i] });
+            } else if (opcode == Pyc::POP_BLOCK && !setups.empty()) {
+                setups.pop_back();
+            }
+        }
+
+        size_t last = last_real(insns, block.first, block.last);
+        switch (Pyc::FlowKindOf(insns[last].opcode)) {
+        case Pyc::FLOW_NEXT:
+        case Pyc::FLOW_SETUP:
+            add(block.succs, fall_through);
+            break;
+        case Pyc::FLOW_JUMP:
+            add(block.succs, blockAt(m_targets[last]));
+            break;
+        case Pyc::FLOW_BRANCH:
+            add(block.succs, fall_through);
+            add(block.succs, blockAt(m_targets[last]));
+            break;
+        case Pyc::FLOW_BREAK:
+            for (size_t s = setups.size(); s-- > 0; ) {
+                if (setups[s].loop) {
+                    add(block.succs, blockAt(setups[s].target));
+                    break;
+                }
+            }
+            break;
+        case Pyc::FLOW_EXIT:
+            break;
+        }
+    }
+
+    for (size_t b = 0; b < m_blocks.size(); ++b) {
+        for (int succ : m_blocks[b].succs)
+            m_blocks[succ].preds.push_back((int)b);
+        for (int handler : m_blocks[b].handlers) {
+            if (std::find(m_blocks[b].succs.begin(), m_blocks[b].succs.end(), handler)
+                    == m_blocks[b].succs.end())
+                m_blocks[handler].preds.push_back((int)b);
+        }
+    }
+}
+
+void PycControlFlow::findDominators()
+{
+    if (m_blocks.empty())
+        return;
+
+    // Depth first, for the postorder the dominator iteration relies on
+    std::vector<int> postorder_index(m_blocks.size(), -1);
+    std::vector<std::pair<int, size_t>> pending(1, std::make_pair(0, (size_t)0));
+    std::vector<int> postorder;
+    m_blocks[0].reachable = true;
+    while (!pending.empty()) {
+        int b = pending.back().first;
+        size_t edge = pending.back().second++;
+        const Block& block = m_blocks[b];
+        size_t edges = block.succs.size() + block.handlers.size();
+        if (edge < edges) {
+            int next = (edge < block.succs.size()) ? block.succs[edge]
+                     : block.handlers[edge - block.succs.size()];
+            if (!m_blocks[next].reachable) {
+                m_blocks[next].reachable = true;
+                pending.push_back(std::make_pair(next, (size_t)0));
+            }
+        } else {
+            postorder_index[b] = (int)postorder.size();
+            postorder.push_back(b);
+            pending.pop_back();
+        }
+    }
+    m_order.assign(postorder.rbegin(), postorder.rend());
+
+    // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+    std::vector<int> idom(m_blocks.size(), -1);
+    idom[0] = 0;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (postorder_index[a] < postorder_index[b])
+                a = idom[a];
+            while (postorder_index[b] < postorder_index[a])
+                b = idom[b];
+        }
+        return a;
+    };
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (int b : m_order) {
+            if (b == 0)
+                continue;
+            int new_idom = -1;
+            for (int pred : m_blocks[b].preds) {
+                if (idom[pred] < 0)
+                    continue;
+                new_idom = (new_idom < 0) ? pred : intersect(pred, new_idom);
+            }
+            if (new_idom != idom[b]) {
+                idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    for (size_t b = 1; b < m_blocks.size(); ++b)
+        m_blocks[b].idom = idom[b];
+}
+
+bool PycControlFlow::dominates(int a, int b) const
+{
+    if (!m_blocks[b].reachable)
+        return false;
+    for ( ; b >= 0; b = m_blocks[b].idom) {
+        if (b == a)
+            return true;
+    }
+    return false;
+}
+
+void PycControlFlow::findLoops()
+{
+    // A jump back to a block which dominates the jump closes a loop, made
+    // of the blocks which reach the jump without passing the header
+    std::vector<std::vector<int>> latches(m_blocks.size());
+    std::vector<int> headers;
+    for (int b : m_order) {
+        for (int header : m_blocks[b].succs) {
+            if (!dominates(header, b))
+                continue;
+            if (latches[header].empty())
+                headers.push_back(header);
+            latches[header].push_back(b);
+        }
+    }
+
+    std::vector<std::vector<int>> bodies;
+    std::vector<int> seen(m_blocks.size(), -1);
+    for (int header : headers) {
+        std::vector<int> body(1, header);
+        seen[header] = header;
+        std::vector<int> pending(latches[header]);
+        while (!pending.empty()) {
+            int member = pending.back();
+            pending.pop_back();
+            if (seen[member] == header)
+                continue;
+            seen[member] = header;
+            body.push_back(member);
+            for (int pred : m_blocks[member].preds) {
+                if (m_blocks[pred].reachable)
+                    pending.push_back(pred);
+            }
+        }
+        bodies.push_back(std::move(body));
+    }
+
+    // Outer loops first, so the innermost header is left in each block
+    std::stable_sort(bodies.begin(), bodies.end(),
+                     [](const std::vector<int>& a, const std::vector<int>& b) {
+                         return a.size() > b.size();
+                     });
+    for (const auto& body : bodies) {
+        for (int member : body) {
+            m_blocks[member].loop = body.front();
+            ++m_blocks[member].loopDepth;
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef _PYC_CONTROLFLOW_H
+#define _PYC_CONTROLFLOW_H
+
+#include "pyc_code.h"
+#include <vector>
+
+/* The basic blocks of a code object and the control flow between them,
+ * with dominators and natural loops.  It is built from the decoded
+ * instructions in one pass plus the dominator iteration, and answers
+ * lookups by offset in constant time, so passes over the same code
+ * object can share one instead of each scanning the bytecode. */
+class PycControlFlow {
+public:
+    struct Block {
+        size_t first, last;         // Instruction indices; last is exclusive
+        int start, end;             // Byte offsets; end is exclusive
+        std::vector<int> succs;     // The fall through successor comes first
+        std::vector<int> handlers;  // Where exceptions raised in here go
+        std::vector<int> preds;     // Including the blocks it handles
+        int idom;                   // Immediate dominator, -1 for the entry
+                                    // and unreachable blocks
+        int loop;                   // Header of the innermost loop, or -1
+        int loopDepth;              // Number of loops it is part of
+        bool reachable;
+    };
+
+    PycControlFlow(PycRef<PycCode> code, PycModule* mod);
+
+    const std::vector<Block>& blocks() const { return m_blocks; }
+
+    /* The block with the instruction at offset, or -1 if it is outside the
+     * code */
+    int blockAt(int offset) const
+    {
+        return (offset >= 0 && (size_t)offset < m_blockAt.size()) ? m_blockAt[offset] : -1;
+    }
+
+    /* Where the instruction with this index jumps to, or -1 */
+    int jumpTarget(size_t insn) const { return m_targets[insn]; }
+
+    /* Whether every path from the entry to b passes through a */
+    bool dominates(int a, int b) const;
+
+    bool isLoopHeader(int block) const { return m_blocks[block].loop == block; }
+
+private:
+    void findBlocks(const PycCode::instructions_t& insns, PycRef<PycCode> code,
+                    PycModule* mod, int size);
+    void link(const PycCode::instructions_t& insns, PycRef<PycCode> code,
+              PycModule* mod);
+    void findDominators();
+    void findLoops();
+
+    std::vector<Block> m_blocks;
+    std::vector<int> m_blockAt;     // By byte offset
+    std::vector<int> m_targets;     // By instruction index
+    std::vector<int> m_order;       // Reachable blocks in reverse postorder
+};
+
+#endif
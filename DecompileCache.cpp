@@ -0,0 +1,269 @@
+#include "DecompileCache.h"
+#include "InputFiles.h"
+#include "pyc_numeric.h"
+#include "pyc_sequence.h"
+#include "pyc_string.h"
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+/* Two independent 64-bit hashes of the same bytes, FNV-1a and a
+ * multiply-rotate one, for a combined 128-bit key */
+class KeyHasher {
+public:
+    KeyHasher() : m_fnv(14695981039346656037ULL), m_mix(0x243F6A8885A308D3ULL) { }
+
+    void bytes(const void* data, size_t length)
+    {
+        auto cp = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < length; ++i) {
+            m_fnv = (m_fnv ^ cp[i]) * 1099511628211ULL;
+            m_mix = (m_mix ^ cp[i]) * 0x9E3779B97F4A7C15ULL;
+            m_mix = (m_mix << 31) | (m_mix >> 33);
+        }
+    }
+
+    void number(long long value) { bytes(&value, sizeof(value)); }
+
+    /* Length-prefixed, so consecutive strings can't run into each other */
+    void string(const char* data, size_t length)
+    {
+        number((long long)length);
+        bytes(data, length);
+    }
+
+    CodeHasher::Hash finish() const { return { m_fnv, m_mix }; }
+
+private:
+    uint64_t m_fnv, m_mix;
+};
+
+std::string CodeHasher::Hash::hex() const
+{
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)hi,
+             (unsigned long long)lo);
+    return buf;
+}
+
+CodeHasher::Hash CodeHasher::hash(PycCode* code, PycModule* mod)
+{
+    auto iter = m_hashes.find(code);
+    if (iter != m_hashes.end())
+        return iter->second;
+
+    // Iterative over the nested code objects, so each is hashed once
+    // and deep nesting can't overflow the stack
+    std::vector<PycCode*> pending(1, code);
+    while (!pending.empty()) {
+        PycCode* current = pending.back();
+        bool ready = true;
+        auto consts = current->consts();
+        for (int i = 0; i < consts->size(); ++i) {
+            PycCode* child = consts->get(i).try_cast<PycCode>();
+            if (child && m_hashes.find(child) == m_hashes.end()) {
+                pending.push_back(child);
+                ready = false;
+            }
+        }
+        if (!ready)
+            continue;
+        pending.pop_back();
+        if (m_hashes.find(current) != m_hashes.end())
+            continue;
+
+        KeyHasher hasher;
+        hashFields(hasher, current, mod, false);
+        m_hashes[current] = hasher.finish();
+    }
+    return m_hashes[code];
+}
+
+CodeHasher::Hash CodeHasher::ownHash(PycCode* code, PycModule* mod)
+{
+    // The lambdas and such which are hashed in full need their hashes
+    auto consts = code->consts();
+    for (int i = 0; i < consts->size(); ++i) {
+        PycCode* child = consts->get(i).try_cast<PycCode>();
+        if (child && child->name()->startsWith("<"))
+            hash(child, mod);
+    }
+    KeyHasher hasher;
+    hashFields(hasher, code, mod, true);
+    return hasher.finish();
+}
+
+void CodeHasher::hashFields(KeyHasher& hasher, PycCode* code, PycModule* mod, bool own)
+{
+    hasher.number(mod->majorVer());
+    hasher.number(mod->minorVer());
+    hasher.number(mod->isUnicode());
+    hasher.number(code->argCount());
+    hasher.number(code->posOnlyArgCount());
+    hasher.number(code->kwOnlyArgCount());
+    hasher.number(code->numLocals());
+    hasher.number(code->stackSize());
+    hasher.number(code->flags());
+    PycObject* fields[] = {
+        code->code(), code->consts(), code->names(), code->localNames(),
+        code->localKinds(), code->freeVars(), code->cellVars(),
+        code->name(), code->qualName(), code->exceptTable(),
+    };
+    for (PycObject* field : fields)
+        hashObject(hasher, field, own);
+    if (m_lineNumbers) {
+        hasher.number(code->firstLine());
+        hashObject(hasher, code->lnTable(), own);
+    }
+}
+
+void CodeHasher::hashObject(KeyHasher& hasher, PycObject* obj, bool own)
+{
+    if (!obj) {
+        hasher.number(-1);
+        return;
+    }
+    hasher.number(obj->type());
+    if (auto str = pyc_dyn_cast<PycString>(obj)) {
+        hasher.string(str->data(), str->length());
+    } else if (auto code = pyc_dyn_cast<PycCode>(obj)) {
+        if (own && !code->name()->startsWith("<")) {
+            hasher.string(code->name()->data(), code->name()->length());
+        } else {
+            // Nested code objects are hashed before the code containing them
+            Hash key = m_hashes[code];
+            hasher.bytes(&key, sizeof(key));
+        }
+    } else if (auto seq = pyc_dyn_cast<PycSimpleSequence>(obj)) {
+        hasher.number(seq->size());
+        for (const auto& item : seq->values())
+            hashObject(hasher, item, own);
+    } else if (auto dict = pyc_dyn_cast<PycDict>(obj)) {
+        hasher.number((long long)dict->values().size());
+        for (const auto& item : dict->values()) {
+            hashObject(hasher, std::get<0>(item), own);
+            hashObject(hasher, std::get<1>(item), own);
+        }
+    } else if (auto num = pyc_dyn_cast<PycInt>(obj)) {
+        hasher.number(num->value());
+    } else if (auto num = pyc_dyn_cast<PycLong>(obj)) {
+        hasher.number(num->size());
+        hasher.bytes(num->value().data(), num->value().size() * sizeof(uint16_t));
+    } else if (auto num = pyc_dyn_cast<PycComplex>(obj)) {
+        hasher.string(num->value(), strlen(num->value()));
+        hasher.string(num->imag(), strlen(num->imag()));
+    } else if (auto num = pyc_dyn_cast<PycFloat>(obj)) {
+        hasher.string(num->value(), strlen(num->value()));
+    } else if (auto num = pyc_dyn_cast<PycCComplex>(obj)) {
+        double parts[] = { num->value(), num->imag() };
+        hasher.bytes(parts, sizeof(parts));
+    } else if (auto num = pyc_dyn_cast<PycCFloat>(obj)) {
+        double value = num->value();
+        hasher.bytes(&value, sizeof(value));
+    }
+    // The singletons are identified by their type
+}
+
+DecompileCache::Key DecompileCache::key(PycCode* code, PycModule* mod, const std::string& state)
+{
+    Key code_key = m_hasher.hash(code, mod);
+    KeyHasher hasher;
+    hasher.bytes(&code_key, sizeof(code_key));
+    hasher.string(state.data(), state.size());
+    return hasher.finish();
+}
+
+std::string DecompileCache::path(const Key& key) const
+{
+    std::string hex = key.hex();
+    return m_dir + PATHSEP + hex.substr(0, 2) + PATHSEP + hex.substr(2) + ".py";
+}
+
+/* Entries start with a line of "pycdc-cache 2 <result> <clean>" */
+static const char CACHE_MAGIC[] = "pycdc-cache 2 ";
+
+bool ResidentCache::lookup(const CodeHasher::Hash& key, std::string& text, bool& result,
+                           bool& clean) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto found = m_entries.find(key);
+    if (found == m_entries.end())
+        return false;
+    text = found->second.text;
+    result = found->second.result;
+    clean = found->second.clean;
+    return true;
+}
+
+void ResidentCache::store(const CodeHasher::Hash& key, const std::string& text, bool result,
+                          bool clean)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto found = m_entries.find(key);
+    if (found != m_entries.end()) {
+        m_size -= found->second.text.size();
+        m_entries.erase(found);
+    }
+    if (m_size + text.size() > m_limit) {
+        m_entries.clear();
+        m_size = 0;
+    }
+    m_entries[key] = Entry { text, result, clean };
+    m_size += text.size();
+}
+
+bool DecompileCache::lookup(const Key& key, std::string& text, bool& result, bool& clean) const
+{
+    if (m_resident && m_resident->lookup(key, text, result, clean))
+        return true;
+    if (m_dir.empty())
+        return false;
+
+    std::ifstream in(path(key), std::ios_base::in | std::ios_base::binary);
+    if (!in)
+        return false;
+    std::string header;
+    if (!std::getline(in, header) || header.size() != sizeof(CACHE_MAGIC) + 2
+            || header.compare(0, sizeof(CACHE_MAGIC) - 1, CACHE_MAGIC) != 0)
+        return false;
+    result = header[sizeof(CACHE_MAGIC) - 1] == '1';
+    clean = header[sizeof(CACHE_MAGIC) + 1] == '1';
+
+    std::ostringstream body;
+    body << in.rdbuf();
+    text = body.str();
+    if (m_resident)
+        m_resident->store(key, text, result, clean);
+    return true;
+}
+
+void DecompileCache::store(const Key& key, const std::string& text, bool result, bool clean) const
+{
+    if (m_resident)
+        m_resident->store(key, text, result, clean);
+    if (m_dir.empty())
+        return;
+
+    // Written next to the entry and renamed into place, so concurrent runs
+    // sharing the cache never see partial entries
+    std::string entry = path(key);
+    if (!make_parent_dirs(entry))
+        return;
+    std::string temp = entry + ".tmp" + std::to_string(std::random_device()());
+    {
+        std::ofstream out(temp, std::ios_base::out | std::ios_base::binary);
+        if (!out)
+            return;
+        out << CACHE_MAGIC << (result ? '1' : '0') << ' ' << (clean ? '1' : '0') << '\n';
+        out << text;
+        if (!out) {
+            out.close();
+            remove(temp.c_str());
+            return;
+        }
+    }
+    if (rename(temp.c_str(), entry.c_str()) != 0)
+        remove(temp.c_str());
+}
@@ -0,0 +1,124 @@
+#ifndef _PYC_DECOMPILECACHE_H
+#define _PYC_DECOMPILECACHE_H
+
+#include "pyc_module.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class KeyHasher;
+
+/* Hashes code objects by everything their printed source depends on: the
+ * Python version, the code object's bytecode, constants (including nested
+ * code objects) and names.  Line numbers and the file name are left out,
+ * so moving a function doesn't change its hash, unless the output has the
+ * line numbers in it.  The hash of each code object is remembered until
+ * forget(). */
+class CodeHasher {
+public:
+    CodeHasher() : m_lineNumbers() { }
+
+    struct Hash {
+        uint64_t hi, lo;
+
+        bool operator==(const Hash& other) const { return hi == other.hi && lo == other.lo; }
+        bool operator!=(const Hash& other) const { return !(*this == other); }
+        std::string hex() const;
+    };
+
+    Hash hash(PycCode* code, PycModule* mod);
+
+    /* The same, except that nested functions and classes only count by
+     * their name, so only changes to the code itself change it.  Lambdas,
+     * comprehensions and the like are still hashed in full, as they are
+     * printed as part of the code.  This one isn't remembered. */
+    Hash ownHash(PycCode* code, PycModule* mod);
+
+    /* Forgets the hashes remembered for code objects, some of which may be
+     * about to be freed */
+    void forget() { m_hashes.clear(); }
+
+    /* Whether to hash the line numbers too, as for --line-markers */
+    void setLineNumbers(bool lineNumbers)
+    {
+        if (lineNumbers != m_lineNumbers)
+            m_hashes.clear();
+        m_lineNumbers = lineNumbers;
+    }
+
+private:
+    void hashFields(KeyHasher& hasher, PycCode* code, PycModule* mod, bool own);
+    void hashObject(KeyHasher& hasher, PycObject* obj, bool own);
+
+    std::unordered_map<PycCode*, Hash> m_hashes;
+    bool m_lineNumbers;
+};
+
+/* Keeps DecompileCache entries in memory, for a process which decompiles
+ * the same modules over and over (pycdc --watch), so the code objects which
+ * didn't change since are printed without going to disk.  It's shared by
+ * the caches of every thread.  Once its entries add up to more than limit
+ * bytes, it drops them all and starts over. */
+class ResidentCache {
+public:
+    explicit ResidentCache(size_t limit) : m_limit(limit), m_size(0) { }
+
+    bool lookup(const CodeHasher::Hash& key, std::string& text, bool& result,
+                bool& clean) const;
+    void store(const CodeHasher::Hash& key, const std::string& text, bool result, bool clean);
+
+private:
+    struct Entry {
+        std::string text;
+        bool result, clean;
+    };
+
+    struct KeyHash {
+        size_t operator()(const CodeHasher::Hash& key) const { return (size_t)(key.hi ^ key.lo); }
+    };
+
+    size_t m_limit, m_size;
+    mutable std::mutex m_lock;  // Guards the rest
+    std::unordered_map<CodeHasher::Hash, Entry, KeyHash> m_entries;
+};
+
+/* An on-disk cache of the source printed for single code objects, keyed on
+ * the CodeHasher hash of the code object and the printing state it's
+ * printed in, so moving a function doesn't invalidate it.  Entries are
+ * trusted as they are; don't share a cache directory with untrusted users.
+ * With a resident cache, entries are looked up there first and kept there
+ * too; with an empty dir, they are only kept there.
+ *
+ * One cache serves one module at a time, from a single thread. */
+class DecompileCache {
+public:
+    typedef CodeHasher::Hash Key;
+
+    explicit DecompileCache(std::string dir, ResidentCache* resident = nullptr)
+        : m_dir(std::move(dir)), m_resident(resident) { }
+
+    /* state covers the parts of the printing state which the output
+     * depends on */
+    Key key(PycCode* code, PycModule* mod, const std::string& state);
+
+    bool lookup(const Key& key, std::string& text, bool& result, bool& clean) const;
+    void store(const Key& key, const std::string& text, bool result, bool clean) const;
+
+    /* Forgets the hashes remembered for code objects, some of which may be
+     * about to be freed */
+    void forgetHashes() { m_hasher.forget(); }
+
+    /* Key the source on the line numbers of the code too, for output which
+     * has them in it */
+    void setLineNumbers(bool lineNumbers) { m_hasher.setLineNumbers(lineNumbers); }
+
+private:
+    std::string path(const Key& key) const;
+
+    std::string m_dir;
+    ResidentCache* m_resident;
+    CodeHasher m_hasher;
+};
+
+#endif
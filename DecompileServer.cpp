@@ -0,0 +1,321 @@
+#include "DecompileServer.h"
+#include "DecompileCache.h"
+#include "Decompiler.h"
+#include "InputFiles.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <sstream>
+
+#ifdef PYC_HAVE_UNIX_SOCKETS
+#  include <csignal>
+#  include <sys/socket.h>
+#  include <sys/stat.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+#endif
+
+/* Longest accepted header line and payload */
+static const size_t MAX_HEADER = 1024;
+static const size_t MAX_PAYLOAD = (size_t)1 << 30;
+
+/* Requests read ahead of being handled, for each thread */
+static const size_t IN_FLIGHT_PER_THREAD = 2;
+
+/* Guards writing requests' diagnostics to stderr */
+static std::mutex s_stderrLock;
+
+struct DecompileServer::Session {
+    explicit Session(FILE* out_) : out(out_), outstanding(0) { }
+
+    FILE* out;
+    std::mutex lock;        // Guards writing to out and outstanding
+    std::condition_variable idle;
+    size_t outstanding;
+
+    void respond(const std::string& id, const char* status, const std::string& payload)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        fprintf(out, "%s %s %u\n", id.c_str(), status, (unsigned)payload.size());
+        fwrite(payload.data(), 1, payload.size(), out);
+        fflush(out);
+    }
+};
+
+DecompileServer::DecompileServer(unsigned jobs, const char* cacheDir)
+    : m_pool(jobs), m_cacheDir(cacheDir), m_inFlight(0),
+      m_maxInFlight(std::max(m_pool.size(), 1u) * IN_FLIGHT_PER_THREAD)
+{
+}
+
+/* Waits until another request may be read */
+void DecompileServer::reserve()
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (m_inFlight >= m_maxInFlight)
+        m_room.wait(guard);
+    ++m_inFlight;
+}
+
+void DecompileServer::release()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        --m_inFlight;
+    }
+    m_room.notify_one();
+}
+
+static bool read_header(FILE* in, std::string& line)
+{
+    line.clear();
+    int ch;
+    while ((ch = getc(in)) != EOF && ch != '\n') {
+        if (line.size() == MAX_HEADER)
+            return false;
+        line += (char)ch;
+    }
+    return ch == '\n';
+}
+
+/* Grows the payload as its data arrives, so a header alone can't make the
+ * server allocate much */
+static bool read_payload(FILE* in, size_t length, std::vector<unsigned char>& payload)
+{
+    static const size_t CHUNK = 64 << 10;
+    while (payload.size() < length) {
+        size_t have = payload.size();
+        size_t want = std::min(length - have, std::max(CHUNK, have));
+        payload.resize(have + want);
+        if (fread(&payload[have], 1, want, in) != want)
+            return false;
+    }
+    return true;
+}
+
+bool DecompileServer::serve(FILE* in, FILE* out)
+{
+    Session session(out);
+    bool valid = true;
+    std::string line;
+    for ( ;; ) {
+        // Clients which send more than they wait for are held up here
+        reserve();
+        if (!read_header(in, line)) {
+            release();
+            break;
+        }
+        std::istringstream fields(line);
+        std::string id, command, extra;
+        unsigned long long length = 0;
+        if (!(fields >> id >> command >> length) || (fields >> extra)
+                || length > MAX_PAYLOAD) {
+            fprintf(stderr, "Malformed request header: %s\n", line.c_str());
+            release();
+            valid = false;
+            break;
+        }
+        std::vector<unsigned char> payload;
+        if (!read_payload(in, (size_t)length, payload)) {
+            fprintf(stderr, "Request %s ends early\n", id.c_str());
+            release();
+            valid = false;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(session.lock);
+            ++session.outstanding;
+        }
+        // The task takes the payload over; the session outlives it, since
+        // it's only left once nothing is outstanding any more
+        auto request = std::make_shared<std::vector<unsigned char>>(std::move(payload));
+        Session* target = &session;
+        m_pool.submit([this, target, id, command, request]() {
+            handle(*target, id, command, std::move(*request));
+            release();
+            std::lock_guard<std::mutex> guard(target->lock);
+            if (--target->outstanding == 0)
+                target->idle.notify_all();
+        });
+    }
+    if (valid && (!feof(in) || !line.empty())) {
+        fputs("Malformed or truncated request header\n", stderr);
+        valid = false;
+    }
+
+    std::unique_lock<std::mutex> guard(session.lock);
+    while (session.outstanding != 0)
+        session.idle.wait(guard);
+    return valid;
+}
+
+/* Writes what was collected for the request at once, so it can't be mixed
+ * up with what other requests write */
+static void write_diagnostics(const std::string& id, const std::string& text)
+{
+    std::string prefixed;
+    for (size_t from = 0; from < text.size(); ) {
+        size_t end = text.find('\n', from);
+        end = (end == std::string::npos) ? text.size() : end + 1;
+        prefixed += id + ": ";
+        prefixed.append(text, from, end - from);
+        from = end;
+    }
+    if (prefixed.back() != '\n')
+        prefixed += '\n';
+    std::lock_guard<std::mutex> guard(s_stderrLock);
+    fwrite(prefixed.data(), 1, prefixed.size(), stderr);
+    fflush(stderr);
+}
+
+void DecompileServer::handle(Session& session, std::string id, std::string command,
+                             std::vector<unsigned char> payload)
+{
+    std::string response;
+    const char* status;
+    {
+        DiagnosticsBuffer diagnostics;
+        status = handleRequest(command, std::move(payload), response);
+        if (!diagnostics.text().empty())
+            write_diagnostics(id, diagnostics.text());
+    }
+    session.respond(id, status, response);
+}
+
+/* Returns the status to respond with, and sets response to the payload */
+const char* DecompileServer::handleRequest(const std::string& command,
+                                           std::vector<unsigned char> payload,
+                                           std::string& response)
+{
+    bool disasm = false;
+    bool from_data = false;
+    if (command == "decompile") {
+    } else if (command == "decompile-data") {
+        from_data = true;
+    } else if (command == "disasm") {
+        disasm = true;
+    } else if (command == "disasm-data") {
+        disasm = from_data = true;
+    } else {
+        response = "Unknown command " + command;
+        return "error";
+    }
+
+    std::string path, dispname = "<data>";
+    if (!from_data) {
+        path.assign(payload.begin(), payload.end());
+        size_t sep = path.rfind(PATHSEP);
+        dispname = (sep == std::string::npos) ? path : path.substr(sep + 1);
+    }
+
+    DecompileStatus status;
+    std::ostringstream source;
+    try {
+        PycOutput pyc_output(source);
+        PycModule mod;
+        mod.useArena();
+        if (from_data)
+            mod.loadFromBuffer(std::move(payload));
+        else
+            mod.loadFromFile(path.c_str());
+        if (!mod.isValid()) {
+            response = "Could not load " + dispname;
+            return "error";
+        }
+
+        // Requests already keep the pool busy, so nested code objects are
+        // built on this thread
+        std::unique_ptr<DecompileCache> cache;
+        if (m_cacheDir && !disasm)
+            cache.reset(new DecompileCache(m_cacheDir));
+        std::string error;
+        status = decompile_module(&mod, dispname.c_str(),
+                                  disasm ? DECOMPILE_DISASSEMBLE : 0, pyc_output,
+                                  &error, nullptr, cache.get());
+        if (status == DECOMPILE_FAILED) {
+            response = error;
+            return "error";
+        }
+    } catch (std::exception& ex) {
+        response = ex.what();
+        return "error";
+    }
+    response = source.str();
+    return status == DECOMPILE_OK ? "ok" : "incomplete";
+}
+
+#ifdef PYC_HAVE_UNIX_SOCKETS
+bool DecompileServer::listen(const char* path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier run would make bind() fail, but
+    // anything else there is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s already exists and isn't a socket\n", path);
+            return false;
+        }
+        unlink(path);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return false;
+    }
+    // Only this user may connect, as clients can read files through the
+    // server
+    mode_t saved_mask = umask(0177);
+    int bound = bind(sock, (sockaddr*)&addr, sizeof(addr));
+    umask(saved_mask);
+    if (bound != 0 || ::listen(sock, 16) != 0) {
+        fprintf(stderr, "Error listening on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    // A client going away must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    for ( ;; ) {
+        int conn = accept(sock, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            close(sock);
+            return false;
+        }
+        int conn_out = dup(conn);
+        FILE* in = fdopen(conn, "rb");
+        FILE* out = (conn_out >= 0) ? fdopen(conn_out, "wb") : nullptr;
+        if (!in || !out) {
+            perror("fdopen");
+            if (in)
+                fclose(in);
+            else
+                close(conn);
+            if (out)
+                fclose(out);
+            else if (conn_out >= 0)
+                close(conn_out);
+            continue;
+        }
+        std::thread([this, in, out]() {
+            serve(in, out);
+            fclose(in);
+            fclose(out);
+        }).detach();
+    }
+}
+#endif
@@ -0,0 +1,80 @@
+#ifndef _PYC_DECOMPILESERVER_H
+#define _PYC_DECOMPILESERVER_H
+
+#include "ThreadPool.h"
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define PYC_HAVE_UNIX_SOCKETS
+#endif
+
+/* Serves decompile and disassemble requests over a stream, so that one
+ * long-running process can handle many of them.  Every request and response
+ * is a header line followed by a payload of exactly the given length:
+ *
+ *   request:   <id> <command> <length>\n<payload>
+ *   response:  <id> <status> <length>\n<payload>
+ *
+ * <id> is any word, which is echoed back: requests are handled concurrently
+ * and answered as they finish, not necessarily in order.  The commands are
+ *
+ *   decompile       the payload is the path of a .pyc file
+ *   decompile-data  the payload is the contents of a .pyc file
+ *   disasm          like decompile, but writes the disassembly instead
+ *   disasm-data
+ *
+ * <status> is "ok", "incomplete" if some of the code couldn't be decompiled
+ * (the payload is the source nonetheless), or "error", in which case the
+ * payload is the error message.  A malformed request header ends the
+ * session, since there's no telling where the next request would start.
+ * Payloads of up to 1 GiB are accepted, and only take memory as their data
+ * arrives.  Once two requests per thread are waiting or being handled,
+ * across all sessions, no more are read until some of them are answered.
+ * Messages about a request's input go to stderr, each line prefixed with
+ * its id.
+ *
+ * The server reads any file a client names, with its own permissions, and
+ * sends back what's in it, so clients need to be trusted with everything the
+ * server's user can read.  That's why the Unix socket listen() creates is
+ * only accessible to that user. */
+class DecompileServer {
+public:
+    /* Requests are handled on jobs threads, shared by all sessions */
+    DecompileServer(unsigned jobs, const char* cacheDir);
+
+    /* Serves requests read from in until its end, and returns once all of
+     * them are answered.  Returns false if the input was malformed. */
+    bool serve(FILE* in, FILE* out);
+
+#ifdef PYC_HAVE_UNIX_SOCKETS
+    /* Serves every connection made to a Unix socket at path as a session
+     * of its own.  The socket is created with mode 0600, replacing one left
+     * at path by an earlier run, but nothing else.  Only returns if it can't
+     * be set up. */
+    bool listen(const char* path);
+#endif
+
+private:
+    struct Session;
+
+    void handle(Session& session, std::string id, std::string command,
+                std::vector<unsigned char> payload);
+    const char* handleRequest(const std::string& command, std::vector<unsigned char> payload,
+                              std::string& response);
+    void reserve();
+    void release();
+
+    ThreadPool m_pool;
+    const char* m_cacheDir;
+
+    std::mutex m_lock;      // Guards m_inFlight
+    std::condition_variable m_room;
+    size_t m_inFlight;
+    size_t m_maxInFlight;
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "Decompiler.h"
+#include "ASTree.h"
+#include "Disassembler.h"
+
+void print_source_header(PycModule* mod, const char* dispname, PycOutput& out)
+{
+    out << "# Source Generated with Decompyle++\n";
+    formatted_print(out, "# File: %s (Python %d.%d%s)\n\n", dispname,
+                    mod->majorVer(), mod->minorVer(),
+                    (mod->majorVer() < 3 && mod->isUnicode()) ? " Unicode" : "");
+}
+
+DecompileStatus decompile_module(PycModule* mod, const char* dispname, unsigned flags,
+                                 PycOutput& out, std::string* error, ThreadPool* pool,
+                                 DecompileCache* cache)
+{
+    try {
+        if (flags & DECOMPILE_DISASSEMBLE) {
+            disassemble_module(mod, dispname, 0, out);
+            return DECOMPILE_OK;
+        }
+        print_source_header(mod, dispname, out);
+        DecompileSettings settings;
+        settings.pool = pool;
+        settings.cache = cache;
+        settings.stream = (flags & DECOMPILE_STREAM) != 0;
+        settings.lowMemory = (flags & DECOMPILE_LOW_MEMORY) != 0;
+        settings.lineMarkers = (flags & DECOMPILE_LINE_MARKERS) != 0;
+        return decompyle(mod->code(), mod, out, settings) ? DECOMPILE_OK : DECOMPILE_INCOMPLETE;
+    } catch (std::exception& ex) {
+        if (error)
+            *error = ex.what();
+        return DECOMPILE_FAILED;
+    }
+}
+
+DecompileStatus decompile_pyc(const void* data, size_t size, const char* dispname,
+                              unsigned flags, PycOutput& out, std::string* error)
+{
+    PycModule mod;
+    if (flags & DECOMPILE_LOW_MEMORY)
+        mod.setLazyLoading(true);
+    else
+        mod.useArena();
+    try {
+        mod.loadFromBuffer(data, size);
+    } catch (std::exception& ex) {
+        if (error)
+            *error = ex.what();
+        return DECOMPILE_FAILED;
+    }
+    if (!mod.isValid()) {
+        if (error)
+            *error = "Bad magic number or unsupported Python version";
+        return DECOMPILE_FAILED;
+    }
+    return decompile_module(&mod, dispname, flags, out, error);
+}
@@ -0,0 +1,45 @@
+#ifndef _PYC_DECOMPILER_H
+#define _PYC_DECOMPILER_H
+
+#include "pyc_module.h"
+#include <string>
+
+class DecompileCache;
+class ThreadPool;
+
+/* Entry points for decompiling whole modules from a program of its own.
+ * Apart from what the loaders report about unreadable files, they report
+ * errors through the returned status and error message only. */
+
+enum DecompileStatus {
+    DECOMPILE_OK, DECOMPILE_INCOMPLETE, DECOMPILE_FAILED
+};
+
+enum DecompileFlags {
+    DECOMPILE_DISASSEMBLE = 0x1,    // Write the disassembly instead
+    DECOMPILE_STREAM = 0x2,         // Flush each top-level statement when done
+    DECOMPILE_LOW_MEMORY = 0x4,     // Free code objects once they are printed
+    DECOMPILE_LINE_MARKERS = 0x8,   // Comment each statement with its source line
+};
+
+/* Writes the comment which decompiled source starts with.  dispname is the
+ * file name to show. */
+void print_source_header(PycModule* mod, const char* dispname, PycOutput& out);
+
+/* Writes a loaded module's source (or disassembly), header included.  If
+ * it fails, the reason is stored in error, if given.  DECOMPILE_LOW_MEMORY
+ * only frees code objects if the module was loaded lazily and without an
+ * arena. */
+DecompileStatus decompile_module(PycModule* mod, const char* dispname, unsigned flags,
+                                 PycOutput& out, std::string* error = nullptr,
+                                 ThreadPool* pool = nullptr,
+                                 DecompileCache* cache = nullptr);
+
+/* Loads a .pyc image of size bytes from data and writes it like
+ * decompile_module() does.  The data is read in place, without copying
+ * it, and may be released as soon as this returns. */
+DecompileStatus decompile_pyc(const void* data, size_t size, const char* dispname,
+                              unsigned flags, PycOutput& out,
+                              std::string* error = nullptr);
+
+#endif
@@ -0,0 +1,610 @@
+#include <cstdarg>
+#include "Disassembler.h"
+#include "ControlFlow.h"
+#include "pyc_numeric.h"
+#include "bytecode.h"
+
+static const char* flag_names[] = {
+    "CO_OPTIMIZED", "CO_NEWLOCALS", "CO_VARARGS", "CO_VARKEYWORDS",
+    "CO_NESTED", "CO_GENERATOR", "CO_NOFREE", "CO_COROUTINE",
+    "CO_ITERABLE_COROUTINE", "CO_ASYNC_GENERATOR", "<0x400>", "<0x800>",
+    "CO_GENERATOR_ALLOWED", "<0x2000>", "<0x4000>", "<0x8000>",
+    "<0x10000>", "CO_FUTURE_DIVISION", "CO_FUTURE_ABSOLUTE_IMPORT", "CO_FUTURE_WITH_STATEMENT",
+    "CO_FUTURE_PRINT_FUNCTION", "CO_FUTURE_UNICODE_LITERALS", "CO_FUTURE_BARRY_AS_BDFL",
+            "CO_FUTURE_GENERATOR_STOP",
+    "CO_FUTURE_ANNOTATIONS", "CO_NO_MONITORING_EVENTS", "<0x4000000>", "<0x8000000>",
+    "<0x10000000>", "<0x20000000>", "<0x40000000>", "<0x80000000>"
+};
+
+static void print_coflags(unsigned long flags, PycOutput& pyc_output)
+{
+    if (flags == 0) {
+        pyc_output << "\n";
+        return;
+    }
+
+    pyc_output << " (";
+    unsigned long f = 1;
+    int k = 0;
+    while (k < 32) {
+        if ((flags & f) != 0) {
+            flags &= ~f;
+            if (flags == 0)
+                pyc_output << flag_names[k];
+            else
+                pyc_output << flag_names[k] << " | ";
+        }
+        ++k;
+        f <<= 1;
+    }
+    pyc_output << ")\n";
+}
+
+static void iputs(PycOutput& pyc_output, int indent, const char* text)
+{
+    for (int i=0; i<indent; i++)
+        pyc_output << "    ";
+    pyc_output << text;
+}
+
+static void ivprintf(PycOutput& pyc_output, int indent, const char* fmt,
+                     va_list varargs)
+{
+    for (int i=0; i<indent; i++)
+        pyc_output << "    ";
+    formatted_printv(pyc_output, fmt, varargs);
+}
+
+static void iprintf(PycOutput& pyc_output, int indent, const char* fmt, ...)
+{
+    va_list varargs;
+    va_start(varargs, fmt);
+    ivprintf(pyc_output, indent, fmt, varargs);
+    va_end(varargs);
+}
+
+static void print_block_list(const std::vector<int>& blocks, PycOutput& pyc_output)
+{
+    for (size_t i = 0; i < blocks.size(); ++i)
+        formatted_print(pyc_output, i ? ", %d" : "%d", blocks[i]);
+}
+
+/* One line per basic block: its offsets, where it goes, its immediate
+ * dominator and the innermost loop it's in */
+static void output_control_flow(const PycControlFlow& flow, int indent, PycOutput& pyc_output)
+{
+    const auto& blocks = flow.blocks();
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        const PycControlFlow::Block& block = blocks[b];
+        iprintf(pyc_output, indent, "%d: %d to %d", (int)b, block.start, block.end);
+        if (!block.succs.empty()) {
+            pyc_output << " -> ";
+            print_block_list(block.succs, pyc_output);
+        }
+        if (!block.handlers.empty()) {
+            pyc_output << " except ";
+            print_block_list(block.handlers, pyc_output);
+        }
+        if (!block.reachable)
+            pyc_output << " unreachable";
+        else if (block.idom >= 0)
+            formatted_print(pyc_output, " idom %d", block.idom);
+        if (flow.isLoopHeader((int)b))
+            formatted_print(pyc_output, " loop header, depth %d", block.loopDepth);
+        else if (block.loop >= 0)
+            formatted_print(pyc_output, " in loop %d, depth %d", block.loop, block.loopDepth);
+        pyc_output << "\n";
+    }
+}
+
+static unsigned int stored_flags(PycRef<PycCode> code, PycModule* mod)
+{
+    unsigned int flags = code->flags();
+    if (!mod->has(PycModule::CAP_POS_ONLY_ARGS)) {
+        // Remap flags back to the value stored in the PyCode object
+        flags = (flags & 0xFFFF) | ((flags & 0xFFF00000) >> 4);
+    }
+    return flags;
+}
+
+void output_object(PycRef<PycObject> obj, PycModule* mod, int indent,
+                   unsigned flags, PycOutput& pyc_output)
+{
+    if (obj == NULL) {
+        iputs(pyc_output, indent, "<NULL>");
+        return;
+    }
+
+    switch (obj->type()) {
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        {
+            PycRef<PycCode> codeObj = obj.cast<PycCode>();
+            iputs(pyc_output, indent, "[Code]\n");
+            iprintf(pyc_output, indent + 1, "File Name: %s\n", codeObj->fileName()->value());
+            iprintf(pyc_output, indent + 1, "Object Name: %s\n", codeObj->name()->value());
+            if (mod->has(PycModule::CAP_QUALNAME))
+                iprintf(pyc_output, indent + 1, "Qualified Name: %s\n", codeObj->qualName()->value());
+            iprintf(pyc_output, indent + 1, "Arg Count: %d\n", codeObj->argCount());
+            if (mod->has(PycModule::CAP_POS_ONLY_ARGS))
+                iprintf(pyc_output, indent + 1, "Pos Only Arg Count: %d\n", codeObj->posOnlyArgCount());
+            if (mod->has(PycModule::CAP_KW_ONLY_ARGS))
+                iprintf(pyc_output, indent + 1, "KW Only Arg Count: %d\n", codeObj->kwOnlyArgCount());
+            if (!mod->has(PycModule::CAP_LOCALSPLUS))
+                iprintf(pyc_output, indent + 1, "Locals: %d\n", codeObj->numLocals());
+            if (mod->has(PycModule::CAP_LINE_TABLE))
+                iprintf(pyc_output, indent + 1, "Stack Size: %d\n", codeObj->stackSize());
+            if (mod->has(PycModule::CAP_CODE_ARGS)) {
+                iprintf(pyc_output, indent + 1, "Flags: 0x%08X", stored_flags(codeObj, mod));
+                print_coflags(codeObj->flags(), pyc_output);
+            }
+
+            iputs(pyc_output, indent + 1, "[Names]\n");
+            for (int i=0; i<codeObj->names()->size(); i++)
+                output_object(codeObj->names()->get(i), mod, indent + 2, flags, pyc_output);
+
+            if (mod->has(PycModule::CAP_CODE_ARGS)) {
+                if (mod->has(PycModule::CAP_LOCALSPLUS))
+                    iputs(pyc_output, indent + 1, "[Locals+Names]\n");
+                else
+                    iputs(pyc_output, indent + 1, "[Var Names]\n");
+                for (int i=0; i<codeObj->localNames()->size(); i++)
+                    output_object(codeObj->localNames()->get(i), mod, indent + 2, flags, pyc_output);
+            }
+
+            if (mod->has(PycModule::CAP_LOCALSPLUS) && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
+                iputs(pyc_output, indent + 1, "[Locals+Kinds]\n");
+                output_object(codeObj->localKinds().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
+            }
+
+            if (mod->has(PycModule::CAP_CLOSURE_VARS)) {
+                iputs(pyc_output, indent + 1, "[Free Vars]\n");
+                for (int i=0; i<codeObj->freeVars()->size(); i++)
+                    output_object(codeObj->freeVars()->get(i), mod, indent + 2, flags, pyc_output);
+
+                iputs(pyc_output, indent + 1, "[Cell Vars]\n");
+                for (int i=0; i<codeObj->cellVars()->size(); i++)
+                    output_object(codeObj->cellVars()->get(i), mod, indent + 2, flags, pyc_output);
+            }
+
+            iputs(pyc_output, indent + 1, "[Constants]\n");
+            for (int i=0; i<codeObj->consts()->size(); i++)
+                output_object(codeObj->consts()->get(i), mod, indent + 2, flags, pyc_output);
+
+            iputs(pyc_output, indent + 1, "[Disassembly]\n");
+            bc_disasm(pyc_output, codeObj, mod, indent + 2, flags);
+
+            if ((flags & Pyc::DISASM_CONTROL_FLOW) != 0) {
+                iputs(pyc_output, indent + 1, "[Control Flow]\n");
+                output_control_flow(PycControlFlow(codeObj, mod), indent + 2, pyc_output);
+            }
+
+            if (mod->has(PycModule::CAP_LINE_TABLE) && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
+                iprintf(pyc_output, indent + 1, "First Line: %d\n", codeObj->firstLine());
+                iputs(pyc_output, indent + 1, "[Line Number Table]\n");
+                output_object(codeObj->lnTable().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
+            }
+
+            if (mod->has(PycModule::CAP_EXCEPTION_TABLE) && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
+                iputs(pyc_output, indent + 1, "[Exception Table]\n");
+                output_object(codeObj->exceptTable().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
+                const auto& entries = codeObj->exceptionEntries();
+                if (!entries.empty())
+                    iputs(pyc_output, indent + 1, "[Exception Handlers]\n");
+                for (const auto& entry : entries) {
+                    iprintf(pyc_output, indent + 2, "%d to %d -> %d [%d]%s\n",
+                            entry.start, entry.end, entry.target, entry.depth,
+                            entry.lasti ? " lasti" : "");
+                }
+            }
+        }
+        break;
+    case PycObject::TYPE_STRING:
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_INTERNED:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_ASCII_INTERNED:
+    case PycObject::TYPE_SHORT_ASCII:
+    case PycObject::TYPE_SHORT_ASCII_INTERNED:
+        iputs(pyc_output, indent, "");
+        obj.cast<PycString>()->print(pyc_output, mod);
+        pyc_output << "\n";
+        break;
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        {
+            iputs(pyc_output, indent, "(\n");
+            for (const auto& val : obj.cast<PycTuple>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, ")\n");
+        }
+        break;
+    case PycObject::TYPE_LIST:
+        {
+            iputs(pyc_output, indent, "[\n");
+            for (const auto& val : obj.cast<PycList>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, "]\n");
+        }
+        break;
+    case PycObject::TYPE_DICT:
+        {
+            iputs(pyc_output, indent, "{\n");
+            for (const auto& val : obj.cast<PycDict>()->values()) {
+                output_object(std::get<0>(val), mod, indent + 1, flags, pyc_output);
+                output_object(std::get<1>(val), mod, indent + 2, flags, pyc_output);
+            }
+            iputs(pyc_output, indent, "}\n");
+        }
+        break;
+    case PycObject::TYPE_SET:
+        {
+            iputs(pyc_output, indent, "{\n");
+            for (const auto& val : obj.cast<PycSet>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, "}\n");
+        }
+        break;
+    case PycObject::TYPE_FROZENSET:
+        {
+            iputs(pyc_output, indent, "frozenset({\n");
+            for (const auto& val : obj.cast<PycSet>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, "})\n");
+        }
+        break;
+    case PycObject::TYPE_NONE:
+        iputs(pyc_output, indent, "None\n");
+        break;
+    case PycObject::TYPE_FALSE:
+        iputs(pyc_output, indent, "False\n");
+        break;
+    case PycObject::TYPE_TRUE:
+        iputs(pyc_output, indent, "True\n");
+        break;
+    case PycObject::TYPE_ELLIPSIS:
+        iputs(pyc_output, indent, "...\n");
+        break;
+    case PycObject::TYPE_INT:
+        iprintf(pyc_output, indent, "%d\n", obj.cast<PycInt>()->value());
+        break;
+    case PycObject::TYPE_LONG:
+        iprintf(pyc_output, indent, "%s\n", obj.cast<PycLong>()->repr(mod).c_str());
+        break;
+    case PycObject::TYPE_FLOAT:
+        iprintf(pyc_output, indent, "%s\n", obj.cast<PycFloat>()->value());
+        break;
+    case PycObject::TYPE_COMPLEX:
+        iprintf(pyc_output, indent, "(%s+%sj)\n", obj.cast<PycComplex>()->value(),
+                                      obj.cast<PycComplex>()->imag());
+        break;
+    case PycObject::TYPE_BINARY_FLOAT:
+        iprintf(pyc_output, indent, "%g\n", obj.cast<PycCFloat>()->value());
+        break;
+    case PycObject::TYPE_BINARY_COMPLEX:
+        iprintf(pyc_output, indent, "(%g+%gj)\n", obj.cast<PycCComplex>()->value(),
+                                      obj.cast<PycCComplex>()->imag());
+        break;
+    default:
+        iprintf(pyc_output, indent, "<TYPE: %d>\n", obj->type());
+    }
+}
+
+/* Writes str as a JSON string.  Strings which aren't known to be UTF-8
+ * have their high bytes written as \u00XX escapes, as if they were
+ * Latin-1, so the output stays valid UTF-8. */
+static void write_json_string(PycOutput& out, const char* str, size_t length, bool utf8)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.put('"');
+    const char* run = str;
+    const char* end = str + length;
+    for (const char* ch = str; ch != end; ++ch) {
+        unsigned char byte = (unsigned char)*ch;
+        if (byte >= 0x20 && byte != '"' && byte != '\\' && (byte < 0x80 || utf8))
+            continue;
+        out.write(run, ch - run);
+        run = ch + 1;
+        if (byte == '"' || byte == '\\') {
+            out.put('\\');
+            out.put((char)byte);
+        } else if (byte == '\n') {
+            out.write("\\n", 2);
+        } else if (byte == '\t') {
+            out.write("\\t", 2);
+        } else {
+            char escape[6] = { '\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 0xF] };
+            out.write(escape, sizeof(escape));
+        }
+    }
+    out.write(run, end - run);
+    out.put('"');
+}
+
+static void write_json_string(PycOutput& out, PycRef<PycString> str, PycModule* mod)
+{
+    bool utf8 = str->type() != PycObject::TYPE_STRING && str->type() != PycObject::TYPE_INTERNED
+             && (mod->majorVer() >= 3 || str->type() == PycObject::TYPE_UNICODE);
+    write_json_string(out, str->data(), (size_t)str->length(), utf8);
+}
+
+/* Code objects with their parent's id, in the order their records are
+ * written; their index is their id */
+struct JsonCodeQueue {
+    std::vector<std::pair<PycRef<PycCode>, int>> pending;
+    size_t next;
+};
+
+static void write_json_value(PycOutput& out, PycRef<PycObject> obj, PycModule* mod,
+                             JsonCodeQueue& queue, int parent);
+
+static void write_json_list(PycOutput& out, const std::vector<PycRef<PycObject>>& values,
+                            PycModule* mod, JsonCodeQueue& queue, int parent)
+{
+    out.put('[');
+    for (size_t i = 0; i < values.size(); ++i) {
+        if (i)
+            out.put(',');
+        write_json_value(out, values[i], mod, queue, parent);
+    }
+    out.put(']');
+}
+
+static void write_json_names(PycOutput& out, const char* key, PycRef<PycSequence> names,
+                             PycModule* mod)
+{
+    out << ",\"" << key << "\":[";
+    for (int i = 0; i < names->size(); ++i) {
+        if (i)
+            out.put(',');
+        PycRef<PycString> name = names->get(i).try_cast<PycString>();
+        if (name != NULL)
+            write_json_string(out, name, mod);
+        else
+            out << "null";
+    }
+    out.put(']');
+}
+
+/* Constants map to JSON where there's an exact match (None, booleans, int,
+ * str, list); anything else is an object naming its type */
+static void write_json_value(PycOutput& out, PycRef<PycObject> obj, PycModule* mod,
+                             JsonCodeQueue& queue, int parent)
+{
+    if (obj == NULL) {
+        out << "null";
+        return;
+    }
+
+    char number[96];
+    switch (obj->type()) {
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        out << "{\"code\":" << (int)queue.pending.size() << '}';
+        queue.pending.emplace_back(obj.cast<PycCode>(), parent);
+        break;
+    case PycObject::TYPE_STRING:
+        if (mod->majorVer() >= 3) {
+            out << "{\"bytes\":";
+            write_json_string(out, obj.cast<PycString>(), mod);
+            out.put('}');
+            break;
+        }
+        /* Fall through */
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_INTERNED:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_ASCII_INTERNED:
+    case PycObject::TYPE_SHORT_ASCII:
+    case PycObject::TYPE_SHORT_ASCII_INTERNED:
+        write_json_string(out, obj.cast<PycString>(), mod);
+        break;
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        out << "{\"tuple\":";
+        write_json_list(out, obj.cast<PycTuple>()->values(), mod, queue, parent);
+        out.put('}');
+        break;
+    case PycObject::TYPE_LIST:
+        write_json_list(out, obj.cast<PycList>()->values(), mod, queue, parent);
+        break;
+    case PycObject::TYPE_SET:
+    case PycObject::TYPE_FROZENSET:
+        out << (obj->type() == PycObject::TYPE_SET ? "{\"set\":" : "{\"frozenset\":");
+        write_json_list(out, obj.cast<PycSet>()->values(), mod, queue, parent);
+        out.put('}');
+        break;
+    case PycObject::TYPE_DICT:
+        {
+            out << "{\"dict\":[";
+            bool first = true;
+            for (const auto& item : obj.cast<PycDict>()->values()) {
+                out << (first ? "[" : ",[");
+                write_json_value(out, std::get<0>(item), mod, queue, parent);
+                out.put(',');
+                write_json_value(out, std::get<1>(item), mod, queue, parent);
+                out.put(']');
+                first = false;
+            }
+            out << "]}";
+        }
+        break;
+    case PycObject::TYPE_NONE:
+        out << "null";
+        break;
+    case PycObject::TYPE_FALSE:
+        out << "false";
+        break;
+    case PycObject::TYPE_TRUE:
+        out << "true";
+        break;
+    case PycObject::TYPE_ELLIPSIS:
+        out << "{\"ellipsis\":true}";
+        break;
+    case PycObject::TYPE_STOPITER:
+        out << "{\"stopiteration\":true}";
+        break;
+    case PycObject::TYPE_INT:
+        out << obj.cast<PycInt>()->value();
+        break;
+    case PycObject::TYPE_LONG:
+        out << "{\"long\":\"" << obj.cast<PycLong>()->repr(mod) << "\"}";
+        break;
+    case PycObject::TYPE_FLOAT:
+        out << "{\"float\":\"" << obj.cast<PycFloat>()->value() << "\"}";
+        break;
+    case PycObject::TYPE_COMPLEX:
+        out << "{\"complex\":[\"" << obj.cast<PycComplex>()->value() << "\",\""
+            << obj.cast<PycComplex>()->imag() << "\"]}";
+        break;
+    case PycObject::TYPE_BINARY_FLOAT:
+        snprintf(number, sizeof(number), "{\"float\":\"%.17g\"}",
+                 obj.cast<PycCFloat>()->value());
+        out << number;
+        break;
+    case PycObject::TYPE_BINARY_COMPLEX:
+        snprintf(number, sizeof(number), "{\"complex\":[\"%.17g\",\"%.17g\"]}",
+                 obj.cast<PycCComplex>()->value(), obj.cast<PycCComplex>()->imag());
+        out << number;
+        break;
+    default:
+        out << "{\"type\":" << obj->type() << '}';
+    }
+}
+
+/* One line for a code object, with everything but the code objects in its
+ * constants, which get lines of their own and are referred to by id */
+static void write_json_code(PycOutput& out, PycRef<PycCode> code, int id, int parent,
+                            PycModule* mod, unsigned flags, JsonCodeQueue& queue)
+{
+    out << "{\"id\":" << id << ",\"parent\":";
+    if (parent < 0)
+        out << "null";
+    else
+        out << parent;
+    out << ",\"name\":";
+    write_json_string(out, code->name(), mod);
+    if (mod->has(PycModule::CAP_QUALNAME)) {
+        out << ",\"qualname\":";
+        write_json_string(out, code->qualName(), mod);
+    }
+    out << ",\"filename\":";
+    write_json_string(out, code->fileName(), mod);
+    if (mod->has(PycModule::CAP_LINE_TABLE))
+        out << ",\"first_line\":" << code->firstLine();
+    out << ",\"argcount\":" << code->argCount();
+    if (mod->has(PycModule::CAP_POS_ONLY_ARGS))
+        out << ",\"posonlyargcount\":" << code->posOnlyArgCount();
+    if (mod->has(PycModule::CAP_KW_ONLY_ARGS))
+        out << ",\"kwonlyargcount\":" << code->kwOnlyArgCount();
+    if (!mod->has(PycModule::CAP_LOCALSPLUS))
+        out << ",\"nlocals\":" << code->numLocals();
+    if (mod->has(PycModule::CAP_LINE_TABLE))
+        out << ",\"stacksize\":" << code->stackSize();
+    if (mod->has(PycModule::CAP_CODE_ARGS))
+        out << ",\"flags\":" << stored_flags(code, mod);
+
+    write_json_names(out, "names", code->names(), mod);
+    if (mod->has(PycModule::CAP_CODE_ARGS)) {
+        write_json_names(out, mod->has(PycModule::CAP_LOCALSPLUS) ? "localsplusnames" : "varnames",
+                         code->localNames(), mod);
+    }
+    if (mod->has(PycModule::CAP_LOCALSPLUS)) {
+        out << ",\"localspluskinds\":[";
+        PycRef<PycString> kinds = code->localKinds();
+        for (int i = 0; i < kinds->length(); ++i) {
+            if (i)
+                out.put(',');
+            out << (int)(unsigned char)kinds->data()[i];
+        }
+        out.put(']');
+    }
+    if (mod->has(PycModule::CAP_CLOSURE_VARS)) {
+        write_json_names(out, "freevars", code->freeVars(), mod);
+        write_json_names(out, "cellvars", code->cellVars(), mod);
+    }
+
+    out << ",\"consts\":[";
+    PycRef<PycSequence> consts = code->consts();
+    for (int i = 0; i < consts->size(); ++i) {
+        if (i)
+            out.put(',');
+        write_json_value(out, consts->get(i), mod, queue, id);
+    }
+
+    // [offset, opcode] or [offset, opcode, operand]
+    out << "],\"insns\":[";
+    bool first = true;
+    for (const auto& insn : code->instructions(mod)) {
+        if (insn.opcode == Pyc::CACHE && (flags & Pyc::DISASM_SHOW_CACHES) == 0)
+            continue;
+        out << (first ? "[" : ",[") << insn.offset << ",\"" << Pyc::OpcodeName(insn.opcode) << '"';
+        if (insn.opcode >= Pyc::PYC_HAVE_ARG)
+            out << ',' << insn.operand;
+        out.put(']');
+        first = false;
+    }
+
+    // [offset, line] where a line starts, with -1 for code without one
+    out << "],\"lines\":[";
+    first = true;
+    for (const auto& entry : code->lineTable(mod)) {
+        out << (first ? "[" : ",[") << entry.offset << ',' << entry.line << ']';
+        first = false;
+    }
+    out.put(']');
+
+    if (mod->has(PycModule::CAP_EXCEPTION_TABLE)) {
+        // [start, end, target, depth, lasti]
+        out << ",\"exceptions\":[";
+        first = true;
+        for (const auto& entry : code->exceptionEntries()) {
+            out << (first ? "[" : ",[") << entry.start << ',' << entry.end << ','
+                << entry.target << ',' << entry.depth << ',' << (entry.lasti ? "true" : "false")
+                << ']';
+            first = false;
+        }
+        out.put(']');
+    }
+    out << "}\n";
+}
+
+/* A line about the file, then one per code object, parents first */
+static void output_json_module(PycModule* mod, const char* dispname, unsigned flags,
+                               PycOutput& pyc_output)
+{
+    pyc_output << "{\"file\":";
+    write_json_string(pyc_output, dispname, strlen(dispname), true);
+    pyc_output << ",\"version\":\"" << mod->majorVer() << '.' << mod->minorVer() << '"';
+    if (mod->header().magic) {
+        char magic[16];
+        snprintf(magic, sizeof(magic), "0x%08x", mod->header().magic);
+        pyc_output << ",\"magic\":\"" << magic << '"';
+    }
+    if (mod->majorVer() < 3 && mod->isUnicode())
+        pyc_output << ",\"unicode\":true";
+    pyc_output << "}\n";
+
+    JsonCodeQueue queue;
+    queue.next = 0;
+    if (mod->code() != NULL)
+        queue.pending.emplace_back(mod->code(), -1);
+    while (queue.next < queue.pending.size()) {
+        int id = (int)queue.next;
+        auto item = queue.pending[queue.next++];
+        write_json_code(pyc_output, item.first, id, item.second, mod, flags, queue);
+    }
+}
+
+void disassemble_module(PycModule* mod, const char* dispname, unsigned flags,
+                        PycOutput& pyc_output)
+{
+    if ((flags & Pyc::DISASM_JSON) != 0) {
+        output_json_module(mod, dispname, flags, pyc_output);
+        return;
+    }
+    formatted_print(pyc_output, "%s (Python %d.%d%s)\n", dispname,
+                    mod->majorVer(), mod->minorVer(),
+                    (mod->majorVer() < 3 && mod->isUnicode()) ? " -U" : "");
+    output_object(mod->code().try_cast<PycObject>(), mod, 0, flags, pyc_output);
+}
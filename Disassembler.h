@@ -0,0 +1,18 @@
+#ifndef _PYC_DISASSEMBLER_H
+#define _PYC_DISASSEMBLER_H
+
+#include "pyc_module.h"
+
+/* Writes obj and everything nested in it as an indented listing.  flags
+ * are a combination of Pyc::DisassemblyFlags. */
+void output_object(PycRef<PycObject> obj, PycModule* mod, int indent,
+                   unsigned flags, PycOutput& pyc_output);
+
+/* Writes the header line naming the file and its version, followed by the
+ * listing of the module's code object.  With Pyc::DISASM_JSON, that is
+ * newline delimited JSON instead: a line about the file, then a line for
+ * each code object. */
+void disassemble_module(PycModule* mod, const char* dispname, unsigned flags,
+                        PycOutput& pyc_output);
+
+#endif
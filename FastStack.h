@@ -4,50 +4,131 @@
 #include "ASTNode.h"
 #include <stack>
 
+/* A persistent stack: the entries are an immutable linked list, which copies
+ * of the stack share.  That makes taking and restoring a snapshot O(1),
+ * which BuildFromCode does for every branch it follows. */
 class FastStack {
 public:
-    FastStack(int size) : m_ptr(-1) { m_stack.resize(size); }
+    FastStack(int /* size hint */) : m_top() { }
 
-    FastStack(const FastStack& copy)
-        : m_stack(copy.m_stack), m_ptr(copy.m_ptr) { }
+    FastStack(const FastStack& copy) : m_top(copy.m_top) { retain(m_top); }
 
     FastStack& operator=(const FastStack& copy)
     {
-        m_stack = copy.m_stack;
-        m_ptr = copy.m_ptr;
+        retain(copy.m_top);
+        release(m_top);
+        m_top = copy.m_top;
         return *this;
     }
 
+    ~FastStack() { release(m_top); }
+
     void push(PycRef<ASTNode> node)
     {
-        if (static_cast<int>(m_stack.size()) == m_ptr + 1)
-            m_stack.emplace_back(nullptr);
-
-        m_stack[++m_ptr] = std::move(node);
+        // The new cell takes over our reference to the old top
+        m_top = newCell(std::move(node), m_top);
     }
 
     void pop()
     {
-        if (m_ptr > -1)
-            m_stack[m_ptr--] = nullptr;
+        if (m_top) {
+            Cell* cell = m_top;
+            m_top = cell->next;
+            retain(m_top);
+            release(cell);
+        }
     }
 
-    PycRef<ASTNode> top() const
+    /* Borrowed; the reference is only good until the entry is popped */
+    const PycRef<ASTNode>& top() const
     {
-        if (m_ptr > -1)
-            return m_stack[m_ptr];
-        else
+        static const PycRef<ASTNode> none;
+        return m_top ? m_top->node : none;
+    }
+
+    /* Pops the top entry and returns it.  Unless a copy of the stack still
+     * shares it, the reference is moved out instead of copied. */
+    PycRef<ASTNode> take()
+    {
+        if (!m_top)
             return nullptr;
+        Cell* cell = m_top;
+        PycRef<ASTNode> node;
+        if (cell->refs == 1)
+            node = std::move(cell->node);
+        else
+            node = cell->node;
+        m_top = cell->next;
+        retain(m_top);
+        release(cell);
+        return node;
     }
 
     bool empty() const
     {
-        return m_ptr == -1;
+        return m_top == nullptr;
     }
 
 private:
-    std::vector<PycRef<ASTNode>> m_stack;
-    int m_ptr;
+    struct Cell {
+        PycRef<ASTNode> node;
+        Cell* next;
+        int refs;
+    };
+
+    /* Unused cells are kept per thread, since pushing and popping is by far
+     * the most frequent thing done with a stack */
+    struct CellPool {
+        Cell* free = nullptr;
+        ~CellPool()
+        {
+            while (free) {
+                Cell* next = free->next;
+                delete free;
+                free = next;
+            }
+        }
+    };
+
+    static CellPool& pool()
+    {
+        static thread_local CellPool cell_pool;
+        return cell_pool;
+    }
+
+    static Cell* newCell(PycRef<ASTNode> node, Cell* next)
+    {
+        CellPool& cells = pool();
+        Cell* cell = cells.free;
+        if (cell)
+            cells.free = cell->next;
+        else
+            cell = new Cell;
+        cell->node = std::move(node);
+        cell->next = next;
+        cell->refs = 1;
+        return cell;
+    }
+
+    static void retain(Cell* cell)
+    {
+        if (cell)
+            ++cell->refs;
+    }
+
+    static void release(Cell* cell)
+    {
+        // Iterative, so dropping a deep stack can't overflow the C++ stack
+        while (cell && --cell->refs == 0) {
+            Cell* next = cell->next;
+            cell->node = nullptr;
+            cell->next = pool().free;
+            pool().free = cell;
+            cell = next;
+        }
+    }
+
+    Cell* m_top;
 };
 
 typedef std::stack<FastStack> stackhist_t;
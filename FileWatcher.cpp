@@ -0,0 +1,243 @@
+#include "FileWatcher.h"
+#include "InputFiles.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef PYC_HAVE_INOTIFY
+#  include <dirent.h>
+#  include <poll.h>
+#  include <sys/inotify.h>
+#  include <unistd.h>
+#else
+#  include <chrono>
+#  include <thread>
+#  include <sys/stat.h>
+#  include <sys/types.h>
+#endif
+
+static std::string normalize_root(const std::string& root)
+{
+    std::string result = root;
+    while (result.size() > 1 && (result.back() == '/' || result.back() == PATHSEP))
+        result.pop_back();
+    return result;
+}
+
+#ifdef PYC_HAVE_INOTIFY
+
+/* How long to wait for more changes once some were seen */
+static const int SETTLE_MS = 50;
+
+/* Compilers write to a temporary file and rename it into place, which is
+ * IN_MOVED_TO; IN_CLOSE_WRITE catches the files written in place */
+static const uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE
+                                     | IN_DELETE | IN_ONLYDIR;
+
+FileWatcher::FileWatcher() : m_fd(inotify_init1(IN_CLOEXEC)) { }
+
+FileWatcher::~FileWatcher()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool FileWatcher::watch(const std::string& root)
+{
+    if (m_fd < 0) {
+        fprintf(stderr, "Error watching for changes: %s\n", strerror(errno));
+        return false;
+    }
+    std::string tree = normalize_root(root);
+    m_roots.push_back(tree);
+    return addTree(tree, std::string(), nullptr);
+}
+
+/* Watches the directory at subdir in root and those in it.  The .pyc files
+ * found in them are added to found, if given, for a directory which was
+ * created or moved in after the files in it were. */
+bool FileWatcher::addTree(const std::string& root, const std::string& subdir, ChangeSet* found)
+{
+    std::string dirpath = subdir.empty() ? root : root + PATHSEP + subdir;
+    int wd = inotify_add_watch(m_fd, dirpath.c_str(), WATCH_EVENTS);
+    if (wd < 0) {
+        fprintf(stderr, "Error watching directory %s: %s\n", dirpath.c_str(), strerror(errno));
+        return false;
+    }
+    m_dirs[wd] = WatchedDir { root, subdir };
+
+    DIR* dir = opendir(dirpath.c_str());
+    if (!dir) {
+        fprintf(stderr, "Error reading directory %s\n", dirpath.c_str());
+        return false;
+    }
+    std::vector<std::string> entries;
+    while (struct dirent* ent = readdir(dir))
+        entries.push_back(ent->d_name);
+    closedir(dir);
+
+    bool ok = true;
+    for (const auto& name : entries) {
+        if (name == "." || name == "..")
+            continue;
+        std::string relname = subdir.empty() ? name : subdir + PATHSEP + name;
+        if (is_directory(root + PATHSEP + relname))
+            ok = addTree(root, relname, found) && ok;
+        else if (found && has_pyc_extension(name))
+            (*found)[std::make_pair(root, relname)] = false;
+    }
+    return ok;
+}
+
+/* Adds the changes in the events which arrive within timeout_ms (or for
+ * good, if it's negative).  Returns 1 if there were any events, 0 if there
+ * weren't, and -1 if reading them failed. */
+int FileWatcher::readEvents(ChangeSet& changes, int timeout_ms)
+{
+    struct pollfd pfd = { m_fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR)
+        return 0;
+    if (ready <= 0)
+        return ready;
+
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    ssize_t length = read(m_fd, buffer, sizeof(buffer));
+    if (length < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (length <= 0) {
+        fprintf(stderr, "Error watching for changes: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (char* pos = buffer; pos < buffer + length; ) {
+        auto event = reinterpret_cast<const struct inotify_event*>(pos);
+        pos += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Some events were lost, so anything may have changed
+            for (const auto& root : m_roots)
+                addTree(root, std::string(), &changes);
+            continue;
+        }
+        auto dir = m_dirs.find(event->wd);
+        if (dir == m_dirs.end())
+            continue;
+        if (event->mask & IN_IGNORED) {
+            m_dirs.erase(dir);
+            continue;
+        }
+        if (event->len == 0)
+            continue;
+
+        std::string name(event->name);
+        const std::string root = dir->second.root;
+        std::string relname = dir->second.subdir.empty() ? name
+                              : dir->second.subdir + PATHSEP + name;
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                addTree(root, relname, &changes);
+            } else if (event->mask & IN_MOVED_FROM) {
+                // Still watched where it went, which may be outside the tree
+                std::string prefix = relname + PATHSEP;
+                for (auto it = m_dirs.begin(); it != m_dirs.end(); ) {
+                    const WatchedDir& watched = it->second;
+                    if (watched.root == root && (watched.subdir == relname
+                            || watched.subdir.compare(0, prefix.size(), prefix) == 0)) {
+                        inotify_rm_watch(m_fd, it->first);
+                        it = m_dirs.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+        } else if (has_pyc_extension(name)) {
+            // A file being created is only done once it's closed
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                changes[std::make_pair(root, relname)] = false;
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                changes[std::make_pair(root, relname)] = true;
+        }
+    }
+    return 1;
+}
+
+std::vector<FileWatcher::Change> FileWatcher::wait()
+{
+    ChangeSet changes;
+    while (changes.empty()) {
+        if (readEvents(changes, -1) < 0)
+            return std::vector<Change>();
+    }
+    int got;
+    while ((got = readEvents(changes, SETTLE_MS)) > 0)
+        continue;
+    if (got < 0)
+        return std::vector<Change>();
+
+    std::vector<Change> result;
+    for (const auto& change : changes)
+        result.push_back(Change { change.first.first, change.first.second, change.second });
+    return result;
+}
+
+#else
+
+FileWatcher::FileWatcher() { }
+
+FileWatcher::~FileWatcher() { }
+
+bool FileWatcher::watch(const std::string& root)
+{
+    std::string tree = normalize_root(root);
+    if (!is_directory(tree)) {
+        fprintf(stderr, "Error watching directory %s: not a directory\n", tree.c_str());
+        return false;
+    }
+    m_roots.push_back(tree);
+    m_listing = list();
+    return true;
+}
+
+FileWatcher::Listing FileWatcher::list() const
+{
+    Listing listing;
+    for (const auto& root : m_roots) {
+        std::vector<InputFile> inputs;
+        add_input(root, inputs);
+        for (const auto& input : inputs) {
+            struct stat st;
+            if (stat(input.path.c_str(), &st) != 0)
+                continue;
+            listing[std::make_pair(root, input.path.substr(root.size() + 1))]
+                    = FileState { (uint64_t)st.st_size, (int64_t)st.st_mtime };
+        }
+    }
+    return listing;
+}
+
+std::vector<FileWatcher::Change> FileWatcher::wait()
+{
+    ChangeSet changes;
+    while (changes.empty()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        Listing listing = list();
+        for (const auto& file : listing) {
+            auto old = m_listing.find(file.first);
+            if (old == m_listing.end() || old->second != file.second)
+                changes[file.first] = false;
+        }
+        for (const auto& file : m_listing) {
+            if (listing.find(file.first) == listing.end())
+                changes[file.first] = true;
+        }
+        m_listing.swap(listing);
+    }
+
+    std::vector<Change> result;
+    for (const auto& change : changes)
+        result.push_back(Change { change.first.first, change.first.second, change.second });
+    return result;
+}
+
+#endif
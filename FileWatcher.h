@@ -0,0 +1,76 @@
+#ifndef _PYC_FILEWATCHER_H
+#define _PYC_FILEWATCHER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#  define PYC_HAVE_INOTIFY
+#endif
+
+/* Waits for the .pyc and .pyo files in directory trees to be written,
+ * moved in or removed, as a __pycache__ directory is updated when Python
+ * recompiles changed modules.  On Linux, the trees are watched with
+ * inotify, including the directories created in them later; elsewhere,
+ * they are listed every half a second, comparing each file's size and
+ * modification time with the last listing. */
+class FileWatcher {
+public:
+    struct Change {
+        std::string root;       // As given to watch()
+        std::string relname;    // Relative to root
+        bool removed;
+    };
+
+    FileWatcher();
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    /* Starts watching the tree at root.  Writes a message to stderr and
+     * returns false if it can't. */
+    bool watch(const std::string& root);
+
+    /* Blocks until some files have changed, and then until there are no
+     * more changes for a little while, as a compile touches many files
+     * at once.  Each file is listed once, by its last change, in order
+     * of root and relname.  Returns none if watching failed. */
+    std::vector<Change> wait();
+
+private:
+    typedef std::map<std::pair<std::string, std::string>, bool> ChangeSet;
+
+#ifdef PYC_HAVE_INOTIFY
+    bool addTree(const std::string& root, const std::string& subdir, ChangeSet* found);
+    int readEvents(ChangeSet& changes, int timeout_ms);
+
+    struct WatchedDir {
+        std::string root, subdir;
+    };
+
+    int m_fd;
+    std::map<int, WatchedDir> m_dirs;
+#else
+    struct FileState {
+        uint64_t size;
+        int64_t mtime;
+
+        bool operator!=(const FileState& other) const
+        {
+            return size != other.size || mtime != other.mtime;
+        }
+    };
+    typedef std::map<std::pair<std::string, std::string>, FileState> Listing;
+
+    Listing list() const;
+
+    Listing m_listing;
+#endif
+    std::vector<std::string> m_roots;
+};
+
+#endif
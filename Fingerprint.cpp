@@ -0,0 +1,227 @@
+#include "Fingerprint.h"
+#include "bytecode.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static uint64_t mix64(uint64_t x)
+{
+    // The splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/* The opcode, and the operand only where it picks the operator */
+static int normalized_token(const PycInstruction& insn)
+{
+    switch (insn.opcode) {
+    case Pyc::COMPARE_OP_A:
+    case Pyc::BINARY_OP_A:
+    case Pyc::IS_OP_A:
+    case Pyc::CONTAINS_OP_A:
+        return (insn.opcode << 10) | (insn.operand & 0x3FF);
+    default:
+        return insn.opcode << 10;
+    }
+}
+
+/* Instructions which say nothing about what the code does */
+static bool is_filler(int opcode)
+{
+    switch (opcode) {
+    case Pyc::CACHE:
+    case Pyc::NOP:
+    case Pyc::EXTENDED_ARG_A:
+    case Pyc::SET_LINENO_A:
+    case Pyc::RESUME_A:
+        return true;
+    default:
+        return false;
+    }
+}
+
+PycFingerprint fingerprint_code(PycRef<PycCode> code, PycModule* mod)
+{
+    std::vector<int> tokens;
+    for (const auto& insn : code->instructions(mod)) {
+        if (!is_filler(insn.opcode))
+            tokens.push_back(normalized_token(insn));
+    }
+
+    // Code shorter than one n-gram is a single shingle
+    std::vector<uint64_t> shingles;
+    const size_t ngram = PycFingerprint::NGRAM;
+    size_t count = (tokens.size() >= ngram) ? tokens.size() - ngram + 1 : (tokens.empty() ? 0 : 1);
+    shingles.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (size_t j = i; j < std::min(i + ngram, tokens.size()); ++j)
+            hash = (hash ^ (uint64_t)tokens[j]) * 0x100000001B3ULL;
+        shingles.push_back(mix64(hash));
+    }
+    std::sort(shingles.begin(), shingles.end());
+    shingles.erase(std::unique(shingles.begin(), shingles.end()), shingles.end());
+
+    PycFingerprint fingerprint;
+    fingerprint.instructions = (uint32_t)tokens.size();
+
+    int weights[64] = { };
+    for (uint64_t shingle : shingles) {
+        for (int bit = 0; bit < 64; ++bit)
+            weights[bit] += ((shingle >> bit) & 1) ? 1 : -1;
+    }
+    fingerprint.simhash = 0;
+    for (int bit = 0; bit < 64; ++bit) {
+        if (weights[bit] > 0)
+            fingerprint.simhash |= 1ULL << bit;
+    }
+
+    // One hash function per slot, by mixing in a different seed
+    for (int i = 0; i < PycFingerprint::MINHASH_SIZE; ++i) {
+        uint64_t seed = mix64(0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1));
+        uint32_t lowest = 0xFFFFFFFF;
+        for (uint64_t shingle : shingles)
+            lowest = std::min(lowest, (uint32_t)(mix64(shingle ^ seed) >> 32));
+        fingerprint.minhash[i] = lowest;
+    }
+    return fingerprint;
+}
+
+double PycFingerprint::similarity(const PycFingerprint& other) const
+{
+    int same = 0;
+    for (int i = 0; i < MINHASH_SIZE; ++i) {
+        if (minhash[i] == other.minhash[i])
+            ++same;
+    }
+    return (double)same / MINHASH_SIZE;
+}
+
+int PycFingerprint::distance(const PycFingerprint& other) const
+{
+    uint64_t diff = simhash ^ other.simhash;
+    int bits = 0;
+    for ( ; diff; diff &= diff - 1)
+        ++bits;
+    return bits;
+}
+
+uint64_t PycFingerprintIndex::bandKey(const PycFingerprint& fingerprint, int band)
+{
+    uint64_t key = (uint64_t)band;
+    for (int row = 0; row < BAND_ROWS; ++row)
+        key = mix64(key ^ fingerprint.minhash[band * BAND_ROWS + row]);
+    return key;
+}
+
+void PycFingerprintIndex::add(std::string name, const PycFingerprint& fingerprint)
+{
+    size_t entry = m_entries.size();
+    m_entries.push_back({ std::move(name), fingerprint });
+    for (int band = 0; band < BANDS; ++band)
+        m_bands[band][bandKey(fingerprint, band)].push_back(entry);
+}
+
+std::vector<PycFingerprintIndex::Match> PycFingerprintIndex::query(
+        const PycFingerprint& fingerprint, size_t count, double min_similarity) const
+{
+    std::vector<size_t> candidates;
+    for (int band = 0; band < BANDS; ++band) {
+        auto found = m_bands[band].find(bandKey(fingerprint, band));
+        if (found != m_bands[band].end())
+            candidates.insert(candidates.end(), found->second.begin(), found->second.end());
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    std::vector<Match> matches;
+    for (size_t entry : candidates) {
+        double similarity = fingerprint.similarity(m_entries[entry].fingerprint);
+        if (similarity >= min_similarity)
+            matches.push_back({ entry, similarity });
+    }
+    std::stable_sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) {
+        return a.similarity > b.similarity;
+    });
+    if (matches.size() > count)
+        matches.resize(count);
+    return matches;
+}
+
+/* The file starts with a magic, the MinHash size and the number of entries.
+ * Each entry is the length of its name, the name, its instruction count,
+ * SimHash and MinHash, all little endian. */
+static const char INDEX_MAGIC[8] = { 'P', 'Y', 'C', 'F', 'P', '\0', '\0', '\1' };
+
+static void put32(std::vector<unsigned char>& out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out.push_back((unsigned char)(value >> (8 * i)));
+}
+
+bool PycFingerprintIndex::save(const char* filename) const
+{
+    std::vector<unsigned char> data(INDEX_MAGIC, INDEX_MAGIC + sizeof(INDEX_MAGIC));
+    put32(data, PycFingerprint::MINHASH_SIZE);
+    put32(data, (uint32_t)m_entries.size());
+    for (const auto& entry : m_entries) {
+        put32(data, (uint32_t)entry.name.size());
+        data.insert(data.end(), entry.name.begin(), entry.name.end());
+        put32(data, entry.fingerprint.instructions);
+        put32(data, (uint32_t)entry.fingerprint.simhash);
+        put32(data, (uint32_t)(entry.fingerprint.simhash >> 32));
+        for (uint32_t value : entry.fingerprint.minhash)
+            put32(data, value);
+    }
+
+    FILE* out = fopen(filename, "wb");
+    if (!out) {
+        fprintf(stderr, "Error opening file '%s' for writing\n", filename);
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+    ok = (fclose(out) == 0) && ok;
+    if (!ok)
+        fprintf(stderr, "Error writing %s\n", filename);
+    return ok;
+}
+
+bool PycFingerprintIndex::load(const char* filename)
+{
+    PycMappedFile in(filename);
+    if (!in.isOpen()) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        return false;
+    }
+    char magic[sizeof(INDEX_MAGIC)];
+    if (in.getBuffer(sizeof(magic), magic) != (int)sizeof(magic)
+            || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0
+            || in.get32() != PycFingerprint::MINHASH_SIZE) {
+        fprintf(stderr, "%s is not a fingerprint index\n", filename);
+        return false;
+    }
+
+    const size_t entry_size = 16 + 4 * PycFingerprint::MINHASH_SIZE;
+    size_t count = (uint32_t)in.get32();
+    for (size_t i = 0; i < count; ++i) {
+        size_t name_length = (uint32_t)in.get32();
+        if (in.atEof() || name_length + entry_size - 4 > in.size() - in.position()) {
+            fprintf(stderr, "%s is truncated\n", filename);
+            return false;
+        }
+        std::string name(name_length, '\0');
+        in.getBuffer((int)name_length, &name[0]);
+        PycFingerprint fingerprint;
+        fingerprint.instructions = (uint32_t)in.get32();
+        fingerprint.simhash = (uint32_t)in.get32();
+        fingerprint.simhash |= (uint64_t)(uint32_t)in.get32() << 32;
+        for (uint32_t& value : fingerprint.minhash)
+            value = (uint32_t)in.get32();
+        add(std::move(name), fingerprint);
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+#ifndef _PYC_FINGERPRINT_H
+#define _PYC_FINGERPRINT_H
+
+#include "pyc_module.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* What a code object's bytecode looks like, regardless of the names and
+ * constants it uses: the shingles are the n-grams of its opcodes, with the
+ * operands left out except where they pick an operator.  Two code objects
+ * with similar instruction sequences get similar fingerprints, which can
+ * be compared without decompiling anything. */
+struct PycFingerprint {
+    static const int MINHASH_SIZE = 64;
+    static const int NGRAM = 3;
+
+    uint64_t simhash;
+    uint32_t minhash[MINHASH_SIZE];
+    uint32_t instructions;      // Not counting the ones which were left out
+
+    /* The estimated Jaccard similarity of the two sets of shingles */
+    double similarity(const PycFingerprint& other) const;
+
+    /* The number of bits the SimHashes differ in */
+    int distance(const PycFingerprint& other) const;
+};
+
+PycFingerprint fingerprint_code(PycRef<PycCode> code, PycModule* mod);
+
+/* Calls visit(code, qualname) for code and every code object nested in its
+ * constants, parents first.  Without a co_qualname, the name is made up of
+ * the names of the enclosing functions and classes. */
+template <class _Visit>
+void visit_code_objects(PycRef<PycCode> code, PycModule* mod, const std::string& qualname,
+                        _Visit&& visit);
+
+/* Fingerprints of named code objects, stored in a file.  Queries compare
+ * against the entries which share a band of MinHash values with the query
+ * (locality sensitive hashing), so they don't scan the whole index. */
+class PycFingerprintIndex {
+public:
+    struct Entry {
+        std::string name;
+        PycFingerprint fingerprint;
+    };
+
+    struct Match {
+        size_t entry;
+        double similarity;
+    };
+
+    void add(std::string name, const PycFingerprint& fingerprint);
+    const std::vector<Entry>& entries() const { return m_entries; }
+
+    /* Both return false and report why on stderr if they fail */
+    bool save(const char* filename) const;
+    bool load(const char* filename);
+
+    /* Up to count entries which are at least min_similarity alike, the
+     * most similar first */
+    std::vector<Match> query(const PycFingerprint& fingerprint, size_t count,
+                             double min_similarity) const;
+
+private:
+    static const int BANDS = 16;
+    static const int BAND_ROWS = PycFingerprint::MINHASH_SIZE / BANDS;
+
+    static uint64_t bandKey(const PycFingerprint& fingerprint, int band);
+
+    std::vector<Entry> m_entries;
+    std::unordered_map<uint64_t, std::vector<size_t>> m_bands[BANDS];
+};
+
+template <class _Visit>
+void visit_code_objects(PycRef<PycCode> code, PycModule* mod, const std::string& qualname,
+                        _Visit&& visit)
+{
+    visit(code, qualname);
+    PycRef<PycSequence> consts = code->consts();
+    for (int i = 0; i < consts->size(); ++i) {
+        PycRef<PycCode> child = consts->get(i).try_cast<PycCode>();
+        if (child == NULL)
+            continue;
+        std::string name;
+        if (mod->has(PycModule::CAP_QUALNAME) && child->qualName() != NULL)
+            name = child->qualName()->strValue();
+        else if (qualname.empty() || qualname == "<module>")
+            name = child->name()->strValue();
+        else
+            name = qualname + "." + child->name()->strValue();
+        visit_code_objects(child, mod, name, visit);
+    }
+}
+
+#endif
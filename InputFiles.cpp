@@ -0,0 +1,230 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include "InputFiles.h"
+
+#ifdef WIN32
+#  include <windows.h>
+#  include <direct.h>
+#else
+#  include <dirent.h>
+#  include <sys/stat.h>
+#  include <sys/types.h>
+#endif
+
+static bool is_separator(char ch)
+{
+    return ch == '/' || ch == PATHSEP;
+}
+
+bool is_directory(const std::string& path)
+{
+#ifdef WIN32
+    DWORD attrs = GetFileAttributesA(path.c_str());
+    return attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+uint64_t input_size(const InputFile& input)
+{
+    if (input.archive)
+        return input.archive->members()[input.member].length;
+#ifdef WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(input.path.c_str(), GetFileExInfoStandard, &data))
+        return 0;
+    return ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+    struct stat st;
+    return stat(input.path.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+#endif
+}
+
+static bool make_directory(const std::string& path)
+{
+#ifdef WIN32
+    return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+/* Create all missing parent directories of the file at path */
+bool make_parent_dirs(const std::string& path)
+{
+    for (size_t i = 1; i < path.size(); ++i) {
+        if (is_separator(path[i]) && !is_separator(path[i-1])) {
+            if (!make_directory(path.substr(0, i)))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool has_pyc_extension(const std::string& name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return false;
+    std::string ext = name.substr(dot);
+    return ext == ".pyc" || ext == ".pyo";
+}
+
+/* Turn an input path into something that can be appended to the output
+ * directory: drop any root and "." / ".." components, and swap the .pyc
+ * extension for .py */
+static std::string output_relpath(const std::string& path)
+{
+    std::string result;
+    size_t start = 0;
+    if (path.size() >= 2 && path[1] == ':')
+        start = 2;  // Drive letter
+    while (start < path.size()) {
+        size_t end = start;
+        while (end < path.size() && !is_separator(path[end]))
+            ++end;
+        std::string part = path.substr(start, end - start);
+        if (!part.empty() && part != "." && part != "..") {
+            if (!result.empty())
+                result += PATHSEP;
+            result += part;
+        }
+        start = end + 1;
+    }
+    if (has_pyc_extension(result))
+        result.resize(result.size() - 1);
+    else
+        result += ".py";
+    return result;
+}
+
+InputFile tree_input(const std::string& root, const std::string& relname)
+{
+    InputFile input;
+    input.path = root + PATHSEP + relname;
+    input.relpath = output_relpath(relname);
+    input.member = 0;
+    return input;
+}
+
+bool list_directory(const std::string& dirpath, std::vector<std::string>& names)
+{
+    std::vector<std::string> entries;
+#ifdef WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE hFind = FindFirstFileA((dirpath + "\\*").c_str(), &found);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Error reading directory %s\n", dirpath.c_str());
+        return false;
+    }
+    do {
+        entries.push_back(found.cFileName);
+    } while (FindNextFileA(hFind, &found));
+    FindClose(hFind);
+#else
+    DIR* dir = opendir(dirpath.c_str());
+    if (!dir) {
+        fprintf(stderr, "Error reading directory %s\n", dirpath.c_str());
+        return false;
+    }
+    while (struct dirent* ent = readdir(dir))
+        entries.push_back(ent->d_name);
+    closedir(dir);
+#endif
+
+    // Keep the processing order stable regardless of the filesystem
+    std::sort(entries.begin(), entries.end());
+    for (auto& name : entries) {
+        if (name != "." && name != "..")
+            names.push_back(std::move(name));
+    }
+    return true;
+}
+
+static void walk_directory(const std::string& root, const std::string& subdir,
+                           std::vector<InputFile>& inputs)
+{
+    std::vector<std::string> entries;
+    if (!list_directory(subdir.empty() ? root : root + PATHSEP + subdir, entries))
+        return;
+    for (const auto& name : entries) {
+        std::string relname = subdir.empty() ? name : subdir + PATHSEP + name;
+        if (is_directory(root + PATHSEP + relname))
+            walk_directory(root, relname, inputs);
+        else if (has_pyc_extension(name))
+            inputs.push_back(tree_input(root, relname));
+    }
+}
+
+/* Adds the members of the archive at path, unless it isn't one */
+static bool add_archive(const std::string& path, std::vector<InputFile>& inputs)
+{
+    std::shared_ptr<const PycArchive> archive;
+    try {
+        archive = PycArchive::open(path.c_str());
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error reading archive %s: %s\n", path.c_str(), ex.what());
+        return true;
+    }
+    if (!archive)
+        return false;
+
+    const auto& members = archive->members();
+    if (members.empty())
+        fprintf(stderr, "No compiled modules found in %s\n", path.c_str());
+    for (size_t i = 0; i < members.size(); ++i) {
+        InputFile input;
+        input.path = path + PATHSEP + members[i].name;
+        input.relpath = output_relpath(input.path);
+        input.archive = archive;
+        input.member = i;
+        inputs.push_back(std::move(input));
+    }
+    return true;
+}
+
+void add_input(const std::string& path, std::vector<InputFile>& inputs)
+{
+    if (is_directory(path)) {
+        std::string root = path;
+        while (root.size() > 1 && is_separator(root.back()))
+            root.pop_back();
+        walk_directory(root, "", inputs);
+    } else if (has_pyc_extension(path) || !add_archive(path, inputs)) {
+        InputFile input;
+        input.path = path;
+        input.relpath = output_relpath(path);
+        input.member = 0;
+        inputs.push_back(std::move(input));
+    }
+}
+
+bool read_list_file(const char* filename, std::vector<InputFile>& inputs)
+{
+    std::ifstream list_file;
+    std::istream* list = &std::cin;
+    if (strcmp(filename, "-") != 0) {
+        list_file.open(filename);
+        if (list_file.fail()) {
+            fprintf(stderr, "Error opening list file '%s'\n", filename);
+            return false;
+        }
+        list = &list_file;
+    }
+
+    std::string line;
+    while (std::getline(*list, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            add_input(line, inputs);
+    }
+    return true;
+}
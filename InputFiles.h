@@ -0,0 +1,52 @@
+#ifndef _PYC_INPUTFILES_H
+#define _PYC_INPUTFILES_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "pyc_archive.h"
+
+#ifdef WIN32
+#  define PATHSEP '\\'
+#else
+#  define PATHSEP '/'
+#endif
+
+struct InputFile {
+    std::string path;       // Path used to open the file
+    std::string relpath;    // Path of the output, relative to the output dir
+
+    /* For a member of an archive, path is the archive's path followed by
+     * the member's name */
+    std::shared_ptr<const PycArchive> archive;
+    size_t member;
+};
+
+bool is_directory(const std::string& path);
+
+/* Create all missing parent directories of the file at path */
+bool make_parent_dirs(const std::string& path);
+
+/* Adds the names in the directory at dirpath, sorted, leaving out "." and
+ * "..".  Writes a message to stderr and returns false if it can't. */
+bool list_directory(const std::string& dirpath, std::vector<std::string>& names);
+
+/* Whether name ends in .pyc or .pyo */
+bool has_pyc_extension(const std::string& name);
+
+/* The input for the file at relname in the directory tree at root, as
+ * add_input finds it when given root */
+InputFile tree_input(const std::string& root, const std::string& relname);
+
+/* The size of the input's .pyc image, or 0 if it can't be found out */
+uint64_t input_size(const InputFile& input);
+
+/* Add path, or all .pyc and .pyo files found under it if it's a directory,
+ * or the compiled modules in it if it's an archive (see PycArchive) */
+void add_input(const std::string& path, std::vector<InputFile>& inputs);
+
+/* Add every path listed in filename, one per line ("-" reads stdin) */
+bool read_list_file(const char* filename, std::vector<InputFile>& inputs);
+
+#endif
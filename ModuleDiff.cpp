@@ -0,0 +1,76 @@
+#include "ModuleDiff.h"
+#include "DecompileCache.h"
+#include "Fingerprint.h"
+#include <unordered_map>
+
+namespace {
+
+struct NamedCode {
+    std::string name;
+    PycCode* code;
+};
+
+}
+
+/* The named code objects of a module, parents first.  Names which were
+ * taken already, e.g. by a function defined one way or another on the two
+ * branches of an if, get a "#2" and so on. */
+static std::vector<NamedCode> named_code(PycModule* mod)
+{
+    std::vector<NamedCode> result;
+    std::unordered_map<std::string, int> seen;
+    PycRef<PycCode> root = mod->code();
+    visit_code_objects(root, mod, "<module>",
+                       [&](PycRef<PycCode> code, const std::string& qualname) {
+        if (!code.isIdent(root) && code->name()->startsWith("<"))
+            return;
+        int count = ++seen[qualname];
+        result.push_back({ (count == 1) ? qualname : qualname + "#" + std::to_string(count),
+                           code });
+    });
+    return result;
+}
+
+/* Whether name is nested in the last of names, which then covers it */
+static bool nested_in_last(const std::vector<std::string>& names, const std::string& name)
+{
+    if (names.empty())
+        return false;
+    const std::string& parent = names.back();
+    return name.size() > parent.size() && name.compare(0, parent.size(), parent) == 0
+            && name[parent.size()] == '.';
+}
+
+ModuleDiff diff_modules(PycModule* old_mod, PycModule* new_mod)
+{
+    ModuleDiff diff;
+    CodeHasher hasher;
+    std::vector<NamedCode> old_code = named_code(old_mod);
+    std::unordered_map<std::string, size_t> old_index;
+    for (size_t i = 0; i < old_code.size(); ++i)
+        old_index[old_code[i].name] = i;
+
+    std::vector<bool> matched(old_code.size());
+    for (const auto& entry : named_code(new_mod)) {
+        auto found = old_index.find(entry.name);
+        if (found == old_index.end()) {
+            if (!nested_in_last(diff.added, entry.name))
+                diff.added.push_back(entry.name);
+            continue;
+        }
+        matched[found->second] = true;
+        PycCode* old_entry = old_code[found->second].code;
+        if (hasher.hash(entry.code, new_mod) == hasher.hash(old_entry, old_mod)) {
+            // The module itself is printed regardless
+            if (!PycRef<PycCode>(entry.code).isIdent(new_mod->code()))
+                diff.unchanged.insert(entry.code);
+        } else if (hasher.ownHash(entry.code, new_mod) != hasher.ownHash(old_entry, old_mod)) {
+            diff.changed.push_back(entry.name);
+        }
+    }
+    for (size_t i = 0; i < old_code.size(); ++i) {
+        if (!matched[i] && !nested_in_last(diff.removed, old_code[i].name))
+            diff.removed.push_back(old_code[i].name);
+    }
+    return diff;
+}
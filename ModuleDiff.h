@@ -0,0 +1,31 @@
+#ifndef _PYC_MODULEDIFF_H
+#define _PYC_MODULEDIFF_H
+
+#include "pyc_module.h"
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/* How a newer version of a module differs from an older one, by its
+ * functions and classes.  Code objects are matched up by their qualified
+ * names (see visit_code_objects), and compared by their CodeHasher hashes,
+ * which leave out line numbers.  Lambdas, comprehensions and the like are
+ * part of the code they are in. */
+struct ModuleDiff {
+    /* Whose own code changed, including the module's ("<module>"), and the
+     * ones which are new, in the order the new module has them */
+    std::vector<std::string> changed, added;
+
+    /* In the order the old module has them */
+    std::vector<std::string> removed;
+
+    /* The new module's code objects which are the same as in the old one,
+     * code nested in them included */
+    std::unordered_set<const PycCode*> unchanged;
+
+    bool empty() const { return changed.empty() && added.empty() && removed.empty(); }
+};
+
+ModuleDiff diff_modules(PycModule* old_mod, PycModule* new_mod);
+
+#endif
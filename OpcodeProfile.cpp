@@ -0,0 +1,119 @@
+#include "OpcodeProfile.h"
+
+#ifdef OPCODE_PROFILE
+
+#include "ASTNode.h"
+#include "bytecode.h"
+#include "pyc_stats.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace {
+
+/* Major versions 1 to 3, with up to 16 minor versions each */
+const int VERSIONS = 4 * 16;
+
+/* The last slot of each version is for PYC_INVALID_OPCODE */
+const int OPCODE_SLOTS = Pyc::PYC_LAST_OPCODE + 1;
+
+OpcodeProfile::Counter s_opcodes[VERSIONS][OPCODE_SLOTS];
+OpcodeProfile::Counter s_nodes[ASTNode::NODE_LOCALS + 1];
+OpcodeProfile::Counter s_discarded;
+
+/* Time spent in the scopes nested in the innermost open one */
+thread_local uint64_t t_nested;
+
+const char* const node_names[] = {
+    "NODE_INVALID", "NODE_NODELIST", "NODE_OBJECT", "NODE_UNARY", "NODE_BINARY",
+    "NODE_COMPARE", "NODE_SLICE", "NODE_STORE", "NODE_RETURN", "NODE_NAME",
+    "NODE_DELETE", "NODE_FUNCTION", "NODE_CLASS", "NODE_CALL", "NODE_IMPORT",
+    "NODE_TUPLE", "NODE_LIST", "NODE_SET", "NODE_MAP", "NODE_SUBSCR", "NODE_PRINT",
+    "NODE_CONVERT", "NODE_KEYWORD", "NODE_RAISE", "NODE_EXEC", "NODE_BLOCK",
+    "NODE_COMPREHENSION", "NODE_LOADBUILDCLASS", "NODE_AWAITABLE",
+    "NODE_FORMATTEDVALUE", "NODE_JOINEDSTR", "NODE_CONST_MAP",
+    "NODE_ANNOTATED_VAR", "NODE_CHAINSTORE", "NODE_TERNARY",
+    "NODE_KW_NAMES_MAP", "NODE_LOCALS",
+};
+
+static_assert(sizeof(node_names) / sizeof(node_names[0]) == ASTNode::NODE_LOCALS + 1,
+              "OpcodeProfile node_names not in sync with ASTNode::Type");
+
+struct Line {
+    const char* kind;
+    std::string version;
+    const char* name;
+    uint64_t count, totalNanos, selfNanos;
+};
+
+}
+
+OpcodeProfile::Counter& OpcodeProfile::opcode(int major, int minor, int opcode)
+{
+    if (major < 0 || major >= 4 || minor < 0 || minor >= 16)
+        return s_discarded;
+    if (opcode < 0 || opcode >= Pyc::PYC_LAST_OPCODE)
+        opcode = Pyc::PYC_LAST_OPCODE;
+    return s_opcodes[major * 16 + minor][opcode];
+}
+
+OpcodeProfile::Counter& OpcodeProfile::node(int type)
+{
+    if (type < 0 || type > ASTNode::NODE_LOCALS)
+        return s_discarded;
+    return s_nodes[type];
+}
+
+OpcodeProfile::Scope::Scope(Counter& counter)
+    : m_counter(&counter), m_start(PycStats::now()), m_outerNested(t_nested)
+{
+    t_nested = 0;
+}
+
+void OpcodeProfile::Scope::stop()
+{
+    if (!m_counter)
+        return;
+    uint64_t total = PycStats::now() - m_start;
+    uint64_t nested = std::min(t_nested, total);
+    m_counter->count.fetch_add(1, std::memory_order_relaxed);
+    m_counter->totalNanos.fetch_add(total, std::memory_order_relaxed);
+    m_counter->selfNanos.fetch_add(total - nested, std::memory_order_relaxed);
+    t_nested = m_outerNested + total;
+    m_counter = nullptr;
+}
+
+void OpcodeProfile::report(FILE* out)
+{
+    std::vector<Line> lines;
+    for (int version = 0; version < VERSIONS; ++version) {
+        for (int op = 0; op < OPCODE_SLOTS; ++op) {
+            const Counter& counter = s_opcodes[version][op];
+            if (counter.count == 0)
+                continue;
+            std::string name = std::to_string(version / 16) + "." + std::to_string(version % 16);
+            lines.push_back({ "opcode", name,
+                              (op == Pyc::PYC_LAST_OPCODE) ? "<INVALID>" : Pyc::OpcodeName(op),
+                              counter.count, counter.totalNanos, counter.selfNanos });
+        }
+    }
+    for (int type = 0; type <= ASTNode::NODE_LOCALS; ++type) {
+        const Counter& counter = s_nodes[type];
+        if (counter.count != 0) {
+            lines.push_back({ "node", "-", node_names[type], counter.count,
+                              counter.totalNanos, counter.selfNanos });
+        }
+    }
+    std::stable_sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) {
+        return a.selfNanos > b.selfNanos;
+    });
+
+    fputs("# kind\tversion\tname\tcount\ttotal_ms\tself_ms\tself_ns_per_call\n", out);
+    for (const auto& line : lines) {
+        fprintf(out, "%s\t%s\t%s\t%llu\t%.3f\t%.3f\t%.1f\n", line.kind, line.version.c_str(),
+                line.name, (unsigned long long)line.count, line.totalNanos / 1e6,
+                line.selfNanos / 1e6, (double)line.selfNanos / line.count);
+    }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _PYC_OPCODE_PROFILE_H
+#define _PYC_OPCODE_PROFILE_H
+
+/* Counts and times each opcode case of BuildFromCode, by Python version,
+ * and each node type print_src() prints, to see where the time goes over
+ * a whole corpus.  Only built with -DENABLE_OPCODE_PROFILE=ON; the counters
+ * are process wide, so they add up over every input.
+ *
+ * Times are kept both in total and by themselves, without the time of the
+ * scopes nested in them (a statement printed while building, the operands
+ * of an expression being printed), so the self times add up to the time
+ * spent in all of the scopes. */
+#ifdef OPCODE_PROFILE
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+namespace OpcodeProfile {
+
+struct Counter {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> totalNanos;
+    std::atomic<uint64_t> selfNanos;
+};
+
+Counter& opcode(int major, int minor, int opcode);
+Counter& node(int type);
+
+/* Times from construction until stop() or destruction, whichever is first.
+ * Scopes on the same thread must be nested. */
+class Scope {
+public:
+    explicit Scope(Counter& counter);
+    ~Scope() { stop(); }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    void stop();
+
+private:
+    Counter* m_counter;
+    uint64_t m_start;
+    uint64_t m_outerNested;
+};
+
+/* Writes a tab separated line per opcode or node type which was seen,
+ * slowest first by self time: kind, version, name, count, total ms, self ms
+ * and self ns per call.  Sort it differently with e.g. sort -t$'\t' -k4nr. */
+void report(FILE* out);
+
+}
+
+#endif
+
+#endif
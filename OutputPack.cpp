@@ -0,0 +1,230 @@
+#include "OutputPack.h"
+#include "pyc_stats.h"
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef WIN32
+#  include <io.h>
+#else
+#  include <unistd.h>
+#endif
+
+#ifdef PYC_HAVE_ZLIB
+#  include <zlib.h>
+#endif
+
+bool OutputPack::canCompress()
+{
+#ifdef PYC_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+OutputPack::~OutputPack()
+{
+    if (m_data)
+        fclose(m_data);
+    if (m_index)
+        fclose(m_index);
+}
+
+static bool truncate_file(FILE* file, uint64_t size)
+{
+    clearerr(file);
+    fflush(file);
+#ifdef WIN32
+    return _chsize_s(_fileno(file), (__int64)size) == 0;
+#else
+    return ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+}
+
+static bool file_size(FILE* file, uint64_t& size)
+{
+    if (fseek(file, 0, SEEK_END) != 0)
+        return false;
+    long long pos = (long long)ftell(file);
+    if (pos < 0)
+        return false;
+    size = (uint64_t)pos;
+    return true;
+}
+
+/* Reads where the members listed in an existing index end, and the size of
+ * its complete lines */
+static void read_index(const std::string& index_name, uint64_t& data_end, uint64_t& index_size)
+{
+    data_end = index_size = 0;
+    std::ifstream in(index_name, std::ios_base::in | std::ios_base::binary);
+    std::string line;
+    uint64_t pos = 0;
+    while (std::getline(in, line)) {
+        if (in.eof())
+            break;
+        pos += line.size() + 1;
+        unsigned long long offset, size;
+        size_t fields = line.rfind(", \"offset\": ");
+        if (fields == std::string::npos
+                || sscanf(line.c_str() + fields, ", \"offset\": %llu, \"size\": %llu",
+                          &offset, &size) != 2)
+            continue;
+        data_end = offset + size;
+        index_size = pos;
+    }
+}
+
+bool OutputPack::open(const char* filename)
+{
+    m_filename = filename;
+    m_indexName = m_filename + ".index";
+    uint64_t data_end, index_size;
+    read_index(m_indexName, data_end, index_size);
+
+    m_data = fopen(filename, "ab");
+    if (!m_data) {
+        fprintf(stderr, "Error opening file '%s' for writing\n", filename);
+        return false;
+    }
+    m_index = fopen(m_indexName.c_str(), "ab");
+    if (!m_index) {
+        fprintf(stderr, "Error opening file '%s' for writing\n", m_indexName.c_str());
+        return false;
+    }
+
+    // A run which was cut short may have left a member or an index line
+    // behind which isn't complete
+    uint64_t data_size, index_file_size;
+    if (!file_size(m_data, data_size) || !file_size(m_index, index_file_size)) {
+        fprintf(stderr, "Error reading the size of '%s'\n", filename);
+        return false;
+    }
+    if (data_size < data_end) {
+        fprintf(stderr, "'%s' is shorter than its index says, so it can't be appended to\n",
+                filename);
+        return false;
+    }
+    if ((data_size > data_end && !truncate_file(m_data, data_end))
+            || (index_file_size > index_size && !truncate_file(m_index, index_size))) {
+        fprintf(stderr, "Error cutting off the incomplete end of '%s': %s\n", filename,
+                strerror(errno));
+        return false;
+    }
+    m_offset = data_end;
+    m_indexSize = index_size;
+    return true;
+}
+
+/* Cuts both files back to where they were before the append which failed */
+bool OutputPack::rollBack()
+{
+    if (truncate_file(m_data, m_offset) && truncate_file(m_index, m_indexSize))
+        return true;
+    fprintf(stderr, "Error undoing a failed write to '%s', so nothing more is appended: %s\n",
+            m_filename.c_str(), strerror(errno));
+    m_broken = true;
+    return false;
+}
+
+bool OutputPack::append(const std::string& name, const std::string& member, uint64_t length)
+{
+    std::string line = "{\"file\": ";
+    append_json_string(line, name.data(), name.size());
+    char fields[96];
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_broken)
+        return false;
+    if (fwrite(member.data(), 1, member.size(), m_data) != member.size()
+            || fflush(m_data) != 0) {
+        fprintf(stderr, "Error writing to '%s': %s\n", m_filename.c_str(), strerror(errno));
+        rollBack();
+        return false;
+    }
+    snprintf(fields, sizeof(fields), ", \"offset\": %llu, \"size\": %llu, \"length\": %llu}\n",
+             (unsigned long long)m_offset, (unsigned long long)member.size(),
+             (unsigned long long)length);
+    line += fields;
+    if (fwrite(line.data(), 1, line.size(), m_index) != line.size() || fflush(m_index) != 0) {
+        fprintf(stderr, "Error writing to '%s': %s\n", m_indexName.c_str(), strerror(errno));
+        rollBack();
+        return false;
+    }
+    m_offset += member.size();
+    m_indexSize += line.size();
+    return true;
+}
+
+#ifdef PYC_HAVE_ZLIB
+
+GzipStreamBuf::GzipStreamBuf() : m_stream(new z_stream), m_length()
+{
+    memset(m_stream.get(), 0, sizeof(z_stream));
+    if (deflateInit2(m_stream.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("Could not set up zlib");
+}
+
+GzipStreamBuf::~GzipStreamBuf()
+{
+    deflateEnd(m_stream.get());
+}
+
+void GzipStreamBuf::compress(const char* data, size_t count, bool last)
+{
+    z_stream& zs = *m_stream;
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs.avail_in = (uInt)count;
+    for ( ;; ) {
+        size_t used = m_member.size();
+        m_member.resize(used + count / 2 + 4096);
+        zs.next_out = reinterpret_cast<Bytef*>(&m_member[used]);
+        zs.avail_out = (uInt)(m_member.size() - used);
+        int status = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+        m_member.resize(m_member.size() - zs.avail_out);
+        if (status == Z_STREAM_END || (!last && zs.avail_in == 0 && zs.avail_out != 0))
+            break;
+        if (status != Z_OK && status != Z_BUF_ERROR)
+            throw std::runtime_error("Could not compress the output");
+    }
+}
+
+#else
+
+// Without zlib, nothing should make a pack; the output is kept as it is
+struct z_stream_s { };
+
+GzipStreamBuf::GzipStreamBuf() : m_length() { }
+GzipStreamBuf::~GzipStreamBuf() { }
+
+void GzipStreamBuf::compress(const char* data, size_t count, bool)
+{
+    m_member.append(data, count);
+}
+
+#endif
+
+std::string GzipStreamBuf::finish()
+{
+    compress(nullptr, 0, true);
+    return std::move(m_member);
+}
+
+GzipStreamBuf::int_type GzipStreamBuf::overflow(int_type ch)
+{
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+        return traits_type::not_eof(ch);
+    char byte = traits_type::to_char_type(ch);
+    xsputn(&byte, 1);
+    return ch;
+}
+
+std::streamsize GzipStreamBuf::xsputn(const char* data, std::streamsize count)
+{
+    m_length += (uint64_t)count;
+    compress(data, (size_t)count, false);
+    return count;
+}
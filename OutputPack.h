@@ -0,0 +1,86 @@
+#ifndef _PYC_OUTPUT_PACK_H
+#define _PYC_OUTPUT_PACK_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+
+struct z_stream_s;
+
+/* One file which the outputs of a batch run are appended to, instead of a
+ * file per input.  Each output is a gzip member of its own, so the whole
+ * file is a valid .gz stream of all of them, and an index next to it,
+ * <filename>.index, has a line of JSON for each with where its member is:
+ *
+ *   {"file": "pkg/mod.py", "offset": 0, "size": 123, "length": 456}
+ *
+ * size is the member's compressed size, and length the output's.  Opening
+ * an existing pack appends to it; the index only lists complete members.
+ * A member or index line which couldn't be written in full, e.g. as the
+ * disk is full or the process was killed, is cut off again, so the files
+ * always end after the last member the index lists. */
+class OutputPack {
+public:
+    OutputPack() : m_data(), m_index(), m_offset(), m_indexSize(), m_broken() { }
+    ~OutputPack();
+
+    OutputPack(const OutputPack&) = delete;
+    OutputPack& operator=(const OutputPack&) = delete;
+
+    /* Whether compressing is supported in this build */
+    static bool canCompress();
+
+    /* Returns false, with an error message printed, if either file can't
+     * be opened for appending, or the data is shorter than the index says */
+    bool open(const char* filename);
+
+    /* Appends a member made by a GzipStreamBuf, and its index line.  Returns
+     * false, with an error message printed, if they couldn't be written,
+     * leaving both files as they were.  May be called from several
+     * threads. */
+    bool append(const std::string& name, const std::string& member, uint64_t length);
+
+private:
+    bool rollBack();
+
+    std::string m_filename, m_indexName;
+    FILE* m_data;
+    FILE* m_index;
+    uint64_t m_offset;      // The size of the data file
+    uint64_t m_indexSize;
+    bool m_broken;          // Set if a failed append couldn't be undone
+    std::mutex m_lock;
+};
+
+/* Compresses what's written to it into a gzip member, in memory, so each
+ * worker compresses its own outputs */
+class GzipStreamBuf : public std::streambuf {
+public:
+    GzipStreamBuf();
+    ~GzipStreamBuf();
+
+    GzipStreamBuf(const GzipStreamBuf&) = delete;
+    GzipStreamBuf& operator=(const GzipStreamBuf&) = delete;
+
+    /* Ends the member and hands it over; nothing may be written after that */
+    std::string finish();
+
+    /* How much was written to it */
+    uint64_t length() const { return m_length; }
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* data, std::streamsize count) override;
+
+private:
+    void compress(const char* data, size_t count, bool last);
+
+    std::unique_ptr<z_stream_s> m_stream;
+    std::string m_member;
+    uint64_t m_length;
+};
+
+#endif
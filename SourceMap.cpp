@@ -0,0 +1,169 @@
+#include "SourceMap.h"
+#include "Fingerprint.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+static const char MAGIC[] = "PYCSMAP1";
+static const size_t MAGIC_SIZE = 8;
+
+static void put_word(std::string& out, uint32_t value)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+        out += (char)((value >> shift) & 0xFF);
+}
+
+static uint32_t get_word(const std::vector<unsigned char>& data, size_t& pos)
+{
+    if (data.size() - pos < 4)
+        throw std::runtime_error("Truncated source map");
+    uint32_t value = (uint32_t)data[pos] | ((uint32_t)data[pos + 1] << 8)
+            | ((uint32_t)data[pos + 2] << 16) | ((uint32_t)data[pos + 3] << 24);
+    pos += 4;
+    return value;
+}
+
+bool SourceMap::write(const char* filename, PycModule* mod) const
+{
+    std::unordered_map<const PycCode*, std::string> names;
+    visit_code_objects(mod->code(), mod, "<module>",
+                       [&](PycRef<PycCode> code, const std::string& qualname) {
+        names.emplace((PycCode*)code, qualname);
+    });
+
+    struct Code {
+        const PycCode* code;
+        std::string name;
+        std::vector<SourceMapFile::Entry> entries;
+    };
+    std::unordered_map<const PycCode*, size_t> index;
+    std::vector<Code> codes;
+    for (const auto& note : m_notes) {
+        const PycCode* key = note.code;
+        auto found = index.find(key);
+        if (found == index.end()) {
+            auto name = names.find(key);
+            found = index.emplace(key, codes.size()).first;
+            codes.push_back({ key, (name != names.end()) ? name->second
+                              : note.code->name()->strValue(), {} });
+        }
+        uint32_t source_line = (uint32_t)std::max(note.code->lineAt(mod, note.offset), 0);
+        codes[found->second].entries.push_back({ (uint32_t)note.offset, 0, (uint32_t)note.line,
+                                                 source_line });
+    }
+    std::sort(codes.begin(), codes.end(), [](const Code& a, const Code& b) {
+        if (a.name != b.name)
+            return a.name < b.name;
+        return a.code->firstLine() < b.code->firstLine();
+    });
+
+    std::string header, records, entries, names_blob;
+    uint32_t entry_count = 0;
+    for (auto& code : codes) {
+        // Where several notes share an offset, the first line printed wins
+        std::stable_sort(code.entries.begin(), code.entries.end(),
+                         [](const SourceMapFile::Entry& a, const SourceMapFile::Entry& b) {
+            return a.start < b.start;
+        });
+        auto last = std::unique(code.entries.begin(), code.entries.end(),
+                                [](const SourceMapFile::Entry& a, const SourceMapFile::Entry& b) {
+            return a.start == b.start;
+        });
+        code.entries.erase(last, code.entries.end());
+
+        put_word(records, (uint32_t)names_blob.size());
+        put_word(records, (uint32_t)code.name.size());
+        put_word(records, (uint32_t)code.code->firstLine());
+        put_word(records, entry_count);
+        names_blob += code.name;
+        uint32_t code_end = (uint32_t)code.code->code()->length();
+        for (size_t i = 0; i < code.entries.size(); ++i) {
+            const SourceMapFile::Entry& entry = code.entries[i];
+            put_word(entries, entry.start);
+            put_word(entries, (i + 1 < code.entries.size()) ? code.entries[i + 1].start
+                                                             : std::max(code_end, entry.start + 1));
+            put_word(entries, entry.outputLine);
+            put_word(entries, entry.sourceLine);
+        }
+        entry_count += (uint32_t)code.entries.size();
+    }
+    header.assign(MAGIC, MAGIC_SIZE);
+    put_word(header, (uint32_t)codes.size());
+    put_word(header, entry_count);
+    put_word(header, (uint32_t)names_blob.size());
+
+    std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
+    out << header << records << entries << names_blob;
+    out.close();
+    if (out.fail()) {
+        fprintf(stderr, "Error writing file '%s'\n", filename);
+        return false;
+    }
+    return true;
+}
+
+SourceMapFile::SourceMapFile(const char* filename)
+{
+    std::ifstream in(filename, std::ios_base::in | std::ios_base::binary);
+    if (!in)
+        throw std::runtime_error(std::string("Could not open ") + filename);
+    std::vector<unsigned char> data{std::istreambuf_iterator<char>(in),
+                                    std::istreambuf_iterator<char>()};
+    if (data.size() < MAGIC_SIZE || memcmp(data.data(), MAGIC, MAGIC_SIZE) != 0)
+        throw std::runtime_error("Not a source map");
+
+    size_t pos = MAGIC_SIZE;
+    uint32_t code_count = get_word(data, pos);
+    uint32_t entry_count = get_word(data, pos);
+    uint32_t names_size = get_word(data, pos);
+    size_t names_at = pos + 16 * ((size_t)code_count + entry_count);
+    if (names_at > data.size() || data.size() - names_at < names_size)
+        throw std::runtime_error("Truncated source map");
+
+    for (uint32_t i = 0; i < code_count; ++i) {
+        uint32_t name_offset = get_word(data, pos);
+        uint32_t name_length = get_word(data, pos);
+        int first_line = (int)get_word(data, pos);
+        uint32_t first_entry = get_word(data, pos);
+        if (name_offset > names_size || names_size - name_offset < name_length
+                || first_entry > entry_count)
+            throw std::runtime_error("Corrupt source map");
+        m_codes.push_back({ std::string((const char*)&data[names_at + name_offset], name_length),
+                            first_line, first_entry, entry_count });
+        if (i > 0)
+            m_codes[i - 1].endEntry = first_entry;
+    }
+    for (uint32_t i = 0; i < entry_count; ++i) {
+        Entry entry;
+        entry.start = get_word(data, pos);
+        entry.end = get_word(data, pos);
+        entry.outputLine = get_word(data, pos);
+        entry.sourceLine = get_word(data, pos);
+        m_entries.push_back(entry);
+    }
+}
+
+const SourceMapFile::Entry* SourceMapFile::find(const std::string& qualname, int firstLine,
+                                                uint32_t offset) const
+{
+    auto code = std::lower_bound(m_codes.begin(), m_codes.end(), qualname,
+                                 [firstLine](const Code& code, const std::string& name) {
+        return code.name < name || (code.name == name && code.firstLine < firstLine);
+    });
+    if (code == m_codes.end() || code->name != qualname || code->firstLine != firstLine
+            || code->firstEntry >= code->endEntry)
+        return nullptr;
+
+    // The last entry which starts at or before offset
+    auto begin = m_entries.begin() + code->firstEntry;
+    auto end = m_entries.begin() + code->endEntry;
+    auto entry = std::upper_bound(begin, end, offset, [](uint32_t offset, const Entry& entry) {
+        return offset < entry.start;
+    });
+    if (entry == begin || offset >= (entry - 1)->end)
+        return nullptr;
+    return &*(entry - 1);
+}
@@ -0,0 +1,72 @@
+#ifndef _PYC_SOURCE_MAP_H
+#define _PYC_SOURCE_MAP_H
+
+#include "pyc_module.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Where each statement of the decompiled source came from: which code
+ * object, and the range of bytecode offsets (as pycdas shows them) from its
+ * first instruction up to the next statement's.  It's noted while printing
+ * (see DecompileContext::sourceMap), and written to a file of its own,
+ * which SourceMapFile looks up a traceback's code object and offset in.
+ *
+ * The file is little endian 32-bit words throughout:
+ *
+ *   "PYCSMAP1", code count, entry count, size of the names
+ *   code records:  name offset, name length, first line, first entry
+ *   entries:       start offset, end offset, output line, source line
+ *   names:         the qualified names, as UTF-8
+ *
+ * The code records are sorted by name and first line, and the entries of
+ * each code object, which start at its first entry, by start offset. */
+class SourceMap {
+public:
+    /* The statement on the output's line comes from the instruction of code
+     * at offset */
+    void note(PycRef<PycCode> code, int offset, size_t line)
+    {
+        m_notes.push_back({ std::move(code), offset, line });
+    }
+
+    /* Returns false, with an error message printed, if it can't be written */
+    bool write(const char* filename, PycModule* mod) const;
+
+private:
+    struct Note {
+        PycRef<PycCode> code;
+        int offset;
+        size_t line;
+    };
+
+    std::vector<Note> m_notes;
+};
+
+class SourceMapFile {
+public:
+    struct Entry {
+        uint32_t start, end;
+        uint32_t outputLine;
+        uint32_t sourceLine;    // 0 if the code object has no line table
+    };
+
+    /* Throws if it can't be read */
+    explicit SourceMapFile(const char* filename);
+
+    /* The statement which the instruction at offset of the code object with
+     * this qualified name and first line belongs to, or null */
+    const Entry* find(const std::string& qualname, int firstLine, uint32_t offset) const;
+
+private:
+    struct Code {
+        std::string name;
+        int firstLine;
+        size_t firstEntry, endEntry;
+    };
+
+    std::vector<Code> m_codes;
+    std::vector<Entry> m_entries;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned threads)
+    : m_nextQueue(0), m_pending(0), m_stop(false)
+{
+    if (threads == 0)
+        threads = 1;
+    for (unsigned i = 0; i < threads; ++i)
+        m_queues.emplace_back(new Queue);
+    for (unsigned i = 0; i < threads; ++i)
+        m_threads.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::submit(task_t task)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        ++m_pending;
+    }
+    Queue& queue = *m_queues[m_nextQueue++ % m_queues.size()];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(std::move(task));
+    }
+    m_wake.notify_one();
+}
+
+bool ThreadPool::takeTask(unsigned self, task_t& task)
+{
+    {
+        Queue& own = *m_queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < m_queues.size(); ++i) {
+        Queue& other = *m_queues[(self + i) % m_queues.size()];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (!other.tasks.empty()) {
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(unsigned self)
+{
+    for ( ;; ) {
+        task_t task;
+        if (takeTask(self, task)) {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                --m_pending;
+            }
+            task();
+            continue;
+        }
+
+        // A task counted in m_pending may still be on its way into a queue,
+        // so only sleep once there is nothing left at all
+        std::unique_lock<std::mutex> guard(m_lock);
+        if (m_pending == 0) {
+            if (m_stop)
+                return;
+            m_wake.wait(guard);
+        }
+    }
+}
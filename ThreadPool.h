@@ -0,0 +1,52 @@
+#ifndef _PYC_THREADPOOL_H
+#define _PYC_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed set of worker threads with one task queue each.  Workers take
+ * tasks from the back of their own queue and steal from the front of the
+ * others' queues once theirs runs dry. */
+class ThreadPool {
+public:
+    typedef std::function<void()> task_t;
+
+    explicit ThreadPool(unsigned threads);
+
+    /* Runs all tasks which are still queued before returning */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return (unsigned)m_threads.size(); }
+
+    /* Tasks must not throw */
+    void submit(task_t task);
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<task_t> tasks;
+    };
+
+    bool takeTask(unsigned self, task_t& task);
+    void run(unsigned self);
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<unsigned> m_nextQueue;
+
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    size_t m_pending;
+    bool m_stop;
+};
+
+#endif
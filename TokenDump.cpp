@@ -0,0 +1,397 @@
+#include "TokenDump.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+/* Longest first where tokens share a prefix, as in the script */
+static const char* const symbolic_tokens[] = {
+    "<<=", ">>=", "**=", "//=", "...", ".",
+    "+=", "-=", "*=", "@=", "/=", "%=", "&=", "|=", "^=",
+    "<>", "<<", "<=", "<", ">>", ">=", ">", "!=", "==", "=",
+    ",", ";", ":=", ":", "->", "~", "`",
+    "+", "-", "**", "*", "@", "//", "/", "%", "&", "|", "^",
+    "(", ")", "{", "}", "[", "]",
+};
+
+/* What str.strip() strips, short of the non-ASCII whitespace */
+static bool is_space(char ch)
+{
+    return ch == ' ' || (ch >= '\t' && ch <= '\r') || (ch >= '\x1c' && ch <= '\x1f');
+}
+
+static bool is_digit(char ch)
+{
+    return ch >= '0' && ch <= '9';
+}
+
+static bool is_word_char(char ch, bool first)
+{
+    return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == '_'
+            || (!first && is_digit(ch));
+}
+
+static bool is_one_of(char ch, const char* chars)
+{
+    return ch != '\0' && strchr(chars, ch) != nullptr;
+}
+
+static void replace_all(std::string& str, const char* from, const char* to)
+{
+    size_t from_len = strlen(from), to_len = strlen(to);
+    for (size_t pos = str.find(from); pos != std::string::npos;
+            pos = str.find(from, pos + to_len)) {
+        str.replace(pos, from_len, to);
+    }
+}
+
+static std::string without_underscores(const std::string& str)
+{
+    std::string result;
+    for (char ch : str) {
+        if (ch != '_')
+            result += ch;
+    }
+    return result;
+}
+
+/* Reads the lines of the source, each with its newline like readline() */
+class LineReader {
+public:
+    explicit LineReader(const std::string& source) : m_source(source), m_pos() { }
+
+    bool readline(std::string& line)
+    {
+        if (m_pos >= m_source.size())
+            return false;
+        size_t end = m_source.find('\n', m_pos);
+        end = (end == std::string::npos) ? m_source.size() : end + 1;
+        line.assign(m_source, m_pos, end - m_pos);
+        m_pos = end;
+        return true;
+    }
+
+private:
+    const std::string& m_source;
+    size_t m_pos;
+};
+
+/* Where [0-9][0-9_]* starting at pos ends, or pos if it doesn't match */
+static size_t skip_digits(const std::string& str, size_t pos)
+{
+    if (pos >= str.size() || !is_digit(str[pos]))
+        return pos;
+    ++pos;
+    while (pos < str.size() && (is_digit(str[pos]) || str[pos] == '_'))
+        ++pos;
+    return pos;
+}
+
+/* The end of RE_FLOAT's match at pos, or pos if it doesn't match */
+static size_t match_float(const std::string& str, size_t pos)
+{
+    size_t digits = skip_digits(str, pos);
+    size_t end;
+    if (digits < str.size() && str[digits] == '.' && skip_digits(str, digits + 1) > digits + 1)
+        end = skip_digits(str, digits + 1);
+    else if (digits > pos && digits < str.size() && str[digits] == '.')
+        end = digits + 1;
+    else
+        return pos;
+
+    if (end < str.size() && (str[end] == 'e' || str[end] == 'E')) {
+        size_t exp = end + 1;
+        if (exp < str.size() && (str[exp] == '+' || str[exp] == '-'))
+            ++exp;
+        if (skip_digits(str, exp) > exp)
+            end = skip_digits(str, exp);
+    }
+    return end;
+}
+
+/* What str(int(value, 0)) gives, or else str(int(value, 8)) for the
+ * Python 2 octal literals */
+static std::string int_str(const std::string& literal)
+{
+    std::string digits = without_underscores(literal);
+    size_t first = digits.find_first_not_of('0');
+    if (first == std::string::npos)
+        return "0";
+    if (first == 0)
+        return digits;
+    if (digits.find_first_not_of("01234567") != std::string::npos)
+        throw std::runtime_error("invalid literal for int() with base 8: '" + literal + "'");
+
+    // Little endian, in base 10^9
+    std::vector<uint32_t> value;
+    for (char ch : digits) {
+        uint64_t carry = (uint64_t)(ch - '0');
+        for (auto& part : value) {
+            uint64_t next = (uint64_t)part * 8 + carry;
+            part = (uint32_t)(next % 1000000000);
+            carry = next / 1000000000;
+        }
+        if (carry)
+            value.push_back((uint32_t)carry);
+    }
+    std::string result = std::to_string(value.back());
+    for (size_t i = value.size() - 1; i-- > 0; ) {
+        char part[16];
+        snprintf(part, sizeof(part), "%09u", (unsigned)value[i]);
+        result += part;
+    }
+    return result;
+}
+
+/* What repr() gives for a float: the shortest digits which read back as
+ * the same value, in exponent notation if the point is far out */
+static std::string float_repr(double value)
+{
+    if (std::isinf(value))
+        return "inf";
+    if (value == 0)
+        return "0.0";
+
+    char buffer[40];
+    for (int precision = 1; precision <= 17; ++precision) {
+        snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+        if (strtod(buffer, nullptr) == value)
+            break;
+    }
+    const char* exp = strchr(buffer, 'e');
+    std::string digits;
+    for (const char* cp = buffer; cp < exp; ++cp) {
+        if (is_digit(*cp))
+            digits += *cp;
+    }
+    while (digits.size() > 1 && digits.back() == '0')
+        digits.pop_back();
+    int point = atoi(exp + 1) + 1;
+
+    if (point <= -4 || point > 16) {
+        std::string result = digits.substr(0, 1);
+        if (digits.size() > 1)
+            result += "." + digits.substr(1);
+        char exponent[16];
+        snprintf(exponent, sizeof(exponent), "e%c%02d", (point - 1 < 0) ? '-' : '+',
+                 std::abs(point - 1));
+        return result + exponent;
+    }
+    if (point <= 0)
+        return "0." + std::string(-point, '0') + digits;
+    if ((size_t)point >= digits.size())
+        return digits + std::string(point - digits.size(), '0') + ".0";
+    return digits.substr(0, point) + "." + digits.substr(point);
+}
+
+/* The length of the string prefix and opening quotes RE_START_STRING
+ * matches at pos, or 0 */
+static size_t match_string_start(const std::string& line, size_t pos, std::string& prefix,
+                                 std::string& quotes)
+{
+    static const char* const quote_kinds[] = { "'''", "'", "\"\"\"", "\"" };
+    char first = (pos < line.size()) ? line[pos] : '\0';
+    char second = (pos + 1 < line.size()) ? line[pos + 1] : '\0';
+
+    // In the order the alternatives are tried in
+    std::vector<size_t> lengths;
+    if (is_one_of(first, "rR")) {
+        if (is_one_of(second, "fFbB"))
+            lengths.push_back(2);
+        lengths.push_back(1);
+    } else if (is_one_of(first, "uU")) {
+        lengths.push_back(1);
+    } else if (is_one_of(first, "fFbB")) {
+        if (is_one_of(second, "rR"))
+            lengths.push_back(2);
+        lengths.push_back(1);
+    }
+    lengths.push_back(0);
+
+    for (size_t length : lengths) {
+        for (const char* kind : quote_kinds) {
+            if (line.compare(pos + length, strlen(kind), kind) == 0) {
+                prefix = line.substr(pos, length);
+                quotes = kind;
+                return length + quotes.size();
+            }
+        }
+    }
+    return 0;
+}
+
+/* Reads the string starting at pos, reading more lines as needed, and
+ * leaves line and pos at what follows it */
+static std::string string_token(LineReader& reader, std::string& line, size_t& pos, int& n_line)
+{
+    std::string prefix, quotes;
+    size_t start = pos + match_string_start(line, pos, prefix, quotes);
+    std::string content;
+    size_t end;
+    for ( ;; ) {
+        end = line.find(quotes, start);
+        if (end != std::string::npos && end > 0 && line[end - 1] == '\\') {
+            content += line.substr(start, end + 1 - start);
+            start = end + 1;
+            continue;
+        } else if (end != std::string::npos) {
+            content += line.substr(start, end - start);
+            break;
+        }
+
+        content += line.substr(start);
+        ++n_line;
+        start = 0;
+        if (!reader.readline(line))
+            throw std::runtime_error("Reached EOF while looking for " + quotes);
+    }
+    pos = end + quotes.size();
+
+    for (auto& ch : prefix)
+        ch = (char)tolower((unsigned char)ch);
+    std::sort(prefix.begin(), prefix.end());
+    replace_all(content, "\\'", "'");
+    replace_all(content, "'", "\\'");
+    replace_all(content, "\\\"", "\"");
+    replace_all(content, "\t", "\\t");
+    replace_all(content, "\n", "\\n");
+    replace_all(content, "\r", "\\r");
+    return prefix + "'" + content + "'";
+}
+
+/* Python reads the source as UTF-8, and fails on anything else */
+static void check_utf8(const std::string& source)
+{
+    for (size_t i = 0; i < source.size(); ) {
+        unsigned char lead = (unsigned char)source[i];
+        size_t length = (lead < 0x80) ? 1 : (lead >= 0xC2 && lead < 0xE0) ? 2
+                      : (lead >= 0xE0 && lead < 0xF0) ? 3 : (lead >= 0xF0 && lead < 0xF5) ? 4 : 0;
+        if (length == 0 || i + length > source.size())
+            throw std::runtime_error("Source is not valid UTF-8");
+        for (size_t k = 1; k < length; ++k) {
+            if (((unsigned char)source[i + k] & 0xC0) != 0x80)
+                throw std::runtime_error("Source is not valid UTF-8");
+        }
+        i += length;
+    }
+}
+
+std::string token_dump(const std::string& raw_source)
+{
+    check_utf8(raw_source);
+
+    // Universal newlines, as the script reads the file in text mode
+    std::string source;
+    source.reserve(raw_source.size());
+    for (size_t i = 0; i < raw_source.size(); ++i) {
+        if (raw_source[i] != '\r')
+            source += raw_source[i];
+        else if (i + 1 >= raw_source.size() || raw_source[i + 1] != '\n')
+            source += '\n';
+    }
+
+    std::string out;
+    auto token = [&out](const std::string& text) {
+        out += text;
+        out += ' ';
+    };
+
+    LineReader reader(source);
+    std::vector<size_t> indent_stack(1, 0);
+    std::vector<char> context_stack;
+    int n_line = 0;
+    std::string line;
+    while (reader.readline(line)) {
+        ++n_line;
+        size_t first = 0;
+        while (first < line.size() && is_space(line[first]))
+            ++first;
+        if (first == line.size() || line[first] == '#')
+            continue;
+
+        if (context_stack.empty()) {
+            if (first > indent_stack.back()) {
+                indent_stack.push_back(first);
+                out += "<INDENT>\n";
+            }
+            while (first < indent_stack.back()) {
+                indent_stack.pop_back();
+                out += "<OUTDENT>\n";
+            }
+            if (first != indent_stack.back())
+                throw std::runtime_error("Incorrect indentation on line " + std::to_string(n_line));
+        }
+
+        size_t pos = 0;
+        for ( ;; ) {
+            while (pos < line.size() && is_space(line[pos]))
+                ++pos;
+            if (pos == line.size() || line[pos] == '#')
+                break;
+
+            const char* symbol = nullptr;
+            for (const char* candidate : symbolic_tokens) {
+                if (line.compare(pos, strlen(candidate), candidate) == 0) {
+                    symbol = candidate;
+                    break;
+                }
+            }
+            if (symbol) {
+                char ch = symbol[0];
+                if (symbol[1] == '\0' && (ch == '(' || ch == '{' || ch == '[')) {
+                    context_stack.push_back(ch);
+                } else if (symbol[1] == '\0' && (ch == ')' || ch == '}' || ch == ']')) {
+                    char open = (ch == ')') ? '(' : (ch == '}') ? '{' : '[';
+                    if (context_stack.empty() || context_stack.back() != open) {
+                        throw std::runtime_error("Mismatched token on line "
+                                                 + std::to_string(n_line));
+                    }
+                    context_stack.pop_back();
+                }
+                token(symbol);
+                pos += strlen(symbol);
+                continue;
+            }
+
+            size_t end = match_float(line, pos);
+            if (end > pos) {
+                std::string value = without_underscores(line.substr(pos, end - pos));
+                token(float_repr(strtod(value.c_str(), nullptr)));
+                pos = end;
+                continue;
+            }
+
+            end = skip_digits(line, pos);
+            if (end > pos) {
+                token(int_str(line.substr(pos, end - pos)));
+                pos = end;
+                continue;
+            }
+
+            std::string prefix, quotes;
+            if (match_string_start(line, pos, prefix, quotes)) {
+                token(string_token(reader, line, pos, n_line));
+                continue;
+            }
+
+            if (is_word_char(line[pos], true)) {
+                end = pos + 1;
+                while (end < line.size() && is_word_char(line[end], false))
+                    ++end;
+                token(line.substr(pos, end - pos));
+                pos = end;
+                continue;
+            }
+
+            throw std::runtime_error("Unrecognized tokens at line " + std::to_string(n_line));
+        }
+
+        if (context_stack.empty())
+            out += "<EOL>\n";
+    }
+    return out;
+}
@@ -0,0 +1,18 @@
+#ifndef _PYC_TOKENDUMP_H
+#define _PYC_TOKENDUMP_H
+
+#include <string>
+
+/* A port of scripts/token_dump, which the test corpus is compared by: the
+ * tokens of Python source, with the end of each logical line and each
+ * change of indentation on a line of its own, leaving out comments and
+ * other whitespace.  Numbers are printed the way Python prints their
+ * values, and string literals with their prefixes sorted and their quotes
+ * normalized, so equal code compares equal however it was spelled.
+ *
+ * The result is the same text the script writes, for source which is
+ * valid UTF-8 and only indented with ASCII whitespace (as pycdc's output
+ * is).  Throws std::runtime_error where the script raises. */
+std::string token_dump(const std::string& source);
+
+#endif
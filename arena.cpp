@@ -0,0 +1,25 @@
+#include "arena.h"
+#include <new>
+
+BumpAllocator::~BumpAllocator()
+{
+    for (char* block : m_blocks)
+        ::operator delete(block);
+    if (m_account)
+        m_account->remove(m_reserved);
+}
+
+void BumpAllocator::newBlock(size_t size)
+{
+    if (size < m_next)
+        size = m_next;
+    if (m_next < BLOCK_SIZE)
+        m_next *= 2;
+    m_blocks.push_back(nullptr);
+    m_blocks.back() = static_cast<char*>(::operator new(size));
+    m_cur = m_blocks.back();
+    m_end = m_cur + size;
+    m_reserved += size;
+    if (m_account)
+        m_account->add(size);
+}
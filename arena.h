@@ -0,0 +1,81 @@
+#ifndef _PYC_ARENA_H
+#define _PYC_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* The bytes held by the arenas of one input (its module's objects and the
+ * ASTs built from them), and the most they held at once, against an
+ * optional limit.  Shared by the threads building its code objects. */
+class MemoryAccount {
+public:
+    explicit MemoryAccount(uint64_t limit = 0) : m_limit(limit), m_current(0), m_peak(0) { }
+
+    MemoryAccount(const MemoryAccount&) = delete;
+    MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+    void add(uint64_t bytes)
+    {
+        uint64_t now = m_current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        uint64_t peak = m_peak.load(std::memory_order_relaxed);
+        while (now > peak && !m_peak.compare_exchange_weak(peak, now,
+                                                            std::memory_order_relaxed)) { }
+    }
+
+    void remove(uint64_t bytes) { m_current.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    uint64_t current() const { return m_current.load(std::memory_order_relaxed); }
+    uint64_t peak() const { return m_peak.load(std::memory_order_relaxed); }
+    uint64_t limit() const { return m_limit; }
+
+    /* Whether more than the limit is held, if there is one */
+    bool over() const { return m_limit && current() > m_limit; }
+
+private:
+    const uint64_t m_limit;
+    std::atomic<uint64_t> m_current;
+    std::atomic<uint64_t> m_peak;
+};
+
+/* Hands out memory from large blocks, which are only freed all at once when
+ * the allocator is destroyed.  Nothing is destructed; that is up to the
+ * owner of the objects.  The blocks start out small and double in size up
+ * to BLOCK_SIZE, as most code objects only need a few nodes.  They are
+ * charged to account, if given. */
+class BumpAllocator {
+public:
+    explicit BumpAllocator(MemoryAccount* account = nullptr)
+        : m_cur(), m_end(), m_next(FIRST_BLOCK_SIZE), m_account(account), m_reserved() { }
+    ~BumpAllocator();
+
+    BumpAllocator(const BumpAllocator&) = delete;
+    BumpAllocator& operator=(const BumpAllocator&) = delete;
+
+    void* allocate(size_t size)
+    {
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if ((size_t)(m_end - m_cur) < size)
+            newBlock(size);
+        void* mem = m_cur;
+        m_cur += size;
+        return mem;
+    }
+
+private:
+    void newBlock(size_t size);
+
+    static const size_t FIRST_BLOCK_SIZE = 1024;
+    static const size_t BLOCK_SIZE = 32768;
+    static const size_t ALIGNMENT = alignof(std::max_align_t);
+
+    char* m_cur;
+    char* m_end;
+    size_t m_next;          // The size of the next block
+    MemoryAccount* m_account;
+    size_t m_reserved;      // The size of all blocks
+    std::vector<char*> m_blocks;
+};
+
+#endif
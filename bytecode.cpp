@@ -9,7 +9,7 @@
 #endif
 
 #define DECLARE_PYTHON(maj, min) \
-    extern int python_##maj##_##min##_map(int);
+    extern const int* python_##maj##_##min##_table();
 
 DECLARE_PYTHON(1, 0)
 DECLARE_PYTHON(1, 1)
@@ -40,82 +40,112 @@ DECLARE_PYTHON(3, 11)
 DECLARE_PYTHON(3, 12)
 DECLARE_PYTHON(3, 13)
 
-const char* Pyc::OpcodeName(int opcode)
-{
-    static const char* opcode_names[] = {
-        #define OPCODE(x) #x,
-        #define OPCODE_A_FIRST(x) #x,
-        #define OPCODE_A(x) #x,
-        #include "bytecode_ops.inl"
-        #undef OPCODE_A
-        #undef OPCODE_A_FIRST
-        #undef OPCODE
-    };
-
-#if __cplusplus >= 201103L
-    static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == PYC_LAST_OPCODE,
-                  "Pyc::OpcodeName opcode_names not in sync with opcode enum");
-#endif
+static constexpr PycStringView opcode_names[] = {
+    #define OPCODE(x) PycStringView(#x, sizeof(#x) - 1),
+    #define OPCODE_A_FIRST(x) PycStringView(#x, sizeof(#x) - 1),
+    #define OPCODE_A(x) PycStringView(#x, sizeof(#x) - 1),
+    #include "bytecode_ops.inl"
+    #undef OPCODE_A
+    #undef OPCODE_A_FIRST
+    #undef OPCODE
+};
 
-    if (opcode < 0)
-        return "<INVALID>";
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == Pyc::PYC_LAST_OPCODE,
+              "Pyc::OpcodeName opcode_names not in sync with opcode enum");
 
-    if (opcode < PYC_LAST_OPCODE)
-        return opcode_names[opcode];
+PycStringView Pyc::OpcodeNameView(int opcode)
+{
+    if (opcode < 0 || opcode >= PYC_LAST_OPCODE)
+        return PycStringView("<INVALID>", 9);
+    return opcode_names[opcode];
+}
 
-    static char badcode[16];
-    snprintf(badcode, sizeof(badcode), "<%d>", opcode);
-    return badcode;
-};
+const char* Pyc::OpcodeName(int opcode)
+{
+    // The names are literals, so they are terminated as well
+    return OpcodeNameView(opcode).data();
+}
 
-int Pyc::ByteToOpcode(int maj, int min, int opcode)
+const int* Pyc::OpcodeMap(int maj, int min)
 {
     switch (maj) {
     case 1:
         switch (min) {
-        case 0: return python_1_0_map(opcode);
-        case 1: return python_1_1_map(opcode);
-        case 3: return python_1_3_map(opcode);
-        case 4: return python_1_4_map(opcode);
-        case 5: return python_1_5_map(opcode);
-        case 6: return python_1_6_map(opcode);
+        case 0: return python_1_0_table();
+        case 1: return python_1_1_table();
+        case 3: return python_1_3_table();
+        case 4: return python_1_4_table();
+        case 5: return python_1_5_table();
+        case 6: return python_1_6_table();
         }
         break;
     case 2:
         switch (min) {
-        case 0: return python_2_0_map(opcode);
-        case 1: return python_2_1_map(opcode);
-        case 2: return python_2_2_map(opcode);
-        case 3: return python_2_3_map(opcode);
-        case 4: return python_2_4_map(opcode);
-        case 5: return python_2_5_map(opcode);
-        case 6: return python_2_6_map(opcode);
-        case 7: return python_2_7_map(opcode);
+        case 0: return python_2_0_table();
+        case 1: return python_2_1_table();
+        case 2: return python_2_2_table();
+        case 3: return python_2_3_table();
+        case 4: return python_2_4_table();
+        case 5: return python_2_5_table();
+        case 6: return python_2_6_table();
+        case 7: return python_2_7_table();
         }
         break;
     case 3:
         switch (min) {
-        case 0: return python_3_0_map(opcode);
-        case 1: return python_3_1_map(opcode);
-        case 2: return python_3_2_map(opcode);
-        case 3: return python_3_3_map(opcode);
-        case 4: return python_3_4_map(opcode);
-        case 5: return python_3_5_map(opcode);
-        case 6: return python_3_6_map(opcode);
-        case 7: return python_3_7_map(opcode);
-        case 8: return python_3_8_map(opcode);
-        case 9: return python_3_9_map(opcode);
-        case 10: return python_3_10_map(opcode);
-        case 11: return python_3_11_map(opcode);
-        case 12: return python_3_12_map(opcode);
-        case 13: return python_3_13_map(opcode);
+        case 0: return python_3_0_table();
+        case 1: return python_3_1_table();
+        case 2: return python_3_2_table();
+        case 3: return python_3_3_table();
+        case 4: return python_3_4_table();
+        case 5: return python_3_5_table();
+        case 6: return python_3_6_table();
+        case 7: return python_3_7_table();
+        case 8: return python_3_8_table();
+        case 9: return python_3_9_table();
+        case 10: return python_3_10_table();
+        case 11: return python_3_11_table();
+        case 12: return python_3_12_table();
+        case 13: return python_3_13_table();
         }
         break;
     }
-    return PYC_INVALID_OPCODE;
+    return NULL;
+}
+
+int Pyc::ByteToOpcode(int maj, int min, int opcode)
+{
+    const int* map = OpcodeMap(maj, min);
+    if (!map || opcode < 0 || opcode > 255)
+        return PYC_INVALID_OPCODE;
+    return map[opcode];
 }
 
-void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod,
+/* Containers with fewer items are cheaper to format again than to keep */
+static const size_t RENDERED_CONST_ITEMS = 16;
+
+static size_t const_items(const PycObject* obj)
+{
+    switch (obj->type()) {
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        return static_cast<const PycTuple*>(obj)->values().size();
+    case PycObject::TYPE_LIST:
+        return static_cast<const PycList*>(obj)->values().size();
+    case PycObject::TYPE_DICT:
+        return static_cast<const PycDict*>(obj)->values().size();
+    case PycObject::TYPE_SET:
+    case PycObject::TYPE_FROZENSET:
+        return static_cast<const PycSet*>(obj)->values().size();
+    default:
+        return 0;
+    }
+}
+
+static void print_const_value(PycOutput& pyc_output, const PycRef<PycObject>& obj,
+                              PycModule* mod, const char* parent_f_string_quote);
+
+void print_const(PycOutput& pyc_output, const PycRef<PycObject>& obj, PycModule* mod,
                  const char* parent_f_string_quote)
 {
     if (obj == NULL) {
@@ -123,6 +153,23 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
         return;
     }
 
+    // Large constants are kept as text once they have been formatted
+    if (mod == NULL || const_items(obj) < RENDERED_CONST_ITEMS) {
+        print_const_value(pyc_output, obj, mod, parent_f_string_quote);
+        return;
+    }
+    if (const std::string* text = mod->renderedConst(obj, parent_f_string_quote)) {
+        pyc_output << *text;
+        return;
+    }
+    size_t start = pyc_output.beginCapture();
+    print_const_value(pyc_output, obj, mod, parent_f_string_quote);
+    mod->keepRenderedConst(obj, parent_f_string_quote, pyc_output.endCapture(start));
+}
+
+static void print_const_value(PycOutput& pyc_output, const PycRef<PycObject>& obj,
+                              PycModule* mod, const char* parent_f_string_quote)
+{
     switch (obj->type()) {
     case PycObject::TYPE_STRING:
     case PycObject::TYPE_UNICODE:
@@ -137,7 +184,7 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
     case PycObject::TYPE_SMALL_TUPLE:
         {
             pyc_output << "(";
-            PycTuple::value_t values = obj.cast<PycTuple>()->values();
+            const PycTuple::value_t& values = obj.cast<PycTuple>()->values();
             auto it = values.cbegin();
             if (it != values.cend()) {
                 print_const(pyc_output, *it, mod);
@@ -155,7 +202,7 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
     case PycObject::TYPE_LIST:
         {
             pyc_output << "[";
-            PycList::value_t values = obj.cast<PycList>()->values();
+            const PycList::value_t& values = obj.cast<PycList>()->values();
             auto it = values.cbegin();
             if (it != values.cend()) {
                 print_const(pyc_output, *it, mod);
@@ -170,7 +217,7 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
     case PycObject::TYPE_DICT:
         {
             pyc_output << "{";
-            PycDict::value_t values = obj.cast<PycDict>()->values();
+            const PycDict::value_t& values = obj.cast<PycDict>()->values();
             auto it = values.cbegin();
             if (it != values.cend()) {
                 print_const(pyc_output, std::get<0>(*it), mod);
@@ -189,7 +236,7 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
     case PycObject::TYPE_SET:
         {
             pyc_output << "{";
-            PycSet::value_t values = obj.cast<PycSet>()->values();
+            const PycSet::value_t& values = obj.cast<PycSet>()->values();
             auto it = values.cbegin();
             if (it != values.cend()) {
                 print_const(pyc_output, *it, mod);
@@ -204,7 +251,7 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
     case PycObject::TYPE_FROZENSET:
         {
             pyc_output << "frozenset({";
-            PycSet::value_t values = obj.cast<PycSet>()->values();
+            const PycSet::value_t& values = obj.cast<PycSet>()->values();
             auto it = values.cbegin();
             if (it != values.cend()) {
                 print_const(pyc_output, *it, mod);
@@ -269,21 +316,139 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
         break;
     case PycObject::TYPE_CODE:
     case PycObject::TYPE_CODE2:
-        pyc_output << "<CODE> " << obj.cast<PycCode>()->name()->value();
+        pyc_output << "<CODE> " << obj.cast<PycCode>()->name()->view();
         break;
     default:
         formatted_print(pyc_output, "<TYPE: %d>\n", obj->type());
     }
 }
 
+Pyc::FlowKind Pyc::FlowKindOf(int opcode)
+{
+    switch (opcode) {
+    case Pyc::JUMP_FORWARD_A:
+    case Pyc::JUMP_ABSOLUTE_A:
+    case Pyc::CONTINUE_LOOP_A:
+    case Pyc::JUMP_BACKWARD_A:
+    case Pyc::JUMP_BACKWARD_NO_INTERRUPT_A:
+    case Pyc::INSTRUMENTED_JUMP_FORWARD_A:
+    case Pyc::INSTRUMENTED_JUMP_BACKWARD_A:
+        return FLOW_JUMP;
+    case Pyc::JUMP_IF_FALSE_A:
+    case Pyc::JUMP_IF_TRUE_A:
+    case Pyc::JUMP_IF_FALSE_OR_POP_A:
+    case Pyc::JUMP_IF_TRUE_OR_POP_A:
+    case Pyc::POP_JUMP_IF_FALSE_A:
+    case Pyc::POP_JUMP_IF_TRUE_A:
+    case Pyc::POP_JUMP_IF_NONE_A:
+    case Pyc::POP_JUMP_IF_NOT_NONE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_FALSE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_TRUE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_NONE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_NOT_NONE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_FALSE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_TRUE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_NONE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_NOT_NONE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_FALSE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_TRUE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_NONE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_NOT_NONE_A:
+    case Pyc::JUMP_IF_NOT_EXC_MATCH_A:
+    case Pyc::FOR_LOOP_A:
+    case Pyc::FOR_ITER_A:
+    case Pyc::INSTRUMENTED_FOR_ITER_A:
+    case Pyc::SEND_A:
+        return FLOW_BRANCH;
+    case Pyc::SETUP_LOOP_A:
+    case Pyc::SETUP_EXCEPT_A:
+    case Pyc::SETUP_FINALLY_A:
+    case Pyc::SETUP_WITH_A:
+    case Pyc::SETUP_ASYNC_WITH_A:
+        return FLOW_SETUP;
+    case Pyc::BREAK_LOOP:
+        return FLOW_BREAK;
+    case Pyc::RETURN_VALUE:
+    case Pyc::RETURN_CONST_A:
+    case Pyc::INSTRUMENTED_RETURN_VALUE_A:
+    case Pyc::INSTRUMENTED_RETURN_CONST_A:
+    case Pyc::RAISE_EXCEPTION:
+    case Pyc::RAISE_VARARGS_A:
+    case Pyc::RERAISE:
+    case Pyc::RERAISE_A:
+        return FLOW_EXIT;
+    default:
+        return FLOW_NEXT;
+    }
+}
+
+int bc_jump_target(PycModule* mod, int opcode, int operand, int next)
+{
+    const int unit = mod->has(PycModule::CAP_JUMPS_IN_WORDS) ? (int)sizeof(uint16_t) : 1;
+    switch (opcode) {
+    case Pyc::POP_JUMP_IF_FALSE_A:
+    case Pyc::POP_JUMP_IF_TRUE_A:
+        // Relative from 3.12 on
+        if (mod->has(PycModule::CAP_RELATIVE_JUMPS))
+            return next + operand * unit;
+        return operand * unit;
+    case Pyc::JUMP_ABSOLUTE_A:
+    case Pyc::CONTINUE_LOOP_A:
+    case Pyc::JUMP_IF_FALSE_OR_POP_A:
+    case Pyc::JUMP_IF_TRUE_OR_POP_A:
+    case Pyc::JUMP_IF_NOT_EXC_MATCH_A:
+        return operand * unit;
+    case Pyc::JUMP_FORWARD_A:
+    case Pyc::JUMP_IF_FALSE_A:
+    case Pyc::JUMP_IF_TRUE_A:
+    case Pyc::FOR_LOOP_A:
+    case Pyc::FOR_ITER_A:
+    case Pyc::SETUP_LOOP_A:
+    case Pyc::SETUP_EXCEPT_A:
+    case Pyc::SETUP_FINALLY_A:
+    case Pyc::SETUP_WITH_A:
+    case Pyc::SETUP_ASYNC_WITH_A:
+    case Pyc::POP_JUMP_IF_NONE_A:
+    case Pyc::POP_JUMP_IF_NOT_NONE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_FALSE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_TRUE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_NONE_A:
+    case Pyc::POP_JUMP_FORWARD_IF_NOT_NONE_A:
+    case Pyc::SEND_A:
+    case Pyc::INSTRUMENTED_JUMP_FORWARD_A:
+    case Pyc::INSTRUMENTED_FOR_ITER_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_FALSE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_TRUE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_NONE_A:
+    case Pyc::INSTRUMENTED_POP_JUMP_IF_NOT_NONE_A:
+        return next + operand * unit;
+    case Pyc::JUMP_BACKWARD_A:
+    case Pyc::JUMP_BACKWARD_NO_INTERRUPT_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_FALSE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_TRUE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_NONE_A:
+    case Pyc::POP_JUMP_BACKWARD_IF_NOT_NONE_A:
+    case Pyc::INSTRUMENTED_JUMP_BACKWARD_A:
+        return next - operand * unit;
+    default:
+        return -1;
+    }
+}
+
+static inline int map_opcode(const int* map, int byte)
+{
+    return (map && byte >= 0 && byte <= 255) ? map[byte] : Pyc::PYC_INVALID_OPCODE;
+}
+
 void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int& pos)
 {
-    opcode = Pyc::ByteToOpcode(mod->majorVer(), mod->minorVer(), source.getByte());
-    if (mod->verCompare(3, 6) >= 0) {
+    const int* map = mod->opcodeMap();
+    opcode = map_opcode(map, source.getByte());
+    if (mod->has(PycModule::CAP_WORDCODE)) {
         operand = source.getByte();
         pos += 2;
         if (opcode == Pyc::EXTENDED_ARG_A) {
-            opcode = Pyc::ByteToOpcode(mod->majorVer(), mod->minorVer(), source.getByte());
+            opcode = map_opcode(map, source.getByte());
             operand = (operand << 8) | source.getByte();
             pos += 2;
         }
@@ -292,7 +457,7 @@ void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int&
         pos += 1;
         if (opcode == Pyc::EXTENDED_ARG_A) {
             operand = source.get16() << 16;
-            opcode = Pyc::ByteToOpcode(mod->majorVer(), mod->minorVer(), source.getByte());
+            opcode = map_opcode(map, source.getByte());
             pos += 3;
         }
         if (opcode >= Pyc::PYC_HAVE_ARG) {
@@ -302,55 +467,154 @@ void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int&
     }
 }
 
-void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
-               int indent, unsigned flags)
+/* Decodes a whole code string at once.  This produces exactly what repeated
+ * calls to bc_next() would, including the values seen when an instruction
+ * is cut off by the end of the code. */
+void bc_decode(const char* code, int size, PycModule* mod,
+               std::vector<PycInstruction>& instructions)
 {
-    static const char *cmp_strings[] = {
-        "<", "<=", "==", "!=", ">", ">=", "in", "not in", "is", "is not",
-        "<EXCEPTION MATCH>", "<BAD>"
-    };
-    static const size_t cmp_strings_len = sizeof(cmp_strings) / sizeof(cmp_strings[0]);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(code);
+    const int* map = mod->opcodeMap();
+    const bool wordcode = mod->has(PycModule::CAP_WORDCODE);
+    int in = 0;
+    int pos = 0;
 
-    static const char *binop_strings[] = {
-        "+", "&", "//", "<<", "@", "*", "%", "|", "**", ">>", "-", "/", "^",
-        "+=", "&=", "//=", "<<=", "@=", "*=", "%=", "|=", "**=", ">>=", "-=", "/=", "^=",
+    auto get_byte = [&]() -> int {
+        return (in < size) ? bytes[in++] : EOF;
     };
-    static const size_t binop_strings_len = sizeof(binop_strings) / sizeof(binop_strings[0]);
-
-    static const char *intrinsic1_names[] = {
-        "INTRINSIC_1_INVALID", "INTRINSIC_PRINT", "INTRINSIC_IMPORT_STAR",
-        "INTRINSIC_STOPITERATION_ERROR", "INTRINSIC_ASYNC_GEN_WRAP",
-        "INTRINSIC_UNARY_POSITIVE", "INTRINSIC_LIST_TO_TUPLE", "INTRINSIC_TYPEVAR",
-        "INTRINSIC_PARAMSPEC", "INTRINSIC_TYPEVARTUPLE",
-        "INTRINSIC_SUBSCRIPT_GENERIC", "INTRINSIC_TYPEALIAS",
+    auto get16 = [&]() -> int {
+        int result = get_byte() & 0xFF;
+        result |= (get_byte() & 0xFF) << 8;
+        return result;
     };
-    static const size_t intrinsic1_names_len = sizeof(intrinsic1_names) / sizeof(intrinsic1_names[0]);
 
-    static const char *intrinsic2_names[] = {
-        "INTRINSIC_2_INVALID", "INTRINSIC_PREP_RERAISE_STAR",
-        "INTRINSIC_TYPEVAR_WITH_BOUND", "INTRINSIC_TYPEVAR_WITH_CONSTRAINTS",
-        "INTRINSIC_SET_FUNCTION_TYPE_PARAMS", "INTRINSIC_SET_TYPEPARAM_DEFAULT",
-    };
-    static const size_t intrinsic2_names_len = sizeof(intrinsic2_names) / sizeof(intrinsic2_names[0]);
+    instructions.clear();
+    instructions.reserve(wordcode ? size / 2 : size / 2 + 1);
+    while (in < size) {
+        PycInstruction insn;
+        insn.offset = pos;
+        insn.opcode = map_opcode(map, get_byte());
+        if (wordcode) {
+            insn.operand = get_byte();
+            pos += 2;
+            if (insn.opcode == Pyc::EXTENDED_ARG_A) {
+                insn.opcode = map_opcode(map, get_byte());
+                insn.operand = (insn.operand << 8) | get_byte();
+                pos += 2;
+            }
+        } else {
+            insn.operand = 0;
+            pos += 1;
+            if (insn.opcode == Pyc::EXTENDED_ARG_A) {
+                insn.operand = get16() << 16;
+                insn.opcode = map_opcode(map, get_byte());
+                pos += 3;
+            }
+            if (insn.opcode >= Pyc::PYC_HAVE_ARG) {
+                insn.operand |= get16();
+                pos += 2;
+            }
+        }
+        insn.length = pos - insn.offset;
+        instructions.push_back(insn);
+    }
+}
 
-    static const char *format_value_names[] = {
-        "FVC_NONE", "FVC_STR", "FVC_REPR", "FVC_ASCII",
-    };
-    static const size_t format_value_names_len = sizeof(format_value_names) / sizeof(format_value_names[0]);
+/* Operand names for the opcodes which take one, by the operand's value */
+static constexpr const char* cmp_strings[] = {
+    "<", "<=", "==", "!=", ">", ">=", "in", "not in", "is", "is not",
+    "<EXCEPTION MATCH>", "<BAD>"
+};
 
-    PycBuffer source(code->code()->value(), code->code()->length());
+static constexpr const char* binop_strings[] = {
+    "+", "&", "//", "<<", "@", "*", "%", "|", "**", ">>", "-", "/", "^",
+    "+=", "&=", "//=", "<<=", "@=", "*=", "%=", "|=", "**=", ">>=", "-=", "/=", "^=",
+};
 
-    int opcode, operand;
-    int pos = 0;
-    while (!source.atEof()) {
-        int start_pos = pos;
-        bc_next(source, mod, opcode, operand, pos);
+static constexpr const char* is_op_strings[] = { "is", "is not" };
+static constexpr const char* contains_op_strings[] = { "in", "not in" };
+
+static constexpr const char* intrinsic1_names[] = {
+    "INTRINSIC_1_INVALID", "INTRINSIC_PRINT", "INTRINSIC_IMPORT_STAR",
+    "INTRINSIC_STOPITERATION_ERROR", "INTRINSIC_ASYNC_GEN_WRAP",
+    "INTRINSIC_UNARY_POSITIVE", "INTRINSIC_LIST_TO_TUPLE", "INTRINSIC_TYPEVAR",
+    "INTRINSIC_PARAMSPEC", "INTRINSIC_TYPEVARTUPLE",
+    "INTRINSIC_SUBSCRIPT_GENERIC", "INTRINSIC_TYPEALIAS",
+};
+
+static constexpr const char* intrinsic2_names[] = {
+    "INTRINSIC_2_INVALID", "INTRINSIC_PREP_RERAISE_STAR",
+    "INTRINSIC_TYPEVAR_WITH_BOUND", "INTRINSIC_TYPEVAR_WITH_CONSTRAINTS",
+    "INTRINSIC_SET_FUNCTION_TYPE_PARAMS", "INTRINSIC_SET_TYPEPARAM_DEFAULT",
+};
+
+static constexpr const char* format_value_names[] = {
+    "FVC_NONE", "FVC_STR", "FVC_REPR", "FVC_ASCII",
+};
+
+/* Null if the operand is out of the table's range */
+template <size_t N>
+static const char* operand_name(const char* const (&names)[N], int operand)
+{
+    return (operand >= 0 && (size_t)operand < N) ? names[operand] : nullptr;
+}
+
+/* "operand (name)" */
+static void print_operand(PycOutput& pyc_output, int operand, const char* name)
+{
+    pyc_output << operand << " (" << (name ? name : "UNKNOWN") << ')';
+}
+
+/* Left aligned in a field of the width, as "%-*d" and "%-*s" would,
+ * without going through printf */
+static void print_padded(PycOutput& pyc_output, PycStringView str, size_t width)
+{
+    pyc_output << str;
+    for (size_t i = str.size(); i < width; ++i)
+        pyc_output.put(' ');
+}
+
+static void print_padded(PycOutput& pyc_output, int value, size_t width)
+{
+    size_t start = pyc_output.bytesWritten();
+    pyc_output << value;
+    for (size_t i = pyc_output.bytesWritten() - start; i < width; ++i)
+        pyc_output.put(' ');
+}
+
+void bc_disasm(PycOutput& pyc_output, PycRef<PycCode> code, PycModule* mod,
+               int indent, unsigned flags)
+{
+    // Each line's number is shown next to its first instruction, like dis does
+    static const PycCode::lines_t no_lines;
+    const bool show_lines = (flags & Pyc::DISASM_LINE_NUMBERS) != 0;
+    PycLineCursor lines(show_lines ? code->lineTable(mod) : no_lines);
+    int last_line = -1;
+
+    for (const auto& insn : code->instructions(mod)) {
+        const int opcode = insn.opcode;
+        const int operand = insn.operand;
+        const int start_pos = insn.offset;
+        const int pos = insn.offset + insn.length;
         if (opcode == Pyc::CACHE && (flags & Pyc::DISASM_SHOW_CACHES) == 0)
             continue;
 
         for (int i=0; i<indent; i++)
             pyc_output << "    ";
-        formatted_print(pyc_output, "%-7d %-30s  ", start_pos, Pyc::OpcodeName(opcode));
+        if (show_lines) {
+            int line = lines.lineAt(start_pos);
+            if (line >= 0 && line != last_line) {
+                print_padded(pyc_output, line, 5);
+                pyc_output << ' ';
+                last_line = line;
+            } else {
+                pyc_output << "      ";
+            }
+        }
+        print_padded(pyc_output, start_pos, 7);
+        pyc_output << ' ';
+        print_padded(pyc_output, Pyc::OpcodeNameView(opcode), 30);
+        pyc_output << "  ";
 
         if (opcode >= Pyc::PYC_HAVE_ARG) {
             switch (opcode) {
@@ -361,25 +625,24 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
             case Pyc::INSTRUMENTED_RETURN_CONST_A:
                 try {
                     auto constParam = code->getConst(operand);
-                    formatted_print(pyc_output, "%d: ", operand);
+                    pyc_output << operand << ": ";
                     print_const(pyc_output, constParam, mod);
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::LOAD_GLOBAL_A:
                 try {
                     // Special case for Python 3.11+
                     if (mod->verCompare(3, 11) >= 0) {
-                        if (operand & 1)
-                            formatted_print(pyc_output, "%d: NULL + %s", operand, code->getName(operand >> 1)->value());
-                        else
-                            formatted_print(pyc_output, "%d: %s", operand, code->getName(operand >> 1)->value());
+                        PycStringView name = code->getName(operand >> 1)->view();
+                        pyc_output << operand << ((operand & 1) ? ": NULL + " : ": ") << name;
                     } else {
-                        formatted_print(pyc_output, "%d: %s", operand, code->getName(operand)->value());
+                        PycStringView name = code->getName(operand)->view();
+                        pyc_output << operand << ": " << name;
                     }
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::DELETE_ATTR_A:
@@ -400,17 +663,19 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
                     auto arg = operand;
                     if (opcode == Pyc::LOAD_ATTR_A && mod->verCompare(3, 12) >= 0)
                         arg >>= 1;
-                    formatted_print(pyc_output, "%d: %s", operand, code->getName(arg)->value());
+                    PycStringView name = code->getName(arg)->view();
+                    pyc_output << operand << ": " << name;
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::LOAD_SUPER_ATTR_A:
             case Pyc::INSTRUMENTED_LOAD_SUPER_ATTR_A:
                 try {
-                    formatted_print(pyc_output, "%d: %s", operand, code->getName(operand >> 2)->value());
+                    PycStringView name = code->getName(operand >> 2)->view();
+                    pyc_output << operand << ": " << name;
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::DELETE_FAST_A:
@@ -419,20 +684,21 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
             case Pyc::LOAD_FAST_CHECK_A:
             case Pyc::LOAD_FAST_AND_CLEAR_A:
                 try {
-                    formatted_print(pyc_output, "%d: %s", operand, code->getLocal(operand)->value());
+                    PycStringView name = code->getLocal(operand)->view();
+                    pyc_output << operand << ": " << name;
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::LOAD_FAST_LOAD_FAST_A:
             case Pyc::STORE_FAST_LOAD_FAST_A:
             case Pyc::STORE_FAST_STORE_FAST_A:
                 try {
-                    formatted_print(pyc_output, "%d: %s, %s", operand,
-                                    code->getLocal(operand >> 4)->value(),
-                                    code->getLocal(operand & 0xF)->value());
+                    PycStringView first = code->getLocal(operand >> 4)->view();
+                    PycStringView second = code->getLocal(operand & 0xF)->view();
+                    pyc_output << operand << ": " << first << ", " << second;
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::LOAD_CLOSURE_A:
@@ -443,9 +709,10 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
             case Pyc::CALL_FINALLY_A:
             case Pyc::LOAD_FROM_DICT_OR_DEREF_A:
                 try {
-                    formatted_print(pyc_output, "%d: %s", operand, code->getCellVar(mod, operand)->value());
+                    PycStringView name = code->getCellVar(mod, operand)->view();
+                    pyc_output << operand << ": " << name;
                 } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
+                    pyc_output << operand << " <INVALID>";
                 }
                 break;
             case Pyc::JUMP_FORWARD_A:
@@ -473,9 +740,9 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
             case Pyc::INSTRUMENTED_POP_JUMP_IF_TRUE_A:
                 {
                     int offs = operand;
-                    if (mod->verCompare(3, 10) >= 0)
+                    if (mod->has(PycModule::CAP_JUMPS_IN_WORDS))
                         offs *= sizeof(uint16_t); // BPO-27129
-                    formatted_print(pyc_output, "%d (to %d)", operand, pos+offs);
+                    pyc_output << operand << " (to " << pos + offs << ')';
                 }
                 break;
             case Pyc::JUMP_BACKWARD_NO_INTERRUPT_A:
@@ -488,7 +755,7 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
                 {
                     // BACKWARD jumps were only introduced in Python 3.11
                     int offs = operand * sizeof(uint16_t); // BPO-27129
-                    formatted_print(pyc_output, "%d (to %d)", operand, pos-offs);
+                    pyc_output << operand << " (to " << pos - offs << ')';
                 }
                 break;
             case Pyc::POP_JUMP_IF_FALSE_A:
@@ -497,16 +764,15 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
             case Pyc::JUMP_IF_TRUE_OR_POP_A:
             case Pyc::JUMP_ABSOLUTE_A:
             case Pyc::JUMP_IF_NOT_EXC_MATCH_A:
-                if (mod->verCompare(3, 12) >= 0) {
+                if (mod->has(PycModule::CAP_RELATIVE_JUMPS)) {
                     // These are now relative as well
                     int offs = operand * sizeof(uint16_t);
-                    formatted_print(pyc_output, "%d (to %d)", operand, pos+offs);
-                } else if (mod->verCompare(3, 10) >= 0) {
+                    pyc_output << operand << " (to " << pos + offs << ')';
+                } else if (mod->has(PycModule::CAP_JUMPS_IN_WORDS)) {
                     // BPO-27129
-                    formatted_print(pyc_output, "%d (to %d)", operand,
-                                    int(operand * sizeof(uint16_t)));
+                    pyc_output << operand << " (to " << int(operand * sizeof(uint16_t)) << ')';
                 } else {
-                    formatted_print(pyc_output, "%d", operand);
+                    pyc_output << operand;
                 }
                 break;
             case Pyc::COMPARE_OP_A:
@@ -516,80 +782,56 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
                         arg >>= 4; // changed under GH-100923
                     else if (mod->verCompare(3, 13) >= 0)
                         arg >>= 5;
-                    if (static_cast<size_t>(arg) < cmp_strings_len)
-                        formatted_print(pyc_output, "%d (%s)", operand, cmp_strings[arg]);
-                    else
-                        formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+                    print_operand(pyc_output, operand, operand_name(cmp_strings, arg));
                 }
                 break;
             case Pyc::BINARY_OP_A:
-                if (static_cast<size_t>(operand) < binop_strings_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, binop_strings[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+                print_operand(pyc_output, operand, operand_name(binop_strings, operand));
                 break;
             case Pyc::IS_OP_A:
-                formatted_print(pyc_output, "%d (%s)", operand, (operand == 0) ? "is"
-                                                      : (operand == 1) ? "is not"
-                                                      : "UNKNOWN");
+                print_operand(pyc_output, operand, operand_name(is_op_strings, operand));
                 break;
             case Pyc::CONTAINS_OP_A:
-                formatted_print(pyc_output, "%d (%s)", operand, (operand == 0) ? "in"
-                                                      : (operand == 1) ? "not in"
-                                                      : "UNKNOWN");
+                print_operand(pyc_output, operand, operand_name(contains_op_strings, operand));
                 break;
             case Pyc::CALL_INTRINSIC_1_A:
-                if (static_cast<size_t>(operand) < intrinsic1_names_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, intrinsic1_names[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+                print_operand(pyc_output, operand, operand_name(intrinsic1_names, operand));
                 break;
             case Pyc::CALL_INTRINSIC_2_A:
-                if (static_cast<size_t>(operand) < intrinsic2_names_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, intrinsic2_names[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+                print_operand(pyc_output, operand, operand_name(intrinsic2_names, operand));
                 break;
             case Pyc::FORMAT_VALUE_A:
                 {
-                    auto conv = static_cast<size_t>(operand & 0x03);
                     const char *flag = (operand & 0x04) ? " | FVS_HAVE_SPEC" : "";
-                    if (conv < format_value_names_len) {
-                        formatted_print(pyc_output, "%d (%s%s)", operand,
-                                        format_value_names[conv], flag);
-                    } else {
-                        formatted_print(pyc_output, "%d (UNKNOWN)", operand);
-                    }
+                    pyc_output << operand << " (" << format_value_names[operand & 0x03]
+                               << flag << ')';
                 }
                 break;
             case Pyc::CONVERT_VALUE_A:
-                if (static_cast<size_t>(operand) < format_value_names_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, format_value_names[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+                print_operand(pyc_output, operand, operand_name(format_value_names, operand));
                 break;
             case Pyc::SET_FUNCTION_ATTRIBUTE_A:
                 // This looks like a bitmask, but CPython treats it as an exclusive lookup...
                 switch (operand) {
                 case 0x01:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_DEFAULTS)", operand);
+                    print_operand(pyc_output, operand, "MAKE_FUNCTION_DEFAULTS");
                     break;
                 case 0x02:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_KWDEFAULTS)", operand);
+                    print_operand(pyc_output, operand, "MAKE_FUNCTION_KWDEFAULTS");
                     break;
                 case 0x04:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_ANNOTATIONS)", operand);
+                    print_operand(pyc_output, operand, "MAKE_FUNCTION_ANNOTATIONS");
                     break;
                 case 0x08:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_CLOSURE)", operand);
+                    print_operand(pyc_output, operand, "MAKE_FUNCTION_CLOSURE");
                     break;
                 default:
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+                    print_operand(pyc_output, operand, nullptr);
                     break;
                 }
                 break;
             default:
-                formatted_print(pyc_output, "%d", operand);
+                pyc_output << operand;
                 break;
             }
         }
@@ -20,15 +20,56 @@ enum Opcode {
 enum DisassemblyFlags {
     DISASM_PYCODE_VERBOSE = 0x1,
     DISASM_SHOW_CACHES = 0x2,
+    DISASM_LINE_NUMBERS = 0x4,
+    DISASM_CONTROL_FLOW = 0x8,
+    DISASM_JSON = 0x10,
 };
 
+/* Flattened byte -> opcode translation for one Python version */
+struct OpcodeTable {
+    explicit OpcodeTable(int (*map)(int))
+    {
+        for (int i = 0; i < 256; ++i)
+            opcodes[i] = map(i);
+    }
+
+    int opcodes[256];
+};
+
+/* The names come from constant tables, so these never allocate and can be
+ * used from any thread.  Opcodes outside the enum are "<INVALID>". */
 const char* OpcodeName(int opcode);
+PycStringView OpcodeNameView(int opcode);
 int ByteToOpcode(int maj, int min, int opcode);
 
+/* Returns the 256-entry translation table for a Python version, or NULL if
+ * the version is not supported.  Tables are built on first use. */
+const int* OpcodeMap(int maj, int min);
+
+/* How an instruction passes control on */
+enum FlowKind {
+    FLOW_NEXT,      // To the next instruction only
+    FLOW_JUMP,      // To its jump target only
+    FLOW_BRANCH,    // To the next instruction or its jump target
+    FLOW_SETUP,     // To the next instruction, pushing a block which ends at
+                    // (SETUP_LOOP) or is handled at its jump target
+    FLOW_BREAK,     // Out of the innermost SETUP_LOOP block
+    FLOW_EXIT,      // Nowhere in this code object (return, raise)
+};
+
+FlowKind FlowKindOf(int opcode);
+
 }
 
-void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod,
+/* The byte offset an instruction jumps to, or -1 if it doesn't name one.
+ * next is where relative jumps count from: the offset after the
+ * instruction and, in 3.11+, its inline caches. */
+int bc_jump_target(PycModule* mod, int opcode, int operand, int next);
+
+void print_const(PycOutput& pyc_output, const PycRef<PycObject>& obj, PycModule* mod,
                  const char* parent_f_string_quote = nullptr);
 void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int& pos);
-void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
+void bc_decode(const char* code, int size, PycModule* mod,
+               std::vector<PycInstruction>& instructions);
+void bc_disasm(PycOutput& pyc_output, PycRef<PycCode> code, PycModule* mod,
                int indent, unsigned flags);
@@ -1,6 +1,12 @@
 #include "bytecode.h"
 
 #define BEGIN_MAP(maj, min) \
+    int python_##maj##_##min##_map(int id); \
+    const int* python_##maj##_##min##_table() \
+    { \
+        static const Pyc::OpcodeTable table(python_##maj##_##min##_map); \
+        return table.opcodes; \
+    } \
     int python_##maj##_##min##_map(int id) \
     { \
         switch (id) {
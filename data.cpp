@@ -1,10 +1,19 @@
 #include "data.h"
+#include <algorithm>
 #include <cstring>
 #include <cstdarg>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#  define PYC_HAVE_MMAP
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
 /* PycData */
-int PycData::get16()
+int PycData::get16Slow()
 {
     /* Ensure endianness */
     int result = getByte() & 0xFF;
@@ -12,7 +21,7 @@ int PycData::get16()
     return result;
 }
 
-int PycData::get32()
+int PycData::get32Slow()
 {
     /* Ensure endianness */
     int result = getByte() & 0xFF;
@@ -22,7 +31,7 @@ int PycData::get32()
     return result;
 }
 
-Pyc_INT64 PycData::get64()
+Pyc_INT64 PycData::get64Slow()
 {
     /* Ensure endianness */
     Pyc_INT64 result = (Pyc_INT64)(getByte() & 0xFF);
@@ -36,6 +45,18 @@ Pyc_INT64 PycData::get64()
     return result;
 }
 
+int PycData::readBuffer(int bytes, void* buffer)
+{
+    if (bytes <= 0)
+        return 0;
+    if ((size_t)bytes > (size_t)(m_end - m_cur))
+        bytes = (int)(m_end - m_cur);
+    if (bytes != 0)
+        memcpy(buffer, m_cur, bytes);
+    m_cur += bytes;
+    return bytes;
+}
+
 
 /* PycFile */
 PycFile::PycFile(const char* filename)
@@ -50,7 +71,7 @@ bool PycFile::atEof() const
     return (ch == EOF);
 }
 
-int PycFile::getByte()
+int PycFile::readByte()
 {
     int ch = fgetc(m_stream);
     if (ch == EOF)
@@ -58,33 +79,239 @@ int PycFile::getByte()
     return ch;
 }
 
-int PycFile::getBuffer(int bytes, void* buffer)
+int PycFile::readBuffer(int bytes, void* buffer)
 {
     return (int)fread(buffer, 1, bytes, m_stream);
 }
 
 
-/* PycBuffer */
-int PycBuffer::getByte()
+/* PycMappedFile */
+PycMappedFile::PycMappedFile(const char* filename)
+    : m_data(), m_size(), m_open(), m_mapped()
 {
-    if (atEof())
-        return EOF;
-    int ch = (int)(*(m_buffer + m_pos));
-    ++m_pos;
-    return ch & 0xFF;   // Make sure it's just a byte!
+#ifdef PYC_HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            m_data = static_cast<const unsigned char*>(map);
+            m_size = (size_t)st.st_size;
+            m_open = m_mapped = true;
+            m_cur = m_data;
+            m_end = m_data + m_size;
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+#endif
+
+    // Fall back to slurping the whole file into memory
+    FILE* stream = fopen(filename, "rb");
+    if (!stream)
+        return;
+    unsigned char chunk[65536];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), stream)) != 0)
+        m_fallback.insert(m_fallback.end(), chunk, chunk + count);
+    fclose(stream);
+
+    m_data = m_fallback.empty() ? nullptr : &m_fallback[0];
+    m_size = m_fallback.size();
+    m_open = true;
+    m_cur = m_data;
+    m_end = m_data + m_size;
 }
 
-int PycBuffer::getBuffer(int bytes, void* buffer)
+PycMappedFile::PycMappedFile(std::vector<unsigned char> data)
+    : m_data(), m_size(), m_open(true), m_mapped(),
+      m_fallback(std::move(data))
 {
-    if (m_pos + bytes > m_size)
-        bytes = m_size - m_pos;
-    if (bytes != 0)
-        memcpy(buffer, (m_buffer + m_pos), bytes);
-    m_pos += bytes;
-    return bytes;
+    m_data = m_fallback.empty() ? nullptr : &m_fallback[0];
+    m_size = m_fallback.size();
+    m_cur = m_data;
+    m_end = m_data + m_size;
 }
 
-int formatted_print(std::ostream& stream, const char* format, ...)
+PycMappedFile::PycMappedFile(const void* data, size_t size, std::shared_ptr<const void> owner)
+    : m_data(static_cast<const unsigned char*>(data)), m_size(size), m_open(true),
+      m_mapped(), m_owner(std::move(owner))
+{
+    m_cur = m_data;
+    m_end = m_data + m_size;
+}
+
+PycMappedFile::~PycMappedFile()
+{
+#ifdef PYC_HAVE_MMAP
+    if (m_mapped)
+        munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+}
+
+const char* PycMappedFile::getView(int bytes)
+{
+    if (bytes < 0 || (size_t)bytes > (size_t)(m_end - m_cur))
+        return nullptr;
+    const char* view = reinterpret_cast<const char*>(m_cur);
+    m_cur += bytes;
+    return view;
+}
+
+/* PycOutput */
+PycOutput::PycOutput(FILE* file)
+    : m_file(file), m_stream(), m_sink(), m_sinkContext(), m_buffer(BUFFER_SIZE),
+      m_length(), m_flushed(), m_countLines(), m_lines(), m_counted(), m_captures(),
+      m_captureFrom() { }
+
+PycOutput::PycOutput(std::ostream& stream)
+    : m_file(), m_stream(&stream), m_sink(), m_sinkContext(), m_buffer(BUFFER_SIZE),
+      m_length(), m_flushed(), m_countLines(), m_lines(), m_counted(), m_captures(),
+      m_captureFrom() { }
+
+PycOutput::PycOutput(sink_t sink, void* context)
+    : m_file(), m_stream(), m_sink(sink), m_sinkContext(context), m_buffer(BUFFER_SIZE),
+      m_length(), m_flushed(), m_countLines(), m_lines(), m_counted(), m_captures(),
+      m_captureFrom() { }
+
+PycOutput::PycOutput()
+    : m_file(), m_stream(), m_sink(), m_sinkContext(), m_buffer(BUFFER_SIZE),
+      m_length(), m_flushed(), m_countLines(), m_lines(), m_counted(), m_captures(),
+      m_captureFrom() { }
+
+void PycOutput::emit(const char* data, size_t length)
+{
+    if (m_file)
+        fwrite(data, 1, length, m_file);
+    else if (m_stream)
+        m_stream->write(data, length);
+    else if (m_sink)
+        m_sink(m_sinkContext, data, length);
+}
+
+/* Counts the line breaks in the buffer which weren't counted yet */
+void PycOutput::countBuffered()
+{
+    size_t from = std::max(m_counted, m_flushed) - m_flushed;
+    m_lines += std::count(&m_buffer[0] + from, &m_buffer[0] + m_length, '\n');
+    m_counted = bytesWritten();
+}
+
+size_t PycOutput::lineNumber()
+{
+    countBuffered();
+    return m_lines + 1;
+}
+
+void PycOutput::drain()
+{
+    if (m_countLines)
+        countBuffered();
+    if (m_length) {
+        if (m_captures) {
+            size_t from = std::max(m_captureFrom, m_flushed) - m_flushed;
+            m_captured.append(&m_buffer[from], m_length - from);
+        }
+        emit(&m_buffer[0], m_length);
+        m_flushed += m_length;
+        m_length = 0;
+    }
+}
+
+void PycOutput::flush()
+{
+    drain();
+    if (m_file)
+        fflush(m_file);
+    else if (m_stream)
+        m_stream->flush();
+}
+
+void PycOutput::writeSlow(const char* data, size_t length)
+{
+    drain();
+    if (length >= m_buffer.size()) {
+        // Not worth copying through the buffer
+        if (m_captures)
+            m_captured.append(data, length);
+        if (m_countLines)
+            m_lines += std::count(data, data + length, '\n');
+        emit(data, length);
+        m_flushed += length;
+        m_counted = m_flushed;
+    } else {
+        memcpy(&m_buffer[0], data, length);
+        m_length = length;
+    }
+}
+
+size_t PycOutput::beginCapture()
+{
+    if (m_captures++ == 0) {
+        m_captureFrom = bytesWritten();
+        m_captured.clear();
+    }
+    return bytesWritten();
+}
+
+std::string PycOutput::endCapture(size_t start)
+{
+    std::string text;
+    if (start - m_captureFrom < m_captured.size())
+        text.assign(m_captured, start - m_captureFrom, std::string::npos);
+    size_t from = std::max(start, m_flushed) - m_flushed;
+    text.append(&m_buffer[from], m_length - from);
+    --m_captures;
+    return text;
+}
+
+void PycOutput::writeUInt(unsigned long long value)
+{
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    do {
+        *--start = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    write(start, end - start);
+}
+
+void PycOutput::writeInt(long long value)
+{
+    if (value < 0) {
+        put('-');
+        writeUInt(0 - (unsigned long long)value);
+    } else {
+        writeUInt(value);
+    }
+}
+
+int PycOutput::vprintf(const char* format, va_list args)
+{
+    va_list saved_args;
+    va_copy(saved_args, args);
+    size_t avail = m_buffer.size() - m_length;
+    int len = std::vsnprintf(&m_buffer[m_length], avail, format, args);
+    if (len >= 0 && (size_t)len >= avail) {
+        // Didn't fit; make room and format it again
+        drain();
+        if ((size_t)len >= m_buffer.size())
+            m_buffer.resize((size_t)len + 1);
+        len = std::vsnprintf(&m_buffer[0], m_buffer.size(), format, saved_args);
+    }
+    va_end(saved_args);
+
+    if (len > 0)
+        m_length += (size_t)len;
+    return len;
+}
+
+int formatted_print(PycOutput& stream, const char* format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -93,18 +320,44 @@ int formatted_print(std::ostream& stream, const char* format, ...)
     return result;
 }
 
-int formatted_printv(std::ostream& stream, const char* format, va_list args)
+int formatted_printv(PycOutput& stream, const char* format, va_list args)
+{
+    return stream.vprintf(format, args);
+}
+
+static thread_local std::string* t_diagnostics = nullptr;
+
+void pyc_diagnostic(const char* format, ...)
 {
+    va_list args;
+    va_start(args, format);
+    if (!t_diagnostics) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
     va_list saved_args;
     va_copy(saved_args, args);
-    int len = std::vsnprintf(nullptr, 0, format, args);
-    if (len < 0)
-        return len;
-    std::vector<char> vec(static_cast<size_t>(len) + 1);
-    int written = std::vsnprintf(&vec[0], vec.size(), format, saved_args);
+    char buffer[256];
+    int len = std::vsnprintf(buffer, sizeof(buffer), format, args);
+    if (len >= 0 && (size_t)len < sizeof(buffer)) {
+        t_diagnostics->append(buffer, (size_t)len);
+    } else if (len > 0) {
+        size_t start = t_diagnostics->size();
+        t_diagnostics->resize(start + (size_t)len + 1);
+        std::vsnprintf(&(*t_diagnostics)[start], (size_t)len + 1, format, saved_args);
+        t_diagnostics->resize(start + (size_t)len);
+    }
     va_end(saved_args);
+    va_end(args);
+}
 
-    if (written >= 0)
-        stream << &vec[0];
-    return written;
+DiagnosticsBuffer::DiagnosticsBuffer() : m_saved(t_diagnostics)
+{
+    t_diagnostics = &m_text;
+}
+
+DiagnosticsBuffer::~DiagnosticsBuffer()
+{
+    t_diagnostics = m_saved;
 }
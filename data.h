@@ -1,8 +1,14 @@
 #ifndef _PYC_FILE_H
 #define _PYC_FILE_H
 
+#include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <ostream>
+#include <string>
+#include <vector>
+#include "pyc_string_view.h"
 
 #ifdef WIN32
 typedef __int64 Pyc_INT64;
@@ -10,19 +16,90 @@ typedef __int64 Pyc_INT64;
 typedef long long Pyc_INT64;
 #endif
 
+/* Memory backed streams keep their data in the [m_cur, m_end) window, which
+ * the inline readers below consume with one bounds check per field.  Only
+ * streams without such a window, or reads past its end, go through the
+ * virtual readByte() and readBuffer(). */
 class PycData {
 public:
-    PycData() { }
+    PycData() : m_cur(), m_end() { }
     virtual ~PycData() { }
 
     virtual bool isOpen() const = 0;
     virtual bool atEof() const = 0;
 
-    virtual int getByte() = 0;
-    virtual int getBuffer(int bytes, void* buffer) = 0;
-    int get16();
-    int get32();
-    Pyc_INT64 get64();
+    /* Whether there are at least `bytes` more bytes to read, for checking
+     * sizes read from the data before allocating for them.  Streams which
+     * don't know where they end say there are. */
+    virtual bool hasBytes(size_t bytes) const { return bytes <= (size_t)(m_end - m_cur); }
+
+    int getByte()
+    {
+        if (m_cur != m_end)
+            return *m_cur++;
+        return readByte();
+    }
+
+    int getBuffer(int bytes, void* buffer)
+    {
+        if (bytes > 0 && (size_t)bytes <= (size_t)(m_end - m_cur)) {
+            memcpy(buffer, m_cur, bytes);
+            m_cur += bytes;
+            return bytes;
+        }
+        return readBuffer(bytes, buffer);
+    }
+
+    /* Returns a pointer to the next `bytes` bytes of the stream and skips
+     * past them, if the stream is backed by memory which stays valid for
+     * as long as the stream object itself.  Returns nullptr (without
+     * consuming anything) if the stream can't provide such a view. */
+    virtual const char* getView(int) { return nullptr; }
+
+    /* Little endian, regardless of the host */
+    int get16()
+    {
+        if (m_end - m_cur < 2)
+            return get16Slow();
+        int result = m_cur[0] | (m_cur[1] << 8);
+        m_cur += 2;
+        return result;
+    }
+
+    int get32()
+    {
+        if (m_end - m_cur < 4)
+            return get32Slow();
+        unsigned result = (unsigned)m_cur[0] | ((unsigned)m_cur[1] << 8)
+                        | ((unsigned)m_cur[2] << 16) | ((unsigned)m_cur[3] << 24);
+        m_cur += 4;
+        return (int)result;
+    }
+
+    Pyc_INT64 get64()
+    {
+        if (m_end - m_cur < 8)
+            return get64Slow();
+        unsigned long long result = 0;
+        for (int i = 7; i >= 0; --i)
+            result = (result << 8) | m_cur[i];
+        m_cur += 8;
+        return (Pyc_INT64)result;
+    }
+
+protected:
+    /* Called once the window is used up; memory backed streams are at
+     * their end by then */
+    virtual int readByte() { return EOF; }
+    virtual int readBuffer(int bytes, void* buffer);
+
+    const unsigned char* m_cur;
+    const unsigned char* m_end;
+
+private:
+    int get16Slow();
+    int get32Slow();
+    Pyc_INT64 get64Slow();
 };
 
 class PycFile : public PycData {
@@ -32,9 +109,11 @@ public:
 
     bool isOpen() const override { return (m_stream != 0); }
     bool atEof() const override;
+    bool hasBytes(size_t) const override { return true; }
 
-    int getByte() override;
-    int getBuffer(int bytes, void* buffer) override;
+protected:
+    int readByte() override;
+    int readBuffer(int bytes, void* buffer) override;
 
 private:
     FILE* m_stream;
@@ -43,21 +122,180 @@ private:
 class PycBuffer : public PycData {
 public:
     PycBuffer(const void* buffer, int size)
-        : m_buffer((const unsigned char*)buffer), m_size(size), m_pos(0) { }
+        : m_buffer((const unsigned char*)buffer)
+    {
+        m_cur = m_buffer;
+        m_end = m_buffer + size;
+    }
     ~PycBuffer() { }
 
     bool isOpen() const override { return (m_buffer != 0); }
-    bool atEof() const override { return (m_pos == m_size); }
-
-    int getByte() override;
-    int getBuffer(int bytes, void* buffer) override;
+    bool atEof() const override { return (m_cur == m_end); }
 
 private:
     const unsigned char* m_buffer;
-    int m_size, m_pos;
 };
 
-int formatted_print(std::ostream& stream, const char* format, ...);
-int formatted_printv(std::ostream& stream, const char* format, va_list args);
+/* Reads an entire file through a read-only memory mapping where the platform
+ * supports it, or into a single heap buffer otherwise.  Either way, the data
+ * is contiguous and getView() can hand out pointers into it. */
+class PycMappedFile : public PycData {
+public:
+    PycMappedFile(const char* filename);
+
+    /* Serves data which is already in memory, taking it over */
+    explicit PycMappedFile(std::vector<unsigned char> data);
+
+    /* Serves memory which belongs to someone else, without copying it.  It
+     * has to stay valid for as long as the stream, unless owner keeps it
+     * alive. */
+    PycMappedFile(const void* data, size_t size,
+                  std::shared_ptr<const void> owner = std::shared_ptr<const void>());
+    ~PycMappedFile();
+
+    bool isOpen() const override { return m_open; }
+    bool atEof() const override { return (m_cur == m_end); }
+
+    const char* getView(int bytes) override;
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    size_t position() const { return (size_t)(m_cur - m_data); }
+    void seek(size_t pos) { m_cur = m_data + ((pos < m_size) ? pos : m_size); }
+
+private:
+    PycMappedFile(const PycMappedFile&) = delete;
+    PycMappedFile& operator=(const PycMappedFile&) = delete;
+
+    const unsigned char* m_data;
+    size_t m_size;
+    bool m_open, m_mapped;
+    std::vector<unsigned char> m_fallback;
+    std::shared_ptr<const void> m_owner;
+};
+
+/* Buffered text output for the generated source and disassembly.  Output
+ * is collected in one reusable buffer and handed to the target FILE, stream
+ * or sink in large chunks, when the buffer fills up or on flush(). */
+class PycOutput {
+public:
+    typedef void (*sink_t)(void* context, const char* data, size_t length);
+
+    explicit PycOutput(FILE* file);
+    explicit PycOutput(std::ostream& stream);
+    PycOutput(sink_t sink, void* context);
+
+    /* Discards the output, but still counts it */
+    PycOutput();
+    ~PycOutput() { flush(); }
+
+    PycOutput(const PycOutput&) = delete;
+    PycOutput& operator=(const PycOutput&) = delete;
+
+    void write(const char* data, size_t length)
+    {
+        if (length > m_buffer.size() - m_length) {
+            writeSlow(data, length);
+            return;
+        }
+        memcpy(&m_buffer[m_length], data, length);
+        m_length += length;
+    }
+
+    void put(char ch)
+    {
+        if (m_length == m_buffer.size())
+            drain();
+        m_buffer[m_length++] = ch;
+    }
+
+    void writeInt(long long value);
+    void writeUInt(unsigned long long value);
+
+    PycOutput& operator<<(const char* str) { write(str, strlen(str)); return *this; }
+    PycOutput& operator<<(const std::string& str) { write(str.data(), str.size()); return *this; }
+    PycOutput& operator<<(PycStringView str) { write(str.data(), str.size()); return *this; }
+    PycOutput& operator<<(char ch) { put(ch); return *this; }
+    PycOutput& operator<<(int value) { writeInt(value); return *this; }
+    PycOutput& operator<<(long value) { writeInt(value); return *this; }
+    PycOutput& operator<<(long long value) { writeInt(value); return *this; }
+    PycOutput& operator<<(unsigned value) { writeUInt(value); return *this; }
+    PycOutput& operator<<(unsigned long value) { writeUInt(value); return *this; }
+    PycOutput& operator<<(unsigned long long value) { writeUInt(value); return *this; }
+
+    /* Formats straight into the buffer */
+    int vprintf(const char* format, va_list args);
+
+    /* Total number of bytes written so far */
+    size_t bytesWritten() const { return m_flushed + m_length; }
+
+    /* Keep count of the lines written from here on, for lineNumber() */
+    void countLines() { m_countLines = true; }
+
+    /* The line being written, from 1, if countLines() was called from the
+     * start */
+    size_t lineNumber();
+
+    void flush();
+
+    /* Keeps a copy of everything written from here on, until the matching
+     * endCapture() returns it.  Captures may be nested. */
+    size_t beginCapture();
+    std::string endCapture(size_t start);
+
+private:
+    void drain();
+    void writeSlow(const char* data, size_t length);
+    void emit(const char* data, size_t length);
+    void countBuffered();
+
+    static const size_t BUFFER_SIZE = 65536;
+
+    FILE* m_file;
+    std::ostream* m_stream;
+    sink_t m_sink;
+    void* m_sinkContext;
+    std::vector<char> m_buffer;
+    size_t m_length;
+    size_t m_flushed;
+
+    bool m_countLines;
+    size_t m_lines;         // Line breaks seen up to m_counted
+    size_t m_counted;
+
+    /* What was drained from the buffer since the outermost capture began */
+    int m_captures;
+    size_t m_captureFrom;
+    std::string m_captured;
+};
+
+int formatted_print(PycOutput& stream, const char* format, ...);
+int formatted_printv(PycOutput& stream, const char* format, va_list args);
+
+/* Warnings and errors about the input, written to stderr unless the calling
+ * thread collects them with a DiagnosticsBuffer */
+void pyc_diagnostic(const char* format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 1, 2)))
+#endif
+    ;
+
+/* Collects the diagnostics of the calling thread for as long as it exists,
+ * e.g. to tell concurrent requests' messages apart.  Buffers may be nested. */
+class DiagnosticsBuffer {
+public:
+    DiagnosticsBuffer();
+    ~DiagnosticsBuffer();
+
+    DiagnosticsBuffer(const DiagnosticsBuffer&) = delete;
+    DiagnosticsBuffer& operator=(const DiagnosticsBuffer&) = delete;
+
+    const std::string& text() const { return m_text; }
+
+private:
+    std::string m_text;
+    std::string* m_saved;
+};
 
 #endif
@@ -0,0 +1,93 @@
+#include "libpycdc.h"
+#include "Decompiler.h"
+#include <algorithm>
+#include <cstring>
+
+static void copy_message(const std::string& message, char* buffer, size_t buffer_size,
+                         size_t* length = nullptr)
+{
+    if (length)
+        *length = message.size();
+    if (!buffer || buffer_size == 0)
+        return;
+    size_t count = std::min(message.size(), buffer_size - 1);
+    memcpy(buffer, message.data(), count);
+    buffer[count] = '\0';
+}
+
+static unsigned to_flags(unsigned flags)
+{
+    return ((flags & PYCDC_DISASSEMBLE) ? DECOMPILE_DISASSEMBLE : 0)
+         | ((flags & PYCDC_STREAM) ? DECOMPILE_STREAM : 0)
+         | ((flags & PYCDC_LOW_MEMORY) ? DECOMPILE_LOW_MEMORY : 0)
+         | ((flags & PYCDC_LINE_MARKERS) ? DECOMPILE_LINE_MARKERS : 0);
+}
+
+static int to_result(DecompileStatus status)
+{
+    switch (status) {
+    case DECOMPILE_OK:
+        return PYCDC_OK;
+    case DECOMPILE_INCOMPLETE:
+        return PYCDC_INCOMPLETE;
+    default:
+        return PYCDC_ERROR;
+    }
+}
+
+int pycdc_decompile(const void* data, size_t size, const char* name, unsigned flags,
+                    pycdc_write_fn write, void* context, char* error, size_t error_size)
+{
+    std::string message;
+    DecompileStatus status;
+    {
+        PycOutput out(write, context);
+        status = decompile_pyc(data, size, name ? name : "<data>",
+                               to_flags(flags), out, &message);
+    }
+    if (status == DECOMPILE_FAILED)
+        copy_message(message, error, error_size);
+    return to_result(status);
+}
+
+/* Fills the caller's buffer, and counts what didn't fit */
+struct BufferSink {
+    char* buffer;
+    size_t room;        // Not counting the NUL
+    size_t used;
+    size_t length;
+
+    static void write(void* context, const char* data, size_t length)
+    {
+        BufferSink* sink = static_cast<BufferSink*>(context);
+        size_t count = std::min(length, sink->room - sink->used);
+        if (count != 0) {
+            memcpy(sink->buffer + sink->used, data, count);
+            sink->used += count;
+        }
+        sink->length += length;
+    }
+};
+
+int pycdc_decompile_to_buffer(const void* data, size_t size, const char* name,
+                              unsigned flags, char* buffer, size_t buffer_size,
+                              size_t* length)
+{
+    BufferSink sink = { buffer, buffer_size ? buffer_size - 1 : 0, 0, 0 };
+    std::string message;
+    DecompileStatus status;
+    {
+        PycOutput out(&BufferSink::write, &sink);
+        status = decompile_pyc(data, size, name ? name : "<data>",
+                               to_flags(flags), out, &message);
+    }
+    if (status == DECOMPILE_FAILED) {
+        copy_message(message, buffer, buffer_size, length);
+    } else {
+        if (buffer_size != 0)
+            buffer[sink.used] = '\0';
+        if (length)
+            *length = sink.length;
+    }
+    return to_result(status);
+}
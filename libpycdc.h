@@ -0,0 +1,61 @@
+#ifndef _LIBPYCDC_H
+#define _LIBPYCDC_H
+
+/* C interface of the pycdc shared library.  Every call is independent of
+ * the others, so they may be made from several threads at once. */
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(PYCDC_BUILDING_LIBRARY)
+#  define PYCDC_API __declspec(dllexport)
+#elif defined(_WIN32)
+#  define PYCDC_API __declspec(dllimport)
+#elif defined(__GNUC__)
+#  define PYCDC_API __attribute__((visibility("default")))
+#else
+#  define PYCDC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Results; with PYCDC_INCOMPLETE, parts of the source couldn't be
+ * decompiled but the rest was written nonetheless */
+#define PYCDC_OK            0
+#define PYCDC_INCOMPLETE    1
+#define PYCDC_ERROR         (-1)
+
+/* Flags */
+#define PYCDC_DISASSEMBLE   0x1     /* Write the disassembly instead */
+#define PYCDC_STREAM        0x2     /* Pass on each top-level statement as
+                                       soon as it is decompiled */
+#define PYCDC_LOW_MEMORY    0x4     /* Free code objects once printed */
+#define PYCDC_LINE_MARKERS  0x8     /* Put a "# line N" comment with the
+                                       original line ahead of each statement */
+
+/* Receives the output in chunks, as it is written */
+typedef void (*pycdc_write_fn)(void* context, const char* data, size_t length);
+
+/* Decompiles the .pyc image of size bytes at data, passing the source to
+ * write.  name is the file name shown in the output and may be NULL.  On
+ * PYCDC_ERROR, the reason is stored in error as a NUL terminated string,
+ * truncated to error_size bytes, unless error is NULL. */
+PYCDC_API int pycdc_decompile(const void* data, size_t size, const char* name,
+                              unsigned flags, pycdc_write_fn write, void* context,
+                              char* error, size_t error_size);
+
+/* Like pycdc_decompile(), but stores the source in buffer, truncated to
+ * buffer_size bytes and NUL terminated like snprintf() does.  The full
+ * length, without the NUL, is stored in *length, if given, so a buffer
+ * which was too small can be retried with one of length + 1 bytes.  On
+ * PYCDC_ERROR, buffer receives the error message instead. */
+PYCDC_API int pycdc_decompile_to_buffer(const void* data, size_t size, const char* name,
+                                        unsigned flags, char* buffer, size_t buffer_size,
+                                        size_t* length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,408 @@
+#include "pyc_archive.h"
+#include "pyc_module.h"
+#include "pyc_numeric.h"
+#include "pyc_sequence.h"
+#include "pyc_string.h"
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+#ifdef PYC_HAVE_ZLIB
+#  include <zlib.h>
+#endif
+
+static unsigned get_le16(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned get_le32(const unsigned char* p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16)
+         | ((unsigned)p[3] << 24);
+}
+
+static unsigned get_be32(const unsigned char* p)
+{
+    return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8)
+         | (unsigned)p[3];
+}
+
+static bool has_pyc_extension(const std::string& name)
+{
+    size_t dot = name.rfind('.');
+    return dot != std::string::npos
+        && (name.compare(dot, std::string::npos, ".pyc") == 0
+            || name.compare(dot, std::string::npos, ".pyo") == 0);
+}
+
+/* "package.module" to the path its .pyc would have */
+static std::string module_path(std::string name, bool package)
+{
+    std::replace(name.begin(), name.end(), '.', '/');
+    return name + (package ? "/__init__.pyc" : ".pyc");
+}
+
+#ifdef PYC_HAVE_ZLIB
+static std::vector<unsigned char> inflate_data(const unsigned char* data, size_t size,
+                                               size_t length, bool raw)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, raw ? -MAX_WBITS : MAX_WBITS) != Z_OK)
+        throw std::runtime_error("Could not set up zlib");
+
+    // The stored length is only a hint; PYZ archives don't have one
+    std::vector<unsigned char> result(length ? length : size * 4 + 256);
+    zs.next_in = const_cast<Bytef*>(data);
+    zs.avail_in = (uInt)size;
+    for ( ;; ) {
+        zs.next_out = &result[zs.total_out];
+        zs.avail_out = (uInt)(result.size() - zs.total_out);
+        int status = inflate(&zs, Z_NO_FLUSH);
+        if (status == Z_STREAM_END)
+            break;
+        if ((status != Z_OK && status != Z_BUF_ERROR) || zs.avail_out != 0) {
+            inflateEnd(&zs);
+            throw std::runtime_error("Corrupt compressed archive member");
+        }
+        result.resize(result.size() * 2);
+    }
+    result.resize(zs.total_out);
+    inflateEnd(&zs);
+    return result;
+}
+#endif
+
+bool PycArchive::canDecompress()
+{
+#ifdef PYC_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::unique_ptr<PycArchive> PycArchive::open(const char* filename)
+{
+    std::unique_ptr<PycMappedFile> file(new PycMappedFile(filename));
+    if (!file->isOpen())
+        return nullptr;
+
+    std::unique_ptr<PycArchive> archive(new PycArchive);
+    archive->m_buffers.push_back({ file->data(), file->size() });
+    archive->m_file = std::move(file);
+    if (!archive->scan(0, std::string()))
+        return nullptr;
+    return archive;
+}
+
+size_t PycArchive::addBuffer(std::vector<unsigned char> data)
+{
+    m_nested.emplace_back(new std::vector<unsigned char>(std::move(data)));
+    const std::vector<unsigned char>& nested = *m_nested.back();
+    m_buffers.push_back({ nested.empty() ? nullptr : &nested[0], nested.size() });
+    return m_buffers.size() - 1;
+}
+
+bool PycArchive::scan(size_t buffer, const std::string& prefix)
+{
+    const Buffer buf = m_buffers[buffer];
+    if (buf.size >= 4 && memcmp(buf.data, "PYZ\0", 4) == 0)
+        return scanPyz(buffer, prefix);
+    if (buf.size >= 4 && memcmp(buf.data, "PK\3\4", 4) == 0)
+        return scanZip(buffer, prefix);
+    // Executables only have the archive at the end; zip files may have
+    // something ahead of them too
+    return scanCArchive(buffer, prefix) || scanZip(buffer, prefix);
+}
+
+bool PycArchive::scanZip(size_t buffer, const std::string& prefix)
+{
+    const Buffer buf = m_buffers[buffer];
+    const size_t EOCD_SIZE = 22;
+    if (buf.size < EOCD_SIZE)
+        return false;
+
+    // The end of central directory record, followed by up to 64K of comment
+    size_t eocd = buf.size - EOCD_SIZE;
+    size_t lowest = (eocd > 0xFFFF) ? eocd - 0xFFFF : 0;
+    while (get_le32(buf.data + eocd) != 0x06054B50) {
+        if (eocd == lowest)
+            return false;
+        --eocd;
+    }
+    const unsigned char* record = buf.data + eocd;
+    unsigned entries = get_le16(record + 10);
+    size_t dir_size = get_le32(record + 12);
+    size_t dir_offset = get_le32(record + 16);
+    if (entries == 0xFFFF || dir_offset == 0xFFFFFFFF)
+        throw std::runtime_error("ZIP64 archives are not supported");
+    if (dir_size + dir_offset > eocd)
+        return false;
+
+    // Offsets are relative to the start of the zip data, which isn't the
+    // start of the file if something was prepended to it
+    size_t base = eocd - dir_size - dir_offset;
+    size_t pos = base + dir_offset;
+    for (unsigned i = 0; i < entries; ++i) {
+        const unsigned char* entry = buf.data + pos;
+        if (pos + 46 > eocd || get_le32(entry) != 0x02014B50)
+            throw std::runtime_error("Corrupt zip central directory");
+        unsigned flags = get_le16(entry + 8);
+        unsigned method = get_le16(entry + 10);
+        size_t stored = get_le32(entry + 20);
+        size_t length = get_le32(entry + 24);
+        size_t name_len = get_le16(entry + 28);
+        size_t header_offset = base + get_le32(entry + 42);
+        pos += 46 + name_len + get_le16(entry + 30) + get_le16(entry + 32);
+        if (pos > eocd)
+            throw std::runtime_error("Corrupt zip central directory");
+
+        std::string name(reinterpret_cast<const char*>(entry + 46), name_len);
+        if (!has_pyc_extension(name))
+            continue;
+        if (method != 0 && method != 8) {
+            pyc_diagnostic("Skipping %s%s: unsupported compression method %u\n",
+                           prefix.c_str(), name.c_str(), method);
+            continue;
+        }
+
+        const unsigned char* header = buf.data + header_offset;
+        if (header_offset + 30 > buf.size || get_le32(header) != 0x04034B50)
+            throw std::runtime_error("Corrupt zip local header");
+        size_t data = header_offset + 30 + get_le16(header + 26) + get_le16(header + 28);
+        if (data > buf.size || stored > buf.size - data)
+            throw std::runtime_error("Truncated zip archive");
+
+        Member member;
+        member.name = prefix + name;
+        member.buffer = buffer;
+        member.offset = data;
+        member.size = stored;
+        member.length = length;
+        member.compression = (method == 8) ? DEFLATE : STORED;
+        member.encrypted = (flags & 0x1) != 0;
+        member.major = member.minor = -1;
+        m_members.push_back(std::move(member));
+    }
+    return true;
+}
+
+bool PycArchive::scanCArchive(size_t buffer, const std::string& prefix)
+{
+    static const unsigned char COOKIE_MAGIC[] = { 'M', 'E', 'I', 014, 013, 012, 013, 016 };
+    const Buffer buf = m_buffers[buffer];
+    const size_t COOKIE_SIZE = 24;
+    if (buf.size < COOKIE_SIZE)
+        return false;
+
+    size_t cookie = buf.size - COOKIE_SIZE;
+    while (memcmp(buf.data + cookie, COOKIE_MAGIC, sizeof(COOKIE_MAGIC)) != 0) {
+        if (cookie == 0)
+            return false;
+        --cookie;
+    }
+
+    // PyInstaller 2.1 and later add the name of the Python library
+    size_t cookie_size = COOKIE_SIZE;
+    if (cookie + COOKIE_SIZE + 64 <= buf.size) {
+        std::string libname(reinterpret_cast<const char*>(buf.data + cookie + COOKIE_SIZE), 64);
+        std::transform(libname.begin(), libname.end(), libname.begin(), ::tolower);
+        if (libname.find("python") != std::string::npos)
+            cookie_size += 64;
+    }
+    const unsigned char* fields = buf.data + cookie + 8;
+    size_t package_size = get_be32(fields);
+    size_t toc_offset = get_be32(fields + 4);
+    size_t toc_size = get_be32(fields + 8);
+    unsigned pyver = get_be32(fields + 12);
+    if (package_size > cookie + cookie_size)
+        throw std::runtime_error("Corrupt PyInstaller archive");
+    size_t package = cookie + cookie_size - package_size;
+    if (toc_offset > cookie - package || toc_size > cookie - package - toc_offset)
+        throw std::runtime_error("Corrupt PyInstaller table of contents");
+
+    // 27 for 2.7, 310 for 3.10
+    int major = (pyver >= 100) ? pyver / 100 : pyver / 10;
+    int minor = (pyver >= 100) ? pyver % 100 : pyver % 10;
+
+    size_t pos = package + toc_offset;
+    const size_t toc_end = pos + toc_size;
+    while (pos < toc_end) {
+        const unsigned char* entry = buf.data + pos;
+        if (toc_end - pos < 18 || get_be32(entry) < 18 || get_be32(entry) > toc_end - pos)
+            throw std::runtime_error("Corrupt PyInstaller table of contents");
+        size_t entry_size = get_be32(entry);
+        size_t data = package + get_be32(entry + 4);
+        size_t stored = get_be32(entry + 8);
+        size_t length = get_be32(entry + 12);
+        unsigned char flag = entry[16];
+        char type = (char)entry[17];
+        const char* name_start = reinterpret_cast<const char*>(entry + 18);
+        std::string name(name_start, strnlen(name_start, entry_size - 18));
+        pos += entry_size;
+        if (data > cookie || stored > cookie - data)
+            throw std::runtime_error("Truncated PyInstaller archive");
+
+        if (type == 'z' || type == 'Z') {
+            // The PYZ with the bundled modules, or a zip file
+            size_t nested;
+            if (flag == 0) {
+                m_buffers.push_back({ buf.data + data, stored });
+                nested = m_buffers.size() - 1;
+            } else {
+#ifdef PYC_HAVE_ZLIB
+                nested = addBuffer(inflate_data(buf.data + data, stored, length, false));
+#else
+                pyc_diagnostic("Skipping %s%s: compressed, and zlib support is missing\n",
+                               prefix.c_str(), name.c_str());
+                continue;
+#endif
+            }
+            if (!scan(nested, prefix + name + "/")) {
+                pyc_diagnostic("Skipping %s%s: unrecognized archive\n",
+                               prefix.c_str(), name.c_str());
+            }
+            continue;
+        }
+
+        Member member;
+        if (type == 's')
+            member.name = prefix + name + ".pyc";   // Scripts, like the entry point
+        else if (type == 'm' || type == 'M')
+            member.name = prefix + module_path(name, type == 'M');
+        else
+            continue;
+        member.buffer = buffer;
+        member.offset = data;
+        member.size = stored;
+        member.length = length;
+        member.compression = flag ? ZLIB : STORED;
+        member.encrypted = (flag > 1);
+        member.major = major;
+        member.minor = minor;
+        m_members.push_back(std::move(member));
+    }
+    return true;
+}
+
+/* An entry's ispkg flag (up to PyInstaller 5) or type code (6 onwards) */
+static int toc_int(PycRef<PycObject> obj)
+{
+    if (obj == NULL)
+        return -1;
+    if (obj->type() == PycObject::TYPE_TRUE || obj->type() == PycObject::TYPE_FALSE)
+        return (obj->type() == PycObject::TYPE_TRUE) ? 1 : 0;
+    PycRef<PycInt> value = obj.try_cast<PycInt>();
+    return (value != NULL) ? value->value() : -1;
+}
+
+bool PycArchive::scanPyz(size_t buffer, const std::string& prefix)
+{
+    const Buffer buf = m_buffers[buffer];
+    if (buf.size < 12 || memcmp(buf.data, "PYZ\0", 4) != 0)
+        return false;
+
+    PycModule mod;
+    mod.setVersion(get_le32(buf.data + 4));
+    if (!mod.isValid())
+        throw std::runtime_error("Unsupported Python version in PYZ archive");
+    size_t toc_offset = get_be32(buf.data + 8);
+    if (toc_offset >= buf.size)
+        throw std::runtime_error("Corrupt PYZ table of contents");
+
+    // A marshalled list of (name, (type, offset, size)), or a dict in older
+    // versions
+    PycBuffer in(buf.data + toc_offset, (int)(buf.size - toc_offset));
+    PycRef<PycObject> toc = LoadObject(&in, &mod);
+    std::vector<std::pair<PycRef<PycObject>, PycRef<PycObject>>> items;
+    PycRef<PycList> list = toc.try_cast<PycList>();
+    PycRef<PycDict> dict = toc.try_cast<PycDict>();
+    if (list != NULL) {
+        for (int i = 0; i < list->size(); ++i) {
+            PycRef<PycTuple> item = list->get(i).try_cast<PycTuple>();
+            if (item == NULL || item->size() != 2)
+                throw std::runtime_error("Corrupt PYZ table of contents");
+            items.emplace_back(item->get(0), item->get(1));
+        }
+    } else if (dict != NULL) {
+        for (const auto& item : dict->values())
+            items.emplace_back(std::get<0>(item), std::get<1>(item));
+    } else {
+        throw std::runtime_error("Corrupt PYZ table of contents");
+    }
+
+    for (const auto& item : items) {
+        PycRef<PycString> name = item.first.try_cast<PycString>();
+        PycRef<PycTuple> value = item.second.try_cast<PycTuple>();
+        if (name == NULL || value == NULL || value->size() != 3)
+            throw std::runtime_error("Corrupt PYZ table of contents");
+        int type = toc_int(value->get(0));
+        int offset = toc_int(value->get(1));
+        int size = toc_int(value->get(2));
+        if (type != 0 && type != 1)
+            continue;   // Data files and namespace packages
+        if (offset < 0 || size < 0 || (size_t)offset > buf.size
+                || (size_t)size > buf.size - offset)
+            throw std::runtime_error("Corrupt PYZ table of contents");
+
+        Member member;
+        member.name = prefix + module_path(name->strValue(), type == 1);
+        member.buffer = buffer;
+        member.offset = offset;
+        member.size = size;
+        member.length = 0;
+        member.compression = ZLIB;
+        member.encrypted = false;
+        member.major = mod.majorVer();
+        member.minor = mod.minorVer();
+        m_members.push_back(std::move(member));
+    }
+    return true;
+}
+
+std::vector<unsigned char> PycArchive::read(size_t index) const
+{
+    const Member& member = m_members.at(index);
+    if (member.encrypted)
+        throw std::runtime_error("Archive member is encrypted");
+    const unsigned char* data = m_buffers[member.buffer].data + member.offset;
+    if (member.compression == STORED)
+        return std::vector<unsigned char>(data, data + member.size);
+#ifdef PYC_HAVE_ZLIB
+    return inflate_data(data, member.size, member.length, member.compression == DEFLATE);
+#else
+    throw std::runtime_error("Archive member is compressed, and zlib support is missing");
+#endif
+}
+
+void PycArchive::load(size_t index, PycModule& mod) const
+{
+    const Member& member = m_members.at(index);
+    const unsigned char* data = m_buffers[member.buffer].data + member.offset;
+    size_t size = member.size;
+    std::vector<unsigned char> inflated;
+    if (member.compression != STORED || member.encrypted) {
+        inflated = read(index);
+        data = inflated.empty() ? nullptr : &inflated[0];
+        size = inflated.size();
+    }
+
+    // The magic number ends in \r\n, where a marshalled code object starts
+    // with its type
+    bool has_header = (size >= 4 && data[2] == '\r' && data[3] == '\n');
+    if (!has_header && member.major < 0)
+        throw std::runtime_error("Archive member has no .pyc header");
+    if (inflated.empty()) {
+        if (has_header)
+            mod.loadFromBuffer(data, size);
+        else
+            mod.loadFromMarshalledBuffer(data, size, member.major, member.minor);
+    } else {
+        if (has_header)
+            mod.loadFromBuffer(std::move(inflated));
+        else
+            mod.loadFromMarshalledBuffer(std::move(inflated), member.major, member.minor);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _PYC_ARCHIVE_H
+#define _PYC_ARCHIVE_H
+
+#include "data.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+class PycModule;
+
+/* The compiled modules inside a zip file (also .whl, .egg and the
+ * pythonXY.zip stdlib bundles), a PyInstaller executable (CArchive) or a
+ * PyInstaller PYZ archive, read straight from a mapping of the archive.
+ * Archives nested in a CArchive, like its PYZ, are listed along with its
+ * own members.  Once opened, members may be read from several threads at
+ * once. */
+class PycArchive {
+public:
+    enum Compression { STORED, DEFLATE, ZLIB };
+
+    struct Member {
+        std::string name;       // Path inside the archive, ending in .pyc
+        size_t buffer;          // Which of the archive's buffers holds it
+        size_t offset, size;    // Where its stored bytes are
+        size_t length;          // Its size once decompressed
+        Compression compression;
+        bool encrypted;
+        int major, minor;       // The version of members which lack the
+                                // .pyc header, or -1 if unknown
+    };
+
+    /* Returns nullptr if the file isn't one of the supported archives, and
+     * throws if it is one but can't be read */
+    static std::unique_ptr<PycArchive> open(const char* filename);
+
+    const std::vector<Member>& members() const { return m_members; }
+
+    /* The decompressed bytes of a member */
+    std::vector<unsigned char> read(size_t index) const;
+
+    /* Loads a member into mod, with or without a .pyc header.  Stored
+     * members are loaded in place, so the archive has to outlive mod. */
+    void load(size_t index, PycModule& mod) const;
+
+    /* Whether inflating members is supported in this build */
+    static bool canDecompress();
+
+private:
+    struct Buffer {
+        const unsigned char* data;
+        size_t size;
+    };
+
+    PycArchive() { }
+    PycArchive(const PycArchive&) = delete;
+    PycArchive& operator=(const PycArchive&) = delete;
+
+    bool scan(size_t buffer, const std::string& prefix);
+    bool scanZip(size_t buffer, const std::string& prefix);
+    bool scanCArchive(size_t buffer, const std::string& prefix);
+    bool scanPyz(size_t buffer, const std::string& prefix);
+    size_t addBuffer(std::vector<unsigned char> data);
+
+    std::unique_ptr<PycMappedFile> m_file;
+    std::vector<Buffer> m_buffers;
+    std::vector<std::unique_ptr<std::vector<unsigned char>>> m_nested;
+    std::vector<Member> m_members;
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "pyc_code.h"
 #include "pyc_module.h"
 #include "data.h"
+#include "bytecode.h"
+#include <algorithm>
 
 /* == Marshal structure for Code object ==
                 1.0     1.3     1.5     2.1     2.3     3.0     3.8     3.11
@@ -28,103 +30,506 @@ exceptiontable                                                          Obj
 
 void PycCode::load(PycData* stream, PycModule* mod)
 {
-    if (mod->verCompare(1, 3) >= 0 && mod->verCompare(2, 3) < 0)
-        m_argCount = stream->get16();
-    else if (mod->verCompare(2, 3) >= 0)
+    const bool long_fields = mod->has(PycModule::CAP_LONG_CODE_FIELDS);
+    if (long_fields)
         m_argCount = stream->get32();
+    else if (mod->has(PycModule::CAP_CODE_ARGS))
+        m_argCount = stream->get16();
 
-    if (mod->verCompare(3, 8) >= 0)
+    if (mod->has(PycModule::CAP_POS_ONLY_ARGS))
         m_posOnlyArgCount = stream->get32();
     else
         m_posOnlyArgCount = 0;
 
-    if (mod->majorVer() >= 3)
+    if (mod->has(PycModule::CAP_KW_ONLY_ARGS))
         m_kwOnlyArgCount = stream->get32();
     else
         m_kwOnlyArgCount = 0;
 
-    if (mod->verCompare(1, 3) >= 0 && mod->verCompare(2, 3) < 0)
-        m_numLocals = stream->get16();
-    else if (mod->verCompare(2, 3) >= 0 && mod->verCompare(3, 11) < 0)
+    if (mod->has(PycModule::CAP_LOCALSPLUS))
+        m_numLocals = 0;
+    else if (long_fields)
         m_numLocals = stream->get32();
+    else if (mod->has(PycModule::CAP_CODE_ARGS))
+        m_numLocals = stream->get16();
     else
         m_numLocals = 0;
 
-    if (mod->verCompare(1, 5) >= 0 && mod->verCompare(2, 3) < 0)
-        m_stackSize = stream->get16();
-    else if (mod->verCompare(2, 3) >= 0)
+    if (long_fields)
         m_stackSize = stream->get32();
+    else if (mod->has(PycModule::CAP_LINE_TABLE))
+        m_stackSize = stream->get16();
     else
         m_stackSize = 0;
 
-    if (mod->verCompare(1, 3) >= 0 && mod->verCompare(2, 3) < 0)
-        m_flags = stream->get16();
-    else if (mod->verCompare(2, 3) >= 0)
+    if (long_fields)
         m_flags = stream->get32();
+    else if (mod->has(PycModule::CAP_CODE_ARGS))
+        m_flags = stream->get16();
     else
         m_flags = 0;
 
-    if (mod->verCompare(3, 8) < 0) {
+    if (!mod->has(PycModule::CAP_POS_ONLY_ARGS)) {
         // Remap flags to new values introduced in 3.8
         if (m_flags & 0xF0000000)
             throw std::runtime_error("Cannot remap unexpected flags");
         m_flags = (m_flags & 0xFFFF) | ((m_flags & 0xFFF0000) << 4);
     }
 
-    m_code = LoadObject(stream, mod).cast<PycString>();
-    m_consts = LoadObject(stream, mod).cast<PycSequence>();
-    m_names = LoadObject(stream, mod).cast<PycSequence>();
+    // Defaults for the fields which this version doesn't have
+    if (!mod->has(PycModule::CAP_CODE_ARGS))
+        m_localNames = mod->newObject<PycTuple>();
+    if (!mod->has(PycModule::CAP_LOCALSPLUS))
+        m_localKinds = mod->newObject<PycString>();
+    if (!mod->has(PycModule::CAP_CLOSURE_VARS)) {
+        m_freeVars = mod->newObject<PycTuple>();
+        m_cellVars = mod->newObject<PycTuple>();
+    }
+    if (!mod->has(PycModule::CAP_QUALNAME))
+        m_qualName = mod->newObject<PycString>();
+    if (!mod->has(PycModule::CAP_LINE_TABLE))
+        m_lnTable = mod->newObject<PycString>();
+    if (!mod->has(PycModule::CAP_EXCEPTION_TABLE))
+        m_exceptTable = mod->newObject<PycString>();
+}
 
-    if (mod->verCompare(1, 3) >= 0)
-        m_localNames = LoadObject(stream, mod).cast<PycSequence>();
-    else
-        m_localNames = new PycTuple;
+static bool has_field(PycModule* mod, int field)
+{
+    switch (field) {
+    case PycCode::FIELD_LOCAL_NAMES:
+        return mod->has(PycModule::CAP_CODE_ARGS);
+    case PycCode::FIELD_LOCAL_KINDS:
+        return mod->has(PycModule::CAP_LOCALSPLUS);
+    case PycCode::FIELD_QUAL_NAME:
+        return mod->has(PycModule::CAP_QUALNAME);
+    case PycCode::FIELD_EXCEPT_TABLE:
+        return mod->has(PycModule::CAP_EXCEPTION_TABLE);
+    case PycCode::FIELD_FREE_VARS:
+    case PycCode::FIELD_CELL_VARS:
+        return mod->has(PycModule::CAP_CLOSURE_VARS);
+    case PycCode::FIELD_LN_TABLE:
+        return mod->has(PycModule::CAP_LINE_TABLE);
+    default:
+        return true;
+    }
+}
 
-    if (mod->verCompare(3, 11) >= 0)
-        m_localKinds = LoadObject(stream, mod).cast<PycString>();
-    else
-        m_localKinds = new PycString;
+PycCode::Field PycCode::fieldAt(PycModule* mod, int index)
+{
+    int field = FIELD_CODE;
+    for ( ;; ++field) {
+        if (field == FIELD_END || (has_field(mod, field) && index-- == 0))
+            return (Field)field;
+    }
+}
 
-    if (mod->verCompare(2, 1) >= 0 && mod->verCompare(3, 11) < 0)
-        m_freeVars = LoadObject(stream, mod).cast<PycSequence>();
-    else
-        m_freeVars = new PycTuple;
+int PycCode::headerSize(PycModule* mod)
+{
+    // Matches the reads at the start of load()
+    int size = 0;
+    const bool long_fields = mod->has(PycModule::CAP_LONG_CODE_FIELDS);
+    if (long_fields)
+        size += 4 + 4;          // argcount, flags
+    else if (mod->has(PycModule::CAP_CODE_ARGS))
+        size += 2 + 2 + 2;      // argcount, nlocals, flags
+    if (mod->has(PycModule::CAP_POS_ONLY_ARGS))
+        size += 4;              // posonlyargcount
+    if (mod->has(PycModule::CAP_KW_ONLY_ARGS))
+        size += 4;              // kwonlyargcount
+    if (long_fields && !mod->has(PycModule::CAP_LOCALSPLUS))
+        size += 4;              // nlocals
+    if (long_fields)
+        size += 4;              // stacksize
+    else if (mod->has(PycModule::CAP_LINE_TABLE))
+        size += 2;
+    return size;
+}
 
-    if (mod->verCompare(2, 1) >= 0 && mod->verCompare(3, 11) < 0)
-        m_cellVars = LoadObject(stream, mod).cast<PycSequence>();
-    else
-        m_cellVars = new PycTuple;
+int PycCode::firstLineSize(PycModule* mod)
+{
+    if (!mod->has(PycModule::CAP_LINE_TABLE))
+        return 0;
+    return mod->has(PycModule::CAP_LONG_CODE_FIELDS) ? 4 : 2;
+}
 
-    m_fileName = LoadObject(stream, mod).cast<PycString>();
-    m_name = LoadObject(stream, mod).cast<PycString>();
+bool PycCode::wantsChild(PycModule* mod, int index) const
+{
+    return fieldAt(mod, index) != FIELD_END;
+}
 
-    if (mod->verCompare(3, 11) >= 0)
-        m_qualName = LoadObject(stream, mod).cast<PycString>();
-    else
-        m_qualName = new PycString;
+void PycCode::addChild(PycData* stream, PycModule* mod, PycRef<PycObject> child, int index)
+{
+    switch (fieldAt(mod, index)) {
+    case FIELD_CODE:
+        m_code = child.cast<PycString>();
+        break;
+    case FIELD_CONSTS:
+        m_consts = child.cast<PycSequence>();
+        break;
+    case FIELD_NAMES:
+        m_names = child.cast<PycSequence>();
+        break;
+    case FIELD_LOCAL_NAMES:
+        m_localNames = child.cast<PycSequence>();
+        break;
+    case FIELD_LOCAL_KINDS:
+        m_localKinds = child.cast<PycString>();
+        break;
+    case FIELD_FREE_VARS:
+        m_freeVars = child.cast<PycSequence>();
+        break;
+    case FIELD_CELL_VARS:
+        m_cellVars = child.cast<PycSequence>();
+        break;
+    case FIELD_FILE_NAME:
+        m_fileName = child.cast<PycString>();
+        break;
+    case FIELD_NAME:
+        m_name = child.cast<PycString>();
+        break;
+    case FIELD_QUAL_NAME:
+        m_qualName = child.cast<PycString>();
+        break;
+    case FIELD_LN_TABLE:
+        m_lnTable = child.cast<PycString>();
+        break;
+    case FIELD_EXCEPT_TABLE:
+        m_exceptTable = child.cast<PycString>();
+        break;
+    default:
+        break;
+    }
 
-    if (mod->verCompare(1, 5) >= 0 && mod->verCompare(2, 3) < 0)
-        m_firstLine = stream->get16();
-    else if (mod->verCompare(2, 3) >= 0)
-        m_firstLine = stream->get32();
+    // The first line number sits between the names and the line table
+    if (fieldAt(mod, index + 1) == FIELD_LN_TABLE) {
+        if (mod->has(PycModule::CAP_LONG_CODE_FIELDS))
+            m_firstLine = stream->get32();
+        else if (mod->has(PycModule::CAP_LINE_TABLE))
+            m_firstLine = stream->get16();
+    }
+}
 
-    if (mod->verCompare(1, 5) >= 0)
-        m_lnTable = LoadObject(stream, mod).cast<PycString>();
-    else
-        m_lnTable = new PycString;
+PycRef<PycObject> PycCode::resolveConst(int idx) const
+{
+    PycRef<PycSimpleSequence> consts = m_consts.cast<PycSimpleSequence>();
+    PycRef<PycLazyCode> lazy = consts->get(idx).try_cast<PycLazyCode>();
+    if (lazy == NULL)
+        return consts->get(idx);
+    PycRef<PycObject> code = lazy->resolve().cast<PycObject>();
+    consts->set(idx, code);
+    m_standIns.emplace_back(idx, std::move(lazy));
+    return code;
+}
 
-    if (mod->verCompare(3, 11) >= 0)
-        m_exceptTable = LoadObject(stream, mod).cast<PycString>();
-    else
-        m_exceptTable = new PycString;
+void PycCode::resolveConsts() const
+{
+    PycRef<PycSimpleSequence> consts = m_consts.try_cast<PycSimpleSequence>();
+    for (int i = 0; consts != NULL && i < consts->size(); ++i)
+        resolveConst(i);
+    m_lazyConsts = false;
+}
+
+PycRef<PycObject> PycCode::getConst(int idx) const
+{
+    if (m_lazyConsts && m_consts.isa<PycSimpleSequence>())
+        return resolveConst(idx);
+    return m_consts->get(idx);
+}
+
+void PycCode::unloadConsts()
+{
+    if (m_standIns.empty())
+        return;
+    PycRef<PycSimpleSequence> consts = m_consts.cast<PycSimpleSequence>();
+    for (auto& standIn : m_standIns) {
+        standIn.second->unload();
+        consts->set(standIn.first, standIn.second.cast<PycObject>());
+    }
+    m_standIns.clear();
+    m_lazyConsts = true;
+}
+
+const PycCode::instructions_t& PycCode::instructions(PycModule* mod) const
+{
+    if (!m_decoded.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(m_decodeLock);
+        if (!m_decoded.load(std::memory_order_relaxed)) {
+            bc_decode(m_code->data(), m_code->length(), mod, m_instructions);
+            if (PycStats* stats = mod->stats())
+                stats->instructions += m_instructions.size();
+            m_decoded.store(true, std::memory_order_release);
+        }
+    }
+    return m_instructions;
+}
+
+void PycCode::releaseInstructions()
+{
+    std::lock_guard<std::mutex> guard(m_decodeLock);
+    instructions_t().swap(m_instructions);
+    m_decoded.store(false, std::memory_order_relaxed);
+}
+
+/* Reads one of the table's numbers: big endian groups of six bits, with
+ * bit 6 set on all but the last one.  Bit 7 marks an entry's first byte. */
+static bool read_varint(const unsigned char*& pos, const unsigned char* end, int& value)
+{
+    if (pos == end)
+        return false;
+    int byte = *pos++;
+    value = byte & 0x3F;
+    while (byte & 0x40) {
+        if (pos == end)
+            return false;
+        byte = *pos++;
+        value = (value << 6) | (byte & 0x3F);
+    }
+    return true;
+}
+
+static void parse_exception_table(PycRef<PycString> table, PycCode::exceptions_t& entries)
+{
+    if (table == NULL)
+        return;
+    const unsigned char* pos = reinterpret_cast<const unsigned char*>(table->data());
+    const unsigned char* end = pos + table->length();
+    while (pos != end) {
+        int start, length, target, depth_lasti;
+        if (!read_varint(pos, end, start) || !read_varint(pos, end, length)
+                || !read_varint(pos, end, target) || !read_varint(pos, end, depth_lasti))
+            break;
+        // Offsets count code units
+        PycExceptionEntry entry;
+        entry.start = start * (int)sizeof(uint16_t);
+        entry.end = (start + length) * (int)sizeof(uint16_t);
+        entry.target = target * (int)sizeof(uint16_t);
+        entry.depth = depth_lasti >> 1;
+        entry.lasti = (depth_lasti & 1) != 0;
+        entries.push_back(entry);
+    }
+    // CPython writes them in order, but a lookup mustn't depend on that
+    std::sort(entries.begin(), entries.end(),
+              [](const PycExceptionEntry& a, const PycExceptionEntry& b) {
+                  return a.start < b.start;
+              });
+}
+
+const PycCode::exceptions_t& PycCode::exceptionEntries() const
+{
+    if (!m_exceptionsParsed.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(m_decodeLock);
+        if (!m_exceptionsParsed.load(std::memory_order_relaxed)) {
+            parse_exception_table(m_exceptTable, m_exceptions);
+            m_exceptionsParsed.store(true, std::memory_order_release);
+        }
+    }
+    return m_exceptions;
+}
+
+const PycExceptionEntry* PycCode::handlerAt(int offset) const
+{
+    const exceptions_t& entries = exceptionEntries();
+    auto it = std::upper_bound(entries.begin(), entries.end(), offset,
+                               [](int offset, const PycExceptionEntry& entry) {
+                                   return offset < entry.start;
+                               });
+    if (it == entries.begin())
+        return nullptr;
+    --it;
+    return (offset < it->end) ? &*it : nullptr;
+}
+
+/* co_lnotab, 1.5 - 3.9: (offset delta, line delta) byte pairs */
+static void parse_lnotab(const unsigned char* pos, const unsigned char* end, int line,
+                         bool signed_deltas, PycCode::lines_t& lines)
+{
+    int offset = 0;
+    int last_line = -1;
+    for ( ; end - pos >= 2; pos += 2) {
+        if (pos[0] != 0) {
+            if (line != last_line) {
+                lines.push_back({ offset, line });
+                last_line = line;
+            }
+            offset += pos[0];
+        }
+        line += (signed_deltas && pos[1] >= 0x80) ? pos[1] - 0x100 : pos[1];
+    }
+    if (line != last_line)
+        lines.push_back({ offset, line });
+}
+
+/* co_linetable, 3.10: (offset delta, signed line delta) byte pairs, which
+ * cover the code one after the other.  A line delta of -128 means the
+ * code has no line, without changing the line which later deltas apply
+ * to. */
+static void parse_linetable_310(const unsigned char* pos, const unsigned char* end,
+                                int line, PycCode::lines_t& lines)
+{
+    int offset = 0;
+    int current = line;
+    for ( ; end - pos >= 2; pos += 2) {
+        // A delta of 0 carries on with the previous pair's line, or lack of it
+        int delta = (pos[1] >= 0x80) ? pos[1] - 0x100 : pos[1];
+        if (delta == -128) {
+            current = -1;
+        } else if (delta != 0) {
+            line += delta;
+            current = line;
+        }
+        if (pos[0] != 0) {
+            if (lines.empty() || lines.back().line != current)
+                lines.push_back({ offset, current });
+            offset += pos[0];
+        }
+    }
+}
+
+/* The location table's numbers: little endian groups of six bits, with
+ * bit 6 set on all but the last one */
+static bool read_location_varint(const unsigned char*& pos, const unsigned char* end,
+                                 int& value)
+{
+    value = 0;
+    for (int shift = 0; pos != end; shift += 6) {
+        int byte = *pos++;
+        value |= (byte & 0x3F) << shift;
+        if (!(byte & 0x40))
+            return true;
+    }
+    return false;
+}
+
+/* co_linetable, 3.11+: one entry for every run of code units, starting
+ * with a byte of 1cccclll, where c is the kind of entry and lll + 1 the
+ * number of code units */
+static void parse_location_table(const unsigned char* pos, const unsigned char* end,
+                                 int line, PycCode::lines_t& lines)
+{
+    int offset = 0;
+    while (pos != end) {
+        int header = *pos++;
+        if (!(header & 0x80))
+            break;
+        int kind = (header >> 3) & 0xF;
+        int length = ((header & 0x7) + 1) * (int)sizeof(uint16_t);
+        int entry_line = line;
+        int value;
+        switch (kind) {
+        case 15:    // No location
+            entry_line = -1;
+            break;
+        case 14:    // Line delta, end line delta, column, end column
+        case 13:    // Line delta only
+            if (!read_location_varint(pos, end, value))
+                return;
+            line += (value & 1) ? -(value >> 1) : (value >> 1);
+            entry_line = line;
+            for (int i = 0; kind == 14 && i < 3; ++i) {
+                if (!read_location_varint(pos, end, value))
+                    return;
+            }
+            break;
+        case 10:    // Line delta of kind - 10, column, end column
+        case 11:
+        case 12:
+            line += kind - 10;
+            entry_line = line;
+            if (end - pos < 2)
+                return;
+            pos += 2;
+            break;
+        default:    // Same line, packed columns
+            if (pos == end)
+                return;
+            ++pos;
+            break;
+        }
+        if (lines.empty() || lines.back().line != entry_line)
+            lines.push_back({ offset, entry_line });
+        offset += length;
+    }
+}
+
+const PycCode::lines_t& PycCode::lineTable(PycModule* mod) const
+{
+    if (m_linesParsed.load(std::memory_order_acquire))
+        return m_lines;
+
+    // Without a line table, the lines come from the bytecode
+    lines_t lines;
+    if (!mod->has(PycModule::CAP_LINE_TABLE)) {
+        for (const auto& insn : instructions(mod)) {
+            if (insn.opcode == Pyc::SET_LINENO_A
+                    && (lines.empty() || lines.back().line != insn.operand))
+                lines.push_back({ insn.offset, insn.operand });
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(m_decodeLock);
+    if (!m_linesParsed.load(std::memory_order_relaxed)) {
+        if (mod->has(PycModule::CAP_LINE_TABLE) && m_lnTable != NULL) {
+            const unsigned char* pos = reinterpret_cast<const unsigned char*>(m_lnTable->data());
+            const unsigned char* end = pos + m_lnTable->length();
+            if (mod->has(PycModule::CAP_LOCALSPLUS))
+                parse_location_table(pos, end, m_firstLine, lines);
+            else if (mod->has(PycModule::CAP_JUMPS_IN_WORDS))
+                parse_linetable_310(pos, end, m_firstLine, lines);
+            else
+                parse_lnotab(pos, end, m_firstLine, mod->verCompare(3, 6) >= 0, lines);
+        }
+        m_lines = std::move(lines);
+        m_linesParsed.store(true, std::memory_order_release);
+    }
+    return m_lines;
+}
+
+static int line_at(const PycCode::lines_t& lines, int offset, size_t& next)
+{
+    auto it = std::upper_bound(lines.begin(), lines.end(), offset,
+                               [](int offset, const PycLineEntry& entry) {
+                                   return offset < entry.offset;
+                               });
+    next = it - lines.begin();
+    return (it == lines.begin()) ? -1 : (it - 1)->line;
+}
+
+int PycCode::lineAt(PycModule* mod, int offset) const
+{
+    size_t next;
+    return line_at(lineTable(mod), offset, next);
+}
+
+int PycLineCursor::lineAt(int offset)
+{
+    if (m_next > 0 && offset < m_lines[m_next - 1].offset)
+        return line_at(m_lines, offset, m_next);
+    while (m_next < m_lines.size() && m_lines[m_next].offset <= offset)
+        ++m_next;
+    return (m_next == 0) ? -1 : m_lines[m_next - 1].line;
 }
 
 PycRef<PycString> PycCode::getCellVar(PycModule* mod, int idx) const
 {
-    if (mod->verCompare(3, 11) >= 0)
+    if (mod->has(PycModule::CAP_LOCALSPLUS))
         return getLocal(idx);
 
     return (idx >= m_cellVars->size())
         ? m_freeVars->get(idx - m_cellVars->size()).cast<PycString>()
         : m_cellVars->get(idx).cast<PycString>();
 }
+
+
+/* PycLazyCode */
+PycRef<PycCode> PycLazyCode::resolve()
+{
+    if (m_code == NULL)
+        m_code = m_module->loadLazyCode(this);
+    return m_code;
+}
+
+void PycLazyCode::unload()
+{
+    if (m_code != NULL)
+        m_module->unloadLazyCode(this);
+}
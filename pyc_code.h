@@ -3,13 +3,43 @@
 
 #include "pyc_sequence.h"
 #include "pyc_string.h"
+#include <atomic>
+#include <mutex>
 #include <vector>
 
 class PycData;
 class PycModule;
+class PycLazyCode;
+
+/* One decoded bytecode instruction */
+struct PycInstruction {
+    int opcode;     // Pyc::Opcode
+    int operand;    // Includes the value of a preceding EXTENDED_ARG
+    int offset;     // Byte offset of the instruction (or its EXTENDED_ARG)
+    int length;     // Size in bytes, including any EXTENDED_ARG prefix
+};
+
+/* One entry of a Python 3.11+ exception table, with byte offsets */
+struct PycExceptionEntry {
+    int start, end;     // The instructions covered; end is exclusive
+    int target;         // Where the handler starts
+    int depth;          // Stack depth the handler unwinds to
+    bool lasti;         // Whether the offset of the raising instruction is pushed
+};
+
+/* Where the code of one source line starts */
+struct PycLineEntry {
+    int offset;     // Byte offset of the first instruction
+    int line;       // -1 for code which has no line (3.10+)
+};
 
 class PycCode : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_CODE || obj->tag() == TYPE_CODE2;
+    }
+
     typedef std::vector<PycRef<PycString>> globals_t;
     enum CodeFlags {
         CO_OPTIMIZED = 0x1,                                 // 1.3 ->
@@ -37,11 +67,30 @@ public:
         CO_NO_MONITORING_EVENTS = 0x2000000,                // 3.13 ->
     };
 
+    /* The nested objects of a code object, in marshal order */
+    enum Field {
+        FIELD_CODE, FIELD_CONSTS, FIELD_NAMES, FIELD_LOCAL_NAMES, FIELD_LOCAL_KINDS,
+        FIELD_FREE_VARS, FIELD_CELL_VARS, FIELD_FILE_NAME, FIELD_NAME, FIELD_QUAL_NAME,
+        FIELD_LN_TABLE, FIELD_EXCEPT_TABLE, FIELD_END
+    };
+
     PycCode(int type = TYPE_CODE)
         : PycObject(type), m_argCount(), m_posOnlyArgCount(), m_kwOnlyArgCount(),
-          m_numLocals(), m_stackSize(), m_flags(), m_firstLine() { }
+          m_numLocals(), m_stackSize(), m_flags(), m_firstLine(), m_lazyConsts(),
+          m_decoded(false), m_exceptionsParsed(false), m_linesParsed(false) { }
+
+    /* The marshal layout for mod's version: the size of the fixed fields
+     * ahead of the nested objects, the field which receives the index'th
+     * nested object, and the size of the first line number which is read
+     * right before the line table */
+    static int headerSize(PycModule* mod);
+    static Field fieldAt(PycModule* mod, int index);
+    static int firstLineSize(PycModule* mod);
 
     void load(PycData* stream, PycModule* mod) override;
+    bool wantsChild(PycModule* mod, int index) const override;
+    void addChild(PycData* stream, PycModule* mod, PycRef<PycObject> child,
+                  int index) override;
 
     int argCount() const { return m_argCount; }
     int posOnlyArgCount() const { return m_posOnlyArgCount; }
@@ -49,24 +98,28 @@ public:
     int numLocals() const { return m_numLocals; }
     int stackSize() const { return m_stackSize; }
     int flags() const { return m_flags; }
-    PycRef<PycString> code() const { return m_code; }
-    PycRef<PycSequence> consts() const { return m_consts; }
-    PycRef<PycSequence> names() const { return m_names; }
-    PycRef<PycSequence> localNames() const { return m_localNames; }
-    PycRef<PycString> localKinds() const { return m_localKinds; }
-    PycRef<PycSequence> freeVars() const { return m_freeVars; }
-    PycRef<PycSequence> cellVars() const { return m_cellVars; }
-    PycRef<PycString> fileName() const { return m_fileName; }
-    PycRef<PycString> name() const { return m_name; }
-    PycRef<PycString> qualName() const { return m_qualName; }
-    int firstLine() const { return m_firstLine; }
-    PycRef<PycString> lnTable() const { return m_lnTable; }
-    PycRef<PycString> exceptTable() const { return m_exceptTable; }
-
-    PycRef<PycObject> getConst(int idx) const
+    const PycRef<PycString>& code() const { return m_code; }
+    const PycRef<PycSequence>& consts() const
     {
-        return m_consts->get(idx);
+        if (m_lazyConsts)
+            resolveConsts();
+        return m_consts;
     }
+    const PycRef<PycSequence>& names() const { return m_names; }
+    const PycRef<PycSequence>& localNames() const { return m_localNames; }
+    const PycRef<PycString>& localKinds() const { return m_localKinds; }
+    const PycRef<PycSequence>& freeVars() const { return m_freeVars; }
+    const PycRef<PycSequence>& cellVars() const { return m_cellVars; }
+    const PycRef<PycString>& fileName() const { return m_fileName; }
+    const PycRef<PycString>& name() const { return m_name; }
+    const PycRef<PycString>& qualName() const { return m_qualName; }
+    int firstLine() const { return m_firstLine; }
+    const PycRef<PycString>& lnTable() const { return m_lnTable; }
+    const PycRef<PycString>& exceptTable() const { return m_exceptTable; }
+
+    /* Unlike consts(), only loads the one constant if it's a nested code
+     * object which hasn't been loaded yet */
+    PycRef<PycObject> getConst(int idx) const;
 
     PycRef<PycString> getName(int idx) const
     {
@@ -82,11 +135,60 @@ public:
 
     const globals_t& getGlobals() const { return m_globalsUsed; }
 
+    typedef std::vector<PycInstruction> instructions_t;
+
+    /* The decoded bytecode, in the same form as bc_next() produces it.  It
+     * is decoded on first use and then shared by all users. */
+    const instructions_t& instructions(PycModule* mod) const;
+
+    /* Frees the decoded bytecode, which is decoded again if it's needed
+     * after all.  Nothing may be using it at the time. */
+    void releaseInstructions();
+
+    typedef std::vector<PycExceptionEntry> exceptions_t;
+
+    /* The exception table, parsed on first use and sorted by offset.  The
+     * entries don't overlap; an entry which is cut off is left out. */
+    const exceptions_t& exceptionEntries() const;
+
+    /* The entry whose handler covers the instruction at offset, or null */
+    const PycExceptionEntry* handlerAt(int offset) const;
+
+    typedef std::vector<PycLineEntry> lines_t;
+
+    /* Line starts decoded from lnotab, 3.10's linetable or the location
+     * table of 3.11+, or from SET_LINENO for versions which have none of
+     * those.  Decoded on first use, sorted by offset, and each entry has
+     * a different line from the one before it. */
+    const lines_t& lineTable(PycModule* mod) const;
+
+    /* The line of the instruction at offset, or -1 if it has none */
+    int lineAt(PycModule* mod, int offset) const;
+
+    /* Each name is listed once, however often it's stored to (or the code
+     * object is built, if it's shared by several parents) */
     void markGlobal(PycRef<PycString> varname)
     {
+        for (const auto& global : m_globalsUsed) {
+            if (global.isIdent(varname) || global->isEqual(varname->view()))
+                return;
+        }
         m_globalsUsed.emplace_back(std::move(varname));
     }
 
+    /* Some of the constants are still PycLazyCode stand-ins */
+    void setLazyConsts() { m_lazyConsts = true; }
+
+    /* Puts the stand-ins back for the nested code objects which were loaded
+     * lazily, so those are freed as soon as nothing else refers to them.
+     * They are loaded again if they are accessed after all.  Not thread
+     * safe, and only useful if the module doesn't use an arena. */
+    void unloadConsts();
+
+private:
+    void resolveConsts() const;
+    PycRef<PycObject> resolveConst(int idx) const;
+
 private:
     int m_argCount, m_posOnlyArgCount, m_kwOnlyArgCount, m_numLocals;
     int m_stackSize, m_flags;
@@ -104,6 +206,64 @@ private:
     PycRef<PycString> m_lnTable;
     PycRef<PycString> m_exceptTable;
     globals_t m_globalsUsed; /* Global vars used in this code */
+
+    mutable bool m_lazyConsts;
+
+    /* The stand-ins for constants which were loaded, by index */
+    mutable std::vector<std::pair<int, PycRef<PycLazyCode>>> m_standIns;
+
+    mutable std::mutex m_decodeLock;
+    mutable std::atomic<bool> m_decoded;
+    mutable instructions_t m_instructions;
+    mutable std::atomic<bool> m_exceptionsParsed;
+    mutable exceptions_t m_exceptions;
+    mutable std::atomic<bool> m_linesParsed;
+    mutable lines_t m_lines;
+};
+
+/* Finds the lines of instructions visited in order of their offsets in
+ * constant time each, falling back to a search when going backwards */
+class PycLineCursor {
+public:
+    explicit PycLineCursor(const PycCode::lines_t& lines) : m_lines(lines), m_next() { }
+
+    int lineAt(int offset);
+
+private:
+    const PycCode::lines_t& m_lines;
+    size_t m_next;      // The first entry past the previous offset
+};
+
+/* Stands in for a nested code object which hasn't been loaded yet (see
+ * PycModule::setLazyLoading).  Only the constants of a code object and the
+ * module's reference tables hold these; consts() swaps them for the real
+ * thing on first access. */
+class PycLazyCode : public PycObject {
+public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == (TYPE_CODE | STAND_IN);
+    }
+
+    PycLazyCode(PycModule* mod, size_t offset)
+        : PycObject(TYPE_CODE | STAND_IN), m_module(mod), m_offset(offset),
+          m_firstRef(), m_firstIntern() { }
+
+    /* Loads the code object, if that hasn't happened yet */
+    PycRef<PycCode> resolve();
+
+    /* Lets go of the loaded code object */
+    void unload();
+
+private:
+    friend class PycModule;
+
+    PycModule* m_module;
+    size_t m_offset;        // Of the code object's type byte in the input
+    PycRef<PycCode> m_code;
+
+    /* The first reference and intern slots the code object's contents take */
+    size_t m_firstRef, m_firstIntern;
 };
 
 #endif
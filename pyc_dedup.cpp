@@ -0,0 +1,244 @@
+#include "pyc_dedup.h"
+#include "pyc_code.h"
+#include "pyc_numeric.h"
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+/* Mixes in a word at a time, which is plenty for telling objects apart in
+ * a hash table */
+class Hasher {
+public:
+    explicit Hasher(int type) : m_value(0x9E3779B97F4A7C15ULL * (uint64_t)(type + 1)) { }
+
+    void number(uint64_t value)
+    {
+        m_value = (m_value ^ value) * 0xFF51AFD7ED558CCDULL;
+        m_value ^= m_value >> 32;
+    }
+
+    void bytes(const void* data, size_t length)
+    {
+        auto cp = static_cast<const unsigned char*>(data);
+        number(length);
+        for ( ; length >= 8; cp += 8, length -= 8) {
+            uint64_t word;
+            memcpy(&word, cp, 8);
+            number(word);
+        }
+        if (length) {
+            uint64_t word = 0;
+            memcpy(&word, cp, length);
+            number(word);
+        }
+    }
+
+    void pointer(const PycObject* obj) { number((uint64_t)(uintptr_t)obj); }
+
+    size_t finish() const
+    {
+        // Zero marks an empty entry, or an object which isn't shared
+        size_t value = (size_t)(m_value ^ (m_value >> 29));
+        return value ? value : 1;
+    }
+
+private:
+    uint64_t m_value;
+};
+
+}
+
+/* The nested objects of a code object which are compared by identity:
+ * everything but the number fields */
+static void code_fields(const PycCode* code, const PycObject* fields[12])
+{
+    const PycObject* values[] = {
+        code->code(), code->consts(), code->names(), code->localNames(),
+        code->localKinds(), code->freeVars(), code->cellVars(), code->fileName(),
+        code->name(), code->qualName(), code->lnTable(), code->exceptTable(),
+    };
+    memcpy(fields, values, sizeof(values));
+}
+
+static bool is_number(int type)
+{
+    switch (type) {
+    case PycObject::TYPE_INT:
+    case PycObject::TYPE_INT64:
+    case PycObject::TYPE_LONG:
+    case PycObject::TYPE_FLOAT:
+    case PycObject::TYPE_COMPLEX:
+    case PycObject::TYPE_BINARY_FLOAT:
+    case PycObject::TYPE_BINARY_COMPLEX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void hash_number(Hasher& hasher, const PycObject* obj)
+{
+    hasher.number((uint64_t)obj->type());
+    switch (obj->type()) {
+    case PycObject::TYPE_INT:
+        hasher.number((uint64_t)(int64_t)static_cast<const PycInt*>(obj)->value());
+        break;
+    case PycObject::TYPE_INT64:
+    case PycObject::TYPE_LONG:
+        {
+            const auto& value = static_cast<const PycLong*>(obj)->value();
+            hasher.bytes(value.data(), value.size() * sizeof(uint16_t));
+        }
+        break;
+    case PycObject::TYPE_FLOAT:
+    case PycObject::TYPE_COMPLEX:
+        // The imaginary part of a complex is left to the comparison
+        hasher.bytes(static_cast<const PycFloat*>(obj)->value(),
+                     strlen(static_cast<const PycFloat*>(obj)->value()));
+        break;
+    default:
+        {
+            double value = static_cast<const PycCFloat*>(obj)->value();
+            hasher.bytes(&value, sizeof(value));
+        }
+        break;
+    }
+}
+
+/* Numbers are cheap to keep several copies of, so they aren't shared
+ * themselves, and the tuples holding them compare them by value */
+static bool same_item(const PycObject* a, const PycObject* b)
+{
+    if (a == b)
+        return true;
+    return a && b && is_number(a->type()) && a->type() == b->type()
+            && a->isEqual(const_cast<PycObject*>(b));
+}
+
+size_t PycDedup::hash(const PycObject* obj)
+{
+    Hasher hasher(obj->type());
+    switch (obj->type()) {
+    case PycObject::TYPE_STRING:
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_SHORT_ASCII:
+        {
+            auto str = static_cast<const PycString*>(obj);
+            hasher.bytes(str->data(), (size_t)str->length());
+        }
+        break;
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        for (const auto& item : static_cast<const PycTuple*>(obj)->values()) {
+            if (item != NULL && is_number(item.type()))
+                hash_number(hasher, item);
+            else
+                hasher.pointer(item);
+        }
+        break;
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        {
+            auto code = static_cast<const PycCode*>(obj);
+            hasher.number((uint64_t)code->argCount());
+            hasher.number((uint64_t)code->flags());
+            hasher.number((uint64_t)code->firstLine());
+            const PycObject* fields[12];
+            code_fields(code, fields);
+            for (const PycObject* field : fields)
+                hasher.pointer(field);
+        }
+        break;
+    default:
+        return 0;
+    }
+    return hasher.finish();
+}
+
+bool PycDedup::equal(const PycObject* a, const PycObject* b)
+{
+    if (a->type() != b->type())
+        return false;
+    switch (a->type()) {
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        {
+            const auto& values_a = static_cast<const PycTuple*>(a)->values();
+            const auto& values_b = static_cast<const PycTuple*>(b)->values();
+            if (values_a.size() != values_b.size())
+                return false;
+            for (size_t i = 0; i < values_a.size(); ++i) {
+                if (!same_item(values_a[i], values_b[i]))
+                    return false;
+            }
+            return true;
+        }
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        {
+            auto code_a = static_cast<const PycCode*>(a);
+            auto code_b = static_cast<const PycCode*>(b);
+            if (code_a->argCount() != code_b->argCount()
+                    || code_a->posOnlyArgCount() != code_b->posOnlyArgCount()
+                    || code_a->kwOnlyArgCount() != code_b->kwOnlyArgCount()
+                    || code_a->numLocals() != code_b->numLocals()
+                    || code_a->stackSize() != code_b->stackSize()
+                    || code_a->flags() != code_b->flags()
+                    || code_a->firstLine() != code_b->firstLine())
+                return false;
+            const PycObject* fields_a[12];
+            const PycObject* fields_b[12];
+            code_fields(code_a, fields_a);
+            code_fields(code_b, fields_b);
+            return memcmp(fields_a, fields_b, sizeof(fields_a)) == 0;
+        }
+    default:
+        return a->isEqual(const_cast<PycObject*>(b));
+    }
+}
+
+PycRef<PycObject> PycDedup::share(PycRef<PycObject> obj)
+{
+    size_t obj_hash = hash(obj);
+    if (obj_hash == 0)
+        return obj;
+
+    if ((m_count + 1) * 4 > m_table.size() * 3)
+        grow();
+    size_t mask = m_table.size() - 1;
+    for (size_t i = obj_hash & mask; ; i = (i + 1) & mask) {
+        Entry& entry = m_table[i];
+        if (entry.hash == 0) {
+            entry.hash = obj_hash;
+            entry.obj = obj;
+            ++m_count;
+            return obj;
+        }
+        if (entry.hash == obj_hash && equal(entry.obj, obj))
+            return entry.obj;
+    }
+}
+
+void PycDedup::grow()
+{
+    std::vector<Entry> old(m_table.empty() ? 256 : m_table.size() * 2);
+    old.swap(m_table);
+    size_t mask = m_table.size() - 1;
+    for (Entry& entry : old) {
+        if (entry.hash == 0)
+            continue;
+        size_t i = entry.hash & mask;
+        while (m_table[i].hash != 0)
+            i = (i + 1) & mask;
+        m_table[i] = std::move(entry);
+    }
+}
+
+void PycDedup::clear()
+{
+    m_table.clear();
+    m_table.shrink_to_fit();
+    m_count = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _PYC_DEDUP_H
+#define _PYC_DEDUP_H
+
+#include "pyc_object.h"
+#include <vector>
+
+/* Shares objects with the same contents across a module while it's being
+ * loaded, which the marshal format only does for objects which were
+ * identical when the module was marshalled.  Generated code tends to repeat
+ * the same name tuples, bytecode strings and even whole code objects.
+ *
+ * Strings which weren't interned (PycInterner takes care of those), tuples
+ * and code objects are shared.  Their nested objects are compared by
+ * identity, except for numbers, so each object has to be passed through
+ * here before the ones which contain it, as LoadObject() does. */
+class PycDedup {
+public:
+    PycDedup() : m_count() { }
+
+    /* Returns the object seen before with the same contents as obj, or obj
+     * itself if there was none */
+    PycRef<PycObject> share(PycRef<PycObject> obj);
+
+    /* Forgets every object which was seen */
+    void clear();
+
+private:
+    struct Entry {
+        size_t hash;
+        PycRef<PycObject> obj;
+    };
+
+    /* Zero for objects which aren't shared */
+    static size_t hash(const PycObject* obj);
+    static bool equal(const PycObject* a, const PycObject* b);
+    void grow();
+
+    std::vector<Entry> m_table;     // Open addressing, a power of two in size
+    size_t m_count;
+};
+
+#endif
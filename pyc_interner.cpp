@@ -0,0 +1,88 @@
+#include "pyc_interner.h"
+#include <cstdint>
+
+const char* PycInterner::s_names[NUM_NAMES] = {
+    "__name__", "__module__", "__qualname__", "__doc__", "__annotations__",
+    "<lambda>", "<listcomp>", "<module>",
+};
+
+PycInterner::PycInterner()
+    : m_table(64), m_count()
+{
+    for (int i = 0; i < NUM_NAMES; ++i) {
+        m_known[i] = nullptr;
+        int length = (int)strlen(s_names[i]);
+        Entry& entry = find(hash(s_names[i], length), s_names[i], length);
+        entry.hash = hash(s_names[i], length);
+        entry.name = i;
+        ++m_count;
+    }
+}
+
+/* FNV-1a */
+size_t PycInterner::hash(const char* data, int length)
+{
+    uint32_t value = 2166136261u;
+    for (int i = 0; i < length; ++i) {
+        value ^= (unsigned char)data[i];
+        value *= 16777619u;
+    }
+    // Zero marks an empty entry
+    return value ? value : 1;
+}
+
+PycInterner::Entry& PycInterner::find(size_t hash, const char* data, int length)
+{
+    size_t mask = m_table.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        Entry& entry = m_table[i];
+        if (entry.hash == 0)
+            return entry;
+        if (entry.hash != hash)
+            continue;
+        // Well-known names are matched by their value until one is loaded
+        const char* value = entry.str ? entry.str->data() : s_names[entry.name];
+        int value_length = entry.str ? entry.str->length() : (int)strlen(value);
+        if (value_length == length && memcmp(value, data, length) == 0)
+            return entry;
+    }
+}
+
+void PycInterner::grow()
+{
+    std::vector<Entry> old(m_table.size() * 2);
+    old.swap(m_table);
+    size_t mask = m_table.size() - 1;
+    for (Entry& entry : old) {
+        if (entry.hash == 0)
+            continue;
+        size_t i = entry.hash & mask;
+        while (m_table[i].hash != 0)
+            i = (i + 1) & mask;
+        m_table[i] = std::move(entry);
+    }
+}
+
+PycRef<PycString> PycInterner::intern(PycRef<PycString> str)
+{
+    size_t str_hash = hash(str->data(), str->length());
+    Entry& entry = find(str_hash, str->data(), str->length());
+    if (entry.str != NULL)
+        return entry.str;
+
+    str->m_canonical = true;
+    if (entry.hash != 0) {
+        // A well-known name
+        m_known[entry.name] = str;
+        entry.str = std::move(str);
+        return entry.str;
+    }
+
+    entry.hash = str_hash;
+    entry.name = -1;
+    entry.str = std::move(str);
+    PycRef<PycString> result = entry.str;
+    if (++m_count * 2 > m_table.size())
+        grow();
+    return result;
+}
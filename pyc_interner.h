@@ -0,0 +1,53 @@
+#ifndef _PYC_INTERNER_H
+#define _PYC_INTERNER_H
+
+#include "pyc_string.h"
+#include <vector>
+
+/* Keeps one canonical PycString per distinct value of a module's interned
+ * strings (the identifiers), so the names the decompiler looks for can be
+ * recognized by comparing pointers.  Those well-known names are registered
+ * up front, and their canonical string is whichever one with that value is
+ * loaded first. */
+class PycInterner {
+public:
+    enum Name {
+        NAME_NAME, NAME_MODULE, NAME_QUALNAME, NAME_DOC, NAME_ANNOTATIONS,
+        NAME_LAMBDA, NAME_LISTCOMP, NAME_MODULE_CODE, NUM_NAMES
+    };
+
+    PycInterner();
+
+    /* Returns the canonical string with str's value, which is str itself
+     * if there was none yet */
+    PycRef<PycString> intern(PycRef<PycString> str);
+
+    /* Whether str has the value of a well-known name */
+    bool is(const PycString* str, Name name) const
+    {
+        if (str == m_known[name])
+            return true;
+        // Strings which didn't go through here (e.g. not interned ones)
+        // still need comparing
+        return !str->isCanonical() && str->isEqual(s_names[name]);
+    }
+
+private:
+    struct Entry {
+        size_t hash;
+        PycRef<PycString> str;
+        int name;           // The well-known name, or -1
+    };
+
+    static size_t hash(const char* data, int length);
+    Entry& find(size_t hash, const char* data, int length);
+    void grow();
+
+    static const char* s_names[NUM_NAMES];
+
+    std::vector<Entry> m_table;     // Open addressing, a power of two in size
+    size_t m_count;
+    PycString* m_known[NUM_NAMES];
+};
+
+#endif
@@ -1,6 +1,10 @@
 #include "pyc_module.h"
+#include "pyc_numeric.h"
 #include "data.h"
+#include "bytecode.h"
+#include <algorithm>
 #include <stdexcept>
+#include <unordered_set>
 
 void PycModule::setVersion(unsigned int magic)
 {
@@ -187,6 +191,36 @@ void PycModule::setVersion(unsigned int magic)
         m_maj = -1;
         m_min = -1;
     }
+    versionChanged();
+}
+
+void PycModule::versionChanged()
+{
+    m_opcodeMap = Pyc::OpcodeMap(m_maj, m_min);
+
+    m_caps = 0;
+    if (!isValid())
+        return;
+    if (verCompare(1, 3) >= 0)
+        m_caps |= CAP_CODE_ARGS;
+    if (verCompare(1, 5) >= 0)
+        m_caps |= CAP_LINE_TABLE;
+    if (verCompare(2, 1) >= 0 && verCompare(3, 11) < 0)
+        m_caps |= CAP_CLOSURE_VARS;
+    if (verCompare(2, 3) >= 0)
+        m_caps |= CAP_LONG_CODE_FIELDS;
+    if (m_maj >= 3)
+        m_caps |= CAP_KW_ONLY_ARGS;
+    if (verCompare(3, 6) >= 0)
+        m_caps |= CAP_WORDCODE | CAP_FSTRINGS;
+    if (verCompare(3, 8) >= 0)
+        m_caps |= CAP_POS_ONLY_ARGS;
+    if (verCompare(3, 10) >= 0)
+        m_caps |= CAP_JUMPS_IN_WORDS;
+    if (verCompare(3, 11) >= 0)
+        m_caps |= CAP_LOCALSPLUS | CAP_QUALNAME | CAP_EXCEPTION_TABLE;
+    if (verCompare(3, 12) >= 0)
+        m_caps |= CAP_RELATIVE_JUMPS;
 }
 
 bool PycModule::isSupportedVersion(int major, int minor)
@@ -205,62 +239,484 @@ bool PycModule::isSupportedVersion(int major, int minor)
 
 void PycModule::loadFromFile(const char* filename)
 {
-    PycFile in(filename);
-    if (!in.isOpen()) {
-        fprintf(stderr, "Error opening file %s\n", filename);
-        return;
-    }
-    setVersion(in.get32());
-    if (!isValid()) {
-        fputs("Bad MAGIC!\n", stderr);
+    std::unique_ptr<PycMappedFile> source(new PycMappedFile(filename));
+    if (!source->isOpen()) {
+        pyc_diagnostic("Error opening file %s\n", filename);
         return;
     }
+    loadPyc(std::move(source));
+    if (!isValid())
+        pyc_diagnostic("Bad MAGIC!\n");
+}
 
-    int flags = 0;
-    if (verCompare(3, 7) >= 0)
-        flags = in.get32();
+void PycModule::loadFromBuffer(std::vector<unsigned char> data)
+{
+    loadPyc(std::unique_ptr<PycMappedFile>(new PycMappedFile(std::move(data))));
+}
 
-    if (flags & 0x1) {
+void PycModule::loadFromBuffer(const void* data, size_t size, std::shared_ptr<const void> owner)
+{
+    loadPyc(std::unique_ptr<PycMappedFile>(new PycMappedFile(data, size, std::move(owner))));
+}
+
+bool PycModule::readHeader(PycData& in)
+{
+    m_header = PycHeader();
+    m_header.magic = (unsigned int)in.get32();
+    setVersion(m_header.magic);
+    if (!isValid())
+        return false;
+    m_header.size = 4;
+
+    if (verCompare(3, 7) >= 0) {
+        m_header.flags = (unsigned int)in.get32();
+        m_header.size += 4;
+    }
+    if (m_header.flags & 0x1) {
         // Optional checksum added in Python 3.7
-        in.get32();
-        in.get32();
+        m_header.hash = (unsigned long long)in.get64();
+        m_header.size += 8;
     } else {
-        in.get32(); // Timestamp -- who cares?
-
-        if (verCompare(3, 3) >= 0)
-            in.get32(); // Size parameter added in Python 3.3
+        m_header.timestamp = (unsigned int)in.get32();
+        m_header.size += 4;
+        if (verCompare(3, 3) >= 0) {
+            // Size parameter added in Python 3.3
+            m_header.sourceSize = (unsigned int)in.get32();
+            m_header.size += 4;
+        }
     }
+    return true;
+}
+
+void PycModule::loadPyc(std::unique_ptr<PycMappedFile> source)
+{
+    PycMappedFile& in = *source;
+    m_source = std::move(source);
+    if (!readHeader(in))
+        return;
+    loadCode(in);
+}
 
+void PycModule::loadCode(PycMappedFile& in)
+{
+    if (m_lazy)
+        m_lazySource = &in;
     m_code = LoadObject(&in, this).cast<PycCode>();
+    m_dedup.clear();
 }
 
 void PycModule::loadFromMarshalledFile(const char* filename, int major, int minor)
 {
-    PycFile in (filename);
-    if (!in.isOpen()) {
-        fprintf(stderr, "Error opening file %s\n", filename);
+    std::unique_ptr<PycMappedFile> source(new PycMappedFile(filename));
+    if (!source->isOpen()) {
+        pyc_diagnostic("Error opening file %s\n", filename);
         return;
     }
+    loadMarshalled(std::move(source), major, minor);
+}
+
+void PycModule::loadFromMarshalledBuffer(std::vector<unsigned char> data, int major, int minor)
+{
+    loadMarshalled(std::unique_ptr<PycMappedFile>(new PycMappedFile(std::move(data))),
+                   major, minor);
+}
+
+void PycModule::loadFromMarshalledBuffer(const void* data, size_t size, int major, int minor,
+                                         std::shared_ptr<const void> owner)
+{
+    loadMarshalled(std::unique_ptr<PycMappedFile>(new PycMappedFile(data, size, std::move(owner))),
+                   major, minor);
+}
+
+void PycModule::loadMarshalled(std::unique_ptr<PycMappedFile> source, int major, int minor)
+{
+    PycMappedFile& in = *source;
+    m_source = std::move(source);
     if (!isSupportedVersion(major, minor)) {
-        fprintf(stderr, "Unsupported version %d.%d\n", major, minor);
+        pyc_diagnostic("Unsupported version %d.%d\n", major, minor);
         return;
     }
     m_maj = major;
     m_min = minor;
     m_unicode = (major >= 3);
-    m_code = LoadObject(&in, this).cast<PycCode>();
+    versionChanged();
+    loadCode(in);
 }
 
-PycRef<PycString> PycModule::getIntern(int ref) const
+PycModule::~PycModule()
+{
+    if (m_shared.empty())
+        return;
+
+    // Nothing is reference counted any more, so drop our own references
+    // first and then free the shared objects explicitly.  They are all
+    // destroyed before any of them is freed, since destroying an object
+    // still releases its references to the others.
+    m_code = nullptr;
+    m_rendered.clear();
+    m_interns.clear();
+    m_refs.clear();
+    m_dedup.clear();
+    for (PycObject* obj : m_shared)
+        obj->~PycObject();
+    for (PycObject* obj : m_shared)
+        ::operator delete(obj);
+}
+
+void PycModule::keepRenderedConst(const PycRef<PycObject>& obj, const char* quote,
+                                  std::string text)
+{
+    if (m_renderedBytes + text.size() > MAX_RENDERED)
+        return;
+    m_renderedBytes += text.size();
+    RenderedConst& entry = m_rendered[RenderedKey{ obj, quote, m_literalWidth }];
+    entry.obj = obj;
+    entry.text = std::move(text);
+}
+
+void PycModule::shareObjects()
+{
+    std::unordered_set<PycObject*> seen;
+    std::vector<PycObject*> pending;
+    auto visit = [&](PycObject* obj) {
+        if (obj && seen.insert(obj).second)
+            pending.push_back(obj);
+    };
+
+    visit(m_code);
+    for (const auto& str : m_interns)
+        visit(str);
+    for (const auto& obj : m_refs)
+        visit(obj);
+
+    while (!pending.empty()) {
+        PycObject* obj = pending.back();
+        pending.pop_back();
+        // Objects which are already immortal (the singletons, or objects
+        // from the arena) are not ours to free
+        if (!obj->isImmortal()) {
+            obj->makeImmortal();
+            m_shared.push_back(obj);
+        }
+
+        if (auto str = pyc_dyn_cast<PycString>(obj)) {
+            str->strValue();
+        } else if (auto num = pyc_dyn_cast<PycLong>(obj)) {
+            // Its cached repr is filled in on first use
+            num->repr(this);
+        } else if (auto seq = pyc_dyn_cast<PycSimpleSequence>(obj)) {
+            for (const auto& item : seq->values())
+                visit(item);
+        } else if (auto dict = pyc_dyn_cast<PycDict>(obj)) {
+            for (const auto& item : dict->values()) {
+                visit(std::get<0>(item));
+                visit(std::get<1>(item));
+            }
+        } else if (auto code = pyc_dyn_cast<PycCode>(obj)) {
+            visit(code->code());
+            visit(code->consts());
+            visit(code->names());
+            visit(code->localNames());
+            visit(code->localKinds());
+            visit(code->freeVars());
+            visit(code->cellVars());
+            visit(code->fileName());
+            visit(code->name());
+            visit(code->qualName());
+            visit(code->lnTable());
+            visit(code->exceptTable());
+            for (const auto& glob : code->getGlobals())
+                visit(glob);
+        }
+    }
+}
+
+static const size_t NO_ORIGIN = (size_t)-1;
+
+PycRef<PycString> PycModule::getIntern(int ref)
 {
     if (ref < 0 || (size_t)ref >= m_interns.size())
         throw std::out_of_range("Intern index out of range");
+    // Slots reserved while skipping a code object are empty until the
+    // object filling them is loaded
+    if (m_interns[(size_t)ref] == NULL && (size_t)ref < m_internOrigins.size()
+            && m_internOrigins[(size_t)ref].offset != NO_ORIGIN)
+        loadAt(m_internOrigins[(size_t)ref]);
+    if (m_interns[(size_t)ref] == NULL)
+        throw std::out_of_range("Intern index out of range");
     return m_interns[(size_t)ref];
 }
 
-PycRef<PycObject> PycModule::getRef(int ref) const
+PycRef<PycObject> PycModule::share(PycRef<PycObject> obj, size_t slot)
+{
+    if (!m_dedupEnabled || m_lazy || obj == NULL)
+        return obj;
+    PycRef<PycObject> shared = m_dedup.share(obj);
+    if (!shared.isIdent(obj)) {
+        if (m_stats)
+            ++m_stats->sharedObjects;
+        if (slot != NO_SLOT)
+            m_refs[slot] = shared;
+        if (shared.type() == PycObject::TYPE_CODE || shared.type() == PycObject::TYPE_CODE2)
+            m_duplicates.insert(shared.cast<PycCode>());
+    }
+    return shared;
+}
+
+PycRef<PycObject> PycModule::getRef(int ref)
 {
     if (ref < 0 || (size_t)ref >= m_refs.size())
         throw std::out_of_range("Ref index out of range");
+    if (m_refs[(size_t)ref] == NULL && (size_t)ref < m_refOrigins.size()
+            && m_refOrigins[(size_t)ref].offset != NO_ORIGIN)
+        loadAt(m_refOrigins[(size_t)ref]);
+    if (m_refs[(size_t)ref] == NULL)
+        throw std::out_of_range("Ref index out of range");
     return m_refs[(size_t)ref];
 }
+
+PycData* PycModule::lazySource() const
+{
+    return m_lazySource;
+}
+
+PycRef<PycObject> PycModule::deferCode(size_t offset)
+{
+    PycRef<PycLazyCode> lazy = newObject<PycLazyCode>(this, offset);
+    lazy->m_firstRef = m_nextRef;
+    lazy->m_firstIntern = m_nextIntern;
+
+    m_lazySource->seek(offset);
+    size_t refs = 0, interns = 0;
+    skipObject(refs, interns);
+
+    // Reserve the slots, except that the code object's own reference (if it
+    // has one, it's the first) refers to the stand-in until it's loaded
+    if (refs) {
+        m_refs.resize(std::max(m_refs.size(), m_nextRef + refs));
+        if (m_lazySource->data()[offset] & 0x80)
+            m_refs[m_nextRef] = lazy.cast<PycObject>();
+    }
+    if (interns)
+        m_interns.resize(std::max(m_interns.size(), m_nextIntern + interns));
+    m_nextRef += refs;
+    m_nextIntern += interns;
+    return lazy.cast<PycObject>();
+}
+
+PycRef<PycCode> PycModule::loadLazyCode(PycLazyCode* lazy)
+{
+    SlotOrigin origin = { lazy->m_offset, lazy->m_firstRef, lazy->m_firstIntern };
+    return loadAt(origin).cast<PycCode>();
+}
+
+void PycModule::unloadLazyCode(PycLazyCode* lazy)
+{
+    // The code object's own reference refers to the stand-in again
+    if (lazy->m_firstRef < m_refs.size()
+            && m_refs[lazy->m_firstRef].isIdent(lazy->m_code.cast<PycObject>()))
+        m_refs[lazy->m_firstRef] = PycRef<PycObject>(lazy);
+    lazy->m_code = nullptr;
+}
+
+PycRef<PycObject> PycModule::preloaded(int type, size_t offset)
+{
+    PycRef<PycObject> obj;
+    if (type & 0x80) {
+        if (m_nextRef < m_refs.size() && !m_refs[m_nextRef].isa<PycLazyCode>())
+            obj = m_refs[m_nextRef];
+    } else if ((type == PycObject::TYPE_INTERNED || type == PycObject::TYPE_ASCII_INTERNED
+                || type == PycObject::TYPE_SHORT_ASCII_INTERNED)
+               && m_nextIntern < m_interns.size() && m_interns[m_nextIntern] != NULL) {
+        obj = m_interns[m_nextIntern].cast<PycObject>();
+    }
+    if (obj == NULL)
+        return obj;
+
+    m_lazySource->seek(offset);
+    size_t refs = 0, interns = 0;
+    skipObject(refs, interns);
+    m_nextRef += refs;
+    m_nextIntern += interns;
+    return obj;
+}
+
+PycRef<PycObject> PycModule::loadAt(const SlotOrigin& origin)
+{
+    // This may happen in the middle of loading something else
+    size_t saved_pos = m_lazySource->position();
+    size_t saved_ref = m_nextRef, saved_intern = m_nextIntern;
+    m_lazySource->seek(origin.offset);
+    m_nextRef = origin.nextRef;
+    m_nextIntern = origin.nextIntern;
+
+    PycRef<PycObject> obj;
+    try {
+        obj = LoadObject(m_lazySource, this);
+    } catch (...) {
+        m_lazySource->seek(saved_pos);
+        m_nextRef = saved_ref;
+        m_nextIntern = saved_intern;
+        throw;
+    }
+
+    m_lazySource->seek(saved_pos);
+    m_nextRef = saved_ref;
+    m_nextIntern = saved_intern;
+    return obj;
+}
+
+/* Advances past one object in the lazy source, and everything nested in
+ * it, without creating any of them.  Counts the reference and intern slots
+ * that loading them would take, and notes where each of those objects
+ * starts, so any of them can be loaded on its own. */
+void PycModule::skipObject(size_t& refs, size_t& interns)
+{
+    PycMappedFile& in = *m_lazySource;
+    auto skip = [&in](size_t bytes) {
+        if (bytes > in.size() - in.position())
+            throw std::runtime_error("Unexpected end of file in code object");
+        in.seek(in.position() + bytes);
+    };
+
+    // Open containers: how many nested objects each still has to come
+    // (-1 for dicts, up to a NULL key), and for code objects the index of
+    // the next one
+    struct Open {
+        int type;
+        int remaining;
+        int index;
+    };
+    std::vector<Open> open;
+    for ( ;; ) {
+        if (in.atEof())
+            throw std::runtime_error("Unexpected end of file in code object");
+        size_t offset = in.position();
+        int type = in.getByte();
+        bool is_null = false;
+        bool is_interned = false;
+        Open container = { type & 0x7F, 0, 0 };
+        switch (type & 0x7F) {
+        case PycObject::TYPE_OBREF:
+            skip(4);
+            type = 0;       // References don't take a slot themselves
+            break;
+        case PycObject::TYPE_NONE:
+        case PycObject::TYPE_FALSE:
+        case PycObject::TYPE_TRUE:
+        case PycObject::TYPE_STOPITER:
+        case PycObject::TYPE_ELLIPSIS:
+            break;
+        case PycObject::TYPE_INT:
+            skip(4);
+            break;
+        case PycObject::TYPE_INT64:
+        case PycObject::TYPE_BINARY_FLOAT:
+            skip(8);
+            break;
+        case PycObject::TYPE_BINARY_COMPLEX:
+            skip(16);
+            break;
+        case PycObject::TYPE_FLOAT:
+            skip(in.getByte());
+            break;
+        case PycObject::TYPE_COMPLEX:
+            skip(in.getByte());
+            skip(in.getByte());
+            break;
+        case PycObject::TYPE_LONG:
+            {
+                int size = in.get32();
+                skip(2 * (size_t)(size < 0 ? -(long long)size : size));
+            }
+            break;
+        case PycObject::TYPE_STRINGREF:
+            skip(4);
+            break;
+        case PycObject::TYPE_INTERNED:
+        case PycObject::TYPE_ASCII_INTERNED:
+            is_interned = true;
+            /* fall through */
+        case PycObject::TYPE_STRING:
+        case PycObject::TYPE_UNICODE:
+        case PycObject::TYPE_ASCII:
+            skip((unsigned)in.get32());
+            break;
+        case PycObject::TYPE_SHORT_ASCII_INTERNED:
+            is_interned = true;
+            /* fall through */
+        case PycObject::TYPE_SHORT_ASCII:
+            skip(in.getByte());
+            break;
+        case PycObject::TYPE_TUPLE:
+        case PycObject::TYPE_LIST:
+        case PycObject::TYPE_SET:
+        case PycObject::TYPE_FROZENSET:
+            container.remaining = in.get32();
+            if (container.remaining < 0)
+                throw std::bad_alloc();
+            break;
+        case PycObject::TYPE_SMALL_TUPLE:
+            container.remaining = in.getByte();
+            break;
+        case PycObject::TYPE_DICT:
+            container.remaining = -1;
+            break;
+        case PycObject::TYPE_CODE:
+        case PycObject::TYPE_CODE2:
+            skip(PycCode::headerSize(this));
+            container.remaining = -1;
+            break;
+        default:
+            // TYPE_NULL, and anything which CreateObject() doesn't know
+            is_null = true;
+            type = 0;
+            break;
+        }
+        SlotOrigin origin = { offset, m_nextRef + refs, m_nextIntern + interns };
+        if (type & 0x80) {
+            if (m_refOrigins.size() <= origin.nextRef)
+                m_refOrigins.resize(origin.nextRef + 1, { NO_ORIGIN, 0, 0 });
+            m_refOrigins[origin.nextRef] = origin;
+            ++refs;
+        }
+        if (is_interned) {
+            if (m_internOrigins.size() <= origin.nextIntern)
+                m_internOrigins.resize(origin.nextIntern + 1, { NO_ORIGIN, 0, 0 });
+            m_internOrigins[origin.nextIntern] = origin;
+            ++interns;
+        }
+
+        bool is_container = (container.remaining != 0);
+        if (is_container) {
+            open.push_back(container);
+            continue;
+        }
+
+        // Account for the finished object in its container, which may
+        // finish that one as well
+        while (!open.empty()) {
+            Open& parent = open.back();
+            if (parent.type == PycObject::TYPE_DICT) {
+                if (parent.index++ % 2 == 0 && is_null)
+                    parent.remaining = 0;
+            } else if (parent.type == PycObject::TYPE_CODE
+                    || parent.type == PycObject::TYPE_CODE2) {
+                int next = ++parent.index;
+                if (PycCode::fieldAt(this, next) == PycCode::FIELD_END)
+                    parent.remaining = 0;
+                else if (PycCode::fieldAt(this, next) == PycCode::FIELD_LN_TABLE)
+                    skip(PycCode::firstLineSize(this));
+            } else {
+                --parent.remaining;
+            }
+            if (parent.remaining != 0)
+                break;
+            open.pop_back();
+            is_null = false;
+        }
+        if (open.empty())
+            return;
+    }
+}
+
@@ -2,8 +2,18 @@
 #define _PYC_MODULE_H
 
 #include "pyc_code.h"
+#include "pyc_dedup.h"
+#include "pyc_interner.h"
+#include "pyc_stats.h"
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+class PycMappedFile;
+
 enum PycMagic {
     MAGIC_1_0 = 0x00999902,
     MAGIC_1_1 = 0x00999903, /* Also covers 1.2 */
@@ -40,12 +50,51 @@ enum PycMagic {
     INVALID = 0,
 };
 
+/* The fields of a .pyc header besides the magic number */
+struct PycHeader {
+    unsigned int magic;
+    unsigned int flags;         // Python 3.7 ->, bit 0 for hash based ones
+    unsigned int timestamp;     // Of the source, unless hash based
+    unsigned int sourceSize;    // Python 3.3 ->, unless hash based
+    unsigned long long hash;    // Of the source, if hash based
+    size_t size;                // Of the whole header
+};
+
 class PycModule {
 public:
-    PycModule() : m_maj(-1), m_min(-1), m_unicode(false) { }
+    PycModule()
+        : m_maj(-1), m_min(-1), m_unicode(false), m_caps(), m_opcodeMap(), m_header(),
+          m_stats(), m_memory(), m_dedupEnabled(false),
+          m_lazy(false), m_lazySource(), m_nextRef(), m_nextIntern(), m_renderedBytes(),
+          m_literalWidth() { }
+    ~PycModule();
+
+    PycModule(const PycModule&) = delete;
+    PycModule& operator=(const PycModule&) = delete;
 
     void loadFromFile(const char* filename);
     void loadFromMarshalledFile(const char *filename, int major, int minor);
+
+    /* Loads a .pyc image which is already in memory, taking it over.
+     * Unlike loadFromFile(), it doesn't report a bad magic number; check
+     * isValid() afterwards. */
+    void loadFromBuffer(std::vector<unsigned char> data);
+
+    /* Loads from memory without copying it.  Loaded strings may point into
+     * it, so it has to outlive the module, unless owner keeps it alive. */
+    void loadFromBuffer(const void* data, size_t size,
+                        std::shared_ptr<const void> owner = std::shared_ptr<const void>());
+
+    /* Likewise for a code object marshalled without the .pyc header */
+    void loadFromMarshalledBuffer(std::vector<unsigned char> data, int major, int minor);
+    void loadFromMarshalledBuffer(const void* data, size_t size, int major, int minor,
+                                  std::shared_ptr<const void> owner = std::shared_ptr<const void>());
+
+    /* Reads just the .pyc header from in, which is left at the marshalled
+     * code object, and takes the version from it.  Returns false if the
+     * magic number is unknown. */
+    bool readHeader(PycData& in);
+    const PycHeader& header() const { return m_header; }
     bool isValid() const { return (m_maj >= 0) && (m_min >= 0); }
 
     int majorVer() const { return m_maj; }
@@ -60,6 +109,29 @@ public:
 
     bool isUnicode() const { return m_unicode; }
 
+    /* Format and language features which a module's version has, so code
+     * which checks them for every object or instruction tests one bit */
+    enum Capability {
+        CAP_CODE_ARGS = 0x1,            // 1.3+: argcount, nlocals, flags, varnames
+        CAP_LINE_TABLE = 0x2,           // 1.5+: stacksize, firstlineno, lnotab
+        CAP_CLOSURE_VARS = 0x4,         // 2.1 - 3.10: freevars, cellvars
+        CAP_LONG_CODE_FIELDS = 0x8,     // 2.3+: 32-bit code object fields
+        CAP_KW_ONLY_ARGS = 0x10,        // 3.0+
+        CAP_WORDCODE = 0x20,            // 3.6+: two bytes for every instruction
+        CAP_FSTRINGS = 0x40,            // 3.6+
+        CAP_POS_ONLY_ARGS = 0x80,       // 3.8+, with the new code flag values
+        CAP_JUMPS_IN_WORDS = 0x100,     // 3.10+ (BPO-27129)
+        CAP_LOCALSPLUS = 0x200,         // 3.11+: localsplusnames and kinds
+        CAP_QUALNAME = 0x400,           // 3.11+
+        CAP_EXCEPTION_TABLE = 0x800,    // 3.11+
+        CAP_RELATIVE_JUMPS = 0x1000,    // 3.12+: conditional jumps are relative
+    };
+
+    bool has(Capability cap) const { return (m_caps & cap) != 0; }
+
+    /* Byte -> opcode translation table for this module's version */
+    const int* opcodeMap() const { return m_opcodeMap; }
+
     bool strIsUnicode() const
     {
         return (m_maj >= 3) || (m_code->flags() & PycCode::CO_FUTURE_UNICODE_LITERALS) != 0;
@@ -72,24 +144,221 @@ public:
 
     PycRef<PycCode> code() const { return m_code; }
 
-    void intern(PycRef<PycString> str) { m_interns.emplace_back(std::move(str)); }
-    PycRef<PycString> getIntern(int ref) const;
+    /* Takes the next slot for TYPE_STRINGREF with the canonical string
+     * for str's value, which is returned */
+    PycRef<PycString> intern(PycRef<PycString> str)
+    {
+        PycRef<PycString> canonical = m_strings.intern(std::move(str));
+        setSlot(m_interns, m_nextIntern, canonical);
+        return canonical;
+    }
+    PycRef<PycString> getIntern(int ref);
+
+    /* Returns the slot which obj took */
+    size_t refObject(PycRef<PycObject> obj)
+    {
+        setSlot(m_refs, m_nextRef, std::move(obj));
+        return m_nextRef - 1;
+    }
+    PycRef<PycObject> getRef(int ref);
 
-    void refObject(PycRef<PycObject> obj) { m_refs.emplace_back(std::move(obj)); }
-    PycRef<PycObject> getRef(int ref) const;
+    static const size_t NO_SLOT = (size_t)-1;
+
+    /* Share objects with the same contents while loading (see PycDedup).
+     * It costs some time for modules which don't repeat themselves, so
+     * it's off by default.  Must be set before loading, and has no effect
+     * with lazy loading, where objects are found again through the slots
+     * and stand-ins of the objects they replace. */
+    void setDeduplication(bool dedup) { m_dedupEnabled = dedup; }
+
+    /* Returns the object with the same contents as obj which was loaded
+     * before it, if deduplicating and there is one.  That one also
+     * replaces obj in its reference slot. */
+    PycRef<PycObject> share(PycRef<PycObject> obj, size_t slot = NO_SLOT);
+
+    /* Whether more than one code object with code's contents was loaded,
+     * so whatever is made of the others can be reused for it */
+    bool isDuplicate(const PycCode* code) const
+    {
+        return !m_duplicates.empty() && m_duplicates.count(code) != 0;
+    }
+
+    /* Byte and str literals are split into implicitly concatenated ones of
+     * at most width characters, on continuation lines.  0, the default,
+     * leaves them whole; f-strings and triple quoted strings always are. */
+    void setLiteralWidth(size_t width) { m_literalWidth = width; }
+    size_t literalWidth() const { return m_literalWidth; }
+
+    /* The text print_const() rendered obj as, within the f-string quote
+     * quote and at the current literal width, or null if it wasn't kept.  Constants are found by identity,
+     * which keeps the ones referenced again through TYPE_OBREF from being
+     * formatted more than once. */
+    const std::string* renderedConst(const PycObject* obj, const char* quote) const
+    {
+        if (m_rendered.empty())
+            return nullptr;
+        auto found = m_rendered.find(RenderedKey{ obj, quote, m_literalWidth });
+        return (found != m_rendered.end()) ? &found->second.text : nullptr;
+    }
+
+    /* Keeps text for renderedConst(), as long as the total stays within
+     * MAX_RENDERED bytes */
+    void keepRenderedConst(const PycRef<PycObject>& obj, const char* quote, std::string text);
+
+    static const size_t MAX_RENDERED = 16 * 1024 * 1024;
+
+    /* Whether str is one of the well-known names */
+    bool isName(const PycRef<PycString>& str, PycInterner::Name name) const
+    {
+        return m_strings.is(str, name);
+    }
 
     static bool isSupportedVersion(int major, int minor);
 
-private:
+    /* Allocate all objects loaded from now on from an arena owned by the
+     * module, instead of reference counting each of them */
+    void useArena()
+    {
+        if (!m_arena)
+            m_arena.reset(new PycArena(m_memory));
+    }
+
+    /* What the module's arena and the ASTs built from its code are charged
+     * to, if anything; set it before useArena() */
+    MemoryAccount* memoryAccount() const { return m_memory; }
+    void setMemoryAccount(MemoryAccount* account) { m_memory = account; }
+
+    template <class _Obj, class... _Args>
+    _Obj* newObject(_Args&&... args)
+    {
+        if (m_arena)
+            return m_arena->make<_Obj>(std::forward<_Args>(args)...);
+        return new _Obj(std::forward<_Args>(args)...);
+    }
+
+    /* Only load the top-level code object up front; nested code objects
+     * in constants are skipped over and loaded on first access through
+     * PycCode::consts().  A reference into a skipped code object loads just
+     * the object it refers to.  Must be set before loading.  Loading later
+     * isn't thread safe, but shareObjects() loads everything. */
+    void setLazyLoading(bool lazy) { m_lazy = lazy; }
+
+    /* The stream which LoadObject() may leave code objects unloaded in */
+    PycData* lazySource() const;
+
+    /* Skips the code object at offset in the lazy source, and returns a
+     * stand-in for it */
+    PycRef<PycObject> deferCode(size_t offset);
+    PycRef<PycCode> loadLazyCode(PycLazyCode* lazy);
+    void unloadLazyCode(PycLazyCode* lazy);
+
+    /* If the object of the given type at offset in the lazy source was
+     * loaded on its own already (through the slot it takes), skips over
+     * it and returns that */
+    PycRef<PycObject> preloaded(int type, size_t offset);
+
+    /* Counters to update while loading and decompiling, if any */
+    PycStats* stats() const { return m_stats; }
+    void setStats(PycStats* stats) { m_stats = stats; }
+
+    /* Make every loaded object immortal and copy out any strings which are
+     * still backed by the input, so the objects can be used by several
+     * threads at once.  They are then freed together with the module. */
+    void shareObjects();
+
+    /* Takes the version from a .pyc magic number, for loading objects
+     * which are marshalled without the rest of the header */
     void setVersion(unsigned int magic);
 
+private:
+
+    /* Sets up what depends on m_maj and m_min once they are known */
+    void versionChanged();
+
+    /* Reference slots are normally appended, but objects loaded lazily
+     * fill the slots which were reserved for them when skipping them */
+    template <class _Obj>
+    static void setSlot(std::vector<PycRef<_Obj>>& slots, size_t& next, PycRef<_Obj> obj)
+    {
+        if (next < slots.size())
+            slots[next] = std::move(obj);
+        else
+            slots.emplace_back(std::move(obj));
+        ++next;
+    }
+
+    /* Where the object which fills a reserved slot starts in the lazy
+     * source, and the slots which are next when loading it from there */
+    struct SlotOrigin {
+        size_t offset;
+        size_t nextRef, nextIntern;
+    };
+
+    void skipObject(size_t& refs, size_t& interns);
+    PycRef<PycObject> loadAt(const SlotOrigin& origin);
+
+    /* Reads the .pyc header and the code object from source */
+    void loadPyc(std::unique_ptr<PycMappedFile> source);
+    void loadCode(PycMappedFile& in);
+    void loadMarshalled(std::unique_ptr<PycMappedFile> source, int major, int minor);
+
 private:
     int m_maj, m_min;
     bool m_unicode;
+    unsigned int m_caps;
+    const int* m_opcodeMap;
+    PycHeader m_header;
+    PycStats* m_stats;
+    MemoryAccount* m_memory;
+
+    /* Loaded strings may point into this, so it must outlive m_code */
+    std::unique_ptr<PycData> m_source;
+    std::unique_ptr<PycArena> m_arena;
+
+    /* Only used while loading, and released before the arena */
+    bool m_dedupEnabled;
+    PycDedup m_dedup;
+    std::unordered_set<const PycCode*> m_duplicates;
 
     PycRef<PycCode> m_code;
+    PycInterner m_strings;
     std::vector<PycRef<PycString>> m_interns;
     std::vector<PycRef<PycObject>> m_refs;
+    std::vector<PycObject*> m_shared;
+
+    bool m_lazy;
+    PycMappedFile* m_lazySource;
+    size_t m_nextRef, m_nextIntern;
+
+    std::vector<SlotOrigin> m_refOrigins, m_internOrigins;
+
+    struct RenderedKey {
+        const PycObject* obj;
+        const char* quote;
+        size_t width;
+
+        bool operator==(const RenderedKey& other) const
+        {
+            return obj == other.obj && quote == other.quote && width == other.width;
+        }
+    };
+    struct RenderedKeyHash {
+        size_t operator()(const RenderedKey& key) const
+        {
+            return (std::hash<const void*>()(key.obj) * 31
+                    + std::hash<const void*>()(key.quote)) * 31 + key.width;
+        }
+    };
+
+    /* The object is held on to, so its address can't be reused */
+    struct RenderedConst {
+        PycRef<PycObject> obj;
+        std::string text;
+    };
+    std::unordered_map<RenderedKey, RenderedConst, RenderedKeyHash> m_rendered;
+    size_t m_renderedBytes;
+
+    size_t m_literalWidth;
 };
 
 #endif
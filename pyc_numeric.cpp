@@ -1,7 +1,9 @@
 #include "pyc_numeric.h"
 #include "pyc_module.h"
 #include "data.h"
+#include <climits>
 #include <cstring>
+#include <stdexcept>
 
 #ifdef _MSC_VER
 #define snprintf sprintf_s
@@ -18,20 +20,28 @@ void PycInt::load(PycData* stream, PycModule*)
 void PycLong::load(PycData* stream, PycModule*)
 {
     if (type() == TYPE_INT64) {
-        m_value.reserve(4);
-        int lo = stream->get32();
-        int hi = stream->get32();
-        m_value.push_back((lo      ) & 0xFFFF);
-        m_value.push_back((lo >> 16) & 0xFFFF);
-        m_value.push_back((hi      ) & 0xFFFF);
-        m_value.push_back((hi >> 16) & 0xFFFF);
-        m_size = (hi & 0x80000000) != 0 ? -4 : 4;
+        unsigned lo = (unsigned)stream->get32();
+        unsigned hi = (unsigned)stream->get32();
+        uint64_t bits = ((uint64_t)hi << 32) | lo;
+        bool negative = (hi & 0x80000000) != 0;
+        if (negative)
+            bits = ~bits + 1;
+        // Stored like TYPE_LONG, as 15-bit digits
+        while (bits) {
+            m_value.push_back((uint16_t)(bits & 0x7FFF));
+            bits >>= 15;
+        }
+        m_size = negative ? -(int)m_value.size() : (int)m_value.size();
     } else {
         m_size = stream->get32();
+        if (m_size == INT_MIN)
+            throw std::runtime_error("Invalid long integer size");
         int actualSize = m_size >= 0 ? m_size : -m_size;
-        m_value.reserve(actualSize);
+        if (!stream->hasBytes((size_t)actualSize * 2))
+            throw std::runtime_error("Truncated long integer");
+        m_value.resize(actualSize);
         for (int i=0; i<actualSize; i++)
-            m_value.push_back(stream->get16());
+            m_value[i] = (uint16_t)stream->get16();
     }
 }
 
@@ -41,59 +51,50 @@ bool PycLong::isEqual(PycRef<PycObject> obj) const
         return false;
 
     PycRef<PycLong> longObj = obj.cast<PycLong>();
-    if (m_size != longObj->m_size)
-        return false;
-    auto it1 = m_value.cbegin();
-    auto it2 = longObj->m_value.cbegin();
-    while (it1 != m_value.cend()) {
-        if (*it1 != *it2)
-            return false;
-        ++it1, ++it2;
-    }
-    return true;
+    return m_size == longObj->m_size && m_value == longObj->m_value;
 }
 
-std::string PycLong::repr(PycModule* mod) const
+const std::string& PycLong::repr(PycModule* mod) const
 {
     // Longs are printed as hex, since it's easier (and faster) to convert
     // arbitrary-length integers to a power of two than an arbitrary base
+    if (!m_repr.empty())
+        return m_repr;
 
-    if (m_size == 0)
-        return (mod->verCompare(3, 0) >= 0) ? "0x0" : "0x0L";
-
-    // Realign to 32 bits, since Python uses only 15
-    std::vector<unsigned> bits;
-    bits.reserve((m_value.size() + 1) / 2);
-    int shift = 0, temp = 0;
-    for (auto bit : m_value) {
-        temp |= unsigned(bit & 0xFFFF) << shift;
-        shift += 15;
-        if (shift >= 32) {
-            bits.push_back(temp);
-            shift -= 32;
-            temp = unsigned(bit & 0xFFFF) >> (15 - shift);
-        }
+    if (m_size == 0) {
+        m_repr = (mod->verCompare(3, 0) >= 0) ? "0x0" : "0x0L";
+        return m_repr;
     }
-    if (temp)
-        bits.push_back(temp);
 
-    std::string accum;
-    accum.resize(3 + (bits.size() * 8) + 2);
-    char* aptr = &accum[0];
+    // The hex digits come out least significant first, straight from the
+    // 15-bit digits
+    static const char hex_digits[] = "0123456789ABCDEF";
+    std::string hex;
+    hex.reserve(m_value.size() * 15 / 4 + 1);
+    unsigned accum = 0;
+    int accum_bits = 0;
+    for (uint16_t digit : m_value) {
+        accum |= unsigned(digit & 0x7FFF) << accum_bits;
+        accum_bits += 15;
+        while (accum_bits >= 4) {
+            hex.push_back(hex_digits[accum & 0xF]);
+            accum >>= 4;
+            accum_bits -= 4;
+        }
+    }
+    if (accum_bits)
+        hex.push_back(hex_digits[accum & 0xF]);
+    while (hex.size() > 1 && hex.back() == '0')
+        hex.pop_back();
 
+    m_repr.reserve(hex.size() + 4);
     if (m_size < 0)
-        *aptr++ = '-';
-    *aptr++ = '0';
-    *aptr++ = 'x';
-
-    auto iter = bits.crbegin();
-    aptr += snprintf(aptr, 9, "%X", *iter++);
-    while (iter != bits.rend())
-        aptr += snprintf(aptr, 9, "%08X", *iter++);
+        m_repr += '-';
+    m_repr += "0x";
+    m_repr.append(hex.rbegin(), hex.rend());
     if (mod->verCompare(3, 0) < 0)
-        *aptr++ = 'L';
-    *aptr = 0;
-    return accum;
+        m_repr += 'L';
+    return m_repr;
 }
 
 
@@ -3,11 +3,17 @@
 
 #include "pyc_object.h"
 #include "data.h"
+#include <cstdint>
 #include <vector>
 #include <string>
 
 class PycInt : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_INT;
+    }
+
     PycInt(int value = 0, int type = TYPE_INT)
         : PycObject(type), m_value(value) { }
 
@@ -27,6 +33,11 @@ private:
 
 class PycLong : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_INT64 || obj->tag() == TYPE_LONG;
+    }
+
     PycLong(int type = TYPE_LONG)
         : PycObject(type), m_size(0) { }
 
@@ -34,18 +45,28 @@ public:
 
     void load(class PycData* stream, class PycModule* mod) override;
 
+    /* The number of 15-bit digits, negative for negative numbers */
     int size() const { return m_size; }
-    const std::vector<int>& value() const { return m_value; }
 
-    std::string repr(PycModule* mod) const;
+    /* The digits of the absolute value, least significant first */
+    const std::vector<uint16_t>& value() const { return m_value; }
+
+    /* Rendered once, and kept for later calls */
+    const std::string& repr(PycModule* mod) const;
 
 private:
     int m_size;
-    std::vector<int> m_value;
+    std::vector<uint16_t> m_value;
+    mutable std::string m_repr;
 };
 
 class PycFloat : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_FLOAT || obj->tag() == TYPE_COMPLEX;
+    }
+
     PycFloat(int type = TYPE_FLOAT)
         : PycObject(type) { }
 
@@ -61,6 +82,11 @@ private:
 
 class PycComplex : public PycFloat {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_COMPLEX;
+    }
+
     PycComplex(int type = TYPE_COMPLEX)
         : PycFloat(type) { }
 
@@ -76,6 +102,11 @@ private:
 
 class PycCFloat : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_BINARY_FLOAT || obj->tag() == TYPE_BINARY_COMPLEX;
+    }
+
     PycCFloat(int type = TYPE_BINARY_FLOAT)
         : PycObject(type), m_value(0.0) { }
 
@@ -95,6 +126,11 @@ private:
 
 class PycCComplex : public PycCFloat {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_BINARY_COMPLEX;
+    }
+
     PycCComplex(int type = TYPE_BINARY_COMPLEX)
         : PycCFloat(type), m_imag(0.0) { }
 
@@ -4,14 +4,62 @@
 #include "pyc_code.h"
 #include "data.h"
 #include <cstdio>
+#include <utility>
+#include <vector>
 
-PycRef<PycObject> Pyc_None = new PycObject(PycObject::TYPE_NONE);
-PycRef<PycObject> Pyc_Ellipsis = new PycObject(PycObject::TYPE_ELLIPSIS);
-PycRef<PycObject> Pyc_StopIteration = new PycObject(PycObject::TYPE_STOPITER);
-PycRef<PycObject> Pyc_False = new PycObject(PycObject::TYPE_FALSE);
-PycRef<PycObject> Pyc_True = new PycObject(PycObject::TYPE_TRUE);
+/* The singletons are shared by every module, including ones being loaded
+ * or decompiled on other threads */
+static PycObject* make_singleton(int type)
+{
+    PycObject* obj = new PycObject(type);
+    obj->makeImmortal();
+    return obj;
+}
+
+PycRef<PycObject> Pyc_None = make_singleton(PycObject::TYPE_NONE);
+PycRef<PycObject> Pyc_Ellipsis = make_singleton(PycObject::TYPE_ELLIPSIS);
+PycRef<PycObject> Pyc_StopIteration = make_singleton(PycObject::TYPE_STOPITER);
+PycRef<PycObject> Pyc_False = make_singleton(PycObject::TYPE_FALSE);
+PycRef<PycObject> Pyc_True = make_singleton(PycObject::TYPE_TRUE);
+
+void PycObject::destroy()
+{
+    // Objects released while another one is being deleted are queued
+    // instead, so dropping deeply nested data can't overflow the stack
+    static thread_local std::vector<PycObject*>* dying = nullptr;
+    if (dying) {
+        dying->push_back(this);
+        return;
+    }
+
+    std::vector<PycObject*> queue(1, this);
+    dying = &queue;
+    while (!queue.empty()) {
+        PycObject* obj = queue.back();
+        queue.pop_back();
+        delete obj;
+    }
+    dying = nullptr;
+}
+
+/* PycArena */
+PycArena::~PycArena()
+{
+    // Destroying an object still releases its references to the others, so
+    // the memory may only be freed (by m_alloc) once all of them are gone
+    for (PycObject* obj : m_objects)
+        obj->~PycObject();
+}
+
+template <class _Obj>
+static PycObject* new_object(PycModule* mod, int type)
+{
+    if (mod)
+        return mod->newObject<_Obj>(type);
+    return new _Obj(type);
+}
 
-PycRef<PycObject> CreateObject(int type)
+PycRef<PycObject> CreateObject(int type, PycModule* mod)
 {
     switch (type) {
     case PycObject::TYPE_NULL:
@@ -27,63 +75,173 @@ PycRef<PycObject> CreateObject(int type)
     case PycObject::TYPE_ELLIPSIS:
         return Pyc_Ellipsis;
     case PycObject::TYPE_INT:
-        return new PycInt(type);
+        return new_object<PycInt>(mod, type);
     case PycObject::TYPE_INT64:
-        return new PycLong(type);
+        return new_object<PycLong>(mod, type);
     case PycObject::TYPE_FLOAT:
-        return new PycFloat(type);
+        return new_object<PycFloat>(mod, type);
     case PycObject::TYPE_BINARY_FLOAT:
-        return new PycCFloat(type);
+        return new_object<PycCFloat>(mod, type);
     case PycObject::TYPE_COMPLEX:
-        return new PycComplex(type);
+        return new_object<PycComplex>(mod, type);
     case PycObject::TYPE_BINARY_COMPLEX:
-        return new PycCComplex(type);
+        return new_object<PycCComplex>(mod, type);
     case PycObject::TYPE_LONG:
-        return new PycLong(type);
+        return new_object<PycLong>(mod, type);
     case PycObject::TYPE_STRING:
     case PycObject::TYPE_INTERNED:
-    case PycObject::TYPE_STRINGREF:
     case PycObject::TYPE_UNICODE:
     case PycObject::TYPE_ASCII:
     case PycObject::TYPE_ASCII_INTERNED:
     case PycObject::TYPE_SHORT_ASCII:
     case PycObject::TYPE_SHORT_ASCII_INTERNED:
-        return new PycString(type);
+        return new_object<PycString>(mod, type);
     case PycObject::TYPE_TUPLE:
     case PycObject::TYPE_SMALL_TUPLE:
-        return new PycTuple(type);
+        return new_object<PycTuple>(mod, type);
     case PycObject::TYPE_LIST:
-        return new PycList(type);
+        return new_object<PycList>(mod, type);
     case PycObject::TYPE_DICT:
-        return new PycDict(type);
+        return new_object<PycDict>(mod, type);
     case PycObject::TYPE_CODE:
     case PycObject::TYPE_CODE2:
-        return new PycCode(type);
+        return new_object<PycCode>(mod, type);
     case PycObject::TYPE_SET:
     case PycObject::TYPE_FROZENSET:
-        return new PycSet(type);
+        return new_object<PycSet>(mod, type);
     default:
-        fprintf(stderr, "CreateObject: Got unsupported type 0x%X\n", type);
+        pyc_diagnostic("CreateObject: Got unsupported type 0x%X\n", type);
         return NULL;
     }
 }
 
-PycRef<PycObject> LoadObject(PycData* stream, PycModule* mod)
+static bool is_interned(int type)
 {
+    return type == PycObject::TYPE_INTERNED || type == PycObject::TYPE_ASCII_INTERNED
+            || type == PycObject::TYPE_SHORT_ASCII_INTERNED;
+}
+
+/* Reads a single object, without any nested objects it may have.  Sets
+ * is_new unless it's a reference to an object which was loaded before, and
+ * slot to the reference slot a new one took, if any.
+ * When reading from the module's lazy source, objects which were loaded on
+ * their own already are skipped, and with defer_code, a code object is
+ * skipped and a PycLazyCode returned. */
+static PycRef<PycObject> load_one(PycData* stream, PycModule* mod, bool& is_new,
+                                  size_t& slot, bool lazy, bool defer_code)
+{
+    slot = PycModule::NO_SLOT;
+    size_t offset = lazy ? static_cast<PycMappedFile*>(stream)->position() : 0;
     int type = stream->getByte();
     PycRef<PycObject> obj;
 
+    if (lazy) {
+        obj = mod->preloaded(type, offset);
+        if (obj != NULL) {
+            is_new = false;
+            return obj;
+        }
+    }
+
+    is_new = (type != PycObject::TYPE_OBREF && type != PycObject::TYPE_STRINGREF);
+    if (defer_code && ((type & 0x7F) == PycObject::TYPE_CODE
+                       || (type & 0x7F) == PycObject::TYPE_CODE2))
+        return mod->deferCode(offset);
+
+    if (PycStats* stats = mod->stats()) {
+        ++stats->objects;
+        if ((type & 0x7F) == PycObject::TYPE_CODE || (type & 0x7F) == PycObject::TYPE_CODE2)
+            ++stats->codeObjects;
+    }
+
     if (type == PycObject::TYPE_OBREF) {
         int index = stream->get32();
         obj = mod->getRef(index);
+    } else if (type == PycObject::TYPE_STRINGREF) {
+        int index = stream->get32();
+        obj = mod->getIntern(index).cast<PycObject>();
     } else {
-        obj = CreateObject(type & 0x7F);
+        obj = CreateObject(type & 0x7F, mod);
         if (obj != NULL) {
-            if (type & 0x80)
-                mod->refObject(obj);
+            // Interned strings have no nested objects, so they can be
+            // swapped for the canonical one before taking their slot
+            bool interned = is_interned(type & 0x7F);
+            if ((type & 0x80) && !interned)
+                slot = mod->refObject(obj);
             obj->load(stream, mod);
+            if (interned) {
+                obj = mod->intern(obj.cast<PycString>()).cast<PycObject>();
+                if (type & 0x80)
+                    mod->refObject(obj);
+            }
         }
     }
 
     return obj;
 }
+
+struct OpenObject {
+    PycRef<PycObject> obj;
+    int children;       // The number of nested objects received so far
+    size_t slot;
+};
+
+typedef std::vector<OpenObject> open_list_t;
+
+/* The code object whose constants are being loaded, if the innermost open
+ * container is that tuple */
+static PycCode* loading_consts(const open_list_t& open, PycModule* mod)
+{
+    if (open.size() < 2)
+        return nullptr;
+    const auto& owner = open[open.size() - 2];
+    PycCode* code = owner.obj.try_cast<PycCode>();
+    if (code && PycCode::fieldAt(mod, owner.children) == PycCode::FIELD_CONSTS)
+        return code;
+    return nullptr;
+}
+
+PycRef<PycObject> LoadObject(PycData* stream, PycModule* mod)
+{
+    // The containers which are still being loaded, innermost last.  Objects
+    // are still created (and registered with refObject) in stream order, and
+    // each one is shared once it's complete.
+    open_list_t open;
+    bool lazy = (stream == mod->lazySource());
+    for (;;) {
+        bool is_new;
+        size_t slot;
+        PycCode* consts_of = lazy ? loading_consts(open, mod) : nullptr;
+        PycRef<PycObject> obj = load_one(stream, mod, is_new, slot, lazy,
+                                         consts_of != nullptr);
+        if (lazy) {
+            // Stand-ins may only end up in constants, where consts() finds
+            // them; a reference to one from anywhere else loads the code
+            if (PycLazyCode* stand_in = obj.try_cast<PycLazyCode>()) {
+                if (consts_of)
+                    consts_of->setLazyConsts();
+                else
+                    obj = stand_in->resolve().cast<PycObject>();
+            }
+        }
+        if (is_new && obj != NULL && obj->wantsChild(mod, 0)) {
+            open.push_back({ std::move(obj), 0, slot });
+            continue;
+        }
+        if (is_new)
+            obj = mod->share(std::move(obj), slot);
+
+        // Hand the finished object to its container, which may complete
+        // that one as well
+        while (!open.empty()) {
+            auto& parent = open.back();
+            parent.obj->addChild(stream, mod, std::move(obj), parent.children++);
+            if (parent.obj->wantsChild(mod, parent.children))
+                break;
+            obj = mod->share(std::move(parent.obj), parent.slot);
+            open.pop_back();
+        }
+        if (open.empty())
+            return obj;
+    }
+}
@@ -1,7 +1,53 @@
 #ifndef _PYC_OBJECT_H
 #define _PYC_OBJECT_H
 
+#include "arena.h"
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <typeinfo>
+#include <utility>
+#include <vector>
+
+/* Classes whose objects can be told apart by their type tag define
+ * static bool classof(const Base*), like LLVM's isa<> does it.  Casting
+ * to one of them is a compare and a static_cast; casting to any other
+ * class falls back to dynamic_cast.  Since classof is inherited, every
+ * class derived from one which has it needs its own. */
+template <class _Cast, class _From>
+class PycHasClassof {
+    template <class _Class>
+    static auto test(int) -> decltype(_Class::classof(static_cast<const _From*>(nullptr)),
+                                      std::true_type());
+    template <class>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<_Cast>(0))::value;
+};
+
+template <class _Cast, class _From>
+inline typename std::enable_if<std::is_base_of<_Cast, _From>::value, _Cast*>::type
+pyc_dyn_cast(_From* obj)
+{
+    return obj;
+}
+
+template <class _Cast, class _From>
+inline typename std::enable_if<!std::is_base_of<_Cast, _From>::value
+                               && PycHasClassof<_Cast, _From>::value, _Cast*>::type
+pyc_dyn_cast(_From* obj)
+{
+    return (obj && _Cast::classof(obj)) ? static_cast<_Cast*>(obj) : nullptr;
+}
+
+template <class _Cast, class _From>
+inline typename std::enable_if<!std::is_base_of<_Cast, _From>::value
+                               && !PycHasClassof<_Cast, _From>::value, _Cast*>::type
+pyc_dyn_cast(_From* obj)
+{
+    return dynamic_cast<_Cast*>(obj);
+}
 
 template <class _Obj>
 class PycRef {
@@ -53,8 +99,12 @@ public:
 
     PycRef<_Obj>& operator=(PycRef<_Obj>&& obj) noexcept
     {
-        m_obj = obj.m_obj;
-        obj.m_obj = nullptr;
+        if (this != &obj) {
+            if (m_obj)
+                m_obj->delRef();
+            m_obj = obj.m_obj;
+            obj.m_obj = nullptr;
+        }
         return *this;
     }
 
@@ -70,17 +120,20 @@ public:
     inline int type() const;
 
     template <class _Cast>
-    PycRef<_Cast> try_cast() const { return dynamic_cast<_Cast*>(m_obj); }
+    PycRef<_Cast> try_cast() const { return pyc_dyn_cast<_Cast>(m_obj); }
 
     template <class _Cast>
     PycRef<_Cast> cast() const
     {
-        _Cast* result = dynamic_cast<_Cast*>(m_obj);
+        _Cast* result = pyc_dyn_cast<_Cast>(m_obj);
         if (!result)
             throw std::bad_cast();
         return result;
     }
 
+    template <class _Cast>
+    bool isa() const { return pyc_dyn_cast<_Cast>(m_obj) != nullptr; }
+
     bool isIdent(const _Obj* obj) const { return m_obj == obj; }
 
 private:
@@ -129,17 +182,32 @@ public:
         TYPE_SHORT_ASCII_INTERNED = 'Z',    // Python 3.4 ->
     };
 
+    /* Added to the type of an object which stands in for one of that
+     * type, so casts can tell it apart from the real one */
+    static const int STAND_IN = 0x100;
+
     PycObject(int type = TYPE_UNKNOWN) : m_refs(0), m_type(type) { }
     virtual ~PycObject() { }
 
-    int type() const { return m_type; }
+    int type() const { return m_type & ~STAND_IN; }
+
+    /* The type, including STAND_IN */
+    int tag() const { return m_type; }
 
     virtual bool isEqual(PycRef<PycObject> obj) const
     {
         return obj.isIdent(this);
     }
 
+    /* Reads the object's own data.  Containers don't load their nested
+     * objects themselves, so LoadObject() doesn't have to recurse: as long
+     * as wantsChild() returns true, it loads the next object from the
+     * stream and passes it to addChild().  index is the number of nested
+     * objects added so far. */
     virtual void load(PycData*, PycModule*) { }
+    virtual bool wantsChild(PycModule*, int /* index */) const { return false; }
+    virtual void addChild(PycData*, PycModule*, PycRef<PycObject> /* child */,
+                          int /* index */) { }
 
 private:
     int m_refs;
@@ -148,8 +216,18 @@ protected:
     int m_type;
 
 public:
-    void addRef() { ++m_refs; }
-    void delRef() { if (--m_refs == 0) delete this; }
+    void addRef() { if (m_refs >= 0) ++m_refs; }
+    void delRef() { if (m_refs > 0 && --m_refs == 0) destroy(); }
+
+    /* Immortal objects skip reference counting entirely, which makes them
+     * safe to share between threads.  Whoever made them immortal is
+     * responsible for freeing them (if ever). */
+    void makeImmortal() { m_refs = -1; }
+    bool isImmortal() const { return m_refs < 0; }
+
+private:
+    /* Deletes the object without recursing into the ones it holds */
+    void destroy();
 };
 
 template <class _Obj>
@@ -158,7 +236,36 @@ int PycRef<_Obj>::type() const
     return m_obj ? m_obj->type() : PycObject::TYPE_NULL;
 }
 
-PycRef<PycObject> CreateObject(int type);
+/* Owns all objects of a module which is loaded in arena mode.  Objects are
+ * bump-allocated, immortal, and freed together with the arena.  With an
+ * account, making an object once the account is over its limit throws. */
+class PycArena {
+public:
+    explicit PycArena(MemoryAccount* account = nullptr) : m_alloc(account), m_account(account) { }
+    ~PycArena();
+
+    PycArena(const PycArena&) = delete;
+    PycArena& operator=(const PycArena&) = delete;
+
+    template <class _Obj, class... _Args>
+    _Obj* make(_Args&&... args)
+    {
+        if (m_account && m_account->over())
+            throw std::runtime_error("over the memory budget");
+        _Obj* obj = new (m_alloc.allocate(sizeof(_Obj))) _Obj(std::forward<_Args>(args)...);
+        m_objects.push_back(obj);
+        obj->makeImmortal();
+        return obj;
+    }
+
+private:
+    BumpAllocator m_alloc;
+    MemoryAccount* m_account;
+    std::vector<PycObject*> m_objects;
+};
+
+/* If mod is given, the object is allocated from its arena (if it has one) */
+PycRef<PycObject> CreateObject(int type, PycModule* mod = nullptr);
 PycRef<PycObject> LoadObject(PycData* stream, PycModule* mod);
 
 /* Static Singleton objects */
@@ -4,12 +4,15 @@
 #include <stdexcept>
 
 /* PycSimpleSequence */
-void PycSimpleSequence::load(PycData* stream, PycModule* mod)
+void PycSimpleSequence::load(PycData* stream, PycModule*)
 {
     m_size = stream->get32();
     m_values.reserve(m_size);
-    for (int i=0; i<m_size; i++)
-        m_values.push_back(LoadObject(stream, mod));
+}
+
+void PycSimpleSequence::addChild(PycData*, PycModule*, PycRef<PycObject> child, int)
+{
+    m_values.push_back(std::move(child));
 }
 
 bool PycSimpleSequence::isEqual(PycRef<PycObject> obj) const
@@ -32,7 +35,7 @@ bool PycSimpleSequence::isEqual(PycRef<PycObject> obj) const
 
 
 /* PycTuple */
-void PycTuple::load(PycData* stream, PycModule* mod)
+void PycTuple::load(PycData* stream, PycModule*)
 {
     if (type() == TYPE_SMALL_TUPLE)
         m_size = stream->getByte();
@@ -40,21 +43,22 @@ void PycTuple::load(PycData* stream, PycModule* mod)
         m_size = stream->get32();
 
     m_values.resize(m_size);
-    for (int i=0; i<m_size; i++)
-        m_values[i] = LoadObject(stream, mod);
+}
+
+void PycTuple::addChild(PycData*, PycModule*, PycRef<PycObject> child, int index)
+{
+    m_values[index] = std::move(child);
 }
 
 
 /* PycDict */
-void PycDict::load(PycData* stream, PycModule* mod)
+void PycDict::addChild(PycData*, PycModule*, PycRef<PycObject> child, int index)
 {
-    PycRef<PycObject> key, val;
-    for (;;) {
-        key = LoadObject(stream, mod);
-        if (key == NULL)
-            break;
-        val = LoadObject(stream, mod);
-        m_values.emplace_back(std::make_tuple(key, val));
+    if (index % 2 == 0) {
+        if (child != NULL)
+            m_values.emplace_back(std::move(child), nullptr);
+    } else {
+        std::get<1>(m_values.back()) = std::move(child);
     }
 }
 
@@ -7,6 +7,15 @@
 
 class PycSequence : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_TUPLE
+                || obj->tag() == TYPE_SMALL_TUPLE
+                || obj->tag() == TYPE_LIST
+                || obj->tag() == TYPE_SET
+                || obj->tag() == TYPE_FROZENSET;
+    }
+
     PycSequence(int type) : PycObject(type), m_size(0) { }
 
     int size() const { return m_size; }
@@ -18,6 +27,9 @@ protected:
 
 class PycSimpleSequence : public PycSequence {
 public:
+    // All of the sequences are simple ones
+    static bool classof(const PycObject* obj) { return PycSequence::classof(obj); }
+
     typedef std::vector<PycRef<PycObject>> value_t;
 
     PycSimpleSequence(int type) : PycSequence(type) { }
@@ -25,9 +37,13 @@ public:
     bool isEqual(PycRef<PycObject> obj) const override;
 
     void load(class PycData* stream, class PycModule* mod) override;
+    bool wantsChild(class PycModule*, int index) const override { return index < m_size; }
+    void addChild(class PycData* stream, class PycModule* mod, PycRef<PycObject> child,
+                  int index) override;
 
     const value_t& values() const { return m_values; }
     PycRef<PycObject> get(int idx) const override { return m_values.at(idx); }
+    void set(int idx, PycRef<PycObject> obj) { m_values.at(idx) = std::move(obj); }
 
 protected:
     value_t m_values;
@@ -35,26 +51,48 @@ protected:
 
 class PycTuple : public PycSimpleSequence {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_TUPLE || obj->tag() == TYPE_SMALL_TUPLE;
+    }
+
     typedef PycSimpleSequence::value_t value_t;
     PycTuple(int type = TYPE_TUPLE) : PycSimpleSequence(type) { }
 
     void load(class PycData* stream, class PycModule* mod) override;
+    void addChild(class PycData* stream, class PycModule* mod, PycRef<PycObject> child,
+                  int index) override;
 };
 
 class PycList : public PycSimpleSequence {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_LIST;
+    }
+
     typedef PycSimpleSequence::value_t value_t;
     PycList(int type = TYPE_LIST) : PycSimpleSequence(type) { }
 };
 
 class PycSet : public PycSimpleSequence {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_SET || obj->tag() == TYPE_FROZENSET;
+    }
+
     typedef PycSimpleSequence::value_t value_t;
     PycSet(int type = TYPE_SET) : PycSimpleSequence(type) { }
 };
 
 class PycDict : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_DICT;
+    }
+
     typedef std::tuple<PycRef<PycObject>, PycRef<PycObject>> item_t;
     typedef std::vector<item_t> value_t;
 
@@ -62,7 +100,13 @@ public:
 
     bool isEqual(PycRef<PycObject> obj) const override;
 
-    void load(class PycData* stream, class PycModule* mod) override;
+    /* Keys and values alternate, up to a NULL key */
+    bool wantsChild(class PycModule*, int index) const override
+    {
+        return m_values.size() == (size_t)(index + 1) / 2;
+    }
+    void addChild(class PycData* stream, class PycModule* mod, PycRef<PycObject> child,
+                  int index) override;
 
     const value_t& values() const { return m_values; }
 
@@ -0,0 +1,54 @@
+#include "pyc_stats.h"
+#include <cstdio>
+#include <cstring>
+
+void append_json_string(std::string& out, const char* str, size_t length)
+{
+    out += '"';
+    const unsigned char* end = (const unsigned char*)str + length;
+    for (const unsigned char* ch = (const unsigned char*)str; ch != end; ++ch) {
+        if (*ch == '"' || *ch == '\\') {
+            out += '\\';
+            out += (char)*ch;
+        } else if (*ch < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", *ch);
+            out += escape;
+        } else {
+            out += (char)*ch;
+        }
+    }
+    out += '"';
+}
+
+void append_json_string(std::string& out, const char* str)
+{
+    append_json_string(out, str, strlen(str));
+}
+
+std::string PycStats::toJson(const char* filename) const
+{
+    std::string json = "{\"file\": ";
+    append_json_string(json, filename);
+    json += jsonFields();
+    json += "}\n";
+    return json;
+}
+
+std::string PycStats::jsonFields() const
+{
+    char fields[512];
+    snprintf(fields, sizeof(fields),
+             ", \"load_ms\": %.3f, \"build_ms\": %.3f, \"print_ms\": %.3f"
+             ", \"objects\": %llu, \"code_objects\": %llu, \"shared_objects\": %llu"
+             ", \"instructions\": %llu"
+             ", \"ast_nodes\": %llu, \"peak_stack_depth\": %llu, \"bytes_emitted\": %llu"
+             ", \"peak_bytes\": %llu",
+             loadNanos / 1e6, buildNanos.load() / 1e6, printNanos / 1e6,
+             (unsigned long long)objects.load(), (unsigned long long)codeObjects.load(),
+             (unsigned long long)sharedObjects.load(), (unsigned long long)instructions.load(),
+             (unsigned long long)astNodes.load(),
+             (unsigned long long)peakStackDepth.load(), (unsigned long long)bytesEmitted,
+             (unsigned long long)peakBytes);
+    return fields;
+}
@@ -0,0 +1,62 @@
+#ifndef _PYC_STATS_H
+#define _PYC_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/* Counters and phase times for --stats.  Code updates them through the
+ * module's stats() pointer, which is null unless they were asked for, so
+ * leaving them off costs a null check.  The counters may be updated by the
+ * threads which build nested ASTs. */
+class PycStats {
+public:
+    PycStats()
+        : objects(0), codeObjects(0), sharedObjects(0), instructions(0), astNodes(0),
+          peakStackDepth(0), buildNanos(0), loadNanos(0), printNanos(0),
+          bytesEmitted(0), peakBytes(0) { }
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void notePeakStackDepth(uint64_t depth)
+    {
+        uint64_t peak = peakStackDepth.load(std::memory_order_relaxed);
+        while (depth > peak && !peakStackDepth.compare_exchange_weak(peak, depth,
+                                                  std::memory_order_relaxed)) { }
+    }
+
+    /* Everything as a single line JSON object, including the newline */
+    std::string toJson(const char* filename) const;
+
+    /* The same without the file and the braces, starting with ", " */
+    std::string jsonFields() const;
+
+    std::atomic<uint64_t> objects;          // Objects unmarshalled
+    std::atomic<uint64_t> codeObjects;
+    std::atomic<uint64_t> sharedObjects;    // Duplicates replaced by PycDedup
+    std::atomic<uint64_t> instructions;     // Instructions decoded
+    std::atomic<uint64_t> astNodes;         // AST nodes allocated by BuildFromCode
+    std::atomic<uint64_t> peakStackDepth;   // Deepest stack history of any code object
+
+    /* Summed over all threads which built ASTs */
+    std::atomic<uint64_t> buildNanos;
+
+    /* Wall clock times on the main thread; printing excludes the builds
+     * which happened on that thread */
+    uint64_t loadNanos;
+    uint64_t printNanos;
+    uint64_t bytesEmitted;
+    uint64_t peakBytes;     // The most the input's arenas held at once
+};
+
+/* Appends str as a quoted JSON string, with quotes, backslashes and control
+ * characters escaped */
+void append_json_string(std::string& out, const char* str, size_t length);
+void append_json_string(std::string& out, const char* str);
+
+#endif
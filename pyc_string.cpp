@@ -1,49 +1,147 @@
 #include "pyc_string.h"
 #include "pyc_module.h"
 #include "data.h"
+#include <cstdint>
 #include <stdexcept>
 
-static bool check_ascii(const std::string& data)
+/* Strings shorter than this are cheaper to copy into std::string's inline
+ * storage than to reference through the input mapping */
+static const int MIN_VIEW_LENGTH = 16;
+
+/* The scans below look at 16 bytes at a time where SSE2 (part of every
+ * x86-64) or NEON is available, and at 8 bytes at a time otherwise, so
+ * long clean strings are only touched once */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define PYC_SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#  include <arm_neon.h>
+#  define PYC_SIMD_NEON
+#endif
+
+static bool check_ascii(const char* data, int length)
 {
-    auto cp = reinterpret_cast<const unsigned char*>(data.c_str());
-    while (*cp) {
+    const char* cp = data;
+    const char* end = data + length;
+#if defined(PYC_SIMD_SSE2)
+    for ( ; end - cp >= 16; cp += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cp));
+        if (_mm_movemask_epi8(block))
+            return false;
+    }
+#elif defined(PYC_SIMD_NEON)
+    for ( ; end - cp >= 16; cp += 16) {
+        uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t*>(cp));
+        if (vmaxvq_u8(block) & 0x80)
+            return false;
+    }
+#else
+    for ( ; end - cp >= 8; cp += 8) {
+        uint64_t word;
+        memcpy(&word, cp, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+            return false;
+    }
+#endif
+    for ( ; cp != end; ++cp) {
         if (*cp & 0x80)
             return false;
-        ++cp;
     }
     return true;
 }
 
+/* The characters which PycString::print can't write out as they are */
+struct EscapeSet {
+    bool high;          // Bytes >= 0x80
+    char quote;         // The quote character in use
+    bool braces;        // In an f-string
+};
+
+static bool needs_escape(unsigned char ch, const EscapeSet& set)
+{
+    return ch < 0x20 || ch == 0x7F || (set.high && ch >= 0x80) || ch == '\\'
+            || ch == (unsigned char)set.quote || (set.braces && (ch == '{' || ch == '}'));
+}
+
+/* Returns the first character in [cp, end) which needs escaping, or end */
+static const char* find_escape(const char* cp, const char* end, const EscapeSet& set)
+{
+#if defined(PYC_SIMD_SSE2)
+    const __m128i ctrl_max = _mm_set1_epi8(0x1F);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i quote = _mm_set1_epi8(set.quote);
+    const __m128i lbrace = _mm_set1_epi8(set.braces ? '{' : '\\');
+    const __m128i rbrace = _mm_set1_epi8(set.braces ? '}' : '\\');
+    for ( ; end - cp >= 16; cp += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cp));
+        // Unsigned block <= 0x1F
+        __m128i special = _mm_cmpeq_epi8(_mm_min_epu8(block, ctrl_max), block);
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, del));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, backslash));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, quote));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, lbrace));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, rbrace));
+        if (set.high)
+            special = _mm_or_si128(special, block);
+        if (_mm_movemask_epi8(special))
+            break;
+    }
+#elif defined(PYC_SIMD_NEON)
+    const uint8x16_t ctrl_end = vdupq_n_u8(0x20);
+    const uint8x16_t del = vdupq_n_u8(0x7F);
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t quote = vdupq_n_u8((uint8_t)set.quote);
+    const uint8x16_t lbrace = vdupq_n_u8(set.braces ? '{' : '\\');
+    const uint8x16_t rbrace = vdupq_n_u8(set.braces ? '}' : '\\');
+    const uint8x16_t high = vdupq_n_u8(set.high ? 0x80 : 0);
+    for ( ; end - cp >= 16; cp += 16) {
+        uint8x16_t block = vld1q_u8(reinterpret_cast<const uint8_t*>(cp));
+        uint8x16_t special = vcltq_u8(block, ctrl_end);
+        special = vorrq_u8(special, vceqq_u8(block, del));
+        special = vorrq_u8(special, vceqq_u8(block, backslash));
+        special = vorrq_u8(special, vceqq_u8(block, quote));
+        special = vorrq_u8(special, vceqq_u8(block, lbrace));
+        special = vorrq_u8(special, vceqq_u8(block, rbrace));
+        special = vorrq_u8(special, vandq_u8(block, high));
+        if (vmaxvq_u8(special))
+            break;
+    }
+#endif
+    // The rest, and the block the vector loop stopped at
+    for ( ; cp != end; ++cp) {
+        if (needs_escape((unsigned char)*cp, set))
+            return cp;
+    }
+    return end;
+}
+
 /* PycString */
-void PycString::load(PycData* stream, PycModule* mod)
+void PycString::load(PycData* stream, PycModule*)
 {
-    if (type() == TYPE_STRINGREF) {
-        PycRef<PycString> str = mod->getIntern(stream->get32());
-        m_type = str->m_type;
-        m_value = str->m_value;
-    } else {
-        int length;
-        if (type() == TYPE_SHORT_ASCII || type() == TYPE_SHORT_ASCII_INTERNED)
-            length = stream->getByte();
-        else
-            length = stream->get32();
+    int length;
+    if (type() == TYPE_SHORT_ASCII || type() == TYPE_SHORT_ASCII_INTERNED)
+        length = stream->getByte();
+    else
+        length = stream->get32();
 
-        if (length < 0)
-            throw std::bad_alloc();
+    if (length < 0)
+        throw std::bad_alloc();
 
+    if (length >= MIN_VIEW_LENGTH)
+        m_view = stream->getView(length);
+    if (m_view) {
+        m_viewLength = length;
+    } else {
         m_value.resize(length);
-        if (length) {
+        if (length)
             stream->getBuffer(length, &m_value.front());
-            if (type() == TYPE_ASCII || type() == TYPE_ASCII_INTERNED ||
-                    type() == TYPE_SHORT_ASCII || type() == TYPE_SHORT_ASCII_INTERNED) {
-                if (!check_ascii(m_value))
-                    throw std::runtime_error("Invalid bytes in ASCII string");
-            }
-        }
+    }
 
-        if (type() == TYPE_INTERNED || type() == TYPE_ASCII_INTERNED ||
-                type() == TYPE_SHORT_ASCII_INTERNED)
-            mod->intern(this);
+    if (length && (type() == TYPE_ASCII || type() == TYPE_ASCII_INTERNED ||
+            type() == TYPE_SHORT_ASCII || type() == TYPE_SHORT_ASCII_INTERNED)) {
+        if (!check_ascii(data(), length))
+            throw std::runtime_error("Invalid bytes in ASCII string");
     }
 }
 
@@ -53,10 +151,84 @@ bool PycString::isEqual(PycRef<PycObject> obj) const
         return false;
 
     PycRef<PycString> strObj = obj.cast<PycString>();
-    return isEqual(strObj->m_value);
+    return length() == strObj->length()
+            && memcmp(data(), strObj->data(), length()) == 0;
 }
 
-void PycString::print(std::ostream &pyc_output, PycModule* mod, bool triple,
+void PycString::materialize() const
+{
+    m_value.assign(m_view, m_viewLength);
+    m_view = nullptr;
+    m_viewLength = 0;
+}
+
+/* Writes the inside of a literal, split over implicitly concatenated
+ * literals once one has grown to the width (if there is one).  Each piece
+ * after the first goes on a continuation line. */
+class LiteralWriter {
+public:
+    LiteralWriter(PycOutput& out, size_t width, char prefix, char quote, bool utf8)
+        : m_out(out), m_width(width), m_column(0), m_prefix(prefix), m_quote(quote),
+          m_utf8(utf8) { }
+
+    /* Characters which are written as they are */
+    void text(const char* data, size_t length)
+    {
+        while (m_width && m_column + length > m_width) {
+            size_t fits = (m_column < m_width) ? m_width - m_column : 0;
+            // UTF-8 can't be split in the middle of a character
+            if (m_utf8) {
+                while (fits > 0 && (data[fits] & 0xC0) == 0x80)
+                    --fits;
+                if (fits == 0 && m_column == 0) {
+                    for (fits = 1; fits < length && (data[fits] & 0xC0) == 0x80; ++fits) { }
+                }
+            }
+            m_out.write(data, fits);
+            data += fits;
+            length -= fits;
+            m_column += fits;
+            if (length == 0)
+                return;
+            split();
+        }
+        m_out.write(data, length);
+        m_column += length;
+    }
+
+    /* An escape sequence, which is never split */
+    void escape(const char* data, size_t length)
+    {
+        if (m_width && m_column != 0 && m_column + length > m_width)
+            split();
+        m_out.write(data, length);
+        m_column += length;
+    }
+
+    void hexEscape(unsigned char ch)
+    {
+        static const char digits[] = "0123456789abcdef";
+        const char sequence[] = { '\\', 'x', digits[ch >> 4], digits[ch & 0xF] };
+        escape(sequence, sizeof(sequence));
+    }
+
+private:
+    void split()
+    {
+        m_out << m_quote << " \\\n    ";
+        if (m_prefix)
+            m_out << m_prefix;
+        m_out << m_quote;
+        m_column = 0;
+    }
+
+    PycOutput& m_out;
+    size_t m_width, m_column;
+    char m_prefix, m_quote;
+    bool m_utf8;
+};
+
+void PycString::print(PycOutput &pyc_output, PycModule* mod, bool triple,
                       const char* parent_f_string_quote)
 {
     char prefix = 0;
@@ -84,22 +256,19 @@ void PycString::print(std::ostream &pyc_output, PycModule* mod, bool triple,
     if (prefix != 0)
         pyc_output << prefix;
 
-    if (m_value.empty()) {
+    const char* begin = data();
+    const char* end = begin + length();
+    if (begin == end) {
         pyc_output << "''";
         return;
     }
 
-    // Determine preferred quote style (Emulate Python's method)
+    // Determine preferred quote style (Emulate Python's method: double
+    // quotes if there is a single quote but no double quote)
     bool useQuotes = false;
     if (!parent_f_string_quote) {
-        for (char ch : m_value) {
-            if (ch == '\'') {
-                useQuotes = true;
-            } else if (ch == '"') {
-                useQuotes = false;
-                break;
-            }
-        }
+        useQuotes = memchr(begin, '"', end - begin) == nullptr
+                && memchr(begin, '\'', end - begin) != nullptr;
     } else {
         useQuotes = parent_f_string_quote[0] == '"';
     }
@@ -111,42 +280,40 @@ void PycString::print(std::ostream &pyc_output, PycModule* mod, bool triple,
         else
             pyc_output << (useQuotes ? '"' : '\'');
     }
-    for (char ch : m_value) {
-        if (static_cast<unsigned char>(ch) < 0x20 || ch == 0x7F) {
-            if (ch == '\r') {
-                pyc_output << "\\r";
-            } else if (ch == '\n') {
-                if (triple)
-                    pyc_output << '\n';
-                else
-                    pyc_output << "\\n";
-            } else if (ch == '\t') {
-                pyc_output << "\\t";
-            } else {
-                formatted_print(pyc_output, "\\x%02x", (ch & 0xFF));
-            }
-        } else if (static_cast<unsigned char>(ch) >= 0x80) {
-            if (type() == TYPE_UNICODE) {
-                // Unicode stored as UTF-8...  Let the stream interpret it
-                pyc_output << ch;
-            } else {
-                formatted_print(pyc_output, "\\x%02x", (ch & 0xFF));
-            }
-        } else {
-            if (!useQuotes && ch == '\'')
-                pyc_output << R"(\')";
-            else if (useQuotes && ch == '"')
-                pyc_output << R"(\")";
-            else if (ch == '\\')
-                pyc_output << R"(\\)";
-            else if (parent_f_string_quote && ch == '{')
-                pyc_output << "{{";
-            else if (parent_f_string_quote && ch == '}')
-                pyc_output << "}}";
+    // Unicode is stored as UTF-8, which is passed through as it is
+    EscapeSet escapes = { type() != TYPE_UNICODE, useQuotes ? '"' : '\'',
+                          parent_f_string_quote != nullptr };
+
+    // Neither f-strings nor triple quoted strings can be split
+    size_t width = (triple || parent_f_string_quote) ? 0 : mod->literalWidth();
+    LiteralWriter writer(pyc_output, width, prefix, escapes.quote, !escapes.high);
+
+    // Runs of characters which don't need escaping are written in one go
+    const char* run = begin;
+    for (const char* cp = begin; (cp = find_escape(cp, end, escapes)) != end; ++cp) {
+        char ch = *cp;
+        writer.text(run, cp - run);
+        run = cp + 1;
+        if (ch == '\r') {
+            writer.escape("\\r", 2);
+        } else if (ch == '\n') {
+            if (triple)
+                pyc_output << '\n';
             else
-                pyc_output << ch;
+                writer.escape("\\n", 2);
+        } else if (ch == '\t') {
+            writer.escape("\\t", 2);
+        } else if (static_cast<unsigned char>(ch) < 0x20 || static_cast<unsigned char>(ch) >= 0x7F) {
+            writer.hexEscape(static_cast<unsigned char>(ch));
+        } else if (ch == '{' || ch == '}') {
+            const char doubled[] = { ch, ch };
+            writer.escape(doubled, sizeof(doubled));
+        } else {
+            const char escaped[] = { '\\', ch };
+            writer.escape(escaped, sizeof(escaped));
         }
     }
+    writer.text(run, end - run);
     if (!parent_f_string_quote) {
         if (triple)
             pyc_output << (useQuotes ? R"(""")" : "'''");
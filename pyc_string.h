@@ -4,34 +4,73 @@
 #include "pyc_object.h"
 #include "data.h"
 #include <cstdio>
+#include <cstring>
 #include <string>
 
 class PycString : public PycObject {
 public:
+    static bool classof(const PycObject* obj)
+    {
+        return obj->tag() == TYPE_STRING
+                || obj->tag() == TYPE_UNICODE
+                || obj->tag() == TYPE_INTERNED
+                || obj->tag() == TYPE_ASCII
+                || obj->tag() == TYPE_ASCII_INTERNED
+                || obj->tag() == TYPE_SHORT_ASCII
+                || obj->tag() == TYPE_SHORT_ASCII_INTERNED;
+    }
+
     PycString(int type = TYPE_STRING)
-        : PycObject(type) { }
+        : PycObject(type), m_view(), m_viewLength(), m_canonical() { }
 
     bool isEqual(PycRef<PycObject> obj) const override;
-    bool isEqual(const std::string& str) const { return m_value == str; }
+    bool isEqual(PycStringView str) const { return view() == str; }
+    bool startsWith(PycStringView str) const { return view().startsWith(str); }
+
+    void load(class PycData* stream, class PycModule* mod) override;
+
+    int length() const { return m_view ? m_viewLength : (int)m_value.size(); }
+
+    /* The raw bytes of the string.  These may point directly into the
+     * module's input mapping, so they are NOT guaranteed to be terminated. */
+    const char* data() const { return m_view ? m_view : m_value.data(); }
 
-    bool startsWith(const std::string& str) const
+    /* The bytes without copying them; this never allocates */
+    PycStringView view() const { return PycStringView(data(), (size_t)length()); }
+
+    /* NUL-terminated accessors.  A string which is still backed by the input
+     * mapping gets copied into owned storage the first time one of these is
+     * used on it. */
+    const char* value() const { return strValue().c_str(); }
+    const std::string &strValue() const
     {
-        return m_value.substr(0, str.size()) == str;
+        if (m_view)
+            materialize();
+        return m_value;
     }
 
-    void load(class PycData* stream, class PycModule* mod) override;
-
-    int length() const { return (int)m_value.size(); }
-    const char* value() const { return m_value.c_str(); }
-    const std::string &strValue() const { return m_value; }
+    void setValue(std::string str)
+    {
+        m_view = nullptr;
+        m_value = std::move(str);
+    }
 
-    void setValue(std::string str) { m_value = std::move(str); }
+    /* Whether this is the module's canonical string for its value (see
+     * PycInterner) */
+    bool isCanonical() const { return m_canonical; }
 
-    void print(std::ostream& stream, class PycModule* mod, bool triple = false,
+    void print(PycOutput& stream, class PycModule* mod, bool triple = false,
                const char* parent_f_string_quote = nullptr);
 
 private:
-    std::string m_value;
+    friend class PycInterner;
+
+    void materialize() const;
+
+    mutable std::string m_value;
+    mutable const char* m_view;
+    mutable int m_viewLength;
+    bool m_canonical;
 };
 
 #endif
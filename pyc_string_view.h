@@ -0,0 +1,52 @@
+#ifndef _PYC_STRING_VIEW_H
+#define _PYC_STRING_VIEW_H
+
+#include <cstring>
+#include <string>
+
+/* A non-owning reference to a run of bytes, like C++17's std::string_view.
+ * The bytes are NOT guaranteed to be NUL-terminated. */
+class PycStringView {
+public:
+    PycStringView() : m_data(""), m_size() { }
+    constexpr PycStringView(const char* data, size_t size) : m_data(data), m_size(size) { }
+    PycStringView(const char* str) : m_data(str), m_size(strlen(str)) { }
+    PycStringView(const std::string& str) : m_data(str.data()), m_size(str.size()) { }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    const char* begin() const { return m_data; }
+    const char* end() const { return m_data + m_size; }
+
+    char operator[](size_t index) const { return m_data[index]; }
+
+    PycStringView substr(size_t pos, size_t count = (size_t)-1) const
+    {
+        if (pos > m_size)
+            pos = m_size;
+        if (count > m_size - pos)
+            count = m_size - pos;
+        return PycStringView(m_data + pos, count);
+    }
+
+    bool startsWith(PycStringView prefix) const
+    {
+        return m_size >= prefix.m_size && memcmp(m_data, prefix.m_data, prefix.m_size) == 0;
+    }
+
+    std::string str() const { return std::string(m_data, m_size); }
+
+    bool operator==(PycStringView other) const
+    {
+        return m_size == other.m_size && memcmp(m_data, other.m_data, m_size) == 0;
+    }
+    bool operator!=(PycStringView other) const { return !(*this == other); }
+
+private:
+    const char* m_data;
+    size_t m_size;
+};
+
+#endif
@@ -1,39 +1,727 @@
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <memory>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include "ASTree.h"
+#include "BatchManifest.h"
+#include "BatchPipeline.h"
+#include "bytecode.h"
+#include "DecompileCache.h"
+#include "DecompileServer.h"
+#include "Decompiler.h"
+#include "FileWatcher.h"
+#include "InputFiles.h"
+#include "ModuleDiff.h"
+#include "OpcodeProfile.h"
+#include "OutputPack.h"
+#include "SourceMap.h"
+#include "ThreadPool.h"
 
 #ifdef WIN32
-#  define PATHSEP '\\'
-#else
-#  define PATHSEP '/'
+#  include <fcntl.h>
+#  include <io.h>
 #endif
 
+struct DecompileOptions {
+    bool marshalled = false;
+    int major = -1, minor = -1;
+    bool stats = false;
+    const char* only = nullptr;
+    const char* cacheDir = nullptr;
+    bool stream = false;
+    bool lowMemory = false;
+    bool lineMarkers = false;
+    bool scan = false;
+    bool dedup = false;
+    size_t literalWidth = 0;
+    const char* diffAgainst = nullptr;
+    const char* sourceMap = nullptr;
+    ResidentCache* resident = nullptr;
+    bool readInputs = false;
+    uint64_t maxMemory = 0;
+    BuildBudget budget;
+};
+
+/* Notes a file's peak memory use in its stats when it goes out of scope,
+ * and writes its --stats line if asked to */
+class StatsReport {
+public:
+    StatsReport(PycStats& stats, const MemoryAccount& memory, const char* filename, bool print)
+        : m_stats(stats), m_memory(memory), m_filename(filename), m_print(print) { }
+    ~StatsReport()
+    {
+        m_stats.peakBytes = m_memory.peak();
+        if (m_print)
+            fputs(m_stats.toJson(m_filename).c_str(), stderr);
+    }
+
+private:
+    PycStats& m_stats;
+    const MemoryAccount& m_memory;
+    const char* m_filename;
+    bool m_print;
+};
+
+#ifdef OPCODE_PROFILE
+/* Writes the --profile report when main() returns, after every input */
+class ProfileReport {
+public:
+    ProfileReport() : m_filename() { }
+    ~ProfileReport()
+    {
+        if (!m_filename)
+            return;
+        FILE* out = fopen(m_filename, "w");
+        if (!out) {
+            fprintf(stderr, "Error opening file '%s' for writing\n", m_filename);
+            return;
+        }
+        OpcodeProfile::report(out);
+        fclose(out);
+    }
+
+    void setFilename(const char* filename) { m_filename = filename; }
+
+private:
+    const char* m_filename;
+};
+#endif
+
+/* Finds the code objects of the functions or classes with a qualified name
+ * like "Class.method".  The "<locals>" parts which the qualified names of
+ * nested functions have may be left out.  Only the code objects along the
+ * way are looked into, so with lazy loading the others are never loaded. */
+static std::vector<PycRef<PycCode>> find_code(PycRef<PycCode> code, const char* qualname)
+{
+    std::vector<PycRef<PycCode>> matches(1, code);
+    std::istringstream parts(qualname);
+    std::string part;
+    while (std::getline(parts, part, '.')) {
+        if (part == "<locals>")
+            continue;
+        std::vector<PycRef<PycCode>> next;
+        for (const auto& parent : matches) {
+            auto consts = parent->consts();
+            for (int i = 0; i < consts->size(); ++i) {
+                PycRef<PycCode> child = consts->get(i).try_cast<PycCode>();
+                if (child != NULL && child->name() != NULL && child->name()->isEqual(part))
+                    next.push_back(child);
+            }
+        }
+        matches.swap(next);
+    }
+    // Without any parts, the module itself isn't what was asked for
+    if (!matches.empty() && matches.front().isIdent(code))
+        matches.clear();
+    return matches;
+}
+
+/* Loads the input into mod, throwing if it can't be read.  With an image,
+ * which was read already, it's loaded from that instead. */
+static void load_input(const InputFile& input, const DecompileOptions& options, PycModule& mod,
+                       std::vector<unsigned char>* image = nullptr)
+{
+    std::vector<unsigned char> data;
+    if (!image && options.readInputs && !input.archive) {
+        if (!read_file(input.path, data))
+            throw std::runtime_error(strerror(errno));
+        image = &data;
+    }
+    if (image && !options.marshalled) {
+        mod.loadFromBuffer(std::move(*image));
+        if (!mod.isValid())
+            fputs("Bad MAGIC!\n", stderr);
+    } else if (image) {
+        mod.loadFromMarshalledBuffer(std::move(*image), options.major, options.minor);
+    } else if (input.archive)
+        input.archive->load(input.member, mod);
+    else if (!options.marshalled)
+        mod.loadFromFile(input.path.c_str());
+    else
+        mod.loadFromMarshalledFile(input.path.c_str(), options.major, options.minor);
+}
+
+/* Writes the "# Changed: ..." and similar comments about a --diff */
+static void print_diff_summary(const ModuleDiff& diff, const char* against,
+                               PycOutput& pyc_output)
+{
+    pyc_output << "# Compared with " << against << ": " << (int)diff.changed.size()
+               << " changed, " << (int)diff.added.size() << " added, "
+               << (int)diff.removed.size() << " removed\n";
+    const std::pair<const char*, const std::vector<std::string>*> lists[] = {
+        { "Changed", &diff.changed }, { "Added", &diff.added }, { "Removed", &diff.removed },
+    };
+    for (const auto& list : lists) {
+        if (list.second->empty())
+            continue;
+        pyc_output << "# " << list.first << ":";
+        for (const auto& name : *list.second)
+            pyc_output << " " << name;
+        pyc_output << "\n";
+    }
+    if (diff.empty())
+        pyc_output << "# No changes\n";
+    pyc_output << "\n";
+}
+
+/* With stats_out, the --stats counters are kept there, whether or not
+ * they are printed.  image is the input read ahead, if it was. */
+static DecompileStatus decompile_file(const InputFile& input, const DecompileOptions& options,
+                                      std::ostream& out_stream, ThreadPool* pool = nullptr,
+                                      PycStats* stats_out = nullptr,
+                                      std::vector<unsigned char>* image = nullptr)
+{
+    const char* infile = input.path.c_str();
+    PycOutput pyc_output(out_stream);
+    MemoryAccount memory(options.maxMemory);
+    PycModule mod;
+    mod.setMemoryAccount(&memory);
+    // Without an arena, code objects which are done with can be freed
+    if (!options.lowMemory)
+        mod.useArena();
+    mod.setLazyLoading(options.only != nullptr || options.lowMemory);
+    mod.setDeduplication(options.dedup);
+    mod.setLiteralWidth(options.literalWidth);
+
+    // Reported on every way out of here
+    PycStats local_stats;
+    PycStats& stats = stats_out ? *stats_out : local_stats;
+    StatsReport report(stats, memory, infile, options.stats);
+    mod.setStats((options.stats || stats_out) ? &stats : nullptr);
+    uint64_t load_start = mod.stats() ? PycStats::now() : 0;
+    try {
+        load_input(input, options, mod, image);
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error loading file %s: %s\n", infile, ex.what());
+        return DECOMPILE_FAILED;
+    }
+    if (mod.stats())
+        stats.loadNanos = PycStats::now() - load_start;
+
+    if (!mod.isValid()) {
+        fprintf(stderr, "Could not load file %s\n", infile);
+        return DECOMPILE_FAILED;
+    }
+    std::vector<PycRef<PycCode>> targets;
+    if (options.only) {
+        try {
+            targets = find_code(mod.code(), options.only);
+        } catch (std::exception& ex) {
+            fprintf(stderr, "Error loading file %s: %s\n", infile, ex.what());
+            return DECOMPILE_FAILED;
+        }
+        if (targets.empty()) {
+            fprintf(stderr, "No function or class named %s in %s\n", options.only, infile);
+            return DECOMPILE_FAILED;
+        }
+    }
+
+    PycModule old_mod;
+    if (options.diffAgainst) {
+        InputFile old_input = { options.diffAgainst, std::string(), nullptr, 0 };
+        old_mod.useArena();
+        try {
+            load_input(old_input, options, old_mod);
+        } catch (std::exception& ex) {
+            fprintf(stderr, "Error loading file %s: %s\n", options.diffAgainst, ex.what());
+            return DECOMPILE_FAILED;
+        }
+        if (!old_mod.isValid()) {
+            fprintf(stderr, "Could not load file %s\n", options.diffAgainst);
+            return DECOMPILE_FAILED;
+        }
+    }
+
+    const char* dispname = strrchr(infile, PATHSEP);
+    dispname = (dispname == NULL) ? infile : dispname + 1;
+    if (options.sourceMap)
+        pyc_output.countLines();
+    print_source_header(&mod, dispname, pyc_output);
+    DecompileStatus status = DECOMPILE_OK;
+    try {
+        if (options.diffAgainst) {
+            ModuleDiff diff = diff_modules(&old_mod, &mod);
+            print_diff_summary(diff, options.diffAgainst, pyc_output);
+            if (!diff.empty() && !decompyle_changes(mod.code(), &mod, pyc_output, diff.unchanged))
+                status = DECOMPILE_INCOMPLETE;
+        } else if (options.only) {
+            for (const auto& code : targets) {
+                if (!decompyle_only(code, &mod, pyc_output))
+                    status = DECOMPILE_INCOMPLETE;
+            }
+        } else {
+            std::unique_ptr<DecompileCache> cache;
+            if (options.cacheDir || options.resident)
+                cache.reset(new DecompileCache(options.cacheDir ? options.cacheDir : "",
+                                               options.resident));
+            std::unique_ptr<SourceMap> source_map;
+            if (options.sourceMap)
+                source_map.reset(new SourceMap);
+            DecompileSettings settings;
+            settings.pool = pool;
+            settings.cache = cache.get();
+            settings.stream = options.stream;
+            settings.lowMemory = options.lowMemory;
+            settings.lineMarkers = options.lineMarkers;
+            settings.budget = options.budget;
+            settings.sourceMap = source_map.get();
+            if (!decompyle(mod.code(), &mod, pyc_output, settings))
+                status = DECOMPILE_INCOMPLETE;
+            if (source_map && !source_map->write(options.sourceMap, &mod))
+                status = DECOMPILE_FAILED;
+        }
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error decompyling %s: %s\n", infile, ex.what());
+        status = DECOMPILE_FAILED;
+    }
+    stats.bytesEmitted = pyc_output.bytesWritten();
+    return status;
+}
+
+/* Writes what --scan reports about the input as one line of JSON: its
+ * header, and the names and imports of its top-level code.  Nested code
+ * objects are skipped over without loading them, and nothing is
+ * decompiled. */
+static DecompileStatus scan_file(const InputFile& input, const DecompileOptions& options,
+                                 std::ostream& out_stream)
+{
+    PycModule mod;
+    mod.useArena();
+    mod.setLazyLoading(true);
+
+    std::string record = "{\"file\": ";
+    append_json_string(record, input.path.c_str());
+    DecompileStatus status = DECOMPILE_OK;
+    char field[160];
+    try {
+        load_input(input, options, mod);
+        const PycHeader& header = mod.header();
+        if (header.magic) {
+            snprintf(field, sizeof(field), ", \"magic\": \"0x%08x\"", header.magic);
+            record += field;
+        }
+        if (!mod.isValid())
+            throw std::runtime_error("Bad magic number or unsupported Python version");
+        snprintf(field, sizeof(field), ", \"version\": \"%d.%d\"",
+                 mod.majorVer(), mod.minorVer());
+        record += field;
+        if (header.size == 0) {
+            // Marshalled without a header
+        } else if (header.flags & 0x1) {
+            snprintf(field, sizeof(field), ", \"flags\": %u, \"source_hash\": \"%016llx\"",
+                     header.flags, header.hash);
+            record += field;
+        } else {
+            if (mod.verCompare(3, 7) >= 0) {
+                snprintf(field, sizeof(field), ", \"flags\": %u", header.flags);
+                record += field;
+            }
+            snprintf(field, sizeof(field), ", \"timestamp\": %u", header.timestamp);
+            record += field;
+            if (mod.verCompare(3, 3) >= 0) {
+                snprintf(field, sizeof(field), ", \"source_size\": %u", header.sourceSize);
+                record += field;
+            }
+        }
+
+        PycRef<PycCode> code = mod.code();
+        PycRef<PycSequence> names = code->names();
+        std::string lists = ", \"names\": [";
+        for (int i = 0; i < names->size(); ++i) {
+            PycRef<PycString> name = names->get(i).cast<PycString>();
+            if (i != 0)
+                lists += ", ";
+            append_json_string(lists, name->data(), name->length());
+        }
+        lists += "], \"imports\": [";
+        std::vector<int> imported;
+        for (const auto& insn : code->instructions(&mod)) {
+            if (insn.opcode != Pyc::IMPORT_NAME_A || insn.operand >= names->size()
+                    || std::find(imported.begin(), imported.end(), insn.operand) != imported.end())
+                continue;
+            PycRef<PycString> name = names->get(insn.operand).cast<PycString>();
+            if (!imported.empty())
+                lists += ", ";
+            append_json_string(lists, name->data(), name->length());
+            imported.push_back(insn.operand);
+        }
+        lists += "]";
+        record += lists;
+    } catch (std::exception& ex) {
+        record += ", \"error\": ";
+        append_json_string(record, ex.what());
+        status = DECOMPILE_FAILED;
+    }
+    record += "}\n";
+    out_stream << record;
+    return status;
+}
+
+static DecompileStatus process_file(const InputFile& input, const DecompileOptions& options,
+                                    std::ostream& out_stream, ThreadPool* pool = nullptr,
+                                    PycStats* stats_out = nullptr,
+                                    std::vector<unsigned char>* image = nullptr)
+{
+    if (options.scan)
+        return scan_file(input, options, out_stream);
+    return decompile_file(input, options, out_stream, pool, stats_out, image);
+}
+
+static const char* const status_names[] = { "ok", "incomplete", BatchManifest::FAILED_STATUS };
+
+/* Shared state of one batch run.  Workers claim inputs through the atomic
+ * index into order; when writing to stdout, each file is decompiled into its
+ * own buffer and the finished buffers are flushed in input order.  When
+ * pipelined, the inputs are read ahead, in the same order, and the outputs
+ * are written by the writer.  With a pack, the outputs go there instead of
+ * to outdir. */
+struct BatchState {
+    const std::vector<InputFile>& inputs;
+    const DecompileOptions& options;
+    const char* outdir;
+    std::ostream& out;      // Unless there is an outdir
+    bool buffered;
+    BatchManifest* manifest;
+    OutputPack* pack;
+    ReadAhead* readAhead;
+    AsyncWriter* writer;
+
+    /* The inputs left to do, which is those the manifest doesn't list */
+    std::vector<size_t> order;
+    std::atomic<size_t> next;
+    std::vector<DecompileStatus> results;
+    std::vector<std::string> buffers;
+    std::vector<bool> done;
+    std::vector<char> writeFailed;  // By the writer, which can't touch results
+    size_t flushed;
+    std::mutex flush_lock;
+
+    BatchState(const std::vector<InputFile>& inputs_, const DecompileOptions& options_,
+               const char* outdir_, std::ostream& out_, bool buffered_,
+               BatchManifest* manifest_, OutputPack* pack_)
+        : inputs(inputs_), options(options_), outdir(outdir_), out(out_), buffered(buffered_),
+          manifest(manifest_), pack(pack_), readAhead(), writer(), next(0),
+          results(inputs_.size(), DECOMPILE_FAILED), buffers(inputs_.size()),
+          done(inputs_.size(), false), writeFailed(inputs_.size()), flushed(0) { }
+};
+
+/* What the manifest is told about an input */
+struct BatchRecord {
+    PycStats stats;
+    uint64_t wallNanos;
+    std::string outputHash;
+};
+
+/* Processes the input claimed in slot, keeping what the manifest needs to
+ * know about it in record, if given */
+static DecompileStatus batch_process(BatchState& state, size_t slot, std::ostream& out,
+                                     BatchRecord* record)
+{
+    const InputFile& input = state.inputs[state.order[slot]];
+    std::vector<unsigned char> image;
+    bool read_ahead = state.readAhead && state.readAhead->take(slot, image);
+    if (!record)
+        return process_file(input, state.options, out, nullptr, nullptr,
+                            read_ahead ? &image : nullptr);
+
+    HashingStreamBuf hashing(out.rdbuf());
+    std::ostream hashed_out(&hashing);
+    uint64_t start = PycStats::now();
+    DecompileStatus status = process_file(input, state.options, hashed_out, nullptr,
+                                          &record->stats, read_ahead ? &image : nullptr);
+    hashed_out.flush();
+    record->wallNanos = PycStats::now() - start;
+    record->outputHash = hashing.hex();
+    return status;
+}
+
+/* Once its output is written out */
+static void record_input(BatchState& state, size_t index, DecompileStatus status,
+                         const BatchRecord& record)
+{
+    state.manifest->record(state.inputs[index].path, status_names[status], record.wallNanos,
+                           record.outputHash, record.stats);
+}
+
+static bool open_output(const std::string& outpath, std::ofstream& out_file)
+{
+    if (make_parent_dirs(outpath))
+        out_file.open(outpath, std::ios_base::out);
+    if (out_file.fail()) {
+        fprintf(stderr, "Error opening file '%s' for writing\n", outpath.c_str());
+        return false;
+    }
+    return true;
+}
+
+static DecompileStatus batch_decompile(BatchState& state, size_t slot)
+{
+    size_t index = state.order[slot];
+    const InputFile& input = state.inputs[index];
+    std::shared_ptr<BatchRecord> record;
+    if (state.manifest)
+        record = std::make_shared<BatchRecord>();
+
+    if (state.pack) {
+        GzipStreamBuf gzip;
+        std::ostream gzip_out(&gzip);
+        DecompileStatus status = batch_process(state, slot, gzip_out, record.get());
+        gzip_out.flush();
+        uint64_t length = gzip.length();
+        auto member = std::make_shared<std::string>(gzip.finish());
+        auto append = [&state, index, status, member, length, record] {
+            bool written = state.pack->append(state.inputs[index].relpath, *member, length);
+            if (!written) {
+                fprintf(stderr, "Error writing %s to the pack\n", state.inputs[index].path.c_str());
+                state.writeFailed[index] = true;
+            }
+            if (record)
+                record_input(state, index, written ? status : DECOMPILE_FAILED, *record);
+        };
+        if (state.writer)
+            state.writer->submit(append);
+        else
+            append();
+        return status;
+    }
+
+    if (state.outdir && state.writer) {
+        std::ostringstream out_buf;
+        DecompileStatus status = batch_process(state, slot, out_buf, record.get());
+        auto text = std::make_shared<std::string>(out_buf.str());
+        std::string outpath = std::string(state.outdir) + PATHSEP + input.relpath;
+        state.writer->submit([&state, index, status, outpath, text, record] {
+            std::ofstream out_file;
+            bool written = open_output(outpath, out_file);
+            if (written)
+                out_file << *text;
+            if (!written)
+                state.writeFailed[index] = true;
+            if (record)
+                record_input(state, index, written ? status : DECOMPILE_FAILED, *record);
+        });
+        return status;
+    }
+
+    if (state.outdir) {
+        std::string outpath = std::string(state.outdir) + PATHSEP + input.relpath;
+        std::ofstream out_file;
+        if (!open_output(outpath, out_file))
+            return DECOMPILE_FAILED;
+        DecompileStatus status = batch_process(state, slot, out_file, record.get());
+        if (record)
+            record_input(state, index, status, *record);
+        return status;
+    }
+
+    DecompileStatus status;
+    if (!state.buffered) {
+        status = batch_process(state, slot, state.out, record.get());
+        state.out.flush();
+    } else {
+        std::ostringstream out_buf;
+        status = batch_process(state, slot, out_buf, record.get());
+        state.buffers[index] = out_buf.str();
+    }
+    if (record)
+        record_input(state, index, status, *record);
+    return status;
+}
+
+static void batch_worker(BatchState& state)
+{
+    for ( ;; ) {
+        size_t slot = state.next++;
+        if (slot >= state.order.size())
+            break;
+        size_t index = state.order[slot];
+        state.results[index] = batch_decompile(state, slot);
+
+        if (state.buffered) {
+            std::lock_guard<std::mutex> guard(state.flush_lock);
+            state.done[index] = true;
+            while (state.flushed < state.inputs.size() && state.done[state.flushed]) {
+                std::string& buf = state.buffers[state.flushed++];
+                if (state.writer) {
+                    auto text = std::make_shared<std::string>();
+                    text->swap(buf);
+                    state.writer->submit([&state, text] {
+                        state.out << *text;
+                        state.out.flush();
+                    });
+                } else {
+                    state.out << buf;
+                    std::string().swap(buf);
+                }
+            }
+            if (!state.writer)
+                state.out.flush();
+        }
+    }
+}
+
+static int run_batch(const std::vector<InputFile>& inputs, const DecompileOptions& options,
+                     const char* outdir, std::ostream& out, unsigned jobs,
+                     BatchManifest* manifest = nullptr, size_t read_ahead = 0,
+                     OutputPack* pack = nullptr)
+{
+    BatchState state(inputs, options, outdir, out, !outdir && !pack && jobs > 1, manifest,
+                     pack);
+    std::vector<bool> skipped(inputs.size(), false);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (manifest && manifest->isDone(inputs[i].path))
+            skipped[i] = state.done[i] = true;
+        else
+            state.order.push_back(i);
+    }
+
+    /* Without the output in input order to keep to, start on the largest
+     * inputs first, so none of them is left to hold up the end of the run */
+    if ((outdir || pack) && jobs > 1) {
+        std::vector<uint64_t> sizes(inputs.size());
+        for (size_t index : state.order)
+            sizes[index] = input_size(inputs[index]);
+        std::stable_sort(state.order.begin(), state.order.end(), [&](size_t a, size_t b) {
+            return sizes[a] > sizes[b];
+        });
+    }
+
+    std::unique_ptr<ReadAhead> reader;
+    std::unique_ptr<AsyncWriter> writer;
+    if (read_ahead && !options.scan) {
+        // Archive members are read from the archive, which is open already
+        std::vector<std::string> paths;
+        for (size_t index : state.order)
+            paths.push_back(inputs[index].archive ? std::string() : inputs[index].path);
+        reader.reset(new ReadAhead(std::move(paths), read_ahead,
+                                   (unsigned)std::min<size_t>(read_ahead, 4)));
+        writer.reset(new AsyncWriter(read_ahead));
+        state.readAhead = reader.get();
+        state.writer = writer.get();
+        state.buffered = !outdir && !pack;
+    }
+
+    if (jobs > state.order.size())
+        jobs = (unsigned)state.order.size();
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < jobs; ++i)
+        workers.emplace_back(batch_worker, std::ref(state));
+    batch_worker(state);
+    for (auto& worker : workers)
+        worker.join();
+    writer.reset();
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (state.writeFailed[i])
+            state.results[i] = DECOMPILE_FAILED;
+    }
+    const std::vector<DecompileStatus>& results = state.results;
+
+    // The records say which inputs failed already
+    if (options.scan)
+        return std::count(results.begin(), results.end(), DECOMPILE_FAILED) ? 1 : 0;
+
+    size_t counts[3] = { 0, 0, 0 };
+    fputs("\nSummary:\n", stderr);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (skipped[i])
+            continue;
+        ++counts[results[i]];
+        fprintf(stderr, "  %-10s  %s\n", status_names[results[i]], inputs[i].path.c_str());
+    }
+    fprintf(stderr, "%u file(s): %u ok, %u incomplete, %u failed",
+            (unsigned)state.order.size(), (unsigned)counts[DECOMPILE_OK],
+            (unsigned)counts[DECOMPILE_INCOMPLETE], (unsigned)counts[DECOMPILE_FAILED]);
+    if (manifest)
+        fprintf(stderr, ", %u done already", (unsigned)(inputs.size() - state.order.size()));
+    fputs("\n", stderr);
+
+    return counts[DECOMPILE_FAILED] ? 1 : 0;
+}
+
+/* What the resident cache of a --watch run holds at most */
+static const size_t WATCH_CACHE_LIMIT = (size_t)256 << 20;
+
+/* Decompiles the inputs, which are the .pyc files in roots, and then each
+ * one again whenever it changes, until watching fails.  The outputs of
+ * removed inputs are removed too.  The code objects printed before are
+ * kept in memory, so only the ones which changed are decompiled again. */
+static int run_watch(const std::vector<InputFile>& inputs, const std::vector<std::string>& roots,
+                     DecompileOptions options, const char* outdir, unsigned jobs)
+{
+    FileWatcher watcher;
+    for (const auto& root : roots) {
+        if (!watcher.watch(root))
+            return 1;
+    }
+    ResidentCache resident(WATCH_CACHE_LIMIT);
+    options.resident = &resident;
+    // Something else writes the inputs, and a mapped file which is cut short
+    // while it's being decompiled would raise SIGBUS
+    options.readInputs = true;
+    if (!inputs.empty())
+        run_batch(inputs, options, outdir, std::cout, jobs);
+
+    for ( ;; ) {
+        fputs("\nWatching for changes...\n", stderr);
+        std::vector<FileWatcher::Change> changes = watcher.wait();
+        if (changes.empty())
+            return 1;
+        std::vector<InputFile> changed;
+        for (const auto& change : changes) {
+            InputFile input = tree_input(change.root, change.relname);
+            if (!change.removed) {
+                changed.push_back(std::move(input));
+                continue;
+            }
+            std::string outpath = std::string(outdir) + PATHSEP + input.relpath;
+            if (remove(outpath.c_str()) == 0)
+                fprintf(stderr, "Removed %s\n", outpath.c_str());
+        }
+        if (!changed.empty())
+            run_batch(changed, options, outdir, std::cout, jobs);
+    }
+}
+
 int main(int argc, char* argv[])
 {
-    const char* infile = nullptr;
-    bool marshalled = false;
+    std::vector<InputFile> inputs;
+    bool batch = false;
+    const char* outname = nullptr;
     const char* version = nullptr;
-    std::ostream* pyc_output = &std::cout;
-    std::ofstream out_file;
+    unsigned jobs = 1;
+    bool server = false;
+    const char* socket_path = nullptr;
+    unsigned shard = 0, shard_count = 0;
+    const char* manifest_path = nullptr;
+    size_t read_ahead = 0;
+    bool pack = false;
+    bool watch = false;
+    std::vector<std::string> directories;
+    bool other_inputs = false;
+    DecompileOptions options;
+#ifdef OPCODE_PROFILE
+    ProfileReport profile;
+#endif
 
     for (int arg = 1; arg < argc; ++arg) {
         if (strcmp(argv[arg], "-o") == 0) {
             if (arg + 1 < argc) {
-                const char* filename = argv[++arg];
-                out_file.open(filename, std::ios_base::out);
-                if (out_file.fail()) {
-                    fprintf(stderr, "Error opening file '%s' for writing\n",
-                            filename);
-                    return 1;
-                }
-                pyc_output = &out_file;
+                outname = argv[++arg];
             } else {
                 fputs("Option '-o' requires a filename\n", stderr);
                 return 1;
             }
         } else if (strcmp(argv[arg], "-c") == 0) {
-            marshalled = true;
+            options.marshalled = true;
         } else if (strcmp(argv[arg], "-v") == 0) {
             if (arg + 1 < argc) {
                 version = argv[++arg];
@@ -41,33 +729,314 @@ int main(int argc, char* argv[])
                 fputs("Option '-v' requires a version\n", stderr);
                 return 1;
             }
+        } else if (strcmp(argv[arg], "-j") == 0) {
+            if (arg + 1 < argc) {
+                int count = atoi(argv[++arg]);
+                if (count <= 0) {
+                    jobs = std::thread::hardware_concurrency();
+                    if (jobs == 0)
+                        jobs = 1;
+                } else {
+                    jobs = (unsigned)count;
+                }
+            } else {
+                fputs("Option '-j' requires a thread count\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "-l") == 0 || strcmp(argv[arg], "--list") == 0) {
+            if (arg + 1 < argc) {
+                if (!read_list_file(argv[++arg], inputs))
+                    return 1;
+                batch = true;
+                other_inputs = true;
+            } else {
+                fprintf(stderr, "Option '%s' requires a filename\n", argv[arg]);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--shard") == 0) {
+            unsigned index, count;
+            char extra;
+            if (arg + 1 >= argc || sscanf(argv[arg + 1], "%u/%u%c", &index, &count, &extra) != 2
+                    || index >= count) {
+                fputs("Option '--shard' requires a shard like 0/4 (the first of four)\n", stderr);
+                return 1;
+            }
+            shard = index;
+            shard_count = count;
+            ++arg;
+        } else if (strcmp(argv[arg], "--manifest") == 0) {
+            if (arg + 1 < argc) {
+                manifest_path = argv[++arg];
+            } else {
+                fputs("Option '--manifest' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--pack") == 0) {
+            pack = true;
+        } else if (strcmp(argv[arg], "--watch") == 0) {
+            watch = true;
+        } else if (strcmp(argv[arg], "--read-ahead") == 0) {
+            char* end = nullptr;
+            long value = (arg + 1 < argc) ? strtol(argv[arg + 1], &end, 10) : -1;
+            if (arg + 1 >= argc || *end != '\0' || value < 0) {
+                fputs("Option '--read-ahead' requires a count\n", stderr);
+                return 1;
+            }
+            read_ahead = (size_t)value;
+            ++arg;
+        } else if (strcmp(argv[arg], "--only") == 0) {
+            if (arg + 1 < argc) {
+                options.only = argv[++arg];
+            } else {
+                fputs("Option '--only' requires a qualified name\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--cache") == 0) {
+            if (arg + 1 < argc) {
+                options.cacheDir = argv[++arg];
+            } else {
+                fputs("Option '--cache' requires a directory\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--diff") == 0) {
+            if (arg + 1 < argc) {
+                options.diffAgainst = argv[++arg];
+            } else {
+                fputs("Option '--diff' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--source-map") == 0) {
+            if (arg + 1 < argc) {
+                options.sourceMap = argv[++arg];
+            } else {
+                fputs("Option '--source-map' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--stream") == 0) {
+            options.stream = true;
+        } else if (strcmp(argv[arg], "--low-memory") == 0) {
+            options.lowMemory = true;
+        } else if (strcmp(argv[arg], "--line-markers") == 0) {
+            options.lineMarkers = true;
+        } else if (strcmp(argv[arg], "--scan") == 0) {
+            options.scan = true;
+        } else if (strcmp(argv[arg], "--dedup") == 0) {
+            options.dedup = true;
+        } else if (strcmp(argv[arg], "--wrap-literals") == 0) {
+            char* end = nullptr;
+            long value = (arg + 1 < argc) ? strtol(argv[arg + 1], &end, 10) : -1;
+            if (arg + 1 >= argc || *end != '\0' || value < 0) {
+                fputs("Option '--wrap-literals' requires a width\n", stderr);
+                return 1;
+            }
+            options.literalWidth = (size_t)value;
+            ++arg;
+        } else if (strcmp(argv[arg], "--max-steps") == 0
+                || strcmp(argv[arg], "--max-build-ms") == 0) {
+            char* end = nullptr;
+            long value = (arg + 1 < argc) ? strtol(argv[arg + 1], &end, 10) : -1;
+            if (arg + 1 >= argc || *end != '\0' || value < 0) {
+                fprintf(stderr, "Option '%s' requires a count\n", argv[arg]);
+                return 1;
+            }
+            if (strcmp(argv[arg], "--max-steps") == 0)
+                options.budget.steps = (unsigned long)value;
+            else
+                options.budget.millis = (unsigned long)value;
+            ++arg;
+        } else if (strcmp(argv[arg], "--max-memory") == 0) {
+            char* end = nullptr;
+            long value = (arg + 1 < argc) ? strtol(argv[arg + 1], &end, 10) : -1;
+            if (arg + 1 >= argc || *end != '\0' || value < 0) {
+                fputs("Option '--max-memory' requires a size in MiB\n", stderr);
+                return 1;
+            }
+            options.maxMemory = (uint64_t)value << 20;
+            ++arg;
+        } else if (strcmp(argv[arg], "--server") == 0) {
+            server = true;
+#ifdef PYC_HAVE_UNIX_SOCKETS
+        } else if (strcmp(argv[arg], "--listen") == 0) {
+            if (arg + 1 < argc) {
+                socket_path = argv[++arg];
+                server = true;
+            } else {
+                fputs("Option '--listen' requires a socket path\n", stderr);
+                return 1;
+            }
+#endif
+#ifdef OPCODE_PROFILE
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            if (arg + 1 < argc) {
+                profile.setFilename(argv[++arg]);
+            } else {
+                fputs("Option '--profile' requires a filename\n", stderr);
+                return 1;
+            }
+#endif
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            options.stats = true;
         } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
-            fprintf(stderr, "Usage:  %s [options] input.pyc\n\n", argv[0]);
+            fprintf(stderr, "Usage:  %s [options] input.pyc [input2.pyc | directory ...]\n\n", argv[0]);
             fputs("Options:\n", stderr);
             fputs("  -o <filename>  Write output to <filename> (default: stdout)\n", stderr);
+            fputs("                 With multiple inputs, this is a directory which will\n", stderr);
+            fputs("                 receive one .py file per input, mirroring the input tree\n", stderr);
             fputs("  -c             Specify loading a compiled code object. Requires the version to be set\n", stderr);
             fputs("  -v <x.y>       Specify a Python version for loading a compiled code object\n", stderr);
+            fputs("  -l <filename>  Read additional input paths from <filename>, one per line\n", stderr);
+            fputs("                 (use '-' to read them from stdin)\n", stderr);
+            fputs("  -j <count>     Decompile up to <count> files in parallel (0: one per CPU)\n", stderr);
+            fputs("                 For a single input, its functions and classes are\n", stderr);
+            fputs("                 processed in parallel instead\n", stderr);
+            fputs("  --shard <i/N>  Only process the inputs in shard i (from 0) of N, split up\n", stderr);
+            fputs("                 by a hash of their paths relative to the input tree\n", stderr);
+            fputs("  --manifest <filename>\n", stderr);
+            fputs("                 Append a line of JSON to <filename> for each input which\n", stderr);
+            fputs("                 is done, with its status, times and a hash of its output,\n", stderr);
+            fputs("                 and skip the inputs it lists already, to resume a run.\n", stderr);
+            fputs("                 Inputs which failed are tried again\n", stderr);
+            fputs("  --pack         Append the outputs of multiple inputs to the one file named\n", stderr);
+            fputs("                 by -o, as a gzip member each, listed in <filename>.index\n", stderr);
+            fputs("                 (see OutputPack.h)\n", stderr);
+            fputs("  --watch        Keep running after decompiling the directories given, and\n", stderr);
+            fputs("                 decompile each .pyc file in them again whenever it's\n", stderr);
+            fputs("                 written, into the -o directory.  Functions and classes\n", stderr);
+            fputs("                 which didn't change are printed from memory\n", stderr);
+            fputs("  --read-ahead <count>\n", stderr);
+            fputs("                 With multiple inputs, read up to <count> of them ahead of\n", stderr);
+            fputs("                 decompiling them, and write the outputs on a thread of\n", stderr);
+            fputs("                 their own, so slow storage doesn't hold up the workers\n", stderr);
+            fputs("  --only <name>  Only decompile the function or class with the qualified\n", stderr);
+            fputs("                 name <name> (e.g. Class.method), without loading the\n", stderr);
+            fputs("                 rest of the file's code objects\n", stderr);
+            fputs("  --cache <dir>  Reuse the source printed for functions and classes which\n", stderr);
+            fputs("                 are unchanged since an earlier run, which stored it in\n", stderr);
+            fputs("                 <dir>.  Clear it after upgrading pycdc\n", stderr);
+            fputs("  --diff <old.pyc>\n", stderr);
+            fputs("                 Compare the input with an older version of it, list the\n", stderr);
+            fputs("                 functions and classes which changed, were added or were\n", stderr);
+            fputs("                 removed, and print '...' for the bodies of the others\n", stderr);
+            fputs("  --stream       Write out each top-level statement as soon as it's\n", stderr);
+            fputs("                 decompiled, instead of after the whole module\n", stderr);
+            fputs("  --low-memory   Keep as little of the input in memory as possible, by\n", stderr);
+            fputs("                 loading each code object when it's needed and freeing it\n", stderr);
+            fputs("                 once printed.  Implies --stream, and ignores -j for a\n", stderr);
+            fputs("                 single input\n", stderr);
+            fputs("  --line-markers Put a '# line N' comment with the original source line\n", stderr);
+            fputs("                 ahead of each statement\n", stderr);
+            fputs("  --source-map <filename>\n", stderr);
+            fputs("                 Write where each statement came from, its code object and\n", stderr);
+            fputs("                 range of bytecode offsets, to <filename> (see SourceMap.h)\n", stderr);
+            fputs("  --dedup        Share identical strings, tuples and code objects while\n", stderr);
+            fputs("                 loading, and decompile each duplicated function or class\n", stderr);
+            fputs("                 once.  Pays off for generated code, which repeats them\n", stderr);
+            fputs("  --wrap-literals <width>\n", stderr);
+            fputs("                 Split string and bytes literals into pieces of at most\n", stderr);
+            fputs("                 <width> characters, concatenated across lines\n", stderr);
+            fputs("  --max-steps <count>\n", stderr);
+            fputs("                 Give up on decompiling a function, class or module body\n", stderr);
+            fputs("                 after this many steps, and print its disassembly instead\n", stderr);
+            fputs("  --max-build-ms <ms>\n", stderr);
+            fputs("                 The same, after this many milliseconds.  Both bound the\n", stderr);
+            fputs("                 time a malformed file can take (default: no limit)\n", stderr);
+            fputs("  --max-memory <MiB>\n", stderr);
+            fputs("                 Bound the memory the objects loaded from each input and\n", stderr);
+            fputs("                 the ASTs built from them can take: the function, class or\n", stderr);
+            fputs("                 module body being built when it runs out is printed as its\n", stderr);
+            fputs("                 disassembly, and an input which doesn't load within it\n", stderr);
+            fputs("                 fails.  With --low-memory, only the ASTs count\n", stderr);
+            fputs("  --scan         Instead of decompiling, write a line of JSON for each input\n", stderr);
+            fputs("                 with its version, header fields, and the names and imports\n", stderr);
+            fputs("                 of its top-level code.  -o names the one file they go to\n", stderr);
+            fputs("  --server       Serve requests read from stdin instead of decompiling inputs;\n", stderr);
+            fputs("                 see DecompileServer.h for the protocol.  -j sets the\n", stderr);
+            fputs("                 number of requests handled at once\n", stderr);
+#ifdef PYC_HAVE_UNIX_SOCKETS
+            fputs("  --listen <path> Serve requests on a Unix socket created at <path>\n", stderr);
+#endif
+#ifdef OPCODE_PROFILE
+            fputs("  --profile <filename>\n", stderr);
+            fputs("                 Write the counts and times of each opcode and node type\n", stderr);
+            fputs("                 over all inputs to <filename>, slowest first\n", stderr);
+#endif
+            fputs("  --stats        Report timings and counters for each input as a line of\n", stderr);
+            fputs("                 JSON on stderr\n", stderr);
             fputs("  --help         Show this help text and then exit\n", stderr);
+            fputs("\nDirectories given as inputs are searched recursively for .pyc files.\n", stderr);
+            fputs("The compiled modules in zip files (including .whl and .egg files) and\n", stderr);
+            fputs("PyInstaller executables or PYZ archives are read without extracting them.\n", stderr);
             return 0;
         } else {
-            infile = argv[arg];
+            if (is_directory(argv[arg])) {
+                batch = true;
+                directories.push_back(argv[arg]);
+            } else {
+                other_inputs = true;
+            }
+            add_input(argv[arg], inputs);
         }
     }
 
-    if (!infile) {
-        fputs("No input file specified\n", stderr);
+    if (server) {
+        if (!inputs.empty() || options.marshalled || options.only || outname) {
+            fputs("Server mode takes its inputs from requests only\n", stderr);
+            return 1;
+        }
+        DecompileServer decompile_server(jobs, options.cacheDir);
+#ifdef PYC_HAVE_UNIX_SOCKETS
+        if (socket_path)
+            return decompile_server.listen(socket_path) ? 0 : 1;
+#endif
+#ifdef WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        return decompile_server.serve(stdin, stdout) ? 0 : 1;
+    }
+
+    if (watch && (directories.empty() || other_inputs || !outname || options.scan || pack
+                  || manifest_path || shard_count || options.only || options.diffAgainst
+                  || options.sourceMap)) {
+        fputs("Option '--watch' takes directories and -o, without --scan, --pack,\n"
+              "--manifest, --shard, --only, --diff or --source-map\n", stderr);
+        return 1;
+    }
+    if (inputs.empty() && !watch) {
+        fputs(batch ? "No input files found\n" : "No input file specified\n", stderr);
+        return 1;
+    }
+    if (inputs.size() > 1 || shard_count || manifest_path || pack)
+        batch = true;
+    if (pack && (!outname || options.scan)) {
+        fputs("Option '--pack' requires -o, and doesn't apply to --scan\n", stderr);
+        return 1;
+    }
+    if (pack && !OutputPack::canCompress()) {
+        fputs("Option '--pack' is not supported in this build (it requires zlib)\n", stderr);
+        return 1;
+    }
+    if (manifest_path && options.scan) {
+        fputs("Option '--manifest' doesn't apply to --scan\n", stderr);
+        return 1;
+    }
+    if (shard_count) {
+        inputs.erase(std::remove_if(inputs.begin(), inputs.end(), [&](const InputFile& input) {
+            return shard_of(input.relpath, shard_count) != shard;
+        }), inputs.end());
+    }
+    if (options.diffAgainst && (batch || options.only || options.scan)) {
+        fputs("Option '--diff' takes a single input, without --only or --scan\n", stderr);
+        return 1;
+    }
+    if (options.sourceMap && (batch || options.only || options.scan || options.diffAgainst
+                              || options.lineMarkers)) {
+        fputs("Option '--source-map' takes a single input, without --only, --scan, --diff\n"
+              "or --line-markers\n", stderr);
         return 1;
     }
 
-    PycModule mod;
-    if (!marshalled) {
-        try {
-            mod.loadFromFile(infile);
-        } catch (std::exception& ex) {
-            fprintf(stderr, "Error loading file %s: %s\n", infile, ex.what());
-            return 1;
-        }
-    } else {
+    if (options.marshalled) {
         if (!version) {
             fputs("Opening raw code objects requires a version to be specified\n", stderr);
             return 1;
@@ -78,27 +1047,43 @@ int main(int argc, char* argv[])
             fputs("Unable to parse version string (use the format x.y)\n", stderr);
             return 1;
         }
-        int major = std::stoi(s.substr(0, dot));
-        int minor = std::stoi(s.substr(dot+1, s.size()));
-        mod.loadFromMarshalledFile(infile, major, minor);
+        options.major = std::stoi(s.substr(0, dot));
+        options.minor = std::stoi(s.substr(dot+1, s.size()));
     }
 
-    if (!mod.isValid()) {
-        fprintf(stderr, "Could not load file %s\n", infile);
-        return 1;
+    if (watch)
+        return run_watch(inputs, directories, options, outname, jobs);
+
+    if (batch && !options.scan) {
+        BatchManifest manifest;
+        if (manifest_path && !manifest.open(manifest_path))
+            return 1;
+        OutputPack output_pack;
+        if (pack && !output_pack.open(outname))
+            return 1;
+        return run_batch(inputs, options, pack ? nullptr : outname, std::cout, jobs,
+                         manifest_path ? &manifest : nullptr, read_ahead,
+                         pack ? &output_pack : nullptr);
     }
-    const char* dispname = strrchr(infile, PATHSEP);
-    dispname = (dispname == NULL) ? infile : dispname + 1;
-    *pyc_output << "# Source Generated with Decompyle++\n";
-    formatted_print(*pyc_output, "# File: %s (Python %d.%d%s)\n\n", dispname,
-                    mod.majorVer(), mod.minorVer(),
-                    (mod.majorVer() < 3 && mod.isUnicode()) ? " Unicode" : "");
-    try {
-        decompyle(mod.code(), &mod, *pyc_output);
-    } catch (std::exception& ex) {
-        fprintf(stderr, "Error decompyling %s: %s\n", infile, ex.what());
-        return 1;
+
+    std::ostream* pyc_output = &std::cout;
+    std::ofstream out_file;
+    if (outname) {
+        out_file.open(outname, std::ios_base::out);
+        if (out_file.fail()) {
+            fprintf(stderr, "Error opening file '%s' for writing\n", outname);
+            return 1;
+        }
+        pyc_output = &out_file;
     }
+    if (options.scan)
+        return run_batch(inputs, options, nullptr, *pyc_output, jobs);
+
+    // With a single input, spend the threads on its nested code objects
+    std::unique_ptr<ThreadPool> pool;
+    if (jobs > 1 && !options.lowMemory)
+        pool.reset(new ThreadPool(jobs));
 
-    return 0;
+    DecompileStatus status = process_file(inputs[0], options, *pyc_output, pool.get());
+    return status == DECOMPILE_FAILED ? 1 : 0;
 }
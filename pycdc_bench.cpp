@@ -0,0 +1,238 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "ASTree.h"
+#include "InputFiles.h"
+
+/* Every allocation made by this process is counted, so the numbers include
+ * the standard library's.  The benchmark is single threaded; the counters
+ * don't need to be atomic. */
+static size_t alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+// GCC takes the free() calls below for a mismatch with operator new
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#  pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size)
+{
+    ++alloc_count;
+    alloc_bytes += size;
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+enum BenchPhase { PHASE_LOAD, PHASE_BUILD, PHASE_PRINT, NUM_PHASES };
+
+struct PhaseStats {
+    PhaseStats() : seconds(), allocs(), alloc_bytes() { }
+
+    double seconds;
+    size_t allocs;
+    size_t alloc_bytes;
+};
+
+/* Measures one phase from construction until destruction */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(PhaseStats& stats)
+        : m_stats(stats), m_allocs(alloc_count), m_bytes(alloc_bytes),
+          m_start(bench_clock::now()) { }
+
+    ~PhaseTimer()
+    {
+        std::chrono::duration<double> elapsed = bench_clock::now() - m_start;
+        m_stats.seconds += elapsed.count();
+        m_stats.allocs += alloc_count - m_allocs;
+        m_stats.alloc_bytes += alloc_bytes - m_bytes;
+    }
+
+private:
+    PhaseStats& m_stats;
+    size_t m_allocs;
+    size_t m_bytes;
+    bench_clock::time_point m_start;
+};
+
+static size_t file_size(const std::string& path)
+{
+    std::ifstream in(path, std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+    return in ? (size_t)in.tellg() : 0;
+}
+
+static size_t count_instructions(PycCode* code, PycModule* mod)
+{
+    size_t count = code->instructions(mod).size();
+    const auto& consts = code->consts();
+    for (int i = 0; i < consts->size(); ++i) {
+        if (PycCode* child = consts->get(i).try_cast<PycCode>())
+            count += count_instructions(child, mod);
+    }
+    return count;
+}
+
+/* Runs all three phases on one file.  The module and the prebuilt ASTs are
+ * torn down outside of the timed sections. */
+static bool bench_file(const char* path, PhaseStats stats[], size_t& insns,
+                       size_t& output_bytes)
+{
+    std::unique_ptr<PycModule> mod(new PycModule);
+    try {
+        {
+            PhaseTimer timer(stats[PHASE_LOAD]);
+            mod->useArena();
+            mod->loadFromFile(path);
+        }
+        if (!mod->isValid())
+            return false;
+
+        std::unique_ptr<NestedBuilds> builds;
+        {
+            PhaseTimer timer(stats[PHASE_BUILD]);
+            builds.reset(new NestedBuilds(mod->code(), mod.get(), DecompileSettings()));
+        }
+        insns = count_instructions(mod->code(), mod.get());
+
+        PycOutput out;
+        {
+            PhaseTimer timer(stats[PHASE_PRINT]);
+            DecompileContext ctx;
+            ctx.nestedBuilds = builds.get();
+            decompyle(mod->code(), mod.get(), out, ctx);
+        }
+        output_bytes = out.bytesWritten();
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error benchmarking %s: %s\n", path, ex.what());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<InputFile> inputs;
+    int iterations = 10;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-n") == 0) {
+            if (arg + 1 < argc) {
+                iterations = atoi(argv[++arg]);
+                if (iterations <= 0) {
+                    fputs("The iteration count must be positive\n", stderr);
+                    return 1;
+                }
+            } else {
+                fputs("Option '-n' requires an iteration count\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "-l") == 0 || strcmp(argv[arg], "--list") == 0) {
+            if (arg + 1 < argc) {
+                if (!read_list_file(argv[++arg], inputs))
+                    return 1;
+            } else {
+                fprintf(stderr, "Option '%s' requires a filename\n", argv[arg]);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "Usage:  %s [options] input.pyc [input2.pyc | directory ...]\n\n", argv[0]);
+            fputs("Times loading, AST building and printing of each input separately.\n\n", stderr);
+            fputs("Options:\n", stderr);
+            fputs("  -n <count>     Process every input <count> times (default: 10)\n", stderr);
+            fputs("  -l <filename>  Read additional input paths from <filename>, one per line\n", stderr);
+            fputs("                 (use '-' to read them from stdin)\n", stderr);
+            fputs("  --help         Show this help text and then exit\n", stderr);
+            return 0;
+        } else if (argv[arg][0] == '-' && argv[arg][1] != '\0') {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        } else {
+            add_input(argv[arg], inputs);
+        }
+    }
+
+    if (inputs.empty()) {
+        fputs("No input file specified\n", stderr);
+        return 1;
+    }
+
+    // Files which fail once are left out of all further iterations, so every
+    // iteration measures the same work
+    std::vector<bool> usable(inputs.size(), true);
+    PhaseStats stats[NUM_PHASES];
+    size_t files = 0, input_bytes = 0, insns = 0, output_bytes = 0;
+    for (int iter = 0; iter < iterations; ++iter) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (!usable[i])
+                continue;
+            size_t file_insns = 0, file_output = 0;
+            if (!bench_file(inputs[i].path.c_str(), stats, file_insns, file_output)) {
+                fprintf(stderr, "Skipping %s\n", inputs[i].path.c_str());
+                usable[i] = false;
+                continue;
+            }
+            ++files;
+            input_bytes += file_size(inputs[i].path);
+            insns += file_insns;
+            output_bytes += file_output;
+        }
+    }
+
+    printf("%u file(s) x %d iteration(s): %.2f MB in, %u instructions, %.2f MB out\n\n",
+           (unsigned)(files / iterations), iterations, input_bytes / 1e6 / iterations,
+           (unsigned)(insns / iterations), output_bytes / 1e6 / iterations);
+    printf("%-8s %12s %10s %12s %14s %14s\n", "phase", "total ms", "MB/s",
+           "Minsn/s", "allocs/iter", "KB alloc/iter");
+
+    static const char* phase_names[] = { "load", "build", "print" };
+    PhaseStats total;
+    for (int phase = 0; phase <= NUM_PHASES; ++phase) {
+        const PhaseStats& ps = phase < NUM_PHASES ? stats[phase] : total;
+        if (phase < NUM_PHASES) {
+            total.seconds += ps.seconds;
+            total.allocs += ps.allocs;
+            total.alloc_bytes += ps.alloc_bytes;
+        }
+        double seconds = ps.seconds > 0 ? ps.seconds : 1e-9;
+        printf("%-8s %12.2f %10.2f %12.2f %14.0f %14.1f\n",
+               phase < NUM_PHASES ? phase_names[phase] : "total",
+               ps.seconds * 1e3, input_bytes / 1e6 / seconds, insns / 1e6 / seconds,
+               (double)ps.allocs / iterations, ps.alloc_bytes / 1e3 / iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "ASTree.h"
+#include "InputFiles.h"
+
+/* Loads a .pyc image and decompiles it to nowhere.  The budget keeps an
+ * input which makes BuildFromCode go round in circles from counting as a
+ * timeout; it's what a batch run would want to give up on as well. */
+static void decompile_input(const uint8_t* data, size_t size)
+{
+    PycModule mod;
+    mod.useArena();
+    try {
+        mod.loadFromBuffer(data, size);
+        if (!mod.isValid())
+            return;
+        DecompileSettings settings;
+        settings.budget.steps = 200000;
+        settings.budget.millis = 1000;
+        PycOutput out;
+        decompyle(mod.code(), &mod, out, settings);
+    } catch (std::exception&) {
+        // Rejecting bad input is what's expected of it
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    decompile_input(data, size);
+    return 0;
+}
+
+#ifndef PYC_LIBFUZZER
+
+typedef std::chrono::steady_clock fuzz_clock;
+
+/* Without libFuzzer, the inputs are replayed, e.g. to check a corpus or a
+ * crash it found, and to see how many of them can be run per second */
+int main(int argc, char* argv[])
+{
+    std::vector<InputFile> inputs;
+    int iterations = 1;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-n") == 0) {
+            if (arg + 1 < argc) {
+                iterations = atoi(argv[++arg]);
+                if (iterations <= 0) {
+                    fputs("The iteration count must be positive\n", stderr);
+                    return 1;
+                }
+            } else {
+                fputs("Option '-n' requires an iteration count\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "Usage:  %s [options] input [input2 | directory ...]\n\n", argv[0]);
+            fputs("Loads and decompiles every input, and reports the exec/s and the slowest\n", stderr);
+            fputs("input.  Built with -DENABLE_FUZZING=ON, this is a libFuzzer target\n", stderr);
+            fputs("instead, which takes libFuzzer's options.\n\n", stderr);
+            fputs("Options:\n", stderr);
+            fputs("  -n <count>     Run every input <count> times (default: 1)\n", stderr);
+            fputs("  --help         Show this help text and then exit\n", stderr);
+            return 0;
+        } else if (argv[arg][0] == '-' && argv[arg][1] != '\0') {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        } else {
+            add_input(argv[arg], inputs);
+        }
+    }
+
+    if (inputs.empty()) {
+        fputs("No input file specified\n", stderr);
+        return 1;
+    }
+
+    // Read them all up front, so only decompiling is timed
+    std::vector<std::vector<uint8_t>> images;
+    for (const auto& input : inputs) {
+        if (input.archive) {
+            try {
+                images.push_back(input.archive->read(input.member));
+            } catch (std::exception& ex) {
+                fprintf(stderr, "Error reading %s: %s\n", input.path.c_str(), ex.what());
+                return 1;
+            }
+            continue;
+        }
+        std::ifstream in(input.path, std::ios_base::in | std::ios_base::binary);
+        if (!in) {
+            fprintf(stderr, "Error opening file %s\n", input.path.c_str());
+            return 1;
+        }
+        images.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    double total = 0, slowest = 0;
+    size_t slowest_input = 0;
+    for (int iter = 0; iter < iterations; ++iter) {
+        for (size_t i = 0; i < images.size(); ++i) {
+            auto start = fuzz_clock::now();
+            LLVMFuzzerTestOneInput(images[i].data(), images[i].size());
+            std::chrono::duration<double> elapsed = fuzz_clock::now() - start;
+            total += elapsed.count();
+            if (elapsed.count() > slowest) {
+                slowest = elapsed.count();
+                slowest_input = i;
+            }
+        }
+    }
+
+    size_t execs = images.size() * (size_t)iterations;
+    printf("%u exec(s) in %.2f s: %.1f exec/s, slowest %.2f ms (%s)\n",
+           (unsigned)execs, total, execs / (total > 0 ? total : 1e-9), slowest * 1e3,
+           inputs[slowest_input].path.c_str());
+    return 0;
+}
+
+#endif
@@ -0,0 +1,491 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Decompiler.h"
+#include "InputFiles.h"
+#include "TokenDump.h"
+
+#ifdef WIN32
+#  include <io.h>
+#  define dup _dup
+#  define dup2 _dup2
+#  define fileno _fileno
+#else
+#  include <unistd.h>
+#endif
+
+/* The corpus test run of tests/run_tests.py, in one process: every module
+ * in tests/compiled and tests/xfail is decompiled on a pool of threads,
+ * and its tokens (see TokenDump.h) are compared with tests/tokenized.
+ * Anything written to stderr fails a test too, as it does there.  The
+ * time each module takes is measured as well, and compared with a
+ * baseline written by an earlier run, if given. */
+
+typedef std::chrono::steady_clock test_clock;
+
+/* A time a module takes which is this much over its baseline, and over it
+ * by more than the tolerance, counts as slower */
+static const double SLOWER_MIN_MS = 0.5;
+
+struct TestFile {
+    std::string test;       // The name of its tokenized/*.txt
+    std::string name;       // e.g. "compiled/async_for.3.5.pyc"
+    std::string path;
+    bool xfail;
+
+    bool passed;
+    std::string failure;    // Why it didn't pass
+    std::string output;     // The source it was decompiled to
+    std::string tokens;     // And its tokens
+    double millis;          // The fastest of the runs
+};
+
+struct TestRun {
+    std::vector<TestFile>& files;
+    const std::map<std::string, std::string>& expected;
+    int repeat;
+    std::atomic<size_t> next;
+
+    TestRun(std::vector<TestFile>& files_, const std::map<std::string, std::string>& expected_,
+            int repeat_)
+        : files(files_), expected(expected_), repeat(repeat_), next(0) { }
+};
+
+/* Points stderr at a temporary file for as long as it exists, to tell
+ * which tests wrote to it */
+class StderrCapture {
+public:
+    StderrCapture() : m_file(tmpfile()), m_saved(-1), m_read(0)
+    {
+        fflush(stderr);
+        if (m_file) {
+            m_saved = dup(fileno(stderr));
+            dup2(fileno(m_file), fileno(stderr));
+        }
+    }
+
+    ~StderrCapture()
+    {
+        fflush(stderr);
+        if (m_saved >= 0) {
+            dup2(m_saved, fileno(stderr));
+            close(m_saved);
+        }
+        if (m_file)
+            fclose(m_file);
+    }
+
+    StderrCapture(const StderrCapture&) = delete;
+    StderrCapture& operator=(const StderrCapture&) = delete;
+
+    bool ok() const { return m_saved >= 0; }
+
+    /* What was written since the last call */
+    std::string take()
+    {
+        fflush(stderr);
+        if (!m_file)
+            return std::string();
+        fseek(m_file, 0, SEEK_END);
+        long end = ftell(m_file);
+        std::string text;
+        if (end > m_read) {
+            text.resize((size_t)(end - m_read));
+            fseek(m_file, m_read, SEEK_SET);
+            text.resize(fread(&text[0], 1, text.size(), m_file));
+            fseek(m_file, 0, SEEK_END);
+            m_read = end;
+        }
+        return text;
+    }
+
+private:
+    FILE* m_file;
+    int m_saved;
+    long m_read;
+};
+
+static bool read_file(const std::string& path, std::string& data)
+{
+    std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+    if (!in)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+/* The first line where the tokens differ from the expected ones */
+static std::string describe_mismatch(const std::string& expected, const std::string& tokens)
+{
+    std::istringstream want(expected), got(tokens);
+    std::string want_line, got_line;
+    for (int line = 1; ; ++line) {
+        bool have_want = (bool)std::getline(want, want_line);
+        bool have_got = (bool)std::getline(got, got_line);
+        if (!have_want && !have_got)
+            return "Tokenized output does not match expected output\n";
+        if (have_want != have_got || want_line != got_line) {
+            return "Tokenized output does not match expected output at line "
+                    + std::to_string(line) + ":\n- " + (have_want ? want_line : "(end)")
+                    + "\n+ " + (have_got ? got_line : "(end)") + "\n";
+        }
+    }
+}
+
+/* Decompiles the file repeat times, keeping the fastest time, and compares
+ * its tokens with the expected ones */
+static void run_test(TestFile& file, const std::map<std::string, std::string>& expected,
+                     int repeat)
+{
+    file.passed = false;
+    file.millis = 0;
+    std::string image;
+    if (!read_file(file.path, image)) {
+        file.failure = "Error opening file " + file.path + "\n";
+        return;
+    }
+
+    const char* dispname = strrchr(file.path.c_str(), PATHSEP);
+    dispname = dispname ? dispname + 1 : file.path.c_str();
+    for (int run = 0; run < repeat; ++run) {
+        std::ostringstream source;
+        std::string error;
+        auto start = test_clock::now();
+        DecompileStatus status;
+        {
+            PycOutput out(source);
+            status = decompile_pyc(image.data(), image.size(), dispname, 0, out, &error);
+        }
+        std::chrono::duration<double, std::milli> elapsed = test_clock::now() - start;
+        if (run == 0 || elapsed.count() < file.millis)
+            file.millis = elapsed.count();
+        if (status == DECOMPILE_FAILED) {
+            file.failure = "Error decompyling " + file.path + ": " + error + "\n";
+            return;
+        }
+        if (run == 0)
+            file.output = source.str();
+    }
+
+    try {
+        file.tokens = token_dump(file.output);
+    } catch (std::exception& ex) {
+        file.failure = std::string("Error tokenizing the output: ") + ex.what() + "\n";
+        return;
+    }
+    if (file.tokens != expected.at(file.test)) {
+        file.failure = describe_mismatch(expected.at(file.test), file.tokens);
+        return;
+    }
+    file.passed = true;
+}
+
+static void test_worker(TestRun& run)
+{
+    for ( ;; ) {
+        size_t index = run.next++;
+        if (index >= run.files.size())
+            break;
+        run_test(run.files[index], run.expected, run.repeat);
+    }
+}
+
+/* The file a test module was decompiled to and what it was tokenized to,
+ * next to where run_tests.py writes them, to diff them by hand */
+static void write_failure(const TestFile& file, const std::string& outdir)
+{
+    std::string base = outdir + PATHSEP + file.name.substr(file.name.find('/') + 1);
+    if (!make_parent_dirs(base))
+        return;
+    std::ofstream(base + ".src.py", std::ios_base::out | std::ios_base::binary) << file.output;
+    std::ofstream(base + ".tok.txt", std::ios_base::out | std::ios_base::binary) << file.tokens;
+    std::ofstream(base + ".err", std::ios_base::out | std::ios_base::binary) << file.failure;
+}
+
+/* Reads a baseline written with --write-baseline: lines of a file's name,
+ * a tab and its time in ms */
+static bool read_baseline(const char* filename, std::map<std::string, double>& baseline)
+{
+    std::ifstream in(filename);
+    if (!in) {
+        fprintf(stderr, "Error opening baseline '%s'\n", filename);
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t tab = line.find('\t');
+        if (line.empty() || line[0] == '#' || tab == std::string::npos)
+            continue;
+        baseline[line.substr(0, tab)] = atof(line.c_str() + tab + 1);
+    }
+    return true;
+}
+
+static bool write_baseline(const char* filename, const std::vector<TestFile>& files, int repeat)
+{
+    FILE* out = fopen(filename, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening file '%s' for writing\n", filename);
+        return false;
+    }
+    fprintf(out, "# pycdc_test baseline: the fastest of %d run(s) of each file, in ms\n",
+            repeat);
+    for (const auto& file : files)
+        fprintf(out, "%s\t%.3f\n", file.name.c_str(), file.millis);
+    return fclose(out) == 0;
+}
+
+/* Adds the modules of each test in dir (compiled or xfail) */
+static bool find_test_files(const std::string& tests_dir, const char* dir,
+                            const std::vector<std::string>& tests, std::vector<TestFile>& files)
+{
+    std::string dirpath = tests_dir + PATHSEP + dir;
+    std::vector<std::string> names;
+    if (!list_directory(dirpath, names))
+        return false;
+    for (const auto& test : tests) {
+        // As run_tests.py globs for <test>.?.*.pyc
+        for (const auto& name : names) {
+            if (name.size() > test.size() + 7 && name.compare(0, test.size(), test) == 0
+                    && name[test.size()] == '.' && name[test.size() + 2] == '.'
+                    && name.compare(name.size() - 4, 4, ".pyc") == 0) {
+                TestFile file;
+                file.test = test;
+                file.name = std::string(dir) + "/" + name;
+                file.path = dirpath + PATHSEP + name;
+                file.xfail = strcmp(dir, "xfail") == 0;
+                file.passed = false;
+                file.millis = 0;
+                files.push_back(std::move(file));
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string tests_dir = PYCDC_TEST_DIR;
+    unsigned jobs = std::thread::hardware_concurrency();
+    const char* filter = "";
+    int repeat = 1;
+    double tolerance = 50;
+    const char* baseline_path = nullptr;
+    const char* write_baseline_path = nullptr;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-j") == 0 || strcmp(argv[arg], "-n") == 0) {
+            int count = (arg + 1 < argc) ? atoi(argv[arg + 1]) : 0;
+            if (count <= 0) {
+                fprintf(stderr, "Option '%s' requires a positive count\n", argv[arg]);
+                return 1;
+            }
+            if (strcmp(argv[arg], "-j") == 0)
+                jobs = (unsigned)count;
+            else
+                repeat = count;
+            ++arg;
+        } else if (strcmp(argv[arg], "--filter") == 0) {
+            if (arg + 1 < argc) {
+                filter = argv[++arg];
+            } else {
+                fputs("Option '--filter' requires a test name\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--baseline") == 0
+                || strcmp(argv[arg], "--write-baseline") == 0) {
+            if (arg + 1 >= argc) {
+                fprintf(stderr, "Option '%s' requires a filename\n", argv[arg]);
+                return 1;
+            }
+            if (strcmp(argv[arg], "--baseline") == 0)
+                baseline_path = argv[++arg];
+            else
+                write_baseline_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--tolerance") == 0) {
+            char* end = nullptr;
+            double value = (arg + 1 < argc) ? strtod(argv[arg + 1], &end) : -1;
+            if (arg + 1 >= argc || *end != '\0' || value < 0) {
+                fputs("Option '--tolerance' requires a percentage\n", stderr);
+                return 1;
+            }
+            tolerance = value;
+            ++arg;
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "Usage:  %s [options] [tests-dir]\n\n", argv[0]);
+            fputs("Decompiles the test corpus like tests/run_tests.py does, in this process,\n", stderr);
+            fputs("and times each module.  tests-dir defaults to the source tree's.\n\n", stderr);
+            fputs("Options:\n", stderr);
+            fputs("  -j <count>     Run <count> tests at once (default: one per CPU)\n", stderr);
+            fputs("  --filter <text> Only run the tests whose names contain <text>\n", stderr);
+            fputs("  -n <count>     Decompile each module <count> times, and keep the\n", stderr);
+            fputs("                 fastest time (default: 1)\n", stderr);
+            fputs("  --baseline <filename>\n", stderr);
+            fputs("                 Compare the times with the ones in <filename>, and\n", stderr);
+            fputs("                 fail if a module got slower\n", stderr);
+            fputs("  --tolerance <percent>\n", stderr);
+            fputs("                 How much slower than the baseline a module may get\n", stderr);
+            fputs("                 (default: 50)\n", stderr);
+            fputs("  --write-baseline <filename>\n", stderr);
+            fputs("                 Write the times to <filename>, for a later --baseline\n", stderr);
+            fputs("  --help         Show this help text and then exit\n", stderr);
+            return 0;
+        } else if (argv[arg][0] == '-' && argv[arg][1] != '\0') {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        } else {
+            tests_dir = argv[arg];
+        }
+    }
+    if (jobs == 0)
+        jobs = 1;
+
+    std::map<std::string, double> baseline;
+    if (baseline_path && !read_baseline(baseline_path, baseline))
+        return 1;
+
+    std::vector<std::string> tokenized, tests;
+    if (!list_directory(tests_dir + PATHSEP + "tokenized", tokenized))
+        return 1;
+    std::map<std::string, std::string> expected;
+    for (const auto& name : tokenized) {
+        if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".txt") != 0
+                || name.find(filter) == std::string::npos)
+            continue;
+        std::string test = name.substr(0, name.size() - 4);
+        std::string text;
+        if (!read_file(tests_dir + PATHSEP + "tokenized" + PATHSEP + name, text)) {
+            fprintf(stderr, "Error opening file %s\n", name.c_str());
+            return 1;
+        }
+        tests.push_back(test);
+        expected[test] = text;
+    }
+    std::vector<TestFile> compiled, xfail;
+    if (!find_test_files(tests_dir, "compiled", tests, compiled)
+            || !find_test_files(tests_dir, "xfail", tests, xfail))
+        return 1;
+
+    auto start = test_clock::now();
+    {
+        StderrCapture capture;
+        if (!capture.ok()) {
+            fputs("Error redirecting stderr\n", stderr);
+            return 1;
+        }
+
+        // These are expected to write to stderr, so they are run on their own
+        for (auto& file : xfail) {
+            run_test(file, expected, repeat);
+            if (!capture.take().empty())
+                file.passed = false;
+        }
+
+        TestRun run(compiled, expected, repeat);
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < std::min<size_t>(jobs, compiled.size()); ++i)
+            workers.emplace_back(test_worker, std::ref(run));
+        test_worker(run);
+        for (auto& worker : workers)
+            worker.join();
+
+        // Find out which of them wrote it, one at a time
+        if (!capture.take().empty()) {
+            for (auto& file : compiled) {
+                if (!file.passed)
+                    continue;
+                double millis = file.millis;
+                run_test(file, expected, 1);
+                std::string written = capture.take();
+                if (!written.empty()) {
+                    file.passed = false;
+                    file.failure = written;
+                }
+                file.millis = std::min(file.millis, millis);
+            }
+        }
+    }
+    std::chrono::duration<double> elapsed = test_clock::now() - start;
+
+    unsigned total_fails = 0;
+    for (const auto& test : tests) {
+        unsigned count = 0, fails = 0, xfails = 0;
+        std::string errlines;
+        for (const auto& file : compiled) {
+            if (file.test != test)
+                continue;
+            ++count;
+            if (!file.passed) {
+                ++fails;
+                errlines += "\t\033[31m" + file.name.substr(file.name.find('/') + 1) + "\033[0m\n"
+                            + file.failure;
+                write_failure(file, "tests-out");
+            }
+        }
+        for (const auto& file : xfail) {
+            if (file.test == test && !file.passed)
+                ++xfails;
+        }
+
+        printf("\033[1m*** %s:\033[0m ", test.c_str());
+        if (count == 0 && xfails == 0) {
+            printf("No compiled/xfail modules found for %s\n", test.c_str());
+            ++total_fails;
+            continue;
+        }
+        if (fails == 0 && count == 0)
+            printf("\033[33mXFAIL (%u)\033[0m\n", xfails);
+        else if (fails == 0 && xfails)
+            printf("\033[32mPASS (%u)\033[33m + XFAIL (%u)\033[0m\n", count, xfails);
+        else if (fails == 0)
+            printf("\033[32mPASS (%u)\033[0m\n", count);
+        else if (xfails)
+            printf("\033[31mFAIL (%u of %u)\033[33m + XFAIL (%u)\033[0m\n", fails, count, xfails);
+        else
+            printf("\033[31mFAIL (%u of %u)\033[0m\n", fails, count);
+        fputs(errlines.c_str(), stdout);
+        total_fails += fails;
+    }
+
+    unsigned slower = 0;
+    double total_ms = 0;
+    for (const auto& file : compiled) {
+        total_ms += file.millis;
+        auto base = baseline.find(file.name);
+        if (!file.passed || base == baseline.end())
+            continue;
+        if (file.millis > base->second * (1 + tolerance / 100)
+                && file.millis - base->second > SLOWER_MIN_MS) {
+            if (slower++ == 0)
+                puts("\nSlower than the baseline:");
+            printf("  \033[31m%-40s\033[0m %8.3f ms, was %8.3f ms (+%.0f%%)\n", file.name.c_str(),
+                   file.millis, base->second, (file.millis / base->second - 1) * 100);
+        }
+    }
+
+    printf("\n%u file(s) in %.2f s, %.1f ms decompiling\n", (unsigned)(compiled.size() + xfail.size()),
+           elapsed.count(), total_ms);
+    if (write_baseline_path) {
+        std::vector<TestFile> timed(compiled);
+        timed.erase(std::remove_if(timed.begin(), timed.end(), [](const TestFile& file) {
+            return !file.passed;
+        }), timed.end());
+        if (!write_baseline(write_baseline_path, timed, repeat))
+            return 1;
+    }
+    if (total_fails)
+        printf("%u test(s) failed\n", total_fails);
+    if (slower)
+        printf("%u file(s) slower than the baseline\n", slower);
+    return (total_fails || slower) ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Fingerprint.h"
+#include "InputFiles.h"
+
+static void usage(const char* program)
+{
+    fprintf(stderr, "Usage:  %s index [options] -o index.fp input...\n", program);
+    fprintf(stderr, "        %s query [options] index.fp input...\n\n", program);
+    fputs("Fingerprints every code object in the inputs by its bytecode alone.  An\n", stderr);
+    fputs("input may be a .pyc file, a directory of them or an archive.  Queries\n", stderr);
+    fputs("print a line per match: similarity, code object and indexed code object.\n\n", stderr);
+    fputs("Options:\n", stderr);
+    fputs("  -o <filename>  Index file to write (index only)\n", stderr);
+    fputs("  -n <count>     Matches to print per code object (default: 5)\n", stderr);
+    fputs("  -t <fraction>  Least similarity to print, from 0 to 1 (default: 0.5)\n", stderr);
+    fputs("  -m <count>     Skip code objects with fewer instructions (default: 8)\n", stderr);
+    fputs("  --help         Show this help text and then exit\n", stderr);
+}
+
+static bool load_input(const InputFile& input, PycModule& mod)
+{
+    try {
+        if (input.archive)
+            input.archive->load(input.member, mod);
+        else
+            mod.loadFromFile(input.path.c_str());
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error loading file %s: %s\n", input.path.c_str(), ex.what());
+        return false;
+    }
+    if (!mod.isValid()) {
+        fprintf(stderr, "Could not load file %s\n", input.path.c_str());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
+        usage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+    const bool indexing = strcmp(argv[1], "index") == 0;
+    if (!indexing && strcmp(argv[1], "query") != 0) {
+        fprintf(stderr, "Error: Unrecognized command %s\n", argv[1]);
+        return 1;
+    }
+
+    const char* index_file = nullptr;
+    size_t count = 5;
+    double threshold = 0.5;
+    unsigned min_instructions = 8;
+    std::vector<InputFile> inputs;
+    for (int arg = 2; arg < argc; ++arg) {
+        const bool has_value = arg + 1 < argc;
+        if (strcmp(argv[arg], "-o") == 0 && indexing) {
+            if (!has_value) {
+                fputs("Option '-o' requires a filename\n", stderr);
+                return 1;
+            }
+            index_file = argv[++arg];
+        } else if (strcmp(argv[arg], "-n") == 0 || strcmp(argv[arg], "-m") == 0) {
+            char* end = nullptr;
+            long value = has_value ? strtol(argv[arg + 1], &end, 10) : -1;
+            if (!has_value || *end != '\0' || value < 0) {
+                fprintf(stderr, "Option '%s' requires a count\n", argv[arg]);
+                return 1;
+            }
+            if (argv[arg][1] == 'n')
+                count = (size_t)value;
+            else
+                min_instructions = (unsigned)value;
+            ++arg;
+        } else if (strcmp(argv[arg], "-t") == 0) {
+            char* end = nullptr;
+            threshold = has_value ? strtod(argv[arg + 1], &end) : -1;
+            if (!has_value || *end != '\0' || threshold < 0 || threshold > 1) {
+                fputs("Option '-t' requires a fraction from 0 to 1\n", stderr);
+                return 1;
+            }
+            ++arg;
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[arg][0] == '-') {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        } else if (!indexing && !index_file) {
+            index_file = argv[arg];
+        } else {
+            add_input(argv[arg], inputs);
+        }
+    }
+    if (!index_file) {
+        fputs(indexing ? "No index file specified (use -o)\n" : "No index file specified\n",
+              stderr);
+        return 1;
+    }
+    if (inputs.empty()) {
+        fputs("No input file specified\n", stderr);
+        return 1;
+    }
+
+    PycFingerprintIndex index;
+    if (!indexing && !index.load(index_file))
+        return 1;
+
+    int result = 0;
+    for (const auto& input : inputs) {
+        PycModule mod;
+        mod.useArena();
+        if (!load_input(input, mod)) {
+            result = 1;
+            continue;
+        }
+        try {
+            visit_code_objects(mod.code(), &mod, mod.code()->name()->strValue(),
+                               [&](PycRef<PycCode> code, const std::string& qualname) {
+                PycFingerprint fingerprint = fingerprint_code(code, &mod);
+                if (fingerprint.instructions < min_instructions)
+                    return;
+                std::string name = input.path + ":" + qualname;
+                if (indexing) {
+                    index.add(std::move(name), fingerprint);
+                    return;
+                }
+                for (const auto& match : index.query(fingerprint, count, threshold)) {
+                    printf("%.3f %s %s\n", match.similarity, name.c_str(),
+                           index.entries()[match.entry].name.c_str());
+                }
+            });
+        } catch (std::exception& ex) {
+            fprintf(stderr, "Error fingerprinting %s: %s\n", input.path.c_str(), ex.what());
+            result = 1;
+        }
+    }
+
+    if (indexing && !index.save(index_file))
+        return 1;
+    return result;
+}
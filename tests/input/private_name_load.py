@@ -0,0 +1,17 @@
+# Private names are unmangled where they are stored in the class body, and
+# the loads of the same names which follow have to print the same way.
+#
+# Valid Pythons: all
+
+class Klass:
+    __private_var = 3
+    y = __private_var + 1
+
+    def __private_method(self):
+        return self.__private_var
+
+    def method(self):
+        return self.__private_method()
+
+k = Klass()
+print(k.y, k.method())
@@ -0,0 +1,8 @@
+# A module with exception handlers, for their table in 3.11+ disassembly
+
+
+def parse(text):
+    try:
+        return int(text)
+    except ValueError:
+        return None
@@ -0,0 +1,3 @@
+# A long integer constant, which long_huge.3.8.pyc and long_minint.3.8.pyc
+# claim has 0x7ffffff0 and INT_MIN digits
+x = 123456789012345678901234567890
@@ -0,0 +1,13 @@
+# Code which uses a class's private names, for --cache and --watch.
+# private_v2.py is a later version of it.
+class Counter:
+    __start = 1
+
+    def first(self):
+        return self.__start
+
+
+def total():
+    return 2
+
+print(Counter._Counter__start, total(), 1)
@@ -0,0 +1,17 @@
+# A later version of private.py: Counter and total() are the same, but
+# start further down, and the last line changed.
+
+
+
+
+class Counter:
+    __start = 1
+
+    def first(self):
+        return self.__start
+
+
+def total():
+    return 2
+
+print(Counter._Counter__start, total(), 2)
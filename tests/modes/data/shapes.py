@@ -0,0 +1,29 @@
+# The module the mode tests in tests/modes run pycdc and pycdas on.
+# shapes_v2.py is a later version of it, for --diff.
+import math
+from os import path as os_path
+
+SCALE = 2
+
+
+class Circle:
+    def __init__(self, radius):
+        self.radius = radius
+
+    def area(self):
+        return math.pi * self.radius ** 2
+
+    def grow(self, by):
+        self.radius += by * SCALE
+        return self
+
+
+def total_area(shapes):
+    total = 0
+    for shape in shapes:
+        total += shape.area()
+    return total
+
+
+def describe(shape):
+    return 'Circle of radius %d' % shape.radius
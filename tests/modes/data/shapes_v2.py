@@ -0,0 +1,32 @@
+# A later version of shapes.py, for --diff
+import math
+from os import path as os_path
+
+SCALE = 3
+
+
+class Circle:
+    def __init__(self, radius):
+        self.radius = radius
+
+    def area(self):
+        return math.pi * self.radius ** 2
+
+    def grow(self, by):
+        self.radius += by * SCALE
+        return self
+
+
+def total_area(shapes):
+    total = 0
+    for shape in shapes:
+        total += shape.area()
+    return total
+
+
+def describe(shape):
+    return 'A circle of radius %d' % shape.radius
+
+
+def unit():
+    return Circle(1)
@@ -0,0 +1,494 @@
+#!/usr/bin/env python3
+
+"""
+Runs the command line mode tests in tests/modes.  Each .test file is a
+transcript: a line starting with '$ ' is a command, and the lines up to the
+next one are what it's expected to print, its stdout followed by its stderr
+and then '[exit N]' if it doesn't exit with 0.  Lines starting with '#'
+ahead of the first command describe the test.
+
+The commands are run in an empty directory of their own, in which data/
+holds the files of tests/modes/data.  Besides pycdc, pycdas and pycfp,
+whose stdin and stdout may be redirected with '< FILE' and '> FILE' at the
+end, they may be one of the helpers below, for looking at the files the
+modes write, talking to a server, calling libpycdc or running --watch in
+the background.
+"""
+
+import os
+import sys
+import glob
+import gzip
+import json
+import shlex
+import shutil
+import time
+import struct
+import difflib
+import socket
+import ctypes
+import argparse
+import tempfile
+import subprocess
+
+TEST_DIR = os.path.dirname(os.path.realpath(__file__))
+MODES_DIR = os.path.join(TEST_DIR, 'modes')
+BINARIES = ('pycdc', 'pycdas', 'pycfp')
+LIBPYCDC_NAMES = ('libpycdc.so', 'libpycdc.dylib', 'pycdc.dll')
+
+# How long a command may take, or wait for one in the background
+TIMEOUT = 60
+
+
+def helper_cat(args, session):
+    """cat FILE: prints a text file"""
+    with open(args[0], 'r', encoding='utf-8', errors='replace') as in_file:
+        return in_file.read()
+
+
+def helper_ls(args, session):
+    """ls DIR: lists the files in a directory tree"""
+    names = []
+    for root, _, files in os.walk(args[0]):
+        for name in files:
+            names.append(os.path.relpath(os.path.join(root, name), args[0]))
+    return ''.join(name.replace(os.sep, '/') + '\n' for name in sorted(names))
+
+
+def helper_fields(args, session):
+    """fields FILE KEY...: prints some fields of each line of a JSON lines file"""
+    out = ''
+    with open(args[0], 'r', encoding='utf-8') as in_file:
+        for line in in_file:
+            record = json.loads(line)
+            out += ' '.join('{}={}'.format(key, json.dumps(record.get(key)))
+                            for key in args[1:]) + '\n'
+    return out
+
+
+def helper_pack(args, session):
+    """pack FILE: prints the members of a --pack file, as its index lists them"""
+    with open(args[0], 'rb') as in_file:
+        data = in_file.read()
+    out = ''
+    end = 0
+    with open(args[0] + '.index', 'r', encoding='utf-8') as index:
+        for line in index:
+            record = json.loads(line)
+            if record['offset'] != end:
+                out += 'Member {} starts at {} instead of {}\n'.format(
+                        record['file'], record['offset'], end)
+            end = record['offset'] + record['size']
+            text = gzip.decompress(data[record['offset']:end])
+            out += '=== {} ({} bytes)\n'.format(record['file'], record['length'])
+            if len(text) != record['length']:
+                out += 'Member is {} bytes long\n'.format(len(text))
+            out += text.decode('utf-8', 'replace')
+    if end != len(data):
+        out += 'The index ends at {}, but the data at {}\n'.format(end, len(data))
+    return out
+
+
+def helper_sourcemap(args, session):
+    """sourcemap FILE: prints the entries of a --source-map file"""
+    with open(args[0], 'rb') as in_file:
+        data = in_file.read()
+    if data[:8] != b'PYCSMAP1':
+        return 'Bad source map signature\n'
+    code_count, entry_count, names_size = struct.unpack_from('<3I', data, 8)
+    codes_at = 20
+    entries_at = codes_at + code_count * 16
+    names_at = entries_at + entry_count * 16
+    if names_at + names_size != len(data):
+        return 'Source map is {} bytes instead of {}\n'.format(len(data), names_at + names_size)
+    codes = [struct.unpack_from('<4I', data, codes_at + i * 16) for i in range(code_count)]
+    out = ''
+    for i, (name_at, name_len, first_line, first_entry) in enumerate(codes):
+        name = data[names_at + name_at:names_at + name_at + name_len].decode('utf-8')
+        last_entry = codes[i + 1][3] if i + 1 < code_count else entry_count
+        out += '{} (line {})\n'.format(name, first_line)
+        for entry in range(first_entry, last_entry):
+            start, end, output_line, source_line = \
+                    struct.unpack_from('<4I', data, entries_at + entry * 16)
+            out += '  {}-{}: output line {}, source line {}\n'.format(
+                    start, end, output_line, source_line)
+    return out
+
+
+def helper_write(args, session):
+    """write FILE TEXT: writes TEXT and a newline to FILE"""
+    with open(args[0], 'w') as out_file:
+        out_file.write(args[1] + '\n')
+    return ''
+
+
+def helper_append(args, session):
+    """append FILE TEXT: appends TEXT to FILE, without a newline"""
+    with open(args[0], 'a') as out_file:
+        out_file.write(args[1])
+    return ''
+
+
+def helper_cp(args, session):
+    """cp SRC DEST: copies a file"""
+    shutil.copyfile(args[0], args[1])
+    return ''
+
+
+def helper_mkdir(args, session):
+    """mkdir DIR: creates a directory"""
+    os.mkdir(args[0])
+    return ''
+
+
+def helper_rm(args, session):
+    """rm FILE: removes a file"""
+    os.remove(args[0])
+    return ''
+
+
+def helper_diff(args, session):
+    """diff FILE1 FILE2: prints how two text files differ, if they do"""
+    with open(args[0], 'r', encoding='utf-8', errors='replace') as in_file:
+        old = in_file.read().splitlines(True)
+    with open(args[1], 'r', encoding='utf-8', errors='replace') as in_file:
+        new = in_file.read().splitlines(True)
+    return ''.join(difflib.unified_diff(old, new, fromfile=args[0], tofile=args[1]))
+
+
+def helper_request(args, session):
+    """request FILE ID COMMAND PAYLOAD [LENGTH]: appends a --server request
+    to FILE; a PAYLOAD of @NAME sends the contents of the file NAME, and a
+    LENGTH other than the payload's makes it a truncated request"""
+    if args[3].startswith('@'):
+        with open(args[3][1:], 'rb') as in_file:
+            payload = in_file.read()
+    else:
+        payload = args[3].encode('utf-8')
+    length = int(args[4]) if len(args) > 4 else len(payload)
+    with open(args[0], 'ab') as out_file:
+        out_file.write('{} {} {}\n'.format(args[1], args[2], length).encode('utf-8'))
+        out_file.write(payload)
+    return ''
+
+
+def helper_responses(args, session):
+    """responses FILE: prints the --server responses in FILE by id, since
+    they arrive in the order they're finished"""
+    with open(args[0], 'rb') as in_file:
+        data = in_file.read()
+    responses = []
+    while data:
+        header, _, data = data.partition(b'\n')
+        fields = header.decode('utf-8', 'replace').split(' ')
+        if len(fields) != 3 or not fields[2].isdigit() or int(fields[2]) > len(data):
+            responses.append(('~', 'Malformed response: {}\n'.format(' '.join(fields))))
+            break
+        payload = data[:int(fields[2])].decode('utf-8', 'replace')
+        data = data[int(fields[2]):]
+        if payload and not payload.endswith('\n'):
+            payload += '\n'
+        responses.append((fields[0], header.decode('utf-8') + '\n' + payload))
+    return ''.join(response for _, response in sorted(responses))
+
+
+def helper_connect(args, session):
+    """connect SOCKET FILE REPLY: sends FILE to the server listening at
+    SOCKET, and writes what it answers to REPLY, once it's all answered"""
+    with open(args[1], 'rb') as in_file:
+        data = in_file.read()
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        # The server is started in the background, so it may not be
+        # listening yet
+        deadline = time.time() + TIMEOUT
+        while True:
+            try:
+                sock.connect(args[0])
+                break
+            except OSError:
+                if time.time() > deadline:
+                    raise
+                time.sleep(0.05)
+        sock.sendall(data)
+        sock.shutdown(socket.SHUT_WR)
+        reply = b''
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            reply += chunk
+    finally:
+        sock.close()
+    with open(args[2], 'wb') as out_file:
+        out_file.write(reply)
+    return ''
+
+
+LIBPYCDC_FLAGS = {
+    '--disassemble': 0x1,
+    '--stream': 0x2,
+    '--low-memory': 0x4,
+    '--line-markers': 0x8,
+}
+
+def helper_libpycdc(args, session):
+    """libpycdc [--write] [FLAG...] FILE [NAME]: decompiles FILE with
+    libpycdc, into a buffer which is too small at first, or with --write,
+    through a callback; FLAG is --disassemble, --stream, --low-memory or
+    --line-markers"""
+    if not session.libpycdc:
+        return 'libpycdc not found\n[exit 1]\n'
+    lib = ctypes.CDLL(session.libpycdc)
+    flags = 0
+    use_write = False
+    while args and args[0].startswith('--'):
+        if args[0] == '--write':
+            use_write = True
+        else:
+            flags |= LIBPYCDC_FLAGS[args[0]]
+        args = args[1:]
+    with open(args[0], 'rb') as in_file:
+        data = in_file.read()
+    name = args[1].encode('utf-8') if len(args) > 1 else None
+
+    if use_write:
+        write_fn = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.POINTER(ctypes.c_char),
+                                    ctypes.c_size_t)
+        chunks = []
+        write = write_fn(lambda context, chunk, length: chunks.append(chunk[:length]))
+        error = ctypes.create_string_buffer(256)
+        lib.pycdc_decompile.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p,
+                                        ctypes.c_uint, write_fn, ctypes.c_void_p,
+                                        ctypes.c_char_p, ctypes.c_size_t]
+        result = lib.pycdc_decompile(data, len(data), name, flags, write, None,
+                                     error, len(error))
+        out = b''.join(chunks)
+        if result < 0:
+            out += error.value + b'\n'
+    else:
+        lib.pycdc_decompile_to_buffer.argtypes = [
+                ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_uint,
+                ctypes.c_char_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
+        length = ctypes.c_size_t()
+        small = ctypes.create_string_buffer(32)
+        result = lib.pycdc_decompile_to_buffer(data, len(data), name, flags,
+                                               small, len(small), ctypes.byref(length))
+        buffer = ctypes.create_string_buffer(length.value + 1)
+        again = lib.pycdc_decompile_to_buffer(data, len(data), name, flags,
+                                              buffer, len(buffer), ctypes.byref(length))
+        out = buffer.value
+        if again != result or len(out) != length.value:
+            out += 'Retrying returned {} and {} bytes\n'.format(again, len(out)).encode()
+        if not out.startswith(small.value) or len(small.value) != min(len(out), 31):
+            out += b'The short buffer held ' + small.value + b'\n'
+        if result < 0:
+            out += b'\n'
+    out = out.decode('utf-8', 'replace')
+    if result != 0:
+        out += '[returned {}]\n'.format(result)
+    return out
+
+
+def helper_start(args, session):
+    """start NAME COMMAND...: starts pycdc in the background, as NAME"""
+    if args[1] not in BINARIES:
+        return 'Unknown command {}\n[exit 1]\n'.format(args[1])
+    log = tempfile.TemporaryFile(), tempfile.TemporaryFile()
+    proc = subprocess.Popen([os.path.join(session.bindir, args[1])] + args[2:],
+                            stdin=subprocess.DEVNULL, stdout=log[0], stderr=log[1])
+    session.background[args[0]] = [proc, log, 0, 0]
+    return ''
+
+
+def background_output(session, name):
+    """Returns what NAME has printed since the last call, and whether it exited"""
+    proc, log, out_seen, err_seen = session.background[name]
+    exited = proc.poll() is not None
+    log[0].seek(out_seen)
+    log[1].seek(err_seen)
+    out, err = log[0].read(), log[1].read()
+    session.background[name][2:] = [out_seen + len(out), err_seen + len(err)]
+    return out.decode('utf-8', 'replace') + err.decode('utf-8', 'replace'), exited
+
+
+def helper_settle(args, session):
+    """settle NAME: waits for the --watch run NAME to wait for changes, and
+    prints what it printed since the last settle"""
+    proc, log = session.background[args[0]][:2]
+    deadline = time.time() + TIMEOUT
+    timed_out = False
+    while proc.poll() is None:
+        log[1].seek(session.background[args[0]][3])
+        if log[1].read().endswith(b'Watching for changes...\n'):
+            break
+        if time.time() > deadline:
+            timed_out = True
+            break
+        time.sleep(0.05)
+    out, exited = background_output(session, args[0])
+    if exited:
+        out += '[exit {}]\n'.format(proc.returncode)
+    elif timed_out:
+        out += '[timed out]\n'
+    return out
+
+
+def helper_stop(args, session):
+    """stop NAME: stops NAME, and prints what it printed since the last settle"""
+    proc = session.background[args[0]][0]
+    if proc.poll() is None:
+        proc.terminate()
+    proc.wait()
+    out, _ = background_output(session, args[0])
+    for log in session.background.pop(args[0])[1]:
+        log.close()
+    return out
+
+
+HELPERS = {
+    'cat': helper_cat,
+    'ls': helper_ls,
+    'fields': helper_fields,
+    'pack': helper_pack,
+    'sourcemap': helper_sourcemap,
+    'write': helper_write,
+    'append': helper_append,
+    'cp': helper_cp,
+    'mkdir': helper_mkdir,
+    'rm': helper_rm,
+    'diff': helper_diff,
+    'request': helper_request,
+    'responses': helper_responses,
+    'connect': helper_connect,
+    'libpycdc': helper_libpycdc,
+    'start': helper_start,
+    'settle': helper_settle,
+    'stop': helper_stop,
+}
+
+
+class Session:
+    """What the commands of a test share: where the binaries are, and the
+    processes started in the background"""
+    def __init__(self, bindir, libpycdc):
+        self.bindir = bindir
+        self.libpycdc = libpycdc
+        self.background = {}
+
+
+def run_command(command, session):
+    args = shlex.split(command)
+    if args[0] in HELPERS:
+        try:
+            return HELPERS[args[0]](args[1:], session)
+        except (OSError, ValueError) as ex:
+            return '{}\n[exit 1]\n'.format(ex)
+    if args[0] not in BINARIES:
+        return 'Unknown command {}\n[exit 1]\n'.format(args[0])
+    redirects = {'<': None, '>': None}
+    while len(args) > 2 and args[-2] in redirects:
+        redirects[args[-2]] = args[-1]
+        args = args[:-2]
+    stdin = open(redirects['<'], 'rb') if redirects['<'] else subprocess.DEVNULL
+    stdout = open(redirects['>'], 'wb') if redirects['>'] else subprocess.PIPE
+    try:
+        proc = subprocess.run([os.path.join(session.bindir, args[0])] + args[1:],
+                              stdin=stdin, stdout=stdout, stderr=subprocess.PIPE,
+                              timeout=TIMEOUT)
+    except subprocess.TimeoutExpired:
+        return '[timed out]\n'
+    finally:
+        for redirect in (stdin, stdout):
+            if redirect not in (subprocess.DEVNULL, subprocess.PIPE):
+                redirect.close()
+    out = (proc.stdout or b'').decode('utf-8', 'replace') + proc.stderr.decode('utf-8', 'replace')
+    if proc.returncode != 0:
+        out += '[exit {}]\n'.format(proc.returncode)
+    return out
+
+
+def parse_test(test_file):
+    """Returns the description lines and a list of (command, expected) pairs"""
+    header = []
+    steps = []
+    with open(test_file, 'r', encoding='utf-8') as in_file:
+        for line in in_file:
+            if line.startswith('$ '):
+                steps.append((line[2:].rstrip('\n'), ''))
+            elif steps:
+                steps[-1] = (steps[-1][0], steps[-1][1] + line)
+            else:
+                header.append(line)
+    return header, steps
+
+
+def run_test(test_file, session, update):
+    """Returns whether the test passed, and what to print about it"""
+    test_name = os.path.splitext(os.path.basename(test_file))[0]
+    header, steps = parse_test(test_file)
+    workdir = tempfile.mkdtemp(prefix='pycdc-mode-')
+    try:
+        os.symlink(os.path.join(MODES_DIR, 'data'), os.path.join(workdir, 'data'))
+        cwd = os.getcwd()
+        os.chdir(workdir)
+        try:
+            results = [(command, run_command(command, session)) for command, _ in steps]
+        finally:
+            # Whatever a test left running is stopped before its files go
+            for name in list(session.background):
+                helper_stop([name], session)
+            os.chdir(cwd)
+    finally:
+        shutil.rmtree(workdir)
+
+    if update:
+        with open(test_file, 'w', encoding='utf-8') as out_file:
+            out_file.writelines(header)
+            for command, output in results:
+                out_file.write('$ ' + command + '\n' + output)
+        return True, ''
+
+    expected = ''.join('$ {}\n{}'.format(command, output) for command, output in steps)
+    actual = ''.join('$ {}\n{}'.format(command, output) for command, output in results)
+    if actual == expected:
+        return True, '\033[1m*** {}:\033[0m \033[32mPASS\033[0m\n'.format(test_name)
+    diff = difflib.unified_diff(expected.splitlines(True), actual.splitlines(True),
+                                fromfile='modes/{}.test'.format(test_name), tofile='actual')
+    return False, '\033[1m*** {}:\033[0m \033[31mFAIL\033[0m\n{}'.format(test_name,
+                                                                       ''.join(diff))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--bindir', type=str, default=os.getcwd(),
+            help='Directory which pycdc and pycdas are in (default: the current one)')
+    parser.add_argument('--libpycdc', type=str, default=None,
+            help='Path of the pycdc shared library (default: the one in --bindir)')
+    parser.add_argument('--filter', type=str, default='',
+            help='Run only test(s) matching the supplied filter')
+    parser.add_argument('--update', action='store_true',
+            help='Write what the commands print into the tests, to review with git diff')
+    args = parser.parse_args()
+
+    bindir = os.path.realpath(args.bindir)
+    libpycdc = os.path.realpath(args.libpycdc) if args.libpycdc else None
+    if libpycdc is None:
+        found = [os.path.join(bindir, name) for name in LIBPYCDC_NAMES
+                 if os.path.exists(os.path.join(bindir, name))]
+        libpycdc = found[0] if found else None
+
+    glob_pattern = '*{}*.test'.format(args.filter) if args.filter else '*.test'
+    fails = 0
+    for test_file in sorted(glob.glob(os.path.join(MODES_DIR, glob_pattern))):
+        ok, output = run_test(test_file, Session(bindir, libpycdc), args.update)
+        if not ok:
+            fails += 1
+        sys.stdout.write(output)
+
+    if fails:
+        print('{} test(s) failed'.format(fails))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()